@@ -0,0 +1,415 @@
+/*
+** ircload: multi-connection load generator for ircserv
+**
+** Opens N clients, registers them, joins them to M channels and then drives a
+** configurable mix of PRIVMSG, JOIN/PART churn and NICK changes at a fixed
+** rate. PRIVMSG bodies carry their send timestamp, so every delivery to
+** another loadgen client yields one end-to-end latency sample.
+** Results are printed as JSON.
+*/
+
+#include "Metrics.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct Options
+{
+	std::string host = "127.0.0.1";
+	std::string port = "6667";
+	std::string password = "pass";
+	int clients = 100;
+	int channels = 10;
+	int joinsPerClient = 1;
+	double duration = 10.0;
+	double rate = 1000.0;
+	int privmsgWeight = 90;
+	int churnWeight = 5;
+	int nickWeight = 5;
+	int serverPid = 0;
+	std::string output;
+};
+
+struct Connection
+{
+	int fd = -1;
+	int id = 0;
+	int generation = 0;
+	bool registered = false;
+	int joinsPending = 0;
+	std::string in;
+	std::string out;
+	std::vector<int> channels;
+};
+
+struct Results
+{
+	std::uint64_t privmsgSent = 0;
+	std::uint64_t delivered = 0;
+	std::uint64_t churnOps = 0;
+	std::uint64_t nickOps = 0;
+	std::uint64_t errors = 0;
+	Histogram latencyNs;
+};
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options]\n"
+			  << "  --host HOST          server address (127.0.0.1)\n"
+			  << "  --port PORT          server port (6667)\n"
+			  << "  --password PASS      server password (pass)\n"
+			  << "  --clients N          connections to open (100)\n"
+			  << "  --channels M         channels to spread them over (10)\n"
+			  << "  --joins N            channels joined per client (1)\n"
+			  << "  --duration SEC       length of the measured phase (10)\n"
+			  << "  --rate OPS           operations per second, all clients together (1000)\n"
+			  << "  --mix P,C,N          weights of PRIVMSG, JOIN/PART churn and NICK (90,5,5)\n"
+			  << "  --server-pid PID     read the server's RSS from /proc\n"
+			  << "  --json FILE          write results to FILE instead of stdout\n";
+}
+
+static bool parseOptions(int argc, char **argv, Options &opt)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg(argv[i]);
+		if (i + 1 >= argc)
+			return false;
+		std::string value(argv[++i]);
+		if (arg == "--host")
+			opt.host = value;
+		else if (arg == "--port")
+			opt.port = value;
+		else if (arg == "--password")
+			opt.password = value;
+		else if (arg == "--clients")
+			opt.clients = std::atoi(value.c_str());
+		else if (arg == "--channels")
+			opt.channels = std::atoi(value.c_str());
+		else if (arg == "--joins")
+			opt.joinsPerClient = std::atoi(value.c_str());
+		else if (arg == "--duration")
+			opt.duration = std::atof(value.c_str());
+		else if (arg == "--rate")
+			opt.rate = std::atof(value.c_str());
+		else if (arg == "--mix")
+		{
+			if (std::sscanf(value.c_str(), "%d,%d,%d", &opt.privmsgWeight, &opt.churnWeight, &opt.nickWeight) != 3)
+				return false;
+		}
+		else if (arg == "--server-pid")
+			opt.serverPid = std::atoi(value.c_str());
+		else if (arg == "--json")
+			opt.output = value;
+		else
+			return false;
+	}
+	return opt.clients > 0 && opt.channels > 0 && opt.joinsPerClient > 0
+		&& opt.duration > 0 && opt.rate > 0
+		&& opt.privmsgWeight + opt.churnWeight + opt.nickWeight > 0;
+}
+
+static int connectTo(const Options &opt)
+{
+	struct addrinfo hints{};
+	struct addrinfo *res = nullptr;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(opt.host.c_str(), opt.port.c_str(), &hints, &res) != 0)
+		return -1;
+	int fd = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd >= 0 && ::connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd >= 0)
+		::fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+static std::string nickOf(const Connection &c)
+{
+	return "lg" + std::to_string(c.id) + (c.generation ? "_" + std::to_string(c.generation) : "");
+}
+
+static std::string channelName(int index)
+{
+	return "#lg" + std::to_string(index);
+}
+
+/*
+** Handle one line from the server
+** Tracks registration and JOIN completion, answers PING and turns
+** timestamped PRIVMSGs into latency samples
+*/
+static void handleLine(Connection &c, const std::string &line, Results &results, bool measuring)
+{
+	if (line.compare(0, 5, "PING ") == 0)
+	{
+		c.out += "PONG " + line.substr(5) + "\r\n";
+		return;
+	}
+	std::size_t cmd = line.find(' ');
+	if (cmd == std::string::npos)
+		return;
+	std::string rest = line.substr(cmd + 1);
+	if (rest.compare(0, 4, "001 ") == 0)
+		c.registered = true;
+	else if (rest.compare(0, 4, "366 ") == 0)
+		--c.joinsPending;
+	else if (rest.compare(0, 8, "PRIVMSG ") == 0)
+	{
+		std::size_t body = rest.find(" :");
+		if (body == std::string::npos)
+			return;
+		std::uint64_t sentNs = std::strtoull(rest.c_str() + body + 2, nullptr, 10);
+		std::uint64_t now = Clock::now();
+		if (measuring && sentNs && now >= sentNs)
+		{
+			results.latencyNs.record(now - sentNs);
+			++results.delivered;
+		}
+	}
+	else if (rest[0] >= '4' && rest[0] <= '5' && rest.size() > 3 && rest[3] == ' ')
+		++results.errors;
+}
+
+/*
+** One poll round over all connections
+** Flushes pending output, reads and dispatches complete lines
+*/
+static bool pump(std::vector<Connection> &conns, Results &results, bool measuring, int timeoutMs)
+{
+	std::vector<pollfd> fds(conns.size());
+	for (std::size_t i = 0; i < conns.size(); ++i)
+	{
+		fds[i].fd = conns[i].fd;
+		fds[i].events = POLLIN | (conns[i].out.empty() ? 0 : POLLOUT);
+		fds[i].revents = 0;
+	}
+	if (::poll(fds.data(), fds.size(), timeoutMs) < 0 && errno != EINTR)
+		return false;
+
+	char buffer[16384];
+	for (std::size_t i = 0; i < conns.size(); ++i)
+	{
+		Connection &c = conns[i];
+		if (fds[i].revents & (POLLERR | POLLHUP))
+		{
+			std::cerr << "connection " << c.id << " closed by server\n";
+			return false;
+		}
+		if ((fds[i].revents & POLLOUT) && !c.out.empty())
+		{
+			ssize_t sent = ::send(c.fd, c.out.data(), c.out.size(), 0);
+			if (sent > 0)
+				c.out.erase(0, static_cast<std::size_t>(sent));
+		}
+		if (fds[i].revents & POLLIN)
+		{
+			ssize_t bytes;
+			while ((bytes = ::recv(c.fd, buffer, sizeof(buffer), 0)) > 0)
+				c.in.append(buffer, static_cast<std::size_t>(bytes));
+			if (bytes == 0)
+			{
+				std::cerr << "connection " << c.id << " closed by server\n";
+				return false;
+			}
+			std::size_t start = 0;
+			std::size_t pos;
+			while ((pos = c.in.find("\r\n", start)) != std::string::npos)
+			{
+				handleLine(c, c.in.substr(start, pos - start), results, measuring);
+				start = pos + 2;
+			}
+			c.in.erase(0, start);
+		}
+	}
+	return true;
+}
+
+/*
+** Pump until every connection satisfies the predicate or the timeout expires
+*/
+template <typename Pred>
+static bool waitFor(std::vector<Connection> &conns, Results &results, Pred done, double timeoutSec)
+{
+	std::uint64_t deadline = Clock::now() + static_cast<std::uint64_t>(timeoutSec * 1e9);
+	while (Clock::now() < deadline)
+	{
+		bool all = true;
+		for (const Connection &c : conns)
+			all = all && done(c);
+		if (all)
+			return true;
+		if (!pump(conns, results, false, 50))
+			return false;
+	}
+	return false;
+}
+
+static long readRssKb(int pid, const char *field)
+{
+	std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+	std::string key;
+	while (status >> key)
+	{
+		if (key == field)
+		{
+			long kb = 0;
+			status >> kb;
+			return kb;
+		}
+		status.ignore(4096, '\n');
+	}
+	return -1;
+}
+
+/*
+** Issue one operation from the mix on a random connection
+*/
+static void issueOperation(std::vector<Connection> &conns, const Options &opt, Results &results, std::mt19937 &rng)
+{
+	Connection &c = conns[std::uniform_int_distribution<std::size_t>(0, conns.size() - 1)(rng)];
+	int total = opt.privmsgWeight + opt.churnWeight + opt.nickWeight;
+	int roll = std::uniform_int_distribution<int>(0, total - 1)(rng);
+	int channel = c.channels[std::uniform_int_distribution<std::size_t>(0, c.channels.size() - 1)(rng)];
+
+	if (roll < opt.privmsgWeight)
+	{
+		c.out += "PRIVMSG " + channelName(channel) + " :" + std::to_string(Clock::now())
+			   + " " + std::to_string(results.privmsgSent) + "\r\n";
+		++results.privmsgSent;
+	}
+	else if (roll < opt.privmsgWeight + opt.churnWeight)
+	{
+		c.out += "PART " + channelName(channel) + "\r\nJOIN " + channelName(channel) + "\r\n";
+		++results.churnOps;
+	}
+	else
+	{
+		++c.generation;
+		c.out += "NICK " + nickOf(c) + "\r\n";
+		++results.nickOps;
+	}
+}
+
+static void writeResults(std::ostream &out, const Options &opt, const Results &r, double elapsed, long rssKb, long hwmKb)
+{
+	out << "{\n"
+		<< "  \"clients\": " << opt.clients << ",\n"
+		<< "  \"channels\": " << opt.channels << ",\n"
+		<< "  \"duration_s\": " << elapsed << ",\n"
+		<< "  \"target_rate\": " << opt.rate << ",\n"
+		<< "  \"privmsg_sent\": " << r.privmsgSent << ",\n"
+		<< "  \"churn_ops\": " << r.churnOps << ",\n"
+		<< "  \"nick_ops\": " << r.nickOps << ",\n"
+		<< "  \"error_numerics\": " << r.errors << ",\n"
+		<< "  \"messages_delivered\": " << r.delivered << ",\n"
+		<< "  \"sent_per_sec\": " << static_cast<double>(r.privmsgSent) / elapsed << ",\n"
+		<< "  \"delivered_per_sec\": " << static_cast<double>(r.delivered) / elapsed << ",\n"
+		<< "  \"latency_us\": {"
+		<< " \"p50\": " << static_cast<double>(r.latencyNs.percentile(0.5)) / 1e3 << ","
+		<< " \"p99\": " << static_cast<double>(r.latencyNs.percentile(0.99)) / 1e3 << ","
+		<< " \"p999\": " << static_cast<double>(r.latencyNs.percentile(0.999)) / 1e3 << ","
+		<< " \"max\": " << static_cast<double>(r.latencyNs.max()) / 1e3 << " },\n"
+		<< "  \"server_rss_kb\": " << rssKb << ",\n"
+		<< "  \"server_rss_peak_kb\": " << hwmKb << "\n"
+		<< "}\n";
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	if (!parseOptions(argc, argv, opt))
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<Connection> conns(static_cast<std::size_t>(opt.clients));
+	Results results;
+	std::mt19937 rng(42);
+
+	for (int i = 0; i < opt.clients; ++i)
+	{
+		Connection &c = conns[static_cast<std::size_t>(i)];
+		c.id = i;
+		c.fd = connectTo(opt);
+		if (c.fd < 0)
+		{
+			std::cerr << "connect " << i << " failed: " << strerror(errno) << "\n";
+			return EXIT_FAILURE;
+		}
+		c.out = "PASS " + opt.password + "\r\nNICK " + nickOf(c) + "\r\nUSER lg" + std::to_string(i)
+			  + " 0 * :loadgen\r\n";
+	}
+	if (!waitFor(conns, results, [](const Connection &c) { return c.registered; }, 30))
+	{
+		std::cerr << "registration timed out\n";
+		return EXIT_FAILURE;
+	}
+
+	for (Connection &c : conns)
+	{
+		for (int j = 0; j < opt.joinsPerClient && j < opt.channels; ++j)
+		{
+			int channel = (c.id + j) % opt.channels;
+			c.channels.push_back(channel);
+			c.out += "JOIN " + channelName(channel) + "\r\n";
+			++c.joinsPending;
+		}
+	}
+	if (!waitFor(conns, results, [](const Connection &c) { return c.joinsPending <= 0; }, 30))
+	{
+		std::cerr << "joins timed out\n";
+		return EXIT_FAILURE;
+	}
+	results.errors = 0;
+
+	std::uint64_t start = Clock::now();
+	std::uint64_t end = start + static_cast<std::uint64_t>(opt.duration * 1e9);
+	std::uint64_t issued = 0;
+	std::uint64_t now;
+	while ((now = Clock::now()) < end)
+	{
+		std::uint64_t due = static_cast<std::uint64_t>(static_cast<double>(now - start) / 1e9 * opt.rate);
+		for (; issued < due; ++issued)
+			issueOperation(conns, opt, results, rng);
+		if (!pump(conns, results, true, 1))
+			return EXIT_FAILURE;
+	}
+	double elapsed = static_cast<double>(Clock::now() - start) / 1e9;
+	// Let in-flight messages land before reporting
+	std::uint64_t drain = Clock::now() + 500000000ull;
+	while (Clock::now() < drain)
+		pump(conns, results, true, 10);
+
+	long rss = opt.serverPid ? readRssKb(opt.serverPid, "VmRSS:") : -1;
+	long hwm = opt.serverPid ? readRssKb(opt.serverPid, "VmHWM:") : -1;
+
+	if (opt.output.empty())
+		writeResults(std::cout, opt, results, elapsed, rss, hwm);
+	else
+	{
+		std::ofstream out(opt.output);
+		writeResults(out, opt, results, elapsed, rss, hwm);
+	}
+	for (Connection &c : conns)
+		::close(c.fd);
+	return EXIT_SUCCESS;
+}
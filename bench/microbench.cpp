@@ -0,0 +1,351 @@
+/*
+** ircmicro: microbenchmarks for the server's hot paths
+**
+** Each benchmark runs a function in a calibrated loop (about 200ms) and
+** reports nanoseconds per operation. The command mix is read from a file with
+** one protocol line per line (bench/mix.txt by default), so captured traffic
+** can be benchmarked as-is.
+**
+** The server under test listens on an ephemeral port; its clients are real
+** loopback TCP connections accepted through handleNewConnection().
+*/
+
+#include "Server.hpp"
+#include "Metrics.hpp"
+#include "ChannelStore.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/*
+** Friend of Server: builds a populated server and exposes the private paths
+*/
+class ServerBench
+{
+public:
+	explicit ServerBench(int members)
+		: _server(0, "pw")
+	{
+		struct sockaddr_storage bound{};
+		socklen_t len = sizeof(bound);
+		if (::getsockname(_server._listeners.front().fd, reinterpret_cast<struct sockaddr *>(&bound), &len) < 0)
+			throw std::runtime_error("getsockname failed");
+		// The port is at the same offset in sockaddr_in and sockaddr_in6
+		_addr.sin_family = AF_INET;
+		_addr.sin_port = reinterpret_cast<struct sockaddr_in *>(&bound)->sin_port;
+		_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		addClient("alice");
+		addClient("bob");
+		for (int i = 0; i < members; ++i)
+			addClient("member" + std::to_string(i));
+		for (std::size_t i = 0; i < _fds.size(); ++i)
+		{
+			_server.processLine(_fds[i], "JOIN #general");
+			if (i % 2 == 0)
+				_server.processLine(_fds[i], "JOIN #dev");
+		}
+		clearOutput();
+	}
+
+	~ServerBench()
+	{
+		for (int fd : _peers)
+			::close(fd);
+	}
+
+	Server &server() { return _server; }
+	int clientFd() const { return _fds[0]; }
+	int peerFd() const { return _peers[0]; }
+	Client &client() { return _server._clients.at(_fds[0]); }
+
+	std::size_t pollIndex(int fd) const
+	{
+		for (std::size_t i = 0; i < _server._fds.size(); ++i)
+			if (_server._fds[i].fd == fd)
+				return i;
+		throw std::runtime_error("fd not polled");
+	}
+
+	void clearOutput()
+	{
+		for (auto &pair : _server._clients)
+			pair.second.getWriteBuffer().clear();
+	}
+
+	Server::ParsedCommand parse(std::string_view line) { return _server.parseCommand(line); }
+	void processLine(std::string_view line) { _server.processLine(_fds[0], line); }
+	void sendNumeric(int numeric, std::string_view channel, std::string_view msg)
+	{
+		_server.sendNumeric(client(), numeric, channel, msg);
+	}
+	void handleClientRead(std::size_t index)
+	{
+		_server.handleClientRead(index);
+		while (!_server._readyClients.empty())
+			_server.serviceReadyClients();
+	}
+
+private:
+	void addClient(const std::string &nick)
+	{
+		int peer = ::socket(AF_INET, SOCK_STREAM, 0);
+		if (peer < 0 || ::connect(peer, reinterpret_cast<struct sockaddr *>(&_addr), sizeof(_addr)) < 0)
+			throw std::runtime_error("connect failed: " + std::string(strerror(errno)));
+		_server.handleNewConnection(_server._listeners.front());
+		int fd = _server._fds.back().fd;
+		_server.processLine(fd, "PASS pw");
+		_server.processLine(fd, "NICK " + nick);
+		_server.processLine(fd, "USER " + nick + " 0 * :" + nick);
+		_fds.push_back(fd);
+		_peers.push_back(peer);
+	}
+
+	Server				_server;
+	struct sockaddr_in	_addr{};
+	std::vector<int>	_fds;
+	std::vector<int>	_peers;
+};
+
+struct Result
+{
+	std::string name;
+	double nsPerOp;
+	std::uint64_t ops;
+};
+
+static std::vector<Result> g_results;
+static std::string g_filter;
+
+/*
+** Run fn in a loop long enough (~200ms) for a stable per-operation time
+** fn performs opsPerCall operations per call
+*/
+template <typename Fn>
+static void benchmark(const std::string &name, std::size_t opsPerCall, Fn fn)
+{
+	if (!g_filter.empty() && name.find(g_filter) == std::string::npos)
+		return;
+	for (int i = 0; i < 100; ++i)
+		fn();
+
+	std::uint64_t calls = 1;
+	std::uint64_t elapsed = 0;
+	while (true)
+	{
+		std::uint64_t start = Clock::now();
+		for (std::uint64_t i = 0; i < calls; ++i)
+			fn();
+		elapsed = Clock::now() - start;
+		if (elapsed >= 200000000ull || calls >= (1ull << 40))
+			break;
+		calls *= elapsed < 20000000ull ? 10 : 2;
+	}
+	std::uint64_t ops = calls * opsPerCall;
+	Result r = { name, static_cast<double>(elapsed) / static_cast<double>(ops), ops };
+	g_results.push_back(r);
+	std::printf("%-40s %12.1f ns/op %14llu ops\n", name.c_str(), r.nsPerOp,
+				static_cast<unsigned long long>(ops));
+}
+
+static std::vector<std::string> loadMix(const std::string &path)
+{
+	std::ifstream in(path);
+	if (!in)
+		throw std::runtime_error("Cannot open command mix " + path);
+	std::vector<std::string> lines;
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (!line.empty())
+			lines.push_back(line);
+	}
+	if (lines.empty())
+		throw std::runtime_error("Command mix " + path + " is empty");
+	return lines;
+}
+
+static void writeJson(const std::string &path)
+{
+	std::ofstream out(path);
+	out << "{\n  \"benchmarks\": [\n";
+	for (std::size_t i = 0; i < g_results.size(); ++i)
+	{
+		out << "    { \"name\": \"" << g_results[i].name << "\", \"ns_per_op\": " << g_results[i].nsPerOp
+			<< ", \"ops\": " << g_results[i].ops << " }" << (i + 1 < g_results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n}\n";
+}
+
+/// Benchmarks ///
+static void benchParser(ServerBench &bench, const std::vector<std::string> &mix)
+{
+	std::size_t sink = 0;
+	benchmark("Server::parseCommand", mix.size(), [&]() {
+		for (const std::string &line : mix)
+			sink += bench.parse(line).params.size();
+	});
+	if (sink == 42)
+		std::printf("\n");
+}
+
+static void benchDispatch(ServerBench &bench, const std::vector<std::string> &mix)
+{
+	benchmark("Server::processLine (mix)", mix.size(), [&]() {
+		for (const std::string &line : mix)
+			bench.processLine(line);
+		bench.clearOutput();
+	});
+	benchmark("Server::processLine (PING)", 1, [&]() {
+		bench.processLine("PING :ft_irc_server");
+		bench.client().getWriteBuffer().clear();
+	});
+}
+
+static void benchFormatting(ServerBench &bench)
+{
+	benchmark("Server::sendNumeric", 1, [&]() {
+		bench.sendNumeric(332, "#general", ":the topic of the day");
+		bench.client().getWriteBuffer().clear();
+	});
+}
+
+static void benchChannel()
+{
+	std::vector<Client> clients;
+	clients.reserve(1000);
+	for (int i = 0; i < 1000; ++i)
+	{
+		clients.emplace_back(100 + i);
+		clients.back().setNickname("nick" + std::to_string(i));
+	}
+
+	Channel modes("#modes");
+	modes.addClient(&clients[0]);
+	std::vector<std::string_view> set = { "+itkl", "secret", "50" };
+	std::vector<std::string_view> unset = { "-itkl" };
+	std::vector<std::string_view> op = { "+o", "nick0" };
+	std::vector<std::string_view> deop = { "-o", "nick0" };
+	benchmark("Channel::setMode (+itkl/-itkl)", 2, [&]() {
+		modes.setMode(set);
+		modes.setMode(unset);
+	});
+	benchmark("Channel::setMode (+o/-o)", 2, [&]() {
+		modes.setMode(op);
+		modes.setMode(deop);
+	});
+
+	const int sizes[] = { 10, 100, 1000 };
+	for (int size : sizes)
+	{
+		Channel chan("#find");
+		for (int i = 0; i < size; ++i)
+			chan.addClient(&clients[static_cast<std::size_t>(i)]);
+		std::string target = "nick" + std::to_string(size / 2);
+		std::size_t found = 0;
+		benchmark("Channel::findClientByNickname (" + std::to_string(size) + ")", 1, [&]() {
+			found += chan.findClientByNickname(target) != nullptr;
+		});
+	}
+}
+
+static void benchChannelStore()
+{
+	const int count = 50000;
+	std::string path = "/tmp/ircmicro-channels." + std::to_string(::getpid());
+	NameTable names;
+	ChannelMap channels;
+	channels.reserve(count);
+	for (int i = 0; i < count; ++i)
+	{
+		std::string name = "#channel" + std::to_string(i);
+		Channel chan(name);
+		chan.setTopic("topic of channel number " + std::to_string(i));
+		chan.setCreationTime(1700000000 + i);
+		if (i % 3 == 0)
+			chan.setTopicProtection();
+		channels.emplace(names.intern(name), chan);
+	}
+	{
+		ChannelStore writer;
+		ChannelStore::SavedChannels none;
+		writer.load(path, none);
+		writer.writeSnapshot(channels);
+	}
+	benchmark("ChannelStore::load (50000 channels)", 1, [&]() {
+		ChannelStore store;
+		ChannelStore::SavedChannels loaded;
+		if (store.load(path, loaded) != static_cast<std::size_t>(count))
+			throw std::runtime_error("snapshot lost channels");
+	});
+	::unlink(path.c_str());
+}
+
+static void benchFraming(ServerBench &bench)
+{
+	const int linesPerChunk = 64;
+	std::string chunk;
+	for (int i = 0; i < linesPerChunk; ++i)
+		chunk += "PING :ft_irc_server\r\n";
+	std::size_t index = bench.pollIndex(bench.clientFd());
+	benchmark("handleClientRead framing (per line)", linesPerChunk, [&]() {
+		if (::send(bench.peerFd(), chunk.data(), chunk.size(), 0) < 0)
+			throw std::runtime_error("send failed");
+		bench.handleClientRead(index);
+		bench.client().getWriteBuffer().clear();
+	});
+}
+
+int main(int argc, char **argv)
+{
+	std::string mixPath = "bench/mix.txt";
+	std::string jsonPath;
+	int members = 50;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string arg(argv[i]);
+		if (arg == "--mix")
+			mixPath = argv[i + 1];
+		else if (arg == "--json")
+			jsonPath = argv[i + 1];
+		else if (arg == "--filter")
+			g_filter = argv[i + 1];
+		else if (arg == "--members")
+			members = std::atoi(argv[i + 1]);
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--mix FILE] [--json FILE] [--filter NAME] [--members N]\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	try
+	{
+		std::vector<std::string> mix = loadMix(mixPath);
+		ServerBench bench(members);
+		std::printf("%zu-line command mix, %d channel members, %s clock\n\n", mix.size(), members + 2,
+					Clock::usesTsc() ? "TSC" : "clock_gettime");
+		benchParser(bench, mix);
+		benchDispatch(bench, mix);
+		benchFormatting(bench);
+		benchChannel();
+		benchChannelStore();
+		benchFraming(bench);
+		if (!jsonPath.empty())
+			writeJson(jsonPath);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "Benchmark failed: " << e.what() << '\n';
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
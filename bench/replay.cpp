@@ -0,0 +1,321 @@
+/*
+** ircreplay: re-drive a traffic capture against a server
+**
+** Reads a file written with IRCSERV_CAPTURE_FILE and replays it: every
+** captured connection is opened, fed its lines and closed in the recorded
+** order, either at the recorded pace (scaled by --speed) or as fast as the
+** server accepts it (--max). Server output is read and discarded.
+**
+** --dump prints the capture as text instead; --lines prints only the lines,
+** which makes a command mix for ircmicro.
+*/
+
+#include "Capture.hpp"
+#include "Metrics.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct Event
+{
+	Capture::RecordType type;
+	int conn;
+	std::uint64_t timeNs;
+	std::string line;
+};
+
+struct Connection
+{
+	int fd = -1;
+	bool closing = false;
+	std::string out;
+};
+
+struct Options
+{
+	std::string file;
+	std::string host = "127.0.0.1";
+	std::string port = "6667";
+	std::string password;
+	double speed = 1.0;
+	bool max = false;
+	bool dump = false;
+	bool linesOnly = false;
+};
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options] CAPTURE\n"
+			  << "  --host HOST      server address (127.0.0.1)\n"
+			  << "  --port PORT      server port (6667)\n"
+			  << "  --password PASS  rewrite PASS lines to this password\n"
+			  << "  --speed X        replay X times faster than recorded (1)\n"
+			  << "  --max            replay as fast as possible\n"
+			  << "  --dump           print the capture as text and exit\n"
+			  << "  --lines          print only the captured lines and exit\n";
+}
+
+static bool parseOptions(int argc, char **argv, Options &opt)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg(argv[i]);
+		if (arg == "--max")
+			opt.max = true;
+		else if (arg == "--dump")
+			opt.dump = true;
+		else if (arg == "--lines")
+			opt.linesOnly = true;
+		else if (arg.compare(0, 2, "--") == 0 && i + 1 < argc)
+		{
+			std::string value(argv[++i]);
+			if (arg == "--host")
+				opt.host = value;
+			else if (arg == "--port")
+				opt.port = value;
+			else if (arg == "--password")
+				opt.password = value;
+			else if (arg == "--speed")
+				opt.speed = std::atof(value.c_str());
+			else
+				return false;
+		}
+		else if (opt.file.empty())
+			opt.file = arg;
+		else
+			return false;
+	}
+	return !opt.file.empty() && opt.speed > 0;
+}
+
+/*
+** Decode the whole capture into events with absolute timestamps
+*/
+static std::vector<Event> loadCapture(const std::string &path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw std::runtime_error("Cannot open " + path);
+	std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (data.size() < sizeof(Capture::MAGIC) || data.compare(0, sizeof(Capture::MAGIC),
+			std::string(Capture::MAGIC, sizeof(Capture::MAGIC))) != 0)
+		throw std::runtime_error(path + " is not an ircserv capture");
+
+	std::vector<Event> events;
+	const char *p = data.data() + sizeof(Capture::MAGIC);
+	const char *end = data.data() + data.size();
+	std::uint64_t time = 0;
+	while (p < end)
+	{
+		Event ev;
+		std::uint8_t type = static_cast<std::uint8_t>(*p++);
+		std::uint64_t conn, delta, len;
+		if (type < Capture::Open || type > Capture::Close
+			|| !Capture::getVarint(p, end, conn) || !Capture::getVarint(p, end, delta))
+			throw std::runtime_error("Corrupt record at offset " + std::to_string(p - data.data()));
+		ev.type = static_cast<Capture::RecordType>(type);
+		ev.conn = static_cast<int>(conn);
+		time += delta;
+		ev.timeNs = time;
+		if (ev.type == Capture::Line)
+		{
+			if (!Capture::getVarint(p, end, len) || len > static_cast<std::uint64_t>(end - p))
+				throw std::runtime_error("Truncated line at offset " + std::to_string(p - data.data()));
+			ev.line.assign(p, static_cast<std::size_t>(len));
+			p += len;
+		}
+		events.push_back(ev);
+	}
+	return events;
+}
+
+static int connectTo(const Options &opt)
+{
+	struct addrinfo hints{};
+	struct addrinfo *res = nullptr;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(opt.host.c_str(), opt.port.c_str(), &hints, &res) != 0)
+		return -1;
+	int fd = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd >= 0 && ::connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd >= 0)
+		::fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+/*
+** One poll round: send pending input, discard server output and finish
+** connections whose Close has been replayed and whose input is flushed
+*/
+static void pump(std::map<std::uint64_t, Connection> &conns, int timeoutMs)
+{
+	std::vector<pollfd> fds;
+	std::vector<std::uint64_t> keys;
+	for (auto &pair : conns)
+	{
+		pollfd pfd = { pair.second.fd, static_cast<short>(POLLIN | (pair.second.out.empty() ? 0 : POLLOUT)), 0 };
+		fds.push_back(pfd);
+		keys.push_back(pair.first);
+	}
+	if (fds.empty())
+	{
+		if (timeoutMs > 0)
+			::usleep(static_cast<useconds_t>(timeoutMs) * 1000);
+		return;
+	}
+	::poll(fds.data(), fds.size(), timeoutMs);
+
+	char buffer[65536];
+	for (std::size_t i = 0; i < fds.size(); ++i)
+	{
+		Connection &c = conns[keys[i]];
+		if (fds[i].revents & POLLIN)
+			while (::recv(c.fd, buffer, sizeof(buffer), 0) > 0)
+				;
+		if ((fds[i].revents & POLLOUT) && !c.out.empty())
+		{
+			ssize_t sent = ::send(c.fd, c.out.data(), c.out.size(), 0);
+			if (sent > 0)
+				c.out.erase(0, static_cast<std::size_t>(sent));
+		}
+		if ((c.closing && c.out.empty()) || (fds[i].revents & (POLLERR | POLLHUP)))
+		{
+			::close(c.fd);
+			conns.erase(keys[i]);
+		}
+	}
+}
+
+static void dump(const std::vector<Event> &events, bool linesOnly)
+{
+	static const char *names[] = { "", "OPEN", "LINE", "CLOSE" };
+	for (const Event &ev : events)
+	{
+		if (linesOnly)
+		{
+			if (ev.type == Capture::Line)
+				std::cout << ev.line << "\n";
+			continue;
+		}
+		std::printf("%14.6f %6d %-5s %s\n", static_cast<double>(ev.timeNs) / 1e9, ev.conn,
+					names[ev.type], ev.line.c_str());
+	}
+}
+
+/*
+** Replay connections are keyed by the order they were opened in: the
+** server reuses the fd numbers a capture names them by, and a closed
+** connection may still be flushing when its number comes back
+*/
+static void replay(const std::vector<Event> &events, const Options &opt)
+{
+	std::map<std::uint64_t, Connection> conns;
+	std::map<int, std::uint64_t> current;
+	std::uint64_t lines = 0;
+	std::uint64_t opened = 0;
+	std::uint64_t start = Clock::now();
+
+	for (std::size_t i = 0; i < events.size(); ++i)
+	{
+		const Event &ev = events[i];
+		if (!opt.max)
+		{
+			std::uint64_t target = start + static_cast<std::uint64_t>(static_cast<double>(ev.timeNs) / opt.speed);
+			std::uint64_t now;
+			while ((now = Clock::now()) < target)
+				pump(conns, static_cast<int>((target - now) / 1000000));
+		}
+		else if (i % 256 == 0)
+			pump(conns, 0);
+
+		if (ev.type == Capture::Open)
+		{
+			Connection c;
+			c.fd = connectTo(opt);
+			if (c.fd < 0)
+				throw std::runtime_error("connect failed: " + std::string(strerror(errno)));
+			current[ev.conn] = opened;
+			conns[opened] = c;
+			++opened;
+			continue;
+		}
+		auto open = current.find(ev.conn);
+		if (open == current.end())
+			continue;
+		auto it = conns.find(open->second);
+		if (ev.type == Capture::Close)
+			current.erase(open);
+		if (it == conns.end())
+			continue;
+		if (ev.type == Capture::Line)
+		{
+			if (!opt.password.empty() && ev.line.compare(0, 5, "PASS ") == 0)
+				it->second.out += "PASS " + opt.password + "\r\n";
+			else
+				it->second.out += ev.line + "\r\n";
+			++lines;
+		}
+		else
+			it->second.closing = true;
+	}
+
+	std::uint64_t deadline = Clock::now() + 5000000000ull;
+	while (!conns.empty() && Clock::now() < deadline)
+	{
+		for (auto &pair : conns)
+			pair.second.closing = true;
+		pump(conns, 10);
+	}
+	double wall = static_cast<double>(Clock::now() - start) / 1e9;
+	double recorded = events.empty() ? 0 : static_cast<double>(events.back().timeNs) / 1e9;
+
+	std::cout << "{\n"
+			  << "  \"events\": " << events.size() << ",\n"
+			  << "  \"connections\": " << opened << ",\n"
+			  << "  \"lines\": " << lines << ",\n"
+			  << "  \"recorded_s\": " << recorded << ",\n"
+			  << "  \"replay_s\": " << wall << ",\n"
+			  << "  \"lines_per_sec\": " << (wall > 0 ? static_cast<double>(lines) / wall : 0) << "\n"
+			  << "}\n";
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	if (!parseOptions(argc, argv, opt))
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	try
+	{
+		std::vector<Event> events = loadCapture(opt.file);
+		if (opt.dump || opt.linesOnly)
+			dump(events, opt.linesOnly);
+		else
+			replay(events, opt);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "Replay failed: " << e.what() << '\n';
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,732 @@
+/*
+** ircsim: deterministic simulation of ircserv with virtual clients
+**
+** The server runs in-process on an in-memory transport and a virtual clock:
+** a client is a pair of buffers, not a socket, so 100k of them cost a few
+** hundred bytes each and no file descriptors. A seeded scheduler drives them
+** through registration, channel traffic, JOIN/PART/INVITE/NICK churn, slow
+** reads and disconnects (QUIT or a dropped connection, then a reconnect on
+** the same fd), and now and then a connection that turns into a server link
+** with client output still queued. Each tick stands in for poll(), filling
+** in revents from the virtual connections, and runs one iteration of the
+** server's own loop (Server::runIteration()).
+** Every few ticks the server's state is checked for invariant violations:
+** channel members, invitations and the dirty and ready lists may only point
+** at live clients, memberships must agree both ways, and the poll set must
+** match what each client waits for.
+** The same seed gives the same run. Results are printed as JSON; the exit
+** status is non-zero if an invariant was violated.
+*/
+
+#include "Server.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct Options
+{
+	int clients = 100000;
+	int channels = 20000;
+	long ops = 300000;
+	int opsPerTick = 1000;
+	int joinsPerClient = 2;
+	int slowPercent = 5;
+	int checkEvery = 100;
+	int inviteTtl = 1;
+	int maxInvites = 8;
+	unsigned long long seed = 1;
+	std::string output;
+};
+
+/*
+** One end of a virtual connection, seen from the client
+** in: bytes the client sent, not yet read by the server
+** pending: bytes the server sent that the client has not read yet; the
+** transport refuses more than window of them, like a full socket buffer
+*/
+struct VirtualConnection
+{
+	std::string in;
+	std::size_t inOffset = 0;
+	std::size_t pending = 0;
+	std::size_t window = 256 << 10;
+	std::size_t drainPerTick = 256 << 10;
+	bool open = false;
+	bool hungUp = false;
+	bool readable = false;
+	bool draining = false;
+	// A server link: the start of what it was sent is kept for checking
+	bool link = false;
+	std::string kept;
+};
+
+/*
+** In-memory connections, by fd - FIRST_FD
+*/
+class MemoryTransport : public Transport
+{
+public:
+	static const int FIRST_FD = 1 << 16;
+	static const std::size_t KEPT_BYTES = 4096;
+
+	explicit MemoryTransport(std::size_t count) : _connections(count) {}
+
+	VirtualConnection &at(int fd) { return _connections[static_cast<std::size_t>(fd - FIRST_FD)]; }
+
+	ssize_t recv(int fd, char *buffer, std::size_t size) override
+	{
+		VirtualConnection &conn = at(fd);
+		std::size_t available = conn.in.size() - conn.inOffset;
+		if (available == 0)
+		{
+			conn.in.clear();
+			conn.inOffset = 0;
+			if (conn.hungUp)
+				return 0;
+			errno = EAGAIN;
+			return -1;
+		}
+		std::size_t n = std::min(available, size);
+		std::memcpy(buffer, conn.in.data() + conn.inOffset, n);
+		conn.inOffset += n;
+		return static_cast<ssize_t>(n);
+	}
+
+	ssize_t send(int fd, const char *data, std::size_t size, bool) override
+	{
+		VirtualConnection &conn = at(fd);
+		if (!conn.open || conn.hungUp)
+		{
+			errno = EPIPE;
+			return -1;
+		}
+		std::size_t room = conn.window - conn.pending;
+		if (room == 0)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+		std::size_t n = std::min(room, size);
+		if (conn.link && conn.kept.size() < KEPT_BYTES)
+			conn.kept.append(data, std::min(n, KEPT_BYTES - conn.kept.size()));
+		conn.pending += n;
+		bytesDelivered += n;
+		linesDelivered += static_cast<std::uint64_t>(std::count(data, data + n, '\n'));
+		if (!conn.draining)
+		{
+			conn.draining = true;
+			draining.push_back(fd);
+		}
+		return static_cast<ssize_t>(n);
+	}
+
+	void close(int fd) override
+	{
+		VirtualConnection &conn = at(fd);
+		conn.open = false;
+		conn.in.clear();
+		conn.inOffset = 0;
+		conn.pending = 0;
+		conn.kept.clear();
+		++closes;
+	}
+
+	// Client queued input for the server
+	void write(int fd, const std::string &data)
+	{
+		VirtualConnection &conn = at(fd);
+		conn.in += data;
+		if (!conn.readable)
+		{
+			conn.readable = true;
+			readable.push_back(fd);
+		}
+	}
+
+	std::vector<int> readable;
+	std::vector<int> draining;
+	std::uint64_t bytesDelivered = 0;
+	std::uint64_t linesDelivered = 0;
+	std::uint64_t closes = 0;
+
+private:
+	std::vector<VirtualConnection> _connections;
+};
+
+/*
+** Virtual time: starts at a fixed instant, moved by the scheduler only
+*/
+class VirtualClock : public WallClock
+{
+public:
+	std::time_t now() const override { return static_cast<std::time_t>(1700000000 + _ms / 1000); }
+	void advance(std::uint64_t ms) { _ms += ms; }
+	std::uint64_t elapsedMs() const { return _ms; }
+
+private:
+	std::uint64_t _ms = 0;
+};
+
+struct Results
+{
+	std::uint64_t ticks = 0;
+	std::uint64_t ops = 0;
+	std::uint64_t connects = 0;
+	std::uint64_t quits = 0;
+	std::uint64_t hangups = 0;
+	std::uint64_t links = 0;
+	std::uint64_t checks = 0;
+	std::uint64_t violations = 0;
+	std::uint64_t setupNs = 0;
+	std::uint64_t runNs = 0;
+	Histogram tickNs;
+	Histogram checkNs;
+	std::vector<std::string> firstViolations;
+};
+
+/*
+** Friend of Server: owns one, and plays its event loop and its clients
+*/
+class Simulation
+{
+public:
+	Simulation(const Options &opt)
+		: _opt(opt), _server(0, "pw"), _transport(static_cast<std::size_t>(opt.clients)), _rng(opt.seed),
+		  _nicks(static_cast<std::size_t>(opt.clients)), _joined(static_cast<std::size_t>(opt.clients)),
+		  _renames(static_cast<std::size_t>(opt.clients), 0)
+	{
+		_server.useTransport(_transport, _clock);
+		_server._linkPassword = LINK_PASSWORD;
+		// Short-lived invitations, so that expiry and the cap are exercised
+		_server._config.inviteTtl = opt.inviteTtl;
+		_server._config.maxInvites = static_cast<std::size_t>(opt.maxInvites);
+		for (int id = 0; id < opt.clients; ++id)
+		{
+			VirtualConnection &conn = _transport.at(fdOf(id));
+			if (static_cast<int>(pick(100)) < opt.slowPercent)
+			{
+				conn.window = 16 << 10;
+				conn.drainPerTick = 2 << 10;
+			}
+		}
+	}
+
+	~Simulation()
+	{
+		// The virtual fds are not the server's to close
+		auto &fds = _server._fds;
+		fds.erase(std::remove_if(fds.begin(), fds.end(),
+								 [](const pollfd &pfd) { return pfd.fd >= MemoryTransport::FIRST_FD; }),
+				  fds.end());
+	}
+
+	void run(Results &results)
+	{
+		std::uint64_t start = Clock::now();
+		for (int id = 0; id < _opt.clients; ++id)
+		{
+			connect(id, results);
+			for (int k = 0; k < _opt.joinsPerClient; ++k)
+				join(id);
+			if (id % _opt.opsPerTick == _opt.opsPerTick - 1)
+				tick(results);
+		}
+		tick(results);
+		results.setupNs = Clock::now() - start;
+
+		start = Clock::now();
+		while (static_cast<long>(results.ops) < _opt.ops)
+		{
+			for (int i = 0; i < _opt.opsPerTick && static_cast<long>(results.ops) < _opt.ops; ++i)
+			{
+				act(static_cast<int>(pick(static_cast<std::uint64_t>(_opt.clients))), results);
+				++results.ops;
+			}
+			tick(results);
+		}
+		// Let the output settle, then look one last time
+		for (int i = 0; i < 50; ++i)
+			tick(results);
+		check(results);
+		results.runNs = Clock::now() - start;
+	}
+
+	const MemoryTransport &transport() const { return _transport; }
+	const Metrics &metrics() const { return _server._metrics; }
+	std::uint64_t virtualMs() const { return _clock.elapsedMs(); }
+
+	static int commandNames(const char **names)
+	{
+		for (int i = 0; i < Server::COMMAND_COUNT && i < Metrics::MAX_COMMANDS; ++i)
+			names[i] = Server::COMMANDS[i].name;
+		return Server::COMMAND_COUNT;
+	}
+
+private:
+	static constexpr const char *LINK_PASSWORD = "simlink";
+	// Iterations a new link gets to answer before it is looked at
+	static const std::uint64_t LINK_CHECK_TICKS = 3;
+
+	static int fdOf(int id) { return MemoryTransport::FIRST_FD + id; }
+
+	std::uint64_t pick(std::uint64_t n) { return std::uniform_int_distribution<std::uint64_t>(0, n - 1)(_rng); }
+
+	std::string channelName(std::uint64_t index) const { return "#c" + std::to_string(index); }
+
+	std::string randomNick() { return _nicks[pick(static_cast<std::uint64_t>(_opt.clients))]; }
+
+	void send(int id, const std::string &line) { _transport.write(fdOf(id), line + "\r\n"); }
+
+	void connect(int id, Results &results)
+	{
+		int fd = fdOf(id);
+		VirtualConnection &conn = _transport.at(fd);
+		conn.open = true;
+		conn.hungUp = false;
+		conn.link = false;
+		Client &client = _server.registerConnection(fd, _server._listeners.front());
+		client.setHost("sim.invalid");
+		std::size_t slot = static_cast<std::size_t>(id);
+		_nicks[slot] = "v" + std::to_string(id) + "_" + std::to_string(_renames[slot]++);
+		_joined[slot].clear();
+		send(id, "PASS pw");
+		send(id, "NICK " + _nicks[slot]);
+		send(id, "USER u" + std::to_string(id) + " 0 * :virtual client");
+		++results.connects;
+	}
+
+	/*
+	** A connection that registers as a server in the same read as a command
+	** whose reply is still queued for the flush phase
+	** The server must forget the client it was and send the reply once, on
+	** the link; checkLinks() looks at what arrived, then drops the link
+	*/
+	void connectAsLink(int id, Results &results)
+	{
+		int fd = fdOf(id);
+		VirtualConnection &conn = _transport.at(fd);
+		conn.open = true;
+		conn.hungUp = false;
+		conn.link = true;
+		_server.registerConnection(fd, _server._listeners.front()).setHost("sim.invalid");
+		_joined[static_cast<std::size_t>(id)].clear();
+		send(id, "PING :" + linkToken(id));
+		send(id, "PASS " + std::string(LINK_PASSWORD));
+		send(id, "SERVER sim" + std::to_string(id) + ".invalid 1 :simulated peer");
+		_pendingLinks.push_back({ id, results.ticks });
+		++results.links;
+	}
+
+	static std::string linkToken(int id) { return "link" + std::to_string(id); }
+
+	/*
+	** A few iterations after a connection became a link, its PING must have
+	** been answered exactly once; then it hangs up
+	*/
+	void checkLinks(Results &results)
+	{
+		for (std::size_t i = 0; i < _pendingLinks.size();)
+		{
+			PendingLink pending = _pendingLinks[i];
+			if (results.ticks < pending.tick + LINK_CHECK_TICKS)
+			{
+				++i;
+				continue;
+			}
+			VirtualConnection &conn = _transport.at(fdOf(pending.id));
+			std::string pong = "PONG :" + linkToken(pending.id) + "\r\n";
+			std::size_t count = 0;
+			for (std::size_t pos = conn.kept.find(pong); pos != std::string::npos; pos = conn.kept.find(pong, pos + 1))
+				++count;
+			if (count != 1)
+				violation(results, "link " + linkToken(pending.id) + " got its PONG " + std::to_string(count)
+									   + " times");
+			conn.hungUp = true;
+			_transport.write(fdOf(pending.id), "");
+			_pendingLinks[i] = _pendingLinks.back();
+			_pendingLinks.pop_back();
+		}
+	}
+
+	void join(int id)
+	{
+		std::uint64_t channel = pick(static_cast<std::uint64_t>(_opt.channels));
+		send(id, "JOIN " + channelName(channel));
+		_joined[static_cast<std::size_t>(id)].push_back(channel);
+	}
+
+	/*
+	** One action of client id, chosen by weight
+	*/
+	void act(int id, Results &results)
+	{
+		std::size_t slot = static_cast<std::size_t>(id);
+		VirtualConnection &conn = _transport.at(fdOf(id));
+		if (!conn.open)
+		{
+			if (pick(500) == 0)
+				connectAsLink(id, results);
+			else
+			{
+				connect(id, results);
+				join(id);
+			}
+			return;
+		}
+		if (conn.hungUp || conn.link)
+			return;
+		std::vector<std::uint64_t> &joined = _joined[slot];
+		std::uint64_t roll = pick(100);
+		std::string target = joined.empty() ? channelName(pick(static_cast<std::uint64_t>(_opt.channels)))
+											: channelName(joined[pick(joined.size())]);
+		if (roll < 40)
+			send(id, "PRIVMSG " + target + " :tick " + std::to_string(results.ops));
+		else if (roll < 50)
+			send(id, "PRIVMSG " + randomNick() + " :hello");
+		else if (roll < 62)
+			join(id);
+		else if (roll < 70 && !joined.empty())
+		{
+			std::size_t index = pick(joined.size());
+			send(id, "PART " + channelName(joined[index]));
+			joined.erase(joined.begin() + static_cast<std::ptrdiff_t>(index));
+		}
+		else if (roll < 76)
+			send(id, "INVITE " + randomNick() + " " + target);
+		else if (roll < 78)
+			send(id, "MODE " + target + (pick(2) ? " +i" : " -i"));
+		else if (roll < 81)
+			send(id, "TOPIC " + target + " :topic " + std::to_string(results.ops));
+		else if (roll < 84)
+		{
+			_nicks[slot] = "v" + std::to_string(id) + "_" + std::to_string(_renames[slot]++);
+			send(id, "NICK " + _nicks[slot]);
+		}
+		else if (roll < 93)
+			send(id, "PING :" + std::to_string(results.ops));
+		else if (roll < 94)
+			send(id, "WHO " + target);
+		else if (roll < 97)
+		{
+			send(id, "QUIT :bye");
+			++results.quits;
+		}
+		else
+		{
+			// The connection drops: the server reads EOF
+			conn.hungUp = true;
+			_transport.write(fdOf(id), "");
+			++results.hangups;
+		}
+	}
+
+	/*
+	** Stand in for poll(), then run one iteration of the server's loop
+	** Connections with input are readable; those the server waits to write
+	** to are writable once their client has read enough
+	*/
+	void tick(Results &results)
+	{
+		std::uint64_t start = Clock::now();
+		_clock.advance(10);
+		drain();
+		int ready = 0;
+		for (pollfd &pfd : _server._fds)
+		{
+			pfd.revents = 0;
+			if (pfd.fd < MemoryTransport::FIRST_FD || !(pfd.events & POLLOUT))
+				continue;
+			VirtualConnection &conn = _transport.at(pfd.fd);
+			if (conn.open && (conn.hungUp || conn.pending < conn.window))
+				pfd.revents = POLLOUT;
+		}
+		std::vector<int> readable;
+		readable.swap(_transport.readable);
+		for (int fd : readable)
+		{
+			_transport.at(fd).readable = false;
+			if (pollfd *pfd = _server.findPollFd(fd))
+				pfd->revents |= POLLIN;
+		}
+		for (const pollfd &pfd : _server._fds)
+			ready += pfd.revents != 0;
+		_server.runIteration(ready);
+
+		++results.ticks;
+		results.tickNs.record(Clock::now() - start);
+		checkLinks(results);
+		if (results.ticks % static_cast<std::uint64_t>(_opt.checkEvery) == 0)
+			check(results);
+	}
+
+	/*
+	** Clients read some of their output, making room in their window
+	*/
+	void drain()
+	{
+		std::vector<int> draining;
+		draining.swap(_transport.draining);
+		for (int fd : draining)
+		{
+			VirtualConnection &conn = _transport.at(fd);
+			conn.draining = false;
+			conn.pending -= std::min(conn.pending, conn.drainPerTick);
+			if (conn.pending > 0)
+			{
+				conn.draining = true;
+				_transport.draining.push_back(fd);
+			}
+		}
+	}
+
+	void violation(Results &results, const std::string &what)
+	{
+		++results.violations;
+		if (results.firstViolations.size() < 10)
+			results.firstViolations.push_back("tick " + std::to_string(results.ticks) + ": " + what);
+	}
+
+	/*
+	** Walk the server's state and count what should never be
+	*/
+	void check(Results &results)
+	{
+		std::uint64_t start = Clock::now();
+		++results.checks;
+		std::unordered_set<const Client *> live;
+		for (auto &pair : _server._clients)
+			live.insert(&pair.second);
+
+		for (auto &pair : _server._channels)
+		{
+			const Channel &channel = pair.second;
+			const std::string &name = channel.getChannelName();
+			for (Client *member : channel.getMembers())
+			{
+				if (!live.count(member))
+					violation(results, name + ": member is not a live client");
+				else if (!member->getChannels().count(const_cast<Channel *>(&channel)))
+					violation(results, name + ": member " + member->getNickname() + " does not list it");
+			}
+			for (const auto &invite : channel.getInvited())
+			{
+				if (!live.count(invite.first))
+					violation(results, name + ": invitation held for a client that is gone");
+				else if (!invite.first->getInvitations().count(const_cast<Channel *>(&channel)))
+					violation(results, name + ": invited " + invite.first->getNickname() + " does not list it");
+				if (channel.getInvited().size() > _server._config.maxInvites)
+					violation(results, name + ": more invitations than max_invites");
+			}
+			if (channel.getCurrentUsers() != static_cast<int>(channel.getMembers().size()))
+				violation(results, name + ": user count differs from its members");
+			if (channel.isEmpty())
+				violation(results, name + ": empty channel kept");
+		}
+
+		for (auto &pair : _server._clients)
+		{
+			Client &client = pair.second;
+			for (Channel *channel : client.getChannels())
+			{
+				if (!channel->getMembers().count(&client))
+					violation(results, client.getNickname() + " lists a channel it is not a member of");
+			}
+			for (Channel *channel : client.getInvitations())
+			{
+				if (!channel->getInvited().count(&client))
+					violation(results, client.getNickname() + " lists an invitation the channel does not hold");
+			}
+			if (client.isRegistered() && _server.findClientByNick(client.getNickname()) != &client)
+				violation(results, client.getNickname() + ": nickname not indexed");
+			pollfd *pfd = _server.findPollFd(pair.first);
+			if (!pfd)
+				violation(results, client.getNickname() + ": not in the poll set");
+			else if (!client.isDeparting() && client.isWaitingWrite() != ((pfd->events & POLLOUT) != 0))
+				violation(results, client.getNickname() + ": POLLOUT does not match its write state");
+		}
+
+		std::size_t dirty = 0;
+		for (Client *client = _server._dirtyClients; client; client = client->nextDirty())
+		{
+			if (!live.count(client) || !client->isDirty() || ++dirty > live.size())
+			{
+				violation(results, "dirty list holds a client that is gone");
+				break;
+			}
+		}
+		for (int fd : _server._readyClients)
+		{
+			if (_server._clients.count(fd) && !_server._clients.at(fd).isReadReady())
+				violation(results, "ready list and client flag disagree");
+		}
+		results.checkNs.record(Clock::now() - start);
+	}
+
+	const Options			&_opt;
+	Server					_server;
+	MemoryTransport			_transport;
+	VirtualClock			_clock;
+	std::mt19937_64			_rng;
+	std::vector<std::string> _nicks;
+	// Channels each client believes it is in
+	std::vector<std::vector<std::uint64_t>> _joined;
+	std::vector<unsigned>	_renames;
+	// Connections that became links, waiting for checkLinks()
+	struct PendingLink
+	{
+		int				id;
+		std::uint64_t	tick;
+	};
+	std::vector<PendingLink> _pendingLinks;
+};
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options]\n"
+			  << "  --clients N          virtual clients (100000)\n"
+			  << "  --channels M         channel names they pick from (20000)\n"
+			  << "  --ops N              client actions to run (300000)\n"
+			  << "  --ops-per-tick N     actions per event loop iteration (1000)\n"
+			  << "  --joins K            channels each client joins on connect (2)\n"
+			  << "  --slow-percent P     clients reading 2 KiB per tick into a 16 KiB window (5)\n"
+			  << "  --check-every N      check invariants every N ticks (100)\n"
+			  << "  --invite-ttl S       invite_ttl of the server, in virtual seconds (1)\n"
+			  << "  --max-invites N      max_invites of the server (8)\n"
+			  << "  --seed S             scheduler seed (1)\n"
+			  << "  --json FILE          write results to FILE instead of stdout\n";
+}
+
+static bool parseOptions(int argc, char **argv, Options &opt)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg(argv[i]);
+		if (i + 1 >= argc)
+			return false;
+		std::string value(argv[++i]);
+		if (arg == "--clients")
+			opt.clients = std::atoi(value.c_str());
+		else if (arg == "--channels")
+			opt.channels = std::atoi(value.c_str());
+		else if (arg == "--ops")
+			opt.ops = std::atol(value.c_str());
+		else if (arg == "--ops-per-tick")
+			opt.opsPerTick = std::atoi(value.c_str());
+		else if (arg == "--joins")
+			opt.joinsPerClient = std::atoi(value.c_str());
+		else if (arg == "--slow-percent")
+			opt.slowPercent = std::atoi(value.c_str());
+		else if (arg == "--check-every")
+			opt.checkEvery = std::atoi(value.c_str());
+		else if (arg == "--invite-ttl")
+			opt.inviteTtl = std::atoi(value.c_str());
+		else if (arg == "--max-invites")
+			opt.maxInvites = std::atoi(value.c_str());
+		else if (arg == "--seed")
+			opt.seed = std::strtoull(value.c_str(), nullptr, 10);
+		else if (arg == "--json")
+			opt.output = value;
+		else
+			return false;
+	}
+	return opt.clients > 0 && opt.channels > 0 && opt.ops >= 0 && opt.opsPerTick > 0 && opt.joinsPerClient >= 0
+		   && opt.slowPercent >= 0 && opt.slowPercent <= 100 && opt.checkEvery > 0
+		   && opt.inviteTtl >= 0 && opt.maxInvites > 0;
+}
+
+static void writeHistogram(std::ostream &out, const char *name, const Histogram &h, bool last = false)
+{
+	out << "    \"" << name << "\": {"
+		<< " \"count\": " << h.count() << ","
+		<< " \"p50\": " << static_cast<double>(h.percentile(0.5)) / 1e3 << ","
+		<< " \"p99\": " << static_cast<double>(h.percentile(0.99)) / 1e3 << ","
+		<< " \"max\": " << static_cast<double>(h.max()) / 1e3 << " }" << (last ? "\n" : ",\n");
+}
+
+static void writeResults(std::ostream &out, const Options &opt, const Simulation &sim, const Results &r,
+						 const Metrics &metrics, const char *const *commands, int commandCount)
+{
+	out << "{\n"
+		<< "  \"seed\": " << opt.seed << ",\n"
+		<< "  \"clients\": " << opt.clients << ",\n"
+		<< "  \"channels\": " << opt.channels << ",\n"
+		<< "  \"ops\": " << r.ops << ",\n"
+		<< "  \"ticks\": " << r.ticks << ",\n"
+		<< "  \"virtual_seconds\": " << static_cast<double>(sim.virtualMs()) / 1e3 << ",\n"
+		<< "  \"setup_ms\": " << static_cast<double>(r.setupNs) / 1e6 << ",\n"
+		<< "  \"run_ms\": " << static_cast<double>(r.runNs) / 1e6 << ",\n"
+		<< "  \"ops_per_sec\": "
+		<< (r.runNs ? static_cast<double>(r.ops) * 1e9 / static_cast<double>(r.runNs) : 0.0) << ",\n"
+		<< "  \"connects\": " << r.connects << ",\n"
+		<< "  \"quits\": " << r.quits << ",\n"
+		<< "  \"hangups\": " << r.hangups << ",\n"
+		<< "  \"links\": " << r.links << ",\n"
+		<< "  \"closed\": " << sim.transport().closes << ",\n"
+		<< "  \"lines_in\": " << metrics.linesIn << ",\n"
+		<< "  \"invites_expired\": " << metrics.invitesExpired << ",\n"
+		<< "  \"lines_delivered\": " << sim.transport().linesDelivered << ",\n"
+		<< "  \"bytes_delivered\": " << sim.transport().bytesDelivered << ",\n"
+		<< "  \"phases_us\": {\n";
+	writeHistogram(out, "tick", r.tickNs);
+	// The server's own: one client's read turn, and the flush phase
+	writeHistogram(out, "client_read", metrics.readNs);
+	writeHistogram(out, "flush", metrics.flushNs);
+	writeHistogram(out, "check", r.checkNs, true);
+	out << "  },\n"
+		<< "  \"commands_us\": {\n";
+	std::vector<int> used;
+	for (int i = 0; i < commandCount && i < Metrics::MAX_COMMANDS; ++i)
+		if (metrics.commandNs[i].count())
+			used.push_back(i);
+	for (std::size_t i = 0; i < used.size(); ++i)
+		writeHistogram(out, commands[used[i]], metrics.commandNs[used[i]], i + 1 == used.size());
+	out << "  },\n"
+		<< "  \"checks\": " << r.checks << ",\n"
+		<< "  \"violations\": " << r.violations << ",\n"
+		<< "  \"first_violations\": [";
+	for (std::size_t i = 0; i < r.firstViolations.size(); ++i)
+		out << (i ? ",\n    \"" : "\n    \"") << r.firstViolations[i] << "\"";
+	out << (r.firstViolations.empty() ? "]\n" : "\n  ]\n") << "}\n";
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	if (!parseOptions(argc, argv, opt))
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	Logger::instance().setLevel(LogLevel::Error);
+
+	Results results;
+	try
+	{
+		Simulation sim(opt);
+		sim.run(results);
+		const char *commands[Metrics::MAX_COMMANDS];
+		int count = Simulation::commandNames(commands);
+		if (opt.output.empty())
+			writeResults(std::cout, opt, sim, results, sim.metrics(), commands, count);
+		else
+		{
+			std::ofstream out(opt.output);
+			writeResults(out, opt, sim, results, sim.metrics(), commands, count);
+		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "Simulation failed: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+	return results.violations ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,366 @@
+/*
+** ircsync: state sync benchmark
+**
+** Builds the sync stream of a synthetic network (N users, M channels, each
+** user in K of them, one operator per channel), starts ircserv as a standby
+** importing it, and streams it over the unix socket. Meanwhile a client
+** registered on the standby keeps sending PINGs, so the report shows how
+** long the transfer and the apply took and how responsive the standby stayed.
+** Results are printed as JSON.
+*/
+
+#include "Metrics.hpp"
+#include "StateSync.hpp"
+#include "Channel.hpp"
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+struct Options
+{
+	std::string ircserv = "./ircserv";
+	std::string port = "6697";
+	int users = 100000;
+	int channels = 10000;
+	int joinsPerUser = 3;
+	std::string output;
+};
+
+struct Results
+{
+	std::size_t streamBytes = 0;
+	std::uint64_t encodeNs = 0;
+	std::uint64_t sendNs = 0;
+	std::uint64_t totalNs = 0;
+	std::uint64_t applyNs = 0;
+	std::uint64_t longestSliceNs = 0;
+	std::uint32_t slices = 0;
+	std::uint32_t importedUsers = 0;
+	std::uint32_t importedChannels = 0;
+	Histogram pingNs;
+};
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options]\n"
+			  << "  --ircserv PATH       server binary to start as the standby (./ircserv)\n"
+			  << "  --port PORT          port the standby listens on (6697)\n"
+			  << "  --users N            users in the stream (100000)\n"
+			  << "  --channels M         channels in the stream (10000)\n"
+			  << "  --joins K            channels per user (3)\n"
+			  << "  --json FILE          write results to FILE instead of stdout\n";
+}
+
+static bool parseOptions(int argc, char **argv, Options &opt)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg(argv[i]);
+		if (i + 1 >= argc)
+			return false;
+		std::string value(argv[++i]);
+		if (arg == "--ircserv")
+			opt.ircserv = value;
+		else if (arg == "--port")
+			opt.port = value;
+		else if (arg == "--users")
+			opt.users = std::atoi(value.c_str());
+		else if (arg == "--channels")
+			opt.channels = std::atoi(value.c_str());
+		else if (arg == "--joins")
+			opt.joinsPerUser = std::atoi(value.c_str());
+		else if (arg == "--json")
+			opt.output = value;
+		else
+			return false;
+	}
+	return opt.users > 0 && opt.channels > 0 && opt.joinsPerUser > 0 && opt.joinsPerUser <= opt.channels;
+}
+
+static std::string nickOf(int user) { return "user" + std::to_string(user); }
+
+/*
+** The stream a server with this network would send
+** User u is in channels (u * K + k) % M; the first member of each is its operator
+*/
+static std::string buildStream(const Options &opt)
+{
+	std::vector<std::vector<int>> members(static_cast<std::size_t>(opt.channels));
+	for (int u = 0; u < opt.users; ++u)
+		for (int k = 0; k < opt.joinsPerUser; ++k)
+			members[static_cast<std::size_t>((u * opt.joinsPerUser + k) % opt.channels)].push_back(u);
+
+	WireWriter out;
+	std::size_t frame = SyncStream::begin(out, SyncStream::HelloFrame);
+	out.str(SyncStream::MAGIC);
+	out.u32(SyncStream::VERSION);
+	out.str("ircsync.bench");
+	out.u32(static_cast<std::uint32_t>(opt.users));
+	out.u32(static_cast<std::uint32_t>(opt.channels));
+	SyncStream::end(out, frame);
+
+	for (int u = 0; u < opt.users; ++u)
+	{
+		frame = SyncStream::begin(out, SyncStream::UserFrame);
+		out.str(nickOf(u));
+		out.str("u" + std::to_string(u));
+		out.str("127.0.0.1");
+		SyncStream::end(out, frame);
+	}
+	for (int c = 0; c < opt.channels; ++c)
+	{
+		const std::vector<int> &list = members[static_cast<std::size_t>(c)];
+		Channel chan("#channel" + std::to_string(c));
+		chan.setTopic("topic of channel number " + std::to_string(c));
+		chan.setCreationTime(1700000000 + c);
+		if (c % 3 == 0)
+			chan.setTopicProtection();
+		frame = SyncStream::begin(out, SyncStream::ChannelFrame);
+		chan.serializeSettings(out);
+		out.u32(static_cast<std::uint32_t>(list.size()));
+		for (std::size_t i = 0; i < list.size(); ++i)
+		{
+			out.str(nickOf(list[i]));
+			out.u8(i == 0);
+		}
+		SyncStream::end(out, frame);
+	}
+	SyncStream::end(out, SyncStream::begin(out, SyncStream::EndFrame));
+	return std::move(out.buffer());
+}
+
+static bool sendAll(int fd, const char *data, std::size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+/*
+** Read from fd until buffer holds text, or timeoutMs passes
+*/
+static bool readUntil(int fd, std::string &buffer, const std::string &text, int timeoutMs)
+{
+	std::uint64_t deadline = Clock::now() + static_cast<std::uint64_t>(timeoutMs) * 1000000ull;
+	char chunk[4096];
+	while (buffer.find(text) == std::string::npos)
+	{
+		std::uint64_t now = Clock::now();
+		if (now >= deadline)
+			return false;
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (::poll(&pfd, 1, static_cast<int>((deadline - now) / 1000000) + 1) <= 0)
+			continue;
+		ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+		if (n <= 0)
+			return false;
+		buffer.append(chunk, static_cast<std::size_t>(n));
+	}
+	return true;
+}
+
+/*
+** Register a client on the standby, retrying while it starts up
+*/
+static int connectClient(const Options &opt)
+{
+	struct addrinfo hints{};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	for (int attempt = 0; attempt < 100; ++attempt)
+	{
+		struct addrinfo *res = nullptr;
+		if (getaddrinfo("127.0.0.1", opt.port.c_str(), &hints, &res) != 0)
+			return -1;
+		int fd = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (fd >= 0 && ::connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+		{
+			freeaddrinfo(res);
+			std::string greeting = "PASS bench\r\nNICK pinger\r\nUSER pinger 0 * :pinger\r\n";
+			std::string in;
+			if (sendAll(fd, greeting.data(), greeting.size()) && readUntil(fd, in, " 001 ", 5000))
+				return fd;
+			::close(fd);
+			return -1;
+		}
+		if (fd >= 0)
+			::close(fd);
+		freeaddrinfo(res);
+		::usleep(50000);
+	}
+	return -1;
+}
+
+/*
+** PING the standby back to back until stop is set, recording round trips
+*/
+static void pingLoop(int fd, std::atomic<bool> &stop, Histogram &pingNs)
+{
+	std::string in;
+	std::uint64_t seq = 0;
+	while (!stop.load())
+	{
+		std::string token = "t" + std::to_string(++seq);
+		std::string line = "PING :" + token + "\r\n";
+		std::uint64_t start = Clock::now();
+		if (!sendAll(fd, line.data(), line.size()) || !readUntil(fd, in, token, 10000))
+			return;
+		pingNs.record(Clock::now() - start);
+		in.clear();
+		::usleep(200);
+	}
+}
+
+static pid_t startStandby(const Options &opt, const std::string &socketPath, const std::string &configPath)
+{
+	pid_t pid = ::fork();
+	if (pid == 0)
+	{
+		::setenv("IRCSERV_SYNC_FROM", socketPath.c_str(), 1);
+		::setenv("IRCSERV_CONFIG", configPath.c_str(), 1);
+		::setenv("IRCSERV_LOG_LEVEL", "warn", 1);
+		::unsetenv("IRCSERV_STATE_FILE");
+		::unsetenv("IRCSERV_SYNC_SOCKET");
+		::execl(opt.ircserv.c_str(), opt.ircserv.c_str(), opt.port.c_str(), "bench", static_cast<char *>(nullptr));
+		std::perror("exec ircserv");
+		std::_Exit(127);
+	}
+	return pid;
+}
+
+static void writeResults(std::ostream &out, const Options &opt, const Results &r)
+{
+	out << "{\n"
+		<< "  \"users\": " << opt.users << ",\n"
+		<< "  \"channels\": " << opt.channels << ",\n"
+		<< "  \"memberships\": " << static_cast<long long>(opt.users) * opt.joinsPerUser << ",\n"
+		<< "  \"stream_bytes\": " << r.streamBytes << ",\n"
+		<< "  \"encode_ms\": " << static_cast<double>(r.encodeNs) / 1e6 << ",\n"
+		<< "  \"send_ms\": " << static_cast<double>(r.sendNs) / 1e6 << ",\n"
+		<< "  \"import_ms\": " << static_cast<double>(r.totalNs) / 1e6 << ",\n"
+		<< "  \"apply_ms\": " << static_cast<double>(r.applyNs) / 1e6 << ",\n"
+		<< "  \"apply_slices\": " << r.slices << ",\n"
+		<< "  \"longest_slice_us\": " << static_cast<double>(r.longestSliceNs) / 1e3 << ",\n"
+		<< "  \"imported_users\": " << r.importedUsers << ",\n"
+		<< "  \"imported_channels\": " << r.importedChannels << ",\n"
+		<< "  \"ping_during_import_us\": {"
+		<< " \"count\": " << r.pingNs.count() << ","
+		<< " \"p50\": " << static_cast<double>(r.pingNs.percentile(0.5)) / 1e3 << ","
+		<< " \"p99\": " << static_cast<double>(r.pingNs.percentile(0.99)) / 1e3 << ","
+		<< " \"max\": " << static_cast<double>(r.pingNs.max()) / 1e3 << " }\n"
+		<< "}\n";
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	if (!parseOptions(argc, argv, opt))
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	Results results;
+	std::uint64_t start = Clock::now();
+	std::string stream = buildStream(opt);
+	results.encodeNs = Clock::now() - start;
+	results.streamBytes = stream.size();
+
+	std::string socketPath = "/tmp/ircsync." + std::to_string(::getpid()) + ".sock";
+	struct sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+	int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || ::bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0
+		|| ::listen(listener, 1) < 0)
+	{
+		std::perror("sync socket");
+		return EXIT_FAILURE;
+	}
+
+	// The standby drops channels past max_channels: make room for all of them
+	std::string configPath = "/tmp/ircsync." + std::to_string(::getpid()) + ".conf";
+	std::ofstream(configPath) << "max_channels " << opt.channels << "\n";
+	pid_t standby = startStandby(opt, socketPath, configPath);
+	struct pollfd pfd = { listener, POLLIN, 0 };
+	int sock = ::poll(&pfd, 1, 10000) == 1 ? ::accept(listener, nullptr, nullptr) : -1;
+	int client = sock >= 0 ? connectClient(opt) : -1;
+	::close(listener);
+	::unlink(socketPath.c_str());
+	::unlink(configPath.c_str());
+	if (client < 0)
+	{
+		std::cerr << "The standby did not start\n";
+		::kill(standby, SIGKILL);
+		::waitpid(standby, nullptr, 0);
+		return EXIT_FAILURE;
+	}
+
+	std::atomic<bool> stop(false);
+	std::thread pinger(pingLoop, client, std::ref(stop), std::ref(results.pingNs));
+	start = Clock::now();
+	bool ok = sendAll(sock, stream.data(), stream.size());
+	results.sendNs = Clock::now() - start;
+	std::string reply;
+	std::size_t offset = 0;
+	SyncStream::Frame frame{};
+	while (ok && !SyncStream::next(reply, offset, frame))
+	{
+		char chunk[256];
+		ssize_t n = ::recv(sock, chunk, sizeof(chunk), 0);
+		if (n <= 0)
+			ok = false;
+		else
+			reply.append(chunk, static_cast<std::size_t>(n));
+	}
+	results.totalNs = Clock::now() - start;
+	stop = true;
+	pinger.join();
+	::close(sock);
+	::close(client);
+	::kill(standby, SIGINT);
+	::waitpid(standby, nullptr, 0);
+
+	if (!ok || frame.type != SyncStream::DoneFrame)
+	{
+		std::cerr << "The standby did not acknowledge the stream\n";
+		return EXIT_FAILURE;
+	}
+	WireReader done(frame.data, frame.size);
+	results.applyNs = done.u64();
+	results.longestSliceNs = done.u64();
+	results.slices = done.u32();
+	results.importedUsers = done.u32();
+	results.importedChannels = done.u32();
+
+	if (opt.output.empty())
+		writeResults(std::cout, opt, results);
+	else
+	{
+		std::ofstream out(opt.output);
+		writeResults(out, opt, results);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+** Shared storage for client read and write buffers
+** A client only holds buffer memory while data is in flight: an empty
+** buffer is handed back with release(), and acquire() gives a buffer about
+** to be filled the storage of one returned earlier. Idle connections so keep
+** no heap memory at all, however big their last burst was.
+** Buffers that grew past the pooled capacity (4 KiB by default) are freed
+** instead of pooled, and at most 256 are kept unless configure() says
+** otherwise.
+*/
+class BufferPool
+{
+public:
+	static const std::size_t DEFAULT_POOLED_CAPACITY = 4 << 10;
+	static const std::size_t DEFAULT_FREE_BUFFERS = 256;
+
+	// Change the limits; pooled buffers beyond them are freed at once
+	void configure(std::size_t maxPooledCapacity, std::size_t maxFreeBuffers);
+	void acquire(std::string &buffer);
+	void release(std::string &buffer);
+
+	std::size_t freeBuffers() const noexcept;
+	std::size_t freeBytes() const noexcept;
+	std::uint64_t reused() const noexcept;
+	std::uint64_t discarded() const noexcept;
+
+private:
+	std::vector<std::string>	_free;
+	std::size_t					_maxPooledCapacity{DEFAULT_POOLED_CAPACITY};
+	std::size_t					_maxFreeBuffers{DEFAULT_FREE_BUFFERS};
+	std::size_t					_freeBytes{0};
+	std::uint64_t				_reused{0};
+	std::uint64_t				_discarded{0};
+};
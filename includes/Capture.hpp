@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+** Traffic capture
+** Records connection opens, inbound protocol lines and closes to a compact
+** binary file that bench/ircreplay can re-drive against a server.
+**
+** File layout: the 8-byte magic "IRCCAP\0\1", then records of
+**   type (1 byte) | connection (varint) | time delta in ns (varint)
+**   [ line length (varint) | line bytes ]   -- Line records only
+** Connections are identified by their fd, which is only reused after a Close.
+*/
+class Capture
+{
+public:
+	enum RecordType : std::uint8_t
+	{
+		Open = 1,
+		Line = 2,
+		Close = 3
+	};
+
+	static const char MAGIC[8];
+
+	Capture() = default;
+	~Capture();
+
+	Capture(const Capture &other) = delete;
+	Capture &operator=(const Capture &other) = delete;
+
+	void open(const std::string &path, bool append = false);
+	void close();
+	bool enabled() const noexcept;
+
+	void recordOpen(int conn);
+	void recordLine(int conn, std::string_view line);
+	void recordClose(int conn);
+
+	void flush();
+
+	static void putVarint(std::string &out, std::uint64_t value);
+	static bool getVarint(const char *&p, const char *end, std::uint64_t &value);
+
+private:
+	static const std::size_t FLUSH_SIZE = 64 * 1024;
+	static const std::uint64_t FLUSH_INTERVAL_NS = 1000000000ull;
+
+	void header(RecordType type, int conn);
+
+	int				_fd{-1};
+	std::uint64_t	_lastNs{0};
+	std::uint64_t	_lastFlushNs{0};
+	std::string		_buffer;
+};
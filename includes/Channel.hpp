@@ -1,6 +1,9 @@
 #pragma once
 
 #include "Client.hpp"
+#include "Wire.hpp"
+#include "Slab.hpp"
+#include "NameTable.hpp"
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -13,6 +16,17 @@
 
 class Client;
 
+using ClientSet = std::unordered_set<Client *, std::hash<Client *>, std::equal_to<Client *>,
+									 SlabAllocator<Client *, MemberSlab>>;
+
+struct InviteSlab {
+	static constexpr const char *name = "invite";
+};
+
+// Invited clients, with the time each invitation expires
+using InviteMap = std::unordered_map<Client *, std::time_t, std::hash<Client *>, std::equal_to<Client *>,
+									 SlabAllocator<std::pair<Client *const, std::time_t>, InviteSlab>>;
+
 class Channel
 {
 public:
@@ -20,8 +34,16 @@ public:
 
 	void addClient(Client *client);
 	void addOperator(const std::string& name);
-	void inviteUser(Client *client);
+	// Invite client until expires; at cap invitations the one closest to
+	// expiring makes room. The client keeps a reference back to the channel.
+	void inviteUser(Client *client, std::time_t expires, std::size_t cap);
+	void uninvite(Client *client);
+	// Drop the invitations expired by now; returns how many
+	std::size_t expireInvites(std::time_t now);
+	// Drop every invitation, before the channel goes
+	void clearInvites();
 	bool isOperator(Client *client) const;
+	void restoreOperator(Client *client);
 	bool isMember(Client *client);
 
 	void unsetPassword();
@@ -37,12 +59,14 @@ public:
 	void setUserlimit(const std::string limit);
 
 	void removeClient(const std::string& nickname);
+	void removeClient(Client *client);
+	void attachMembers();
 	void removeOperator(const std::string& nickname);
 
 	const std::string &getChannelName() const;
 	const std::string &getTopic() const;
 	int getCurrentUsers() const;
-	const std::unordered_set<Client*>& getMembers() const;
+	const ClientSet& getMembers() const;
 	std::string getPassword() const;
 	int getUserLimit() const;
 	std::string getModeString() const;
@@ -51,14 +75,23 @@ public:
 	bool UserlimitSet() const;
 	bool isInviteOnly() const;
 	bool isEmpty() const;
-	bool isInvited(Client* client) const;
+	bool isInvited(Client* client, std::time_t now) const;
+	const InviteMap &getInvited() const;
 	bool isTopicProtected() const;
 
 	// Creation time handling
 	void setCreationTime(const std::time_t time);
 	std::time_t getCreationTime() const;
 
-	Client *findClientByNickname(const std::string &nickname) const;
+	Client *findClientByNickname(std::string_view nickname) const;
+
+	// State handoff
+	void serialize(WireWriter &out) const;
+	static Channel deserialize(WireReader &in, const std::unordered_map<int, Client *> &byFd);
+
+	// Persistent state (snapshots and write-ahead log)
+	void serializeSettings(WireWriter &out) const;
+	static Channel deserializeSettings(WireReader &in);
 
 private:
 	std::string _password;
@@ -72,8 +105,15 @@ private:
 	int _currentUsers;
 	std::time_t _creationTime;
 
-	std::unordered_map<char, bool> _modes;
-	std::unordered_set<Client *> _clients;
-	std::unordered_set<Client *> _operators;
-	std::unordered_set<Client *> _invited;
-};
\ No newline at end of file
+	ClientSet _clients;
+	ClientSet _operators;
+	InviteMap _invited;
+};
+
+struct ChannelSlab {
+	static constexpr const char *name = "channel";
+};
+
+// Channels by interned name; the map nodes, each holding a Channel, come from a slab pool
+using ChannelMap = std::unordered_map<NameHandle, Channel, NameTable::Hash, std::equal_to<NameHandle>,
+									  SlabAllocator<std::pair<const NameHandle, Channel>, ChannelSlab>>;
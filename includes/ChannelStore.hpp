@@ -0,0 +1,85 @@
+#pragma once
+
+#include "Channel.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <sys/types.h>
+
+/*
+** Persistent channel state
+** Channel settings (topic, modes, key, limit, creation time) are kept in
+** a snapshot file plus a write-ahead log of the changes made since.
+**
+** Snapshot <path>: the 8-byte magic "IRCSNAP\0", u32 version, u64 sequence
+** number of the last change it contains, u32 channel count, then one
+** Channel::serializeSettings() record per channel. It is written by a forked
+** child, so the event loop only pays for the fork, and renamed into place.
+**
+** Log <path>.wal: records of
+**   u32 length | u64 sequence | u8 type | payload
+** where Put carries Channel::serializeSettings() and Remove the channel name.
+** When a snapshot starts, the log is moved to <path>.wal.prev, which is
+** deleted once the snapshot is on disk. Loading replays both logs, skipping
+** changes the snapshot already holds; a torn record at the tail is ignored.
+*/
+class ChannelStore
+{
+public:
+	// Channels read back from disk, by name
+	using SavedChannels = std::unordered_map<std::string, Channel>;
+
+	enum RecordType : std::uint8_t
+	{
+		Put = 1,
+		Remove = 2
+	};
+
+	static const char MAGIC[8];
+	static const std::uint32_t VERSION = 2;
+
+	ChannelStore() = default;
+	~ChannelStore();
+
+	ChannelStore(const ChannelStore &other) = delete;
+	ChannelStore &operator=(const ChannelStore &other) = delete;
+
+	std::size_t load(const std::string &path, SavedChannels &channels);
+	void open(const std::string &path);
+	void close();
+	bool enabled() const noexcept;
+
+	void setInterval(unsigned seconds);
+	int msUntilSnapshot() const;
+	void tick(const ChannelMap &channels);
+	void writeSnapshot(const ChannelMap &channels);
+
+	void logPut(const Channel &channel);
+	void logRemove(const std::string &name);
+
+	std::uint64_t snapshots() const noexcept;
+	std::uint64_t snapshotFailures() const noexcept;
+	std::uint64_t logRecords() const noexcept;
+
+private:
+	void append(RecordType type, const std::string &payload);
+	void startSnapshot(const ChannelMap &channels);
+	void reap(bool wait);
+	void openLog();
+	bool saveSnapshot(const ChannelMap &channels, std::uint64_t seq,
+					  const std::string &tmpPath) const;
+	std::uint64_t loadSnapshot(SavedChannels &channels);
+	void replayLog(const std::string &path, std::uint64_t after, SavedChannels &channels);
+
+	std::string		_path;
+	int				_logFd{-1};
+	std::uint64_t	_seq{0};
+	std::uint64_t	_snapshotSeq{0};
+	std::uint64_t	_intervalNs{300000000000ull};
+	std::uint64_t	_lastSnapshotNs{0};
+	pid_t			_child{-1};
+	std::uint64_t	_childStartNs{0};
+	std::uint64_t	_snapshots{0};
+	std::uint64_t	_snapshotFailures{0};
+	std::uint64_t	_logRecords{0};
+};
@@ -1,7 +1,19 @@
 #pragma once
 
 #include <string>
+#include <ctime>
+#include <unordered_map>
+#include <unordered_set>
 #include "Channel.hpp"
+#include "Wire.hpp"
+#include "Message.hpp"
+#include "Slab.hpp"
+#include "Config.hpp"
+
+class Channel;
+
+using ChannelSet = std::unordered_set<Channel *, std::hash<Channel *>, std::equal_to<Channel *>,
+									  SlabAllocator<Channel *, MemberSlab>>;
 
 enum class RegistrationState
 {
@@ -27,9 +39,24 @@ public:
 	
 	// Identity getters
 	const std::string &getNickname() const noexcept;
+	// Casefolded hash of the nickname (NameTable::hash)
+	std::size_t getNicknameHash() const noexcept;
 	const std::string &getUsername() const noexcept;
 	const std::string &getFullname() const noexcept;
+	const std::string &getHost() const noexcept;
+	// Server a remote user is on; empty for local clients
+	const std::string &getServer() const noexcept;
+	bool isRemote() const noexcept;
+	// Connection class of the listener the client came in through, and the
+	// limits it sets, copied in so the hot paths need no lookup
+	const std::string &getConnClass() const noexcept;
+	const ConnectionClass &getLimits() const noexcept;
+	// When the nickname was taken, to settle collisions between linked servers
+	std::time_t getNickTime() const noexcept;
+	// Key of the private message history of this connection; 0 until used
+	std::uint64_t getHistoryId() const noexcept;
 	int getChannelCount() const;
+	const ChannelSet &getChannels() const noexcept;
 
 	// Read line buffer
 	std::string 		&getReadBuffer() noexcept;
@@ -43,8 +70,21 @@ public:
 	void setNickname(std::string nickname);
 	void setUsername(std::string username);
 	void setFullname(std::string fullname);
-	void incrementChannelCount();
-	void decrementChannelCount();
+	void setHost(std::string host);
+	void setServer(std::string server);
+	void setConnClass(std::string connClass);
+	void setLimits(const ConnectionClass &limits) noexcept;
+	// Count a line received at now; false once the class's flood limit is passed
+	bool countLine(std::time_t now) noexcept;
+	void setNickTime(std::time_t time) noexcept;
+	void setHistoryId(std::uint64_t id) noexcept;
+	// Kept up to date by Channel::addClient() and Channel::removeClient()
+	void joinedChannel(Channel *channel);
+	void leftChannel(Channel *channel);
+	// Channels holding an invitation for this client, kept by the channels
+	const ChannelSet &getInvitations() const noexcept;
+	void invitedTo(Channel *channel);
+	void uninvitedFrom(Channel *channel);
 
 	// Client state information
 	bool hasPassword() const noexcept;
@@ -52,29 +92,95 @@ public:
 	bool hasUsername() const noexcept;
 	bool hasFullname() const noexcept;
 	bool isRegistered() const noexcept;
+	bool isServerOperator() const noexcept;
+	bool isNegotiatingCaps() const noexcept;
+	// Disconnected, waiting for the end of the loop iteration to be removed
+	bool isDeparting() const noexcept;
+	// Sent PASS with the link password, so it may send SERVER
+	bool hasLinkPassword() const noexcept;
+	// Connected through the TLS listener
+	bool isSecure() const noexcept;
 
 	void setHasPassword(bool hasPassword) noexcept;
 	void setIsRegistered(bool isRegistered) noexcept;
+	void setIsServerOperator(bool isServerOperator) noexcept;
+	void setNegotiatingCaps(bool negotiating) noexcept;
+	void setDeparting() noexcept;
+	void setHasLinkPassword(bool hasLinkPassword) noexcept;
+	void setSecure(bool secure) noexcept;
+
+	// IRCv3 capabilities (ClientCap bits)
+	std::uint8_t getCaps() const noexcept;
+	bool hasCap(ClientCap cap) const noexcept;
+	void setCaps(std::uint8_t caps) noexcept;
 
 	bool dataToWrite() const noexcept;
 	void queueMsg(const std::string &msg);
+	// Messages queued since the last write, for the coalescing metrics
+	std::uint32_t takeQueuedMessages() noexcept;
+	// Link in the server's list of clients with output to flush; only the
+	// Client held in the server's map is ever linked
+	bool isDirty() const noexcept;
+	Client *nextDirty() const noexcept;
+	void linkDirty(Client *head) noexcept;
+	void unlinkDirty() noexcept;
+	// On the server's ready list: input left over from its last turn
+	bool isReadReady() const noexcept;
+	void setReadReady(bool ready) noexcept;
+	// POLLOUT is registered: the socket did not take all the output
+	bool isWaitingWrite() const noexcept;
+	void setWaitingWrite(bool waiting) noexcept;
+
+	// State handoff
+	void serialize(WireWriter &out) const;
+	static Client deserialize(WireReader &in);
 
 private:
 	int 		_fd = -1;
-	int			_channelCount;
+	ChannelSet	_channels;
+	ChannelSet	_invitations;
 	std::string _readBuffer;
 	std::string _writeBuffer;
 
 	// Identity & State
 	std::string _nickname;
+	std::size_t _nicknameHash = 0;
 	std::string _username;
 	std::string _fullname;
+	std::string _host;
+	std::string _server;
+	std::string _connClass;
+	ConnectionClass _limits;
+	std::time_t _floodStart = 0;
+	std::uint32_t _floodLines = 0;
+	std::time_t _nickTime = 0;
+	std::uint64_t _historyId = 0;
 
 	bool _hasPassword = false;
 	bool _hasNickname = false;
 	bool _hasUsername = false;
 	bool _hasFullname = false;
 	bool _isRegistered = false;
+	bool _isServerOperator = false;
+	bool _negotiatingCaps = false;
+	bool _departing = false;
+	bool _hasLinkPassword = false;
+	bool _secure = false;
+	std::uint8_t _caps = 0;
+	bool _dirty = false;
+	Client *_dirtyPrev = nullptr;
+	Client *_dirtyNext = nullptr;
+	bool _waitingWrite = false;
+	bool _readReady = false;
+	std::uint32_t _queuedMessages = 0;
 
 	static void trimCrLf(std::string &str);
 };
+
+struct ClientSlab {
+	static constexpr const char *name = "client";
+};
+
+// Connected clients by fd; the map nodes, each holding a Client, come from a slab pool
+using ClientMap = std::unordered_map<int, Client, std::hash<int>, std::equal_to<int>,
+									 SlabAllocator<std::pair<const int, Client>, ClientSlab>>;
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+// Limits shared by the clients of a connection class; 0 turns a limit off
+struct ConnectionClass
+{
+	// Bytes queued for a client before it is dropped as too slow a reader
+	std::size_t		sendq{8 << 20};
+	// Bytes of an unfinished line a client may send
+	std::size_t		recvq{64 << 10};
+	// At most floodLines lines in any floodSeconds window
+	std::uint32_t	floodLines{0};
+	std::uint32_t	floodSeconds{1};
+};
+
+/*
+** Server configuration file, read at startup and again on REHASH or SIGHUP
+** One setting per line, # starts a comment, sizes take a K or M suffix:
+**   password <password>				replaces the one on the command line
+**   listen <address> [options]		as for IRCSERV_LISTEN, one per line
+**   class <name> [sendq=N] [recvq=N] [flood=LINES/SECONDS]
+**   max_joined_channels <n>			channels one client may be in
+**   max_channels <n>					channels on the server
+**   invite_ttl <seconds>				lifetime of an invitation, 0 for no limit
+**   max_invites <n>					invitations one channel holds
+**   recv_buffer <bytes>				read size for client sockets
+**   pooled_buffers <n>				client buffers kept for reuse
+**   pooled_buffer_bytes <bytes>		largest buffer kept for reuse
+** Every setting left out keeps its default; the "default" class always
+** exists and is the one of clients whose class is not defined.
+*/
+struct Config
+{
+	std::string								password;
+	std::vector<std::string>				listeners;
+	std::map<std::string, ConnectionClass>	classes{{"default", ConnectionClass()}};
+	int										maxJoinedChannels{10};
+	int										maxChannels{500};
+	std::time_t								inviteTtl{3600};
+	std::size_t								maxInvites{64};
+	std::size_t								recvBuffer{1024};
+	std::size_t								pooledBuffers{256};
+	std::size_t								pooledBufferBytes{4 << 10};
+
+	// Throws std::runtime_error naming the file and line of the first error
+	static Config load(const std::string &path);
+
+	// The class called name, or the default class
+	const ConnectionClass &connectionClass(const std::string &name) const;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/*
+** Message history
+** Each channel gets a ring of recent PRIVMSG lines in a byte arena; private
+** messages share one ring whose entries are tagged with the history ids of
+** the two connections (Server::historyId()), never with their nicknames.
+** A channel arena starts small and doubles up to its per-ring maximum;
+** when full, the oldest lines are overwritten. The total size of all arenas
+** is capped: when a channel ring needs memory beyond the cap, the least
+** recently used channel rings are dropped whole.
+*/
+class HistoryRing
+{
+public:
+	struct Entry
+	{
+		std::uint64_t	id;
+		std::uint64_t	timeMs;
+		std::uint32_t	offset;
+		std::uint32_t	keyLength;
+		std::uint32_t	lineLength;
+	};
+
+	struct Message
+	{
+		std::uint64_t		id;
+		std::uint64_t		timeMs;
+		std::string_view	line;
+	};
+
+	enum Direction
+	{
+		Latest,
+		Before,
+		After
+	};
+
+	// Bound on the messages a query returns: by msgid or by time (ms)
+	struct Bound
+	{
+		bool			byId;
+		std::uint64_t	value;
+	};
+
+	explicit HistoryRing(std::size_t maxBytes);
+
+	std::size_t capacity() const noexcept;
+	std::size_t maxBytes() const noexcept;
+	std::size_t size() const noexcept;
+
+	bool needsGrowth(std::size_t length) const noexcept;
+	void grow(std::size_t newCapacity);
+	void append(std::uint64_t id, std::uint64_t timeMs, std::string_view key, std::string_view line);
+	std::vector<Message> query(Direction dir, const Bound *bound, std::size_t limit, std::string_view key) const;
+
+private:
+	bool overlaps(const Entry &entry, std::size_t pos, std::size_t length) const noexcept;
+	bool matches(const Entry &entry, std::string_view key) const noexcept;
+	static bool beyond(const Entry &entry, const Bound &bound) noexcept;
+	static bool before(const Entry &entry, const Bound &bound) noexcept;
+
+	std::size_t			_maxBytes;
+	std::vector<char>	_arena;
+	std::size_t			_head{0};
+	std::deque<Entry>	_entries;
+};
+
+class HistoryStore
+{
+public:
+	static const std::size_t INITIAL_RING_BYTES = 4096;
+
+	HistoryStore() = default;
+
+	HistoryStore(const HistoryStore &other) = delete;
+	HistoryStore &operator=(const HistoryStore &other) = delete;
+
+	void configure(std::size_t totalBytes, std::size_t channelBytes, std::size_t privateBytes);
+	bool enabled() const noexcept;
+
+	std::uint64_t nextId() noexcept;
+	void recordChannel(const std::string &channel, std::uint64_t id, std::uint64_t timeMs, std::string_view line);
+	void recordPrivate(std::uint64_t from, std::uint64_t to, std::uint64_t id, std::uint64_t timeMs,
+					   std::string_view line);
+	void dropChannel(const std::string &channel);
+
+	std::vector<HistoryRing::Message> channelHistory(const std::string &channel, HistoryRing::Direction dir,
+													 const HistoryRing::Bound *bound, std::size_t limit);
+	std::vector<HistoryRing::Message> privateHistory(std::uint64_t a, std::uint64_t b, HistoryRing::Direction dir,
+													 const HistoryRing::Bound *bound, std::size_t limit) const;
+
+	std::size_t bytes() const noexcept;
+	std::size_t rings() const noexcept;
+	std::uint64_t evictions() const noexcept;
+
+	static std::uint64_t nowMs();
+	static std::string formatTime(std::uint64_t timeMs);
+	static bool parseTime(std::string_view text, std::uint64_t &timeMs);
+
+private:
+	struct ChannelRing
+	{
+		HistoryRing							ring;
+		std::list<std::string>::iterator	lru;
+	};
+
+	static std::string privateKey(std::uint64_t a, std::uint64_t b);
+	void touch(ChannelRing &entry);
+	bool reserve(std::size_t bytes, const std::string *keep);
+	void append(HistoryRing &ring, const std::string *keep, std::uint64_t id, std::uint64_t timeMs,
+				std::string_view key, std::string_view line);
+
+	std::size_t										_totalBytes{0};
+	std::size_t										_channelBytes{0};
+	std::size_t										_allocated{0};
+	std::uint64_t									_nextId{1};
+	std::uint64_t									_evictions{0};
+	std::unordered_map<std::string, ChannelRing>	_channels;
+	std::list<std::string>							_lru;
+	HistoryRing										_private{0};
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum class LogLevel
+{
+	Debug,
+	Info,
+	Warn,
+	Error
+};
+
+/*
+** Asynchronous logger
+** Producers format a record straight into a slot of a fixed ring and never wait:
+** when the ring is full the record is dropped and counted instead.
+** A background thread drains the ring to a file or to stdout.
+*/
+class Logger
+{
+public:
+	static Logger &instance();
+
+	Logger(const Logger &other) = delete;
+	Logger &operator=(const Logger &other) = delete;
+
+	void start(const std::string &path);
+	void stop();
+
+	void setLevel(LogLevel level) noexcept;
+	bool enabled(LogLevel level) const noexcept;
+	void log(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+	std::uint64_t dropped() const noexcept;
+
+	static bool parseLevel(const std::string &name, LogLevel &levelOut);
+
+private:
+	static const std::size_t RING_SIZE = 4096;
+	static const std::size_t LINE_SIZE = 240;
+
+	struct Slot {
+		std::atomic<std::size_t> seq;
+		LogLevel level;
+		std::int64_t timeNs;
+		std::size_t len;
+		char text[LINE_SIZE];
+	};
+
+	Logger();
+	~Logger();
+
+	void drain();
+	bool writeOne();
+
+	Slot 						_ring[RING_SIZE];
+	alignas(64) std::atomic<std::size_t> _head{0};
+	alignas(64) std::size_t 	_tail{0};
+	std::atomic<std::uint64_t> 	_dropped{0};
+	std::atomic<int> 			_level{static_cast<int>(LogLevel::Info)};
+	std::atomic<bool> 			_running{false};
+	std::atomic<bool> 			_sleeping{false};
+	std::mutex 					_wakeMutex;
+	std::condition_variable 	_wake;
+	std::thread 				_thread;
+	std::FILE 					*_out{nullptr};
+};
+
+#define LOG_DEBUG(...) Logger::instance().log(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) Logger::instance().log(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARN(...) Logger::instance().log(LogLevel::Warn, __VA_ARGS__)
+#define LOG_ERROR(...) Logger::instance().log(LogLevel::Error, __VA_ARGS__)
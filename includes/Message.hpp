@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+** IRCv3 capabilities a client can enable with CAP REQ, as bits
+*/
+enum ClientCap : std::uint8_t
+{
+	CAP_BATCH			= 1 << 0,
+	CAP_SERVER_TIME		= 1 << 1,
+	CAP_MESSAGE_TAGS	= 1 << 2,
+	CAP_MULTI_PREFIX	= 1 << 3,
+	CAP_ECHO_MESSAGE	= 1 << 4
+};
+
+struct CapabilityName
+{
+	const char	*name;
+	ClientCap	cap;
+};
+
+extern const CapabilityName CAPABILITIES[];
+extern const int CAPABILITY_COUNT;
+
+/*
+** A message going out to several clients
+** Only three capabilities change how a message is written: server-time
+** adds the time tag, message-tags the msgid and client-only tags, batch the
+** batch tag. Each of the eight combinations is rendered at most once, the
+** first time a recipient needs it, and shared by every recipient with the
+** same combination.
+*/
+class OutgoingMessage
+{
+public:
+	explicit OutgoingMessage(std::string line, std::uint64_t timeMs = 0, std::uint64_t msgid = 0);
+
+	void setClientTags(std::string tags);
+	void setBatch(std::string batch);
+
+	const std::string &render(std::uint8_t caps);
+	std::uint64_t id() const noexcept;
+	std::uint64_t timeMs() const noexcept;
+
+	// Client-only (+) tags of an incoming tag string, to be relayed
+	static std::string clientOnlyTags(std::string_view tags);
+
+private:
+	static const std::uint8_t TAG_CAPS = CAP_BATCH | CAP_SERVER_TIME | CAP_MESSAGE_TAGS;
+
+	std::string		_line;
+	std::uint64_t	_timeMs;
+	std::uint64_t	_msgid;
+	std::string		_clientTags;
+	std::string		_batch;
+	std::string		_variants[8];
+};
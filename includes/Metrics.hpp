@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+/*
+** Log-linear histogram (HDR style)
+** Each power of two is split into SUB_BUCKETS linear steps, so recording is
+** a shift and an increment and the relative error stays under 1/SUB_BUCKETS.
+*/
+class Histogram
+{
+public:
+	void record(std::uint64_t value) noexcept;
+
+	std::uint64_t count() const noexcept;
+	std::uint64_t sum() const noexcept;
+	std::uint64_t max() const noexcept;
+	std::uint64_t percentile(double q) const noexcept;
+
+private:
+	static const int SUB_BITS = 3;
+	static const int SUB_BUCKETS = 1 << SUB_BITS;
+	static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+	static int bucketOf(std::uint64_t value) noexcept;
+	static std::uint64_t bucketUpper(int index) noexcept;
+
+	std::uint64_t _buckets[BUCKETS] = {};
+	std::uint64_t _count = 0;
+	std::uint64_t _sum = 0;
+	std::uint64_t _max = 0;
+};
+
+/*
+** Cheap monotonic clock for instrumentation, in nanoseconds
+** On x86-64 with an invariant TSC this is one rdtsc and a multiply,
+** calibrated once against CLOCK_MONOTONIC at startup; everywhere else it
+** falls back to clock_gettime(CLOCK_MONOTONIC).
+*/
+class Clock
+{
+public:
+	static std::uint64_t now() noexcept;
+	static bool usesTsc() noexcept;
+
+private:
+	friend struct ClockCalibration;
+
+	static bool				_tsc;
+	static std::uint64_t	_tscBase;
+	static std::uint64_t	_nsBase;
+	static std::uint64_t	_mult;
+};
+
+/*
+** Server metrics
+** Everything is recorded on the event loop thread, so counters are plain
+** integers: recording costs an increment, never a lock or an atomic.
+*/
+struct Metrics
+{
+	std::uint64_t connectionsAccepted = 0;
+	std::uint64_t connectionsClosed = 0;
+	std::uint64_t loopIterations = 0;
+	std::uint64_t recvCalls = 0;
+	std::uint64_t sendCalls = 0;
+	std::uint64_t bytesIn = 0;
+	std::uint64_t bytesOut = 0;
+	std::uint64_t linesIn = 0;
+	std::uint64_t messagesQueued = 0;
+	// POLLOUT registered or dropped for a client socket
+	std::uint64_t pollInterestChanges = 0;
+	// Client turns cut short by the read budget, to go on in the next round
+	std::uint64_t readTurnsDeferred = 0;
+	std::uint64_t invitesExpired = 0;
+
+	Histogram loopNs;
+	Histogram readNs;
+	Histogram writeNs;
+	Histogram processLineNs;
+	Histogram sendqBytes;
+	// Flush phase: time per loop iteration, and messages coalesced per send()
+	Histogram flushNs;
+	Histogram messagesPerWrite;
+
+	// Per command handler, indexed like the dispatch table
+	static const int MAX_COMMANDS = 32;
+	Histogram commandNs[MAX_COMMANDS];
+	std::uint64_t slowCommands = 0;
+	std::uint64_t slowIterations = 0;
+
+	static std::uint64_t now() noexcept;
+
+	void render(std::ostringstream &out) const;
+	static void renderGauge(std::ostringstream &out, const char *name, const char *help, std::uint64_t value);
+	static void renderCounter(std::ostringstream &out, const char *name, const char *help, std::uint64_t value);
+	static void renderSummary(std::ostringstream &out, const char *name, const char *help, const Histogram &h);
+	void renderCommands(std::ostringstream &out, const char *const *names, int count) const;
+};
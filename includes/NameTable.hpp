@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+** Interned nicknames and channel names
+** Names equal under RFC 1459 casemapping (A-Z/a-z, []\ and {}|, ~ and ^)
+** are the same name. Each is stored once, with its casefolded hash, behind
+** a handle that stays valid until its last reference is released. Maps key
+** on handles and hash them without touching the text again, and find()
+** turns a string_view into a handle without allocating.
+** The table is open addressing with linear probing.
+*/
+class NameTable
+{
+public:
+	struct Name {
+		std::string		text;
+		std::size_t		hash;
+		unsigned		refs;
+	};
+
+	// Hash of a handle, for maps keyed by handles
+	struct Hash {
+		std::size_t operator()(const Name *name) const noexcept { return name->hash; }
+	};
+
+	NameTable() = default;
+	~NameTable();
+
+	NameTable(const NameTable &other) = delete;
+	NameTable &operator=(const NameTable &other) = delete;
+
+	const Name *intern(std::string_view text);
+	const Name *find(std::string_view text) const noexcept;
+	void release(const Name *name) noexcept;
+	std::size_t size() const noexcept;
+
+	static char fold(char c) noexcept;
+	static std::size_t hash(std::string_view text) noexcept;
+	static bool equal(std::string_view a, std::string_view b) noexcept;
+
+private:
+	static const std::size_t INITIAL_SLOTS = 64;
+
+	std::size_t slotOf(std::string_view text, std::size_t hash) const noexcept;
+	void grow();
+
+	std::vector<Name *>	_slots;
+	std::size_t			_size{0};
+};
+
+using NameHandle = const NameTable::Name *;
+
+/*
+** RFC 1459 casemapping: A-Z, [, ], \ and ^ fold to a-z, {, }, | and ~
+*/
+inline char NameTable::fold(char c) noexcept
+{
+	if (c >= 'A' && c <= '^')
+		return static_cast<char>(c + 32);
+	return c;
+}
+
+inline bool NameTable::equal(std::string_view a, std::string_view b) noexcept
+{
+	if (a.size() != b.size())
+		return false;
+	for (std::size_t i = 0; i < a.size(); ++i)
+		if (fold(a[i]) != fold(b[i]))
+			return false;
+	return true;
+}
@@ -2,14 +2,28 @@
 
 #include "Client.hpp"
 #include "Channel.hpp"
+#include "Metrics.hpp"
+#include "Capture.hpp"
+#include "ChannelStore.hpp"
+#include "History.hpp"
+#include "BufferPool.hpp"
+#include "StateSync.hpp"
+#include "Tls.hpp"
+#include "Config.hpp"
+#include "Transport.hpp"
 #include <vector>
 #include <string_view>
 #include <unordered_map>
+#include <map>
+#include <memory>
+#include <limits>
 #include <cstddef>
+#include <csignal>
 #include <poll.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 
 struct errs {
 	int num;
@@ -18,15 +32,35 @@ struct errs {
 
 class Server {
 public:
-	Server(int port, const std::string &password);
+	Server(int port, const std::string &password, const std::string &takeoverPath = "");
 	~Server();
 
 	Server(const Server &other) = delete;
 	Server &operator=(const Server &other) = delete;
 
 	void run();
+	void requestStop();
+	void requestRehash();
 	void shutdown();
 
+	void enableMetrics(int port);
+	void setSlowCommandThreshold(std::uint64_t micros);
+	void enableCapture(const std::string &path);
+	void enableUpgrade(const std::string &path);
+	void enableStateStore(const std::string &path, unsigned snapshotSeconds);
+	void configureHistory(std::size_t totalBytes, std::size_t channelBytes, std::size_t privateBytes);
+	void setOperator(const std::string &name, const std::string &password);
+	void enableLinks(const std::string &serverName, const std::string &password,
+					 const std::vector<std::string> &autoconnect);
+	void enableSyncExport(const std::string &path);
+	void enableTls(const std::string &certPath, const std::string &keyPath);
+	void importState(const std::string &path);
+	void addListener(const std::string &spec);
+	void loadConfig(const std::string &path);
+	// Serve clients through transport and on clock's time instead of sockets
+	// and the system clock; both must outlive the server
+	void useTransport(Transport &transport, WallClock &clock);
+
 	void handlePASS(Client &client, const std::vector<std::string_view> &params);
 	void handleNICK(Client &client, const std::vector<std::string_view> &params);
 	void handleUSER(Client &client, const std::vector<std::string_view> &params);
@@ -40,46 +74,326 @@ public:
 	void handleCAP(Client &client, const std::vector<std::string_view> &params);
 	void handleKICK(Client &client, const std::vector<std::string_view> &params);
 	void handleINVITE(Client &client, const std::vector<std::string_view> &params);
+	void handleOPER(Client &client, const std::vector<std::string_view> &params);
+	void handleSTATS(Client &client, const std::vector<std::string_view> &params);
+	void handleCHATHISTORY(Client &client, const std::vector<std::string_view> &params);
+	void handleWHO(Client &client, const std::vector<std::string_view> &params);
+	void handleWHOIS(Client &client, const std::vector<std::string_view> &params);
+	void handleNAMES(Client &client, const std::vector<std::string_view> &params);
+	void handleLIST(Client &client, const std::vector<std::string_view> &params);
+	void handleSERVER(Client &client, const std::vector<std::string_view> &params);
+	void handleCONNECT(Client &client, const std::vector<std::string_view> &params);
+	void handleSQUIT(Client &client, const std::vector<std::string_view> &params);
+	void handleLINKS(Client &client, const std::vector<std::string_view> &params);
+	void handleREHASH(Client &client, const std::vector<std::string_view> &params);
 	
 private:
+	// Microbenchmarks drive the private hot paths directly
+	friend class ServerBench;
+	// The simulation (bench/simulate.cpp) stands in for poll() and runs
+	// the iterations itself
+	friend class Simulation;
+
 	static const int 				BUFFER_SIZE = 1024;
+	static const int				DEFAULT_LISTEN_BACKLOG = 128;
+	static const std::size_t		DEFAULT_HISTORY_BYTES = 16 << 20;
+	static const std::size_t		DEFAULT_HISTORY_CHANNEL_BYTES = 64 << 10;
+	static const std::size_t		DEFAULT_HISTORY_PRIVATE_BYTES = 1 << 20;
+	// A client's turn in a loop iteration: reads, and lines handled
+	static const std::size_t		READS_PER_TURN = 4;
+	static const std::size_t		LINES_PER_TURN = 32;
+	// Longest wait between two sweeps of expired invitations
+	static const std::time_t		INVITE_SWEEP_SECONDS = 60;
+	// LIST stops adding replies once the sendq holds this much
+	static const std::size_t		LIST_SENDQ_BYTES = 32 << 10;
+	// Lost autoconnect links are dialled again after this long
+	static const int				LINK_RETRY_SECONDS = 10;
+	// Applying an imported state stream yields to the event loop after this long
+	static const std::uint64_t		SYNC_SLICE_NS = 1000000;
+	// Reading an imported stream pauses while this much is waiting to be applied
+	static const std::size_t		SYNC_BUFFER_BYTES = 256 << 10;
+	// Imported identities wait this long for their users to reconnect
+	static const int				SYNC_HOLD_SECONDS = 600;
+	// Restored channels nobody has joined are dropped after this long (imported
+	// ones after SYNC_HOLD_SECONDS)
+	static const int				RESTORE_HOLD_SECONDS = 600;
 	int 							_port;
 	int								_channelCount;
 	std::string 					_password;
+	std::string						_commandLinePassword;
 	std::string 					_serverName{"ft_irc_server"};
-	int 							_serverFd{-1};
-	struct sockaddr_in 				_address{};
+	struct sockaddr_storage 		_address{};
 	socklen_t 						_addrLen;
 	std::vector<pollfd> 			_fds;
-	std::unordered_map<int, Client> _clients;
-	std::unordered_map<std::string, Channel> _channels;
+	// Storage lent to client buffers while they hold data
+	BufferPool						_buffers;
+	// Interned nicknames and channel names, keying the maps below
+	NameTable						_names;
+	ClientMap _clients;
+	ChannelMap _channels;
+	// Nicknames in use, and channel names in order (names of _channels)
+	std::unordered_map<NameHandle, Client *, NameTable::Hash> _nicks;
+	std::map<std::string_view, Channel *> _channelIndex;
 	bool							_running{false};
+	volatile std::sig_atomic_t		_stopRequested{0};
 	bool							_wasRegistered{false};
+	std::time_t						_startTime;
+	std::time_t						_nextInviteSweep{0};
+	// When the channels restored or imported empty, and still empty, are
+	// dropped; 0 if none
+	std::time_t						_restoredUntil{0};
+	std::string						_operName;
+	std::string						_operPassword;
+
+	// Metrics and their HTTP exporter
+	Metrics							_metrics;
+	std::uint64_t					_slowCommandNs{10000000};
+	int								_metricsFd{-1};
+	std::unordered_map<int, std::string> _metricsConns;
+
+	// Inbound traffic capture for replay
+	Capture							_capture;
+
+	// Listening sockets (Listener.cpp): TCP over IPv4 and IPv6, and unix
+	// sockets for local clients such as bouncers
+	struct Listener {
+		int				fd{-1};
+		// As configured: *:port (dual-stack), host:port, [v6]:port or unix:/path
+		std::string		address;
+		int				backlog{DEFAULT_LISTEN_BACKLOG};
+		// Connection class of the clients accepted here
+		std::string		connClass{"default"};
+		bool			tls{false};
+		// From the configuration file, so closed once removed from it
+		bool			configured{false};
+		std::uint64_t	accepted{0};
+	};
+	std::vector<Listener>			_listeners;
+
+	// TLS for listeners marked tls; sessions of connections still in the
+	// handshake or, where kernel TLS is not available, encrypted in user space
+	TlsContext						_tls;
+	std::unordered_map<int, std::unique_ptr<TlsSession>> _tlsSessions;
+
+	// Client connections and the protocol's clock, replaced in simulations
+	Transport						_socketTransport;
+	WallClock						_systemClock;
+	Transport						*_transport{&_socketTransport};
+	WallClock						*_clock{&_systemClock};
+
+	// Configuration file (ServerConfig.cpp), reloaded by REHASH and SIGHUP
+	Config							_config;
+	std::string						_configPath;
+	volatile std::sig_atomic_t		_rehashRequested{0};
+	// Where client sockets are read into, recv_buffer bytes
+	std::vector<char>				_readChunk;
+
+	// Hot restart: fd handoff to a new process over a unix socket
+	int								_upgradeFd{-1};
+	std::string						_upgradePath;
+	bool							_handedOff{false};
+	// Started with IRCSERV_TAKEOVER: files of the old process are appended to
+	bool							_tookOver{false};
+
+	// Channel settings persisted across restarts
+	ChannelStore					_store;
+
+	// Recent messages for CHATHISTORY
+	HistoryStore					_history;
+	std::uint64_t					_batchCounter{0};
+	std::uint64_t					_nextHistoryId{1};
+
+	// Message tags of the line being processed
+	std::string_view				_currentTags;
+
+	// LIST replies still to be sent, by client fd
+	struct ListRequest {
+		std::string		resumeAfter;
+		bool			started{false};
+		int				minUsers{0};
+		int				maxUsers{std::numeric_limits<int>::max()};
+		std::time_t		createdAfter{0};
+		std::time_t		createdBefore{0};
+
+		bool addFilter(std::string_view filter, std::time_t now);
+		bool matches(const Channel &channel) const;
+	};
+	std::unordered_map<int, ListRequest> _listings;
+
+	// Clients with output queued since the last flush phase: an intrusive
+	// list through the clients themselves, so marking one costs no allocation
+	Client							*_dirtyClients{nullptr};
+	// Clients whose last turn ran out of budget, by fd, in turn order
+	std::vector<int>				_readyClients;
+	// fd -> index in _fds; repaired on lookup once _fds has changed
+	std::vector<std::size_t>		_pollIndex;
+
+	// Clients disconnected during this loop iteration, removed together
+	struct Departure {
+		int			fd;
+		std::string	reason;
+		bool		relay;
+	};
+	std::vector<Departure>			_departures;
+
+	// Server links (Link.cpp): directly linked servers by fd, and every other
+	// server of the network by name, with the fd of the link leading to it
+	struct Link {
+		int			fd{-1};
+		std::string	name;
+		std::string	description;
+		std::string	readBuffer;
+		std::string	writeBuffer;
+		// host:port this side dialled, dialled again when lost if redial
+		std::string	target;
+		bool		redial{false};
+		// Came in on a client port: its bytes keep moving through the
+		// transport the client connection used
+		bool		inbound{false};
+		bool		connecting{false};
+		bool		passwordOk{false};
+		bool		established{false};
+	};
+	struct PeerServer {
+		std::string	description;
+		std::string	uplink;
+		int			hops;
+		int			via;
+	};
+	// A host:port to dial and its address, resolved before the event loop
+	// runs or given numerically, so dialling never waits on DNS
+	struct LinkTarget {
+		std::string				target;
+		struct sockaddr_storage	address{};
+		socklen_t				addressLen{0};
+	};
+	std::unordered_map<int, Link>	_links;
+	std::unordered_map<std::string, PeerServer> _peers;
+	std::string						_linkPassword;
+	std::vector<LinkTarget>			_autoconnect;
+	std::time_t						_nextLinkAttempt{0};
+	// Remote users live in _clients under negative keys, counting down
+	int								_nextRemoteId{-2};
+
+	// State sync (Sync.cpp): streams to standby processes, by fd, and the
+	// stream this process imports
+	struct SyncExport {
+		std::string		out;
+		std::size_t		sent{0};
+		std::string		in;
+		std::uint64_t	startNs{0};
+	};
+	struct SyncImport {
+		int				fd{-1};
+		std::string		source;
+		std::string		buffer;
+		std::size_t		offset{0};
+		bool			started{false};
+		std::uint64_t	startNs{0};
+		std::uint64_t	applyNs{0};
+		std::uint64_t	longestSliceNs{0};
+		std::uint32_t	slices{0};
+		std::uint32_t	users{0};
+		std::uint32_t	channels{0};
+		std::uint32_t	droppedChannels{0};
+	};
+	// An imported user, by casefolded nickname, until it registers again
+	struct HeldIdentity {
+		std::string					username;
+		std::string					host;
+		std::vector<std::string>	channels;
+		// The channels it was an operator of, given back by reclaimIdentity()
+		std::vector<std::string>	operatorOf;
+	};
+	int								_syncFd{-1};
+	std::string						_syncPath;
+	std::unordered_map<int, SyncExport> _syncExports;
+	SyncImport						_import;
+	std::unordered_map<std::string, HeldIdentity> _held;
+	std::time_t						_heldUntil{0};
 	
 	// Main server functions
 	void initSocket();
+	static Listener parseListener(const std::string &spec);
+	void startListener(const Listener &listener);
+	int openListener(const Listener &listener);
+	Listener *findListener(int fd);
+	void closeListeners(bool removeFiles);
+	void rehash();
+	void applyConfig(const Config &config);
 	void mainLoop();
+	int pollTimeout();
+	void runIteration(int ready);
 	
 	// Event handlers
-	void handleNewConnection();
+	void handleNewConnection(Listener &listener);
+	Client &registerConnection(int fd, Listener &listener);
+	void continueTlsHandshake(std::size_t index);
+	ssize_t receive(int fd, char *buffer, std::size_t size);
+	ssize_t transmit(int fd, const char *data, std::size_t size, bool more = false);
 	void handleClientRead(std::size_t index);
+	void readClient(Client &client);
+	void markReadReady(Client &client);
+	void serviceReadyClients();
 	void handleClientWrite(std::size_t index);
+	bool writeClient(Client &client);
+	void flushOutput();
+	void markDirty(Client &client);
+	void unmarkDirty(Client &client);
+	void setWriteInterest(Client &client, bool enabled);
+	pollfd *findPollFd(int fd);
+	void handleMetricsConnection();
+	void handleMetricsRequest(std::size_t index);
+	std::string renderMetrics();
+	static void renderSlabs(std::ostringstream &out);
+	void renderListeners(std::ostringstream &out) const;
+	void handleUpgradeConnection();
+	void handleLinkRead(std::size_t index);
+	void handleLinkWrite(std::size_t index);
+	void handleSyncConnection();
+	void handleSyncExport(std::size_t index);
+	void handleSyncImport(std::size_t index);
+
+	// Hot restart
+	static struct sockaddr_un unixAddress(const std::string &path);
+	void takeOver(const std::string &path);
+	void serializeState(WireWriter &out, std::vector<int> &fds) const;
+	void restoreState(WireReader &in, const std::vector<int> &fds);
 	
 	// Command processing
 	void processLine(int clientFd, std::string_view line);
+
+	struct CommandEntry {
+		const char *name;
+		void (Server::*handler)(Client &client, const std::vector<std::string_view> &params);
+		bool preRegistration;
+	};
+	static const CommandEntry COMMANDS[];
+	static const int COMMAND_COUNT;
+	static int findCommand(std::string_view command);
 	
 	struct ParsedCommand {
+		std::string_view tags;
+		std::string_view prefix;
 		std::string_view command;
 		std::vector<std::string_view> params;
 	};
 	ParsedCommand parseCommand(std::string_view line);
 	
 	void sendTo(Client &client, const std::string &message);
+	void sendTo(Client &client, OutgoingMessage &message);
 	void sendToChannel(Channel &channel, const std::string &message, Client *exclude);
+	void sendToChannel(Channel &channel, OutgoingMessage &message, Client *exclude);
 
 	void maybeRegistered(Client &client);
-	Client* findClientByNick(const std::string &nick);
+	void sendJoin(Client &client, Channel &channel);
+	void sendNames(Client &client, Channel &channel);
+	void continueList(Client &client);
+	Client* findClientByNick(std::string_view nick);
+	Channel* findChannel(std::string_view name);
 	bool nickInUse(std::string_view nick);
+	void indexNick(Client &client);
+	void unindexNick(Client &client);
 
 	// Message sending
 	void sendNumeric(Client &client, int numeric, const std::string_view msg);
@@ -88,6 +402,71 @@ private:
 	std::string getClientHost(int clientFd);
 	std::string formatPrefix(const Client &client);
 
+	// Channel lifetime
+	Channel *addChannel(Channel channel);
+	void persistChannel(const Channel &channel);
+	void removeChannel(const std::string &name);
+	void invite(Channel &chan, Client &target);
+	void tickInvites();
+	void tickRestoredChannels();
+	std::uint64_t historyId(Client &client);
+
 	// Client disconnection, cleanup
-	void disconnectClient(int fd, std::string_view reason);
+	void disconnectClient(int fd, std::string_view reason, bool relay = true);
+	void flushDisconnects();
+
+	// Server links
+	struct LinkCommand {
+		const char *name;
+		void (Server::*handler)(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	};
+	static const LinkCommand LINK_COMMANDS[];
+	static std::string resolveLinkTarget(const std::string &target, int flags, LinkTarget &resolved);
+	void connectLink(const LinkTarget &target, bool redial);
+	void adoptLink(int fd);
+	void startLink(Link &link);
+	void burstTo(Link &link);
+	void dropLink(int fd, const std::string &reason);
+	void dropAllLinks(const std::string &reason);
+	void removeServers(const std::string &name, const std::string &reason);
+	void tickLinks();
+	int msUntilLinkAttempt() const;
+	void processLinkLine(int fd, std::string_view line);
+	void sendToLink(Link &link, const std::string &line);
+	void propagate(const std::string &line, int exceptFd = -1);
+	void propagateToChannel(const Channel &channel, const std::string &line, int exceptFd = -1);
+	void propagateJoin(const Channel &channel, Client &client);
+	std::string userLine(Client &client, int hops);
+	std::string sjoinLine(const Channel &channel, const std::string &members) const;
+	std::string userPrefix(const Client &client);
+	int routeTo(const Client &client) const;
+	Client *linkSource(const Link &link, std::string_view nick);
+	bool keepsNick(Client &existing, std::time_t ts, Link &link);
+	void announceNick(Client &client, const std::string &oldNick);
+	void linkPASS(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkSERVER(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkSQUIT(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkERROR(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkUID(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkNICK(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkQUIT(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkKILL(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkSJOIN(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkPART(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkKICK(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkMODE(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkTOPIC(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkPRIVMSG(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+	void linkINVITE(Link &link, std::string_view source, const std::vector<std::string_view> &params);
+
+	// State sync
+	void encodeSyncState(WireWriter &out);
+	bool syncPending() const;
+	bool syncBufferFull() const;
+	void tickSync();
+	void applySyncFrames();
+	bool applySyncFrame(const SyncStream::Frame &frame);
+	void finishImport(const std::string &error);
+	void closeSyncExport(std::size_t index);
+	void reclaimIdentity(Client &client);
 };
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+/*
+** Fixed-size object pool
+** Objects are carved out of 64 KiB slabs and freed objects are kept on a
+** free list for the next allocation, so connect/disconnect and JOIN/PART
+** churn reuses the same memory instead of fragmenting the malloc heap.
+** Slabs are only returned when the process exits: a pool's footprint is
+** its peak, which the occupancy report shows.
+** Pools are shared by name and object size, and only used from the event
+** loop thread.
+*/
+class SlabPool
+{
+public:
+	struct Stats {
+		const char		*name;
+		std::size_t		objectSize;
+		std::size_t		inUse;
+		std::size_t		capacity;
+		std::size_t		peak;
+		std::size_t		slabs;
+	};
+
+	~SlabPool();
+
+	SlabPool(const SlabPool &other) = delete;
+	SlabPool &operator=(const SlabPool &other) = delete;
+
+	static SlabPool &get(const char *name, std::size_t objectSize);
+	static std::vector<Stats> report();
+
+	void *allocate();
+	void deallocate(void *object) noexcept;
+	Stats stats() const noexcept;
+
+private:
+	static const std::size_t SLAB_BYTES = 64 << 10;
+
+	struct FreeObject {
+		FreeObject	*next;
+	};
+
+	SlabPool(const char *name, std::size_t objectSize);
+	static std::size_t slotSize(std::size_t objectSize);
+	static std::vector<std::unique_ptr<SlabPool>> &registry();
+
+	const char			*_name;
+	std::size_t			_objectSize;
+	std::size_t			_perSlab;
+	std::vector<void *>	_slabs;
+	FreeObject			*_free{nullptr};
+	std::size_t			_inUse{0};
+	std::size_t			_peak{0};
+};
+
+/*
+** Allocator drawing single objects (container nodes) from the pool named by
+** Tag::name; arrays such as hash buckets still go to operator new
+*/
+template <typename T, typename Tag>
+class SlabAllocator
+{
+public:
+	using value_type = T;
+
+	template <typename U>
+	struct rebind {
+		using other = SlabAllocator<U, Tag>;
+	};
+
+	SlabAllocator() noexcept = default;
+	template <typename U>
+	SlabAllocator(const SlabAllocator<U, Tag> &) noexcept {}
+
+	T *allocate(std::size_t n)
+	{
+		if (n == 1)
+			return static_cast<T *>(pool().allocate());
+		return static_cast<T *>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T *object, std::size_t n) noexcept
+	{
+		if (n == 1)
+			pool().deallocate(object);
+		else
+			::operator delete(object);
+	}
+
+	template <typename U>
+	bool operator==(const SlabAllocator<U, Tag> &) const noexcept { return true; }
+	template <typename U>
+	bool operator!=(const SlabAllocator<U, Tag> &) const noexcept { return false; }
+
+private:
+	static SlabPool &pool()
+	{
+		static SlabPool &instance = SlabPool::get(Tag::name, sizeof(T));
+		return instance;
+	}
+};
+
+// Nodes of the member sets of channels and of the channel sets of clients
+struct MemberSlab {
+	static constexpr const char *name = "member";
+};
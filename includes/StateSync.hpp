@@ -0,0 +1,54 @@
+#pragma once
+
+#include "Wire.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+** State sync stream
+** A running server streams its users and channels to a standby process over
+** a unix socket, as length-prefixed frames:
+**   u32 length | u8 type | payload       (length counts type and payload)
+**
+** Hello    str "IRCSYNC", u32 version, str server name, u32 users, u32 channels
+** User     str nickname, str username, str realname, str host
+** Channel  Channel::serializeSettings(), u32 member count, then per member
+**          str nickname, u8 channel operator
+** End      empty; the standby answers with one Done frame and closes
+** Done     u64 apply ns, u64 longest slice ns, u32 slices, u32 users, u32 channels
+**
+** Every User frame comes before the Channel frames naming that user.
+*/
+class SyncStream
+{
+public:
+	enum FrameType : std::uint8_t
+	{
+		HelloFrame = 1,
+		UserFrame = 2,
+		ChannelFrame = 3,
+		EndFrame = 4,
+		DoneFrame = 5
+	};
+
+	struct Frame
+	{
+		FrameType	type;
+		const char	*data;
+		std::size_t	size;
+	};
+
+	static const char MAGIC[];
+	static const std::uint32_t VERSION = 2;
+	// Larger frames are rejected as corrupt
+	static const std::size_t MAX_FRAME_BYTES = 1 << 20;
+
+	// Start a frame of type at the end of out; end() fills in its length
+	static std::size_t begin(WireWriter &out, FrameType type);
+	static void end(WireWriter &out, std::size_t start);
+
+	// Take the complete frame at offset in buffer, advancing offset past it
+	// Returns false if the frame is not all there yet; throws if it is corrupt
+	static bool next(const std::string &buffer, std::size_t &offset, Frame &frame);
+};
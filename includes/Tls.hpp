@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+/*
+** TLS for client connections, with OpenSSL (built with make TLS=1)
+** OpenSSL runs the handshake, then hands the negotiated keys to kernel TLS:
+** from there the connection is read and written with plain recv()/send(),
+** and the kernel does the crypto. When kernel TLS is not available for the
+** connection (no tls module, an unsupported cipher), the session stays in
+** user space and read()/write() go through OpenSSL.
+** Sessions resume from tickets (TLS 1.3) or the server's session cache
+** (TLS 1.2), so a storm of reconnects mostly skips the full handshake.
+** Built without TLS, supported() is false and load() throws.
+*/
+class TlsSession
+{
+public:
+	enum Step
+	{
+		Established,
+		WantRead,
+		WantWrite,
+		Failed
+	};
+
+	explicit TlsSession(ssl_st *ssl) noexcept;
+	~TlsSession();
+
+	TlsSession(const TlsSession &other) = delete;
+	TlsSession &operator=(const TlsSession &other) = delete;
+
+	// Advance the handshake as far as the socket allows
+	Step handshake();
+	bool established() const noexcept;
+	bool resumed() const;
+	// Both directions run in kernel TLS: the session can be dropped and the
+	// socket used directly
+	bool offloaded() const;
+
+	// Like recv()/send(), failing with EAGAIN until the socket is ready again
+	ssize_t read(char *buffer, std::size_t size);
+	ssize_t write(const char *data, std::size_t size);
+	// Best-effort close_notify before the socket is closed
+	void shutdown();
+
+private:
+	ssl_st	*_ssl;
+	bool	_established{false};
+};
+
+class TlsContext
+{
+public:
+	TlsContext() = default;
+	~TlsContext();
+
+	TlsContext(const TlsContext &other) = delete;
+	TlsContext &operator=(const TlsContext &other) = delete;
+
+	static bool supported() noexcept;
+	void load(const std::string &certPath, const std::string &keyPath);
+	bool enabled() const noexcept;
+
+	// A session for a connection accepted on fd, to be driven by handshake()
+	std::unique_ptr<TlsSession> accept(int fd);
+
+	void countHandshake(const TlsSession &session);
+	void countFailure() noexcept;
+	std::uint64_t handshakes() const noexcept;
+	std::uint64_t resumed() const noexcept;
+	std::uint64_t offloaded() const noexcept;
+	std::uint64_t failures() const noexcept;
+
+	static std::string lastError();
+
+private:
+	ssl_ctx_st		*_ctx{nullptr};
+	std::uint64_t	_handshakes{0};
+	std::uint64_t	_resumed{0};
+	std::uint64_t	_offloaded{0};
+	std::uint64_t	_failures{0};
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <ctime>
+#include <sys/types.h>
+
+/*
+** How the server moves bytes on client connections
+** The default is the sockets themselves; a simulation (bench/simulate.cpp)
+** overrides it with in-memory connections, so the same event handling runs
+** for clients that have no socket at all. recv() and send() follow the
+** system calls: -1 with errno EAGAIN when nothing can be done yet.
+*/
+class Transport
+{
+public:
+	virtual ~Transport() = default;
+
+	virtual ssize_t recv(int fd, char *buffer, std::size_t size);
+	// more: further output follows shortly (MSG_MORE)
+	virtual ssize_t send(int fd, const char *data, std::size_t size, bool more);
+	virtual void close(int fd);
+};
+
+/*
+** The time the protocol sees: channel creation, nick timestamps, flood
+** windows. Overridden by a simulation to run on virtual time.
+*/
+class WallClock
+{
+public:
+	virtual ~WallClock() = default;
+
+	virtual std::time_t now() const;
+};
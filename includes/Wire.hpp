@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+** Binary encoding for server state
+** Fixed-width little-endian integers and u32 length-prefixed strings.
+** The reader works on any byte range (a buffer or an mmap'ed file) and
+** throws std::runtime_error when a value runs past the end.
+*/
+class WireWriter
+{
+public:
+	void u8(std::uint8_t value);
+	void u32(std::uint32_t value);
+	void u64(std::uint64_t value);
+	void str(std::string_view value);
+
+	std::string &buffer() noexcept;
+	const std::string &buffer() const noexcept;
+
+private:
+	std::string _out;
+};
+
+class WireReader
+{
+public:
+	WireReader(const char *data, std::size_t size);
+
+	std::uint8_t u8();
+	std::uint32_t u32();
+	std::uint64_t u64();
+	std::string str();
+
+	std::size_t offset() const noexcept;
+	bool atEnd() const noexcept;
+
+private:
+	const char *need(std::size_t bytes);
+
+	const char	*_data;
+	std::size_t	_size;
+	std::size_t	_pos{0};
+};
@@ -0,0 +1,61 @@
+#include "BufferPool.hpp"
+
+void BufferPool::configure(std::size_t maxPooledCapacity, std::size_t maxFreeBuffers)
+{
+	_maxPooledCapacity = maxPooledCapacity;
+	_maxFreeBuffers = maxFreeBuffers;
+	std::vector<std::string> kept;
+	_freeBytes = 0;
+	for (std::string &storage : _free)
+	{
+		if (storage.capacity() > _maxPooledCapacity || kept.size() >= _maxFreeBuffers)
+			continue;
+		_freeBytes += storage.capacity();
+		kept.push_back(std::move(storage));
+	}
+	_free.swap(kept);
+}
+
+/*
+** Give an empty buffer pooled storage before it is filled
+** Does nothing if the buffer still has storage of its own
+*/
+void BufferPool::acquire(std::string &buffer)
+{
+	if (_free.empty() || buffer.capacity() >= _free.back().capacity())
+		return;
+	_freeBytes -= _free.back().capacity();
+	buffer.swap(_free.back());
+	_free.pop_back();
+	buffer.clear();
+	++_reused;
+}
+
+/*
+** Take back the storage of a buffer that is done with, leaving it empty and
+** without heap memory
+*/
+void BufferPool::release(std::string &buffer)
+{
+	std::string storage;
+	storage.swap(buffer);
+	// Storage still in the string's inline buffer has nothing to give back
+	if (storage.capacity() <= std::string().capacity())
+		return;
+	if (storage.capacity() > _maxPooledCapacity || _free.size() >= _maxFreeBuffers)
+	{
+		++_discarded;
+		return;
+	}
+	storage.clear();
+	_freeBytes += storage.capacity();
+	_free.push_back(std::move(storage));
+}
+
+std::size_t BufferPool::freeBuffers() const noexcept { return _free.size(); }
+
+std::size_t BufferPool::freeBytes() const noexcept { return _freeBytes; }
+
+std::uint64_t BufferPool::reused() const noexcept { return _reused; }
+
+std::uint64_t BufferPool::discarded() const noexcept { return _discarded; }
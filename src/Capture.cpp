@@ -0,0 +1,124 @@
+#include "Capture.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+const char Capture::MAGIC[8] = { 'I', 'R', 'C', 'C', 'A', 'P', '\0', '\1' };
+
+/// Destructor ///
+Capture::~Capture()
+{
+	close();
+}
+
+/*
+** Start capturing to path, truncating any previous capture unless append
+** Writes always go to the end of the file, so two processes sharing it
+** across a hot restart never overwrite each other's records
+*/
+void Capture::open(const std::string &path, bool append)
+{
+	_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (append ? 0 : O_TRUNC), 0600);
+	if (_fd < 0)
+		throw std::runtime_error("Cannot open capture file " + path + ": " + std::string(strerror(errno)));
+	_buffer.reserve(FLUSH_SIZE * 2);
+	_buffer.clear();
+	if (::lseek(_fd, 0, SEEK_END) == 0)
+		_buffer.assign(MAGIC, sizeof(MAGIC));
+	_lastNs = Clock::now();
+	_lastFlushNs = _lastNs;
+	LOG_INFO("Capturing client traffic to %s", path.c_str());
+}
+
+void Capture::close()
+{
+	if (_fd < 0)
+		return;
+	flush();
+	::close(_fd);
+	_fd = -1;
+}
+
+bool Capture::enabled() const noexcept { return _fd >= 0; }
+
+void Capture::recordOpen(int conn)
+{
+	header(Open, conn);
+}
+
+void Capture::recordLine(int conn, std::string_view line)
+{
+	header(Line, conn);
+	putVarint(_buffer, line.size());
+	_buffer.append(line.data(), line.size());
+	if (_buffer.size() >= FLUSH_SIZE || _lastNs - _lastFlushNs >= FLUSH_INTERVAL_NS)
+		flush();
+}
+
+void Capture::recordClose(int conn)
+{
+	header(Close, conn);
+}
+
+/*
+** Write out everything buffered so far
+** Writes go to the page cache, so this costs one syscall per FLUSH_SIZE bytes
+** (or per second on a quiet server)
+*/
+void Capture::flush()
+{
+	_lastFlushNs = _lastNs;
+	std::size_t done = 0;
+	while (done < _buffer.size())
+	{
+		ssize_t n = ::write(_fd, _buffer.data() + done, _buffer.size() - done);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("Capture write failed, capture stopped: %s", strerror(errno));
+			::close(_fd);
+			_fd = -1;
+			break;
+		}
+		done += static_cast<std::size_t>(n);
+	}
+	_buffer.clear();
+}
+
+void Capture::header(RecordType type, int conn)
+{
+	std::uint64_t now = Clock::now();
+	_buffer.push_back(static_cast<char>(type));
+	putVarint(_buffer, static_cast<std::uint64_t>(conn));
+	putVarint(_buffer, now - _lastNs);
+	_lastNs = now;
+}
+
+/// Varint (LEB128) encoding ///
+void Capture::putVarint(std::string &out, std::uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+bool Capture::getVarint(const char *&p, const char *end, std::uint64_t &value)
+{
+	value = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7)
+	{
+		std::uint8_t byte = static_cast<std::uint8_t>(*p++);
+		value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
@@ -4,13 +4,10 @@
 // Channel constructor
 Channel::Channel(const std::string& name) : _channelName(name)
 {
-	std::string mode_list = "itkol";
-	for (char mode : mode_list) 
-	{
-		_modes[mode] = false;
-	}
 	_limitSet = false;
+	_userLimit = -1;
 	_currentUsers = 0;
+	_creationTime = 0;
 	_passwordRequired = false;
 	_inviteOnly = false;
 	_topicProtected = false;
@@ -23,7 +20,7 @@ bool Channel::isEmpty() const { return _clients.empty(); }
 
 int Channel::getCurrentUsers() const { return _currentUsers; }
 
-const std::unordered_set<Client*>& Channel::getMembers() const { return _clients; }
+const ClientSet& Channel::getMembers() const { return _clients; }
 
 bool Channel::isMember(Client *client)
 {
@@ -37,9 +34,9 @@ bool Channel::isMember(Client *client)
 // Client handling
 void Channel::addClient(Client* client) 
 {
-	client->incrementChannelCount();
-	_clients.insert(client);
-	_currentUsers++;
+	client->joinedChannel(this);
+	if (_clients.insert(client).second)
+		_currentUsers++;
 }
 
 void Channel::removeClient(const std::string& nickname) 
@@ -48,19 +45,34 @@ void Channel::removeClient(const std::string& nickname)
 	if (client == nullptr) {
 		throw errs { 401, nickname + " :Such client does not exist" };
 	}
+	removeClient(client);
+}
+
+void Channel::removeClient(Client* client)
+{
+	if (_clients.erase(client) == 0)
+		return;
 	if (_currentUsers > 0)
 		_currentUsers--;
-	if (isOperator(client))
-		removeOperator(nickname);
-	_clients.erase(client);
-	client->decrementChannelCount();
+	_operators.erase(client);
+	client->leftChannel(this);
 }
 
-// Find client by nickname
-Client* Channel::findClientByNickname(const std::string& name) const
+// Tell every member it is in this channel, once the channel is at its final address
+void Channel::attachMembers()
 {
+	for (Client* client : _clients)
+		client->joinedChannel(this);
+	for (auto &invite : _invited)
+		invite.first->invitedTo(this);
+}
+
+// Find client by nickname, in any case; hashes are compared before the text
+Client* Channel::findClientByNickname(std::string_view name) const
+{
+	std::size_t hash = NameTable::hash(name);
 	for (Client* c : _clients) {
-		if (c->getNickname() == name) {
+		if (c->getNicknameHash() == hash && NameTable::equal(c->getNickname(), name)) {
 			return c;
 		}
 	}
@@ -88,6 +100,8 @@ void Channel::removeOperator(const std::string& nickname) {
 
 bool Channel::isOperator(Client* client) const { return _operators.find(client) != _operators.end(); }
 
+void Channel::restoreOperator(Client* client) { _operators.insert(client); }
+
 // Userlimit handling
 void Channel::setUserlimit(const std::string limit) {
 	long long n;
@@ -115,7 +129,53 @@ int Channel::getUserLimit() const { return _userLimit; }
 bool Channel::UserlimitSet() const { return _limitSet; }
 
 // Invite handling
-void Channel::inviteUser(Client *client) { _invited.insert(client); }
+void Channel::inviteUser(Client *client, std::time_t expires, std::size_t cap)
+{
+	auto found = _invited.find(client);
+	if (found != _invited.end())
+	{
+		found->second = expires;
+		return;
+	}
+	if (cap && _invited.size() >= cap)
+	{
+		auto soonest = std::min_element(_invited.begin(), _invited.end(),
+										[](const auto &a, const auto &b) { return a.second < b.second; });
+		uninvite(soonest->first);
+	}
+	_invited.emplace(client, expires);
+	client->invitedTo(this);
+}
+
+void Channel::uninvite(Client *client)
+{
+	if (_invited.erase(client))
+		client->uninvitedFrom(this);
+}
+
+std::size_t Channel::expireInvites(std::time_t now)
+{
+	std::size_t expired = 0;
+	for (auto it = _invited.begin(); it != _invited.end();)
+	{
+		if (it->second > now)
+		{
+			++it;
+			continue;
+		}
+		it->first->uninvitedFrom(this);
+		it = _invited.erase(it);
+		++expired;
+	}
+	return expired;
+}
+
+void Channel::clearInvites()
+{
+	for (auto &invite : _invited)
+		invite.first->uninvitedFrom(this);
+	_invited.clear();
+}
 
 void Channel::setInviteOnly() { _inviteOnly = true; }
 
@@ -123,14 +183,14 @@ void Channel::unsetInviteOnly() { _inviteOnly = false; }
 
 bool Channel::isInviteOnly() const { return _inviteOnly; }
 
-bool Channel::isInvited(Client* client) const
+bool Channel::isInvited(Client* client, std::time_t now) const
 {
-	if (_invited.find(client) != _invited.end())
-		return true;
-	else
-		return false;
+	auto found = _invited.find(client);
+	return found != _invited.end() && found->second > now;
 }
 
+const InviteMap &Channel::getInvited() const { return _invited; }
+
 // Mode handling
 void Channel::setMode(const std::vector<std::string_view>& params)
 {
@@ -180,7 +240,6 @@ void Channel::setMode(const std::vector<std::string_view>& params)
 				adding ? setUserlimit(param) : unsetUserlimit();
 				break;
 		}
-		_modes[c] = adding;
 	}
 }
 
@@ -216,6 +275,113 @@ void Channel::setCreationTime(const std::time_t time)
 }
 std::time_t Channel::getCreationTime() const { return _creationTime; }
 
+// State handoff
+/*
+** Serialize modes, topic and member lists, referring to clients by fd
+** Invitations keep their expiry
+*/
+void Channel::serialize(WireWriter &out) const
+{
+	out.str(_channelName);
+	out.str(_topic);
+	out.str(_password);
+	out.u8(static_cast<std::uint8_t>(_inviteOnly | _passwordRequired << 1 | _topicProtected << 2 | _limitSet << 3));
+	out.u32(static_cast<std::uint32_t>(_limitSet ? _userLimit : -1));
+	out.u64(static_cast<std::uint64_t>(_creationTime));
+
+	out.u32(static_cast<std::uint32_t>(_clients.size()));
+	for (const Client *client : _clients)
+		out.u32(static_cast<std::uint32_t>(client->getFd()));
+	out.u32(static_cast<std::uint32_t>(_operators.size()));
+	for (const Client *client : _operators)
+		out.u32(static_cast<std::uint32_t>(client->getFd()));
+
+	out.u32(static_cast<std::uint32_t>(_invited.size()));
+	for (const auto &invite : _invited)
+	{
+		out.u32(static_cast<std::uint32_t>(invite.first->getFd()));
+		out.u64(static_cast<std::uint64_t>(invite.second));
+	}
+}
+
+/*
+** Rebuild a channel written by serialize()
+** byFd maps the fds used in the stream to the restored clients
+** The members and invited clients do not know about the channel yet: call
+** attachMembers() on the copy that is kept
+*/
+Channel Channel::deserialize(WireReader &in, const std::unordered_map<int, Client *> &byFd)
+{
+	Channel chan(in.str());
+	chan._topic = in.str();
+	chan._password = in.str();
+	std::uint8_t flags = in.u8();
+	chan._inviteOnly = flags & 1;
+	chan._passwordRequired = flags & 2;
+	chan._topicProtected = flags & 4;
+	chan._limitSet = flags & 8;
+	chan._userLimit = static_cast<int>(in.u32());
+	chan._creationTime = static_cast<std::time_t>(in.u64());
+
+	std::uint32_t count = in.u32();
+	for (std::uint32_t i = 0; i < count; ++i)
+	{
+		auto it = byFd.find(static_cast<int>(in.u32()));
+		if (it != byFd.end() && chan._clients.insert(it->second).second)
+			chan._currentUsers++;
+	}
+	count = in.u32();
+	for (std::uint32_t i = 0; i < count; ++i)
+	{
+		auto it = byFd.find(static_cast<int>(in.u32()));
+		if (it != byFd.end() && chan.isMember(it->second))
+			chan._operators.insert(it->second);
+	}
+	count = in.u32();
+	for (std::uint32_t i = 0; i < count; ++i)
+	{
+		auto it = byFd.find(static_cast<int>(in.u32()));
+		std::time_t expires = static_cast<std::time_t>(in.u64());
+		if (it != byFd.end())
+			chan._invited.emplace(it->second, expires);
+	}
+	return chan;
+}
+
+// Persistent state
+/*
+** Serialize what survives a restart: modes, key, limit, topic and creation
+** time. Members, operators and invitations are not persisted: a nickname
+** proves nothing once its client is gone.
+*/
+void Channel::serializeSettings(WireWriter &out) const
+{
+	out.str(_channelName);
+	out.str(_topic);
+	out.str(_password);
+	out.u8(static_cast<std::uint8_t>(_inviteOnly | _passwordRequired << 1 | _topicProtected << 2 | _limitSet << 3));
+	out.u32(static_cast<std::uint32_t>(_limitSet ? _userLimit : -1));
+	out.u64(static_cast<std::uint64_t>(_creationTime));
+}
+
+/*
+** Rebuild a channel written by serializeSettings(), with no members
+*/
+Channel Channel::deserializeSettings(WireReader &in)
+{
+	Channel chan(in.str());
+	chan._topic = in.str();
+	chan._password = in.str();
+	std::uint8_t flags = in.u8();
+	chan._inviteOnly = flags & 1;
+	chan._passwordRequired = flags & 2;
+	chan._topicProtected = flags & 4;
+	chan._limitSet = flags & 8;
+	chan._userLimit = static_cast<int>(in.u32());
+	chan._creationTime = static_cast<std::time_t>(in.u64());
+	return chan;
+}
+
 // Get current mode string
 std::string Channel::getModeString() const
 {
@@ -0,0 +1,392 @@
+#include "ChannelStore.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+const char ChannelStore::MAGIC[8] = { 'I', 'R', 'C', 'S', 'N', 'A', 'P', '\0' };
+
+/// Destructor ///
+ChannelStore::~ChannelStore()
+{
+	close();
+}
+
+/*
+** Read the snapshot and both logs at path into channels
+** Returns the number of channels loaded; missing files mean an empty state
+*/
+std::size_t ChannelStore::load(const std::string &path, SavedChannels &channels)
+{
+	_path = path;
+	std::uint64_t snapshotSeq = loadSnapshot(channels);
+	_seq = snapshotSeq;
+	_snapshotSeq = snapshotSeq;
+	replayLog(_path + ".wal.prev", snapshotSeq, channels);
+	replayLog(_path + ".wal", snapshotSeq, channels);
+	return channels.size();
+}
+
+/*
+** Start logging changes to <path>.wal
+** load() must have been called first so that sequence numbers continue
+*/
+void ChannelStore::open(const std::string &path)
+{
+	_path = path;
+	openLog();
+	_lastSnapshotNs = Clock::now();
+	LOG_INFO("Persisting channel state to %s", path.c_str());
+}
+
+void ChannelStore::close()
+{
+	if (_child > 0)
+		reap(true);
+	if (_logFd >= 0)
+	{
+		::close(_logFd);
+		_logFd = -1;
+	}
+}
+
+bool ChannelStore::enabled() const noexcept { return _logFd >= 0; }
+
+void ChannelStore::setInterval(unsigned seconds)
+{
+	_intervalNs = static_cast<std::uint64_t>(seconds) * 1000000000ull;
+}
+
+/*
+** Poll timeout until the next snapshot is due, or until the running one
+** should be checked on
+*/
+int ChannelStore::msUntilSnapshot() const
+{
+	if (_child > 0)
+		return 100;
+	if (!_intervalNs)
+		return -1;
+	std::uint64_t now = Clock::now();
+	std::uint64_t due = _lastSnapshotNs + _intervalNs;
+	if (now >= due)
+		return 0;
+	return static_cast<int>((due - now) / 1000000 + 1);
+}
+
+/*
+** Called once per loop iteration: collect a finished snapshot and start the
+** next one when it is due and something changed since the last one
+*/
+void ChannelStore::tick(const ChannelMap &channels)
+{
+	if (_child > 0)
+		reap(false);
+	if (_child < 0 && _intervalNs && Clock::now() - _lastSnapshotNs >= _intervalNs)
+	{
+		if (_seq == _snapshotSeq)
+			_lastSnapshotNs = Clock::now();
+		else
+			startSnapshot(channels);
+	}
+}
+
+/*
+** Write a snapshot synchronously, used at shutdown
+** Both logs are emptied afterwards since the snapshot holds everything
+*/
+void ChannelStore::writeSnapshot(const ChannelMap &channels)
+{
+	if (_child > 0)
+		reap(true);
+	std::string tmpPath = _path + ".tmp." + std::to_string(::getpid());
+	if (!saveSnapshot(channels, _seq, tmpPath))
+	{
+		++_snapshotFailures;
+		LOG_ERROR("Channel snapshot failed: %s", strerror(errno));
+		return;
+	}
+	++_snapshots;
+	_snapshotSeq = _seq;
+	::unlink((_path + ".wal.prev").c_str());
+	if (_logFd >= 0 && ::ftruncate(_logFd, 0) < 0)
+		LOG_WARN("Cannot truncate %s.wal: %s", _path.c_str(), strerror(errno));
+	LOG_INFO("Saved %zu channels to %s", channels.size(), _path.c_str());
+}
+
+void ChannelStore::logPut(const Channel &channel)
+{
+	WireWriter out;
+	channel.serializeSettings(out);
+	append(Put, out.buffer());
+}
+
+void ChannelStore::logRemove(const std::string &name)
+{
+	append(Remove, name);
+}
+
+std::uint64_t ChannelStore::snapshots() const noexcept { return _snapshots; }
+
+std::uint64_t ChannelStore::snapshotFailures() const noexcept { return _snapshotFailures; }
+
+std::uint64_t ChannelStore::logRecords() const noexcept { return _logRecords; }
+
+/// Private ///
+
+/*
+** Append one record with a single write()
+** Changes to channel settings are rare, so records are not batched; once
+** write() returns they survive a crash of the process
+*/
+void ChannelStore::append(RecordType type, const std::string &payload)
+{
+	if (_logFd < 0)
+		return;
+	WireWriter out;
+	out.u32(static_cast<std::uint32_t>(payload.size() + 9));
+	out.u64(++_seq);
+	out.u8(type);
+	out.buffer().append(payload);
+	const std::string &record = out.buffer();
+	ssize_t n;
+	do
+		n = ::write(_logFd, record.data(), record.size());
+	while (n < 0 && errno == EINTR);
+	if (n != static_cast<ssize_t>(record.size()))
+		LOG_ERROR("Channel log write failed: %s", n < 0 ? strerror(errno) : "short write");
+	++_logRecords;
+}
+
+/*
+** Fork a child that writes the current channels to disk
+** The child sees a copy-on-write image of the parent's memory, so the event
+** loop only pays for the fork itself. The log is rotated first so that the
+** new log only holds changes the snapshot may be missing; if an earlier
+** snapshot failed, .wal.prev is still needed and the log is kept as is.
+*/
+void ChannelStore::startSnapshot(const ChannelMap &channels)
+{
+	_lastSnapshotNs = Clock::now();
+	std::string prevPath = _path + ".wal.prev";
+	if (::access(prevPath.c_str(), F_OK) != 0)
+	{
+		if (::rename((_path + ".wal").c_str(), prevPath.c_str()) == 0)
+		{
+			::close(_logFd);
+			_logFd = -1;
+			openLog();
+		}
+		else
+			LOG_WARN("Cannot rotate %s.wal: %s", _path.c_str(), strerror(errno));
+	}
+
+	std::uint64_t seq = _seq;
+	_snapshotSeq = seq;
+	std::string tmpPath = _path + ".tmp." + std::to_string(::getpid());
+	pid_t pid = ::fork();
+	if (pid < 0)
+	{
+		++_snapshotFailures;
+		_snapshotSeq = 0;
+		LOG_ERROR("Channel snapshot fork failed: %s", strerror(errno));
+		return;
+	}
+	if (pid == 0)
+		::_exit(saveSnapshot(channels, seq, tmpPath) ? 0 : 1);
+	_child = pid;
+	_childStartNs = _lastSnapshotNs;
+	LOG_DEBUG("Channel snapshot started in pid %d (%zu channels)", static_cast<int>(pid), channels.size());
+}
+
+/*
+** Collect the snapshot child; on success the rotated log is obsolete
+*/
+void ChannelStore::reap(bool wait)
+{
+	int status;
+	pid_t pid;
+	do
+		pid = ::waitpid(_child, &status, wait ? 0 : WNOHANG);
+	while (pid < 0 && errno == EINTR);
+	if (pid == 0)
+		return;
+	_child = -1;
+	if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	{
+		++_snapshots;
+		::unlink((_path + ".wal.prev").c_str());
+		LOG_INFO("Channel snapshot finished after %llu ms",
+				 static_cast<unsigned long long>((Clock::now() - _childStartNs) / 1000000));
+	}
+	else
+	{
+		++_snapshotFailures;
+		_snapshotSeq = 0;
+		LOG_ERROR("Channel snapshot failed, keeping %s.wal.prev", _path.c_str());
+	}
+}
+
+void ChannelStore::openLog()
+{
+	std::string logPath = _path + ".wal";
+	_logFd = ::open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (_logFd < 0)
+		throw std::runtime_error("Cannot open channel log " + logPath + ": " + std::string(strerror(errno)));
+}
+
+/*
+** Write every channel to tmpPath, sync it and rename it over the snapshot
+** Runs in the forked child as well, so it only writes files and never logs
+*/
+bool ChannelStore::saveSnapshot(const ChannelMap &channels, std::uint64_t seq,
+								const std::string &tmpPath) const
+{
+	WireWriter out;
+	out.buffer().reserve(channels.size() * 64 + 64);
+	out.buffer().append(MAGIC, sizeof(MAGIC));
+	out.u32(VERSION);
+	out.u64(seq);
+	out.u32(static_cast<std::uint32_t>(channels.size()));
+	for (const auto &pair : channels)
+		pair.second.serializeSettings(out);
+
+	int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return false;
+	const std::string &data = out.buffer();
+	std::size_t done = 0;
+	while (done < data.size())
+	{
+		ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			::close(fd);
+			::unlink(tmpPath.c_str());
+			return false;
+		}
+		done += static_cast<std::size_t>(n);
+	}
+	bool ok = ::fsync(fd) == 0;
+	ok = ::close(fd) == 0 && ok;
+	if (!ok || ::rename(tmpPath.c_str(), _path.c_str()) < 0)
+	{
+		::unlink(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+/*
+** Map the snapshot read-only and decode it in place
+** Returns the sequence number it was taken at (0 without a snapshot)
+*/
+std::uint64_t ChannelStore::loadSnapshot(SavedChannels &channels)
+{
+	int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return 0;
+		throw std::runtime_error("Cannot open channel snapshot " + _path + ": " + std::string(strerror(errno)));
+	}
+	struct stat st;
+	if (::fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return 0;
+	}
+	std::size_t size = static_cast<std::size_t>(st.st_size);
+	void *map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("Cannot map channel snapshot " + _path + ": " + std::string(strerror(errno)));
+	::madvise(map, size, MADV_SEQUENTIAL);
+
+	const char *data = static_cast<const char *>(map);
+	std::uint64_t seq = 0;
+	try
+	{
+		if (size < sizeof(MAGIC) || std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0)
+			throw std::runtime_error("not a channel snapshot");
+		WireReader in(data + sizeof(MAGIC), size - sizeof(MAGIC));
+		std::uint32_t version = in.u32();
+		if (version != VERSION && version != 1)
+			throw std::runtime_error("unsupported snapshot version " + std::to_string(version));
+		seq = in.u64();
+		std::uint32_t count = in.u32();
+		channels.reserve(channels.size() + count);
+		for (std::uint32_t i = 0; i < count; ++i)
+		{
+			Channel chan = Channel::deserializeSettings(in);
+			// Version 1 records end with operator nicknames, no longer restored
+			for (std::uint32_t operators = version == 1 ? in.u32() : 0; operators > 0; --operators)
+				in.str();
+			std::string name = chan.getChannelName();
+			channels.insert_or_assign(std::move(name), std::move(chan));
+		}
+	}
+	catch (const std::exception &e)
+	{
+		::munmap(map, size);
+		throw std::runtime_error("Channel snapshot " + _path + ": " + e.what());
+	}
+	::munmap(map, size);
+	return seq;
+}
+
+/*
+** Apply the changes in a log that are newer than the snapshot
+*/
+void ChannelStore::replayLog(const std::string &path, std::uint64_t after,
+							 SavedChannels &channels)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	std::string data;
+	char buffer[65536];
+	ssize_t n;
+	while ((n = ::read(fd, buffer, sizeof(buffer))) > 0)
+		data.append(buffer, static_cast<std::size_t>(n));
+	::close(fd);
+
+	std::size_t pos = 0;
+	std::size_t applied = 0;
+	while (data.size() - pos >= 4)
+	{
+		std::uint32_t len = WireReader(data.data() + pos, 4).u32();
+		if (len < 9 || data.size() - pos - 4 < len)
+		{
+			LOG_WARN("Ignoring torn record at the end of %s", path.c_str());
+			break;
+		}
+		WireReader in(data.data() + pos + 4, len);
+		pos += 4 + len;
+		std::uint64_t seq = in.u64();
+		std::uint8_t type = in.u8();
+		if (seq > _seq)
+			_seq = seq;
+		if (seq <= after)
+			continue;
+		if (type == Put)
+		{
+			Channel chan = Channel::deserializeSettings(in);
+			std::string name = chan.getChannelName();
+			channels.insert_or_assign(std::move(name), std::move(chan));
+		}
+		else if (type == Remove)
+			channels.erase(std::string(data.data() + pos - len + 9, len - 9));
+		++applied;
+	}
+	if (applied)
+		LOG_INFO("Replayed %zu channel changes from %s", applied, path.c_str());
+}
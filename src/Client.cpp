@@ -1,13 +1,15 @@
 #include "Client.hpp"
 
 // Constructor
-Client::Client(int fd) : _fd(fd), _channelCount(0) {}
+Client::Client(int fd) : _fd(fd) {}
 
 // Getters
 int Client::getFd() const noexcept { return _fd; }
 
 const std::string& Client::getNickname() const noexcept { return _nickname; }
 
+std::size_t Client::getNicknameHash() const noexcept { return _nicknameHash; }
+
 const std::string& Client::getUsername() const noexcept { return _username; }
 
 const std::string& Client::getFullname() const noexcept { return _fullname; }
@@ -21,7 +23,23 @@ std::string& Client::getWriteBuffer() noexcept { return _writeBuffer; }
 
 const std::string& Client::getWriteBuffer() const noexcept { return _writeBuffer; }
 
-int Client::getChannelCount() const { return _channelCount; }
+const std::string& Client::getHost() const noexcept { return _host; }
+
+const std::string& Client::getServer() const noexcept { return _server; }
+
+bool Client::isRemote() const noexcept { return !_server.empty(); }
+
+const std::string& Client::getConnClass() const noexcept { return _connClass; }
+
+const ConnectionClass& Client::getLimits() const noexcept { return _limits; }
+
+std::time_t Client::getNickTime() const noexcept { return _nickTime; }
+
+std::uint64_t Client::getHistoryId() const noexcept { return _historyId; }
+
+int Client::getChannelCount() const { return static_cast<int>(_channels.size()); }
+
+const ChannelSet& Client::getChannels() const noexcept { return _channels; }
 
 // Setters
 void Client::setFd(int fd) noexcept { _fd = fd; }
@@ -30,6 +48,7 @@ void Client::setNickname(std::string nickname)
 {
 	trimCrLf(nickname);
 	_nickname = nickname;
+	_nicknameHash = NameTable::hash(_nickname);
 	_hasNickname = true;
 }
 
@@ -47,13 +66,58 @@ void Client::setFullname(std::string fullname)
 	_hasFullname = true;
 }
 
-void Client::incrementChannelCount() { _channelCount++; }
-void Client::decrementChannelCount() { _channelCount--; }
+void Client::setHost(std::string host) { _host = std::move(host); }
+
+void Client::setServer(std::string server) { _server = std::move(server); }
+
+void Client::setConnClass(std::string connClass) { _connClass = std::move(connClass); }
+
+void Client::setLimits(const ConnectionClass &limits) noexcept { _limits = limits; }
+
+bool Client::countLine(std::time_t now) noexcept
+{
+	if (_limits.floodLines == 0)
+		return true;
+	if (now - _floodStart >= static_cast<std::time_t>(_limits.floodSeconds))
+	{
+		_floodStart = now;
+		_floodLines = 0;
+	}
+	return ++_floodLines <= _limits.floodLines;
+}
+
+void Client::setNickTime(std::time_t time) noexcept { _nickTime = time; }
+
+void Client::setHistoryId(std::uint64_t id) noexcept { _historyId = id; }
+
+void Client::joinedChannel(Channel *channel) { _channels.insert(channel); }
+void Client::leftChannel(Channel *channel) { _channels.erase(channel); }
+
+const ChannelSet &Client::getInvitations() const noexcept { return _invitations; }
+void Client::invitedTo(Channel *channel) { _invitations.insert(channel); }
+void Client::uninvitedFrom(Channel *channel) { _invitations.erase(channel); }
 
 void Client::setHasPassword(bool hasPassword) noexcept { _hasPassword = hasPassword; }
 
 void Client::setIsRegistered(bool isRegistered) noexcept { _isRegistered = isRegistered; }
 
+void Client::setIsServerOperator(bool isServerOperator) noexcept { _isServerOperator = isServerOperator; }
+
+void Client::setNegotiatingCaps(bool negotiating) noexcept { _negotiatingCaps = negotiating; }
+
+void Client::setDeparting() noexcept { _departing = true; }
+
+void Client::setHasLinkPassword(bool hasLinkPassword) noexcept { _hasLinkPassword = hasLinkPassword; }
+
+void Client::setSecure(bool secure) noexcept { _secure = secure; }
+
+// Capabilities
+std::uint8_t Client::getCaps() const noexcept { return _caps; }
+
+bool Client::hasCap(ClientCap cap) const noexcept { return (_caps & cap) != 0; }
+
+void Client::setCaps(std::uint8_t caps) noexcept { _caps = caps; }
+
 // Client state information
 bool Client::hasPassword() const noexcept { return _hasPassword; }
 
@@ -65,10 +129,113 @@ bool Client::hasFullname() const noexcept { return _hasFullname; }
 
 bool Client::isRegistered() const noexcept { return _isRegistered; }
 
+bool Client::isServerOperator() const noexcept { return _isServerOperator; }
+
+bool Client::isNegotiatingCaps() const noexcept { return _negotiatingCaps; }
+
+bool Client::isDeparting() const noexcept { return _departing; }
+
+bool Client::hasLinkPassword() const noexcept { return _hasLinkPassword; }
+
+bool Client::isSecure() const noexcept { return _secure; }
+
 // Check if there is data to write
 bool Client::dataToWrite() const noexcept { return !_writeBuffer.empty(); }
 
-void Client::queueMsg(const std::string& msg) { _writeBuffer += msg; }
+void Client::queueMsg(const std::string& msg)
+{
+	_writeBuffer += msg;
+	++_queuedMessages;
+}
+
+std::uint32_t Client::takeQueuedMessages() noexcept
+{
+	std::uint32_t queued = _queuedMessages;
+	_queuedMessages = 0;
+	return queued;
+}
+
+bool Client::isDirty() const noexcept { return _dirty; }
+
+Client *Client::nextDirty() const noexcept { return _dirtyNext; }
+
+// Become the head of the list starting at head
+void Client::linkDirty(Client *head) noexcept
+{
+	_dirty = true;
+	_dirtyPrev = nullptr;
+	_dirtyNext = head;
+	if (head)
+		head->_dirtyPrev = this;
+}
+
+// Leave the list, joining the neighbours; the caller updates its head
+void Client::unlinkDirty() noexcept
+{
+	if (_dirtyPrev)
+		_dirtyPrev->_dirtyNext = _dirtyNext;
+	if (_dirtyNext)
+		_dirtyNext->_dirtyPrev = _dirtyPrev;
+	_dirty = false;
+	_dirtyPrev = nullptr;
+	_dirtyNext = nullptr;
+}
+
+bool Client::isReadReady() const noexcept { return _readReady; }
+
+void Client::setReadReady(bool ready) noexcept { _readReady = ready; }
+
+bool Client::isWaitingWrite() const noexcept { return _waitingWrite; }
+
+void Client::setWaitingWrite(bool waiting) noexcept { _waitingWrite = waiting; }
+
+/*
+** Serialize identity, state flags and both buffers
+*/
+void Client::serialize(WireWriter &out) const
+{
+	out.u32(static_cast<std::uint32_t>(_fd));
+	out.str(_nickname);
+	out.str(_username);
+	out.str(_fullname);
+	out.u8(static_cast<std::uint8_t>(_hasPassword | _hasNickname << 1 | _hasUsername << 2
+			| _hasFullname << 3 | _isRegistered << 4 | _isServerOperator << 5 | _negotiatingCaps << 6
+			| _secure << 7));
+	out.u8(_caps);
+	out.u64(static_cast<std::uint64_t>(_nickTime));
+	out.str(_connClass);
+	out.str(_readBuffer);
+	out.str(_writeBuffer);
+}
+
+/*
+** Rebuild a client written by serialize()
+** The fd is the one from the serializing process; the joined channels are
+** rebuilt by Channel::attachMembers() and the host is resolved again on use
+*/
+Client Client::deserialize(WireReader &in)
+{
+	Client client(static_cast<int>(in.u32()));
+	client._nickname = in.str();
+	client._nicknameHash = NameTable::hash(client._nickname);
+	client._username = in.str();
+	client._fullname = in.str();
+	std::uint8_t flags = in.u8();
+	client._hasPassword = flags & 1;
+	client._hasNickname = flags & 2;
+	client._hasUsername = flags & 4;
+	client._hasFullname = flags & 8;
+	client._isRegistered = flags & 16;
+	client._isServerOperator = flags & 32;
+	client._negotiatingCaps = flags & 64;
+	client._secure = flags & 128;
+	client._caps = in.u8();
+	client._nickTime = static_cast<std::time_t>(in.u64());
+	client._connClass = in.str();
+	client._readBuffer = in.str();
+	client._writeBuffer = in.str();
+	return client;
+}
 
 /// Private member functions ///
 // Trim CRLF from the end of a string
@@ -0,0 +1,158 @@
+#include "Config.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+
+/*
+** A count, or a byte size with an optional K or M suffix
+*/
+static bool parseSize(const std::string &text, std::size_t &out)
+{
+	char *end = nullptr;
+	unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+	if (text.empty() || end == text.c_str() || text[0] == '-')
+		return false;
+	if (*end == 'K' || *end == 'k')
+		value <<= 10, ++end;
+	else if (*end == 'M' || *end == 'm')
+		value <<= 20, ++end;
+	if (*end != '\0' || value > (1ull << 40))
+		return false;
+	out = static_cast<std::size_t>(value);
+	return true;
+}
+
+/*
+** The options of a class line: sendq=N, recvq=N and flood=LINES/SECONDS
+*/
+static bool parseClassOption(const std::string &option, ConnectionClass &cls)
+{
+	std::size_t equals = option.find('=');
+	if (equals == std::string::npos)
+		return false;
+	std::string key = option.substr(0, equals);
+	std::string value = option.substr(equals + 1);
+	if (key == "sendq")
+		return parseSize(value, cls.sendq);
+	if (key == "recvq")
+		return parseSize(value, cls.recvq);
+	if (key != "flood")
+		return false;
+	if (value == "off")
+	{
+		cls.floodLines = 0;
+		return true;
+	}
+	std::size_t slash = value.find('/');
+	std::size_t lines;
+	std::size_t seconds;
+	if (slash == std::string::npos || !parseSize(value.substr(0, slash), lines)
+		|| !parseSize(value.substr(slash + 1), seconds) || lines > 100000 || seconds < 1 || seconds > 3600)
+		return false;
+	cls.floodLines = static_cast<std::uint32_t>(lines);
+	cls.floodSeconds = static_cast<std::uint32_t>(seconds);
+	return true;
+}
+
+Config Config::load(const std::string &path)
+{
+	std::ifstream file(path);
+	if (!file)
+		throw std::runtime_error("Cannot open configuration file " + path);
+
+	Config config;
+	std::string line;
+	int number = 0;
+	while (std::getline(file, line))
+	{
+		++number;
+		auto fail = [&](const std::string &message) {
+			return std::runtime_error(path + ":" + std::to_string(number) + ": " + message);
+		};
+		std::size_t comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+		std::istringstream words(line);
+		std::string key;
+		if (!(words >> key))
+			continue;
+		std::string rest;
+		std::getline(words >> std::ws, rest);
+		while (!rest.empty() && (rest.back() == ' ' || rest.back() == '\t' || rest.back() == '\r'))
+			rest.pop_back();
+
+		std::size_t size;
+		if (key == "password")
+		{
+			if (rest.empty() || rest.find(' ') != std::string::npos)
+				throw fail("password takes one word");
+			config.password = rest;
+		}
+		else if (key == "listen")
+		{
+			if (rest.empty())
+				throw fail("listen needs an address");
+			config.listeners.push_back(rest);
+		}
+		else if (key == "class")
+		{
+			std::istringstream options(rest);
+			std::string name;
+			std::string option;
+			if (!(options >> name))
+				throw fail("class needs a name");
+			ConnectionClass &cls = config.classes[name];
+			while (options >> option)
+			{
+				if (!parseClassOption(option, cls))
+					throw fail("invalid class option " + option);
+			}
+		}
+		else if (key == "max_joined_channels" || key == "max_channels")
+		{
+			if (!parseSize(rest, size) || size < 1 || size > 1000000)
+				throw fail("invalid " + key + ": " + rest);
+			(key == "max_channels" ? config.maxChannels : config.maxJoinedChannels) = static_cast<int>(size);
+		}
+		else if (key == "invite_ttl")
+		{
+			if (!parseSize(rest, size) || size > 30 * 86400)
+				throw fail("invite_ttl must be between 0 and 2592000 seconds");
+			config.inviteTtl = static_cast<std::time_t>(size);
+		}
+		else if (key == "max_invites")
+		{
+			if (!parseSize(rest, size) || size < 1 || size > 100000)
+				throw fail("invalid max_invites: " + rest);
+			config.maxInvites = size;
+		}
+		else if (key == "recv_buffer")
+		{
+			if (!parseSize(rest, size) || size < 512 || size > (1 << 20))
+				throw fail("recv_buffer must be between 512 and 1M");
+			config.recvBuffer = size;
+		}
+		else if (key == "pooled_buffers")
+		{
+			if (!parseSize(rest, size) || size > 1000000)
+				throw fail("invalid pooled_buffers: " + rest);
+			config.pooledBuffers = size;
+		}
+		else if (key == "pooled_buffer_bytes")
+		{
+			if (!parseSize(rest, size) || size > (1 << 20))
+				throw fail("invalid pooled_buffer_bytes: " + rest);
+			config.pooledBufferBytes = size;
+		}
+		else
+			throw fail("unknown setting " + key);
+	}
+	return config;
+}
+
+const ConnectionClass &Config::connectionClass(const std::string &name) const
+{
+	auto found = classes.find(name);
+	return found != classes.end() ? found->second : classes.at("default");
+}
@@ -0,0 +1,401 @@
+#include "Server.hpp"
+#include "Logger.hpp"
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+** Hot restart
+** The running process listens on a unix socket. A new binary started with
+** IRCSERV_TAKEOVER connects to it and receives:
+**   u64 length | state blob              (serializeState)
+**   every socket fd, in blob order       (SCM_RIGHTS, in batches)
+** and answers with a single ack byte once it has rebuilt the state.
+** Only then does the old process stop, without touching the connections.
+** Every listener is passed on, unix sockets included. Connections with TLS
+** in user space are closed first: only kernel TLS keeps its state in the
+** socket.
+*/
+
+static const char		HANDOFF_MAGIC[] = "IRCHOT";
+static const std::uint32_t HANDOFF_VERSION = 9;
+static const std::size_t FDS_PER_MESSAGE = 250;
+static const std::uint32_t NO_FD = 0xffffffff;
+
+struct sockaddr_un Server::unixAddress(const std::string &path)
+{
+	struct sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("Unix socket path too long: " + path);
+	std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return addr;
+}
+
+static void writeAll(int sock, const char *data, std::size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = ::send(sock, data, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error("Handoff send failed: " + std::string(strerror(errno)));
+		data += n;
+		size -= static_cast<std::size_t>(n);
+	}
+}
+
+static void readAll(int sock, char *data, std::size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = ::recv(sock, data, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error("Handoff receive failed: " + std::string(n == 0 ? "peer closed" : strerror(errno)));
+		data += n;
+		size -= static_cast<std::size_t>(n);
+	}
+}
+
+static void sendFds(int sock, const std::vector<int> &fds)
+{
+	for (std::size_t start = 0; start < fds.size(); start += FDS_PER_MESSAGE)
+	{
+		std::size_t count = std::min(FDS_PER_MESSAGE, fds.size() - start);
+		char byte = 'F';
+		struct iovec iov = { &byte, 1 };
+		std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+		struct msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		std::memcpy(CMSG_DATA(cmsg), fds.data() + start, sizeof(int) * count);
+		if (::sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+			throw std::runtime_error("Handoff sendmsg failed: " + std::string(strerror(errno)));
+	}
+}
+
+static std::vector<int> receiveFds(int sock, std::size_t expected)
+{
+	std::vector<int> fds;
+	while (fds.size() < expected)
+	{
+		std::size_t count = std::min(FDS_PER_MESSAGE, expected - fds.size());
+		char byte;
+		struct iovec iov = { &byte, 1 };
+		std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+		struct msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		if (::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+			throw std::runtime_error("Handoff recvmsg failed: " + std::string(strerror(errno)));
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC))
+			throw std::runtime_error("Handoff message carried no descriptors");
+		std::size_t got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const int *data = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+		fds.insert(fds.end(), data, data + got);
+	}
+	return fds;
+}
+
+/*
+** Listen for a successor process on a unix socket
+** A stale socket file left by a crashed process is replaced
+*/
+void Server::enableUpgrade(const std::string &path)
+{
+	struct sockaddr_un addr = unixAddress(path);
+	_upgradeFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (_upgradeFd < 0)
+		throw std::runtime_error("Upgrade socket creation failed: " + std::string(strerror(errno)));
+	::unlink(path.c_str());
+	if (::bind(_upgradeFd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+		throw std::runtime_error("Upgrade bind failed: " + std::string(strerror(errno)));
+	if (::listen(_upgradeFd, 1) < 0)
+		throw std::runtime_error("Upgrade listen failed: " + std::string(strerror(errno)));
+	if (::fcntl(_upgradeFd, F_SETFL, O_NONBLOCK) < 0)
+		throw std::runtime_error("Set non-blocking mode failed: " + std::string(strerror(errno)));
+	_upgradePath = path;
+
+	pollfd upgradePollFd;
+	upgradePollFd.fd = _upgradeFd;
+	upgradePollFd.events = POLLIN;
+	upgradePollFd.revents = 0;
+	_fds.push_back(upgradePollFd);
+	LOG_INFO("Hot restart socket ready at %s", path.c_str());
+}
+
+/*
+** A successor connected: hand everything over
+** Runs synchronously; if anything fails before the ack arrives this process
+** simply keeps serving
+*/
+void Server::handleUpgradeConnection()
+{
+	int sock = ::accept(_upgradeFd, nullptr, nullptr);
+	if (sock < 0)
+		return;
+	try
+	{
+		struct timeval timeout = { 10, 0 };
+		::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		for (auto &conn : _metricsConns)
+		{
+			::close(conn.first);
+			auto newEnd = std::remove_if(_fds.begin(), _fds.end(),
+										 [&conn](const pollfd &pfd) { return pfd.fd == conn.first; });
+			_fds.erase(newEnd, _fds.end());
+		}
+		_metricsConns.clear();
+		// Standbys importing from us start over from the new process; an
+		// import of our own stops here, keeping what was applied
+		for (auto &sync : _syncExports)
+		{
+			::close(sync.first);
+			auto newEnd = std::remove_if(_fds.begin(), _fds.end(),
+										 [&sync](const pollfd &pfd) { return pfd.fd == sync.first; });
+			_fds.erase(newEnd, _fds.end());
+		}
+		_syncExports.clear();
+		if (_import.fd >= 0)
+			finishImport("Server restarting");
+		// Links are not handed over: the network sees a split, and the new
+		// process dials its links again. Clients that left are not handed over either.
+		dropAllLinks("Server restarting");
+		// OpenSSL sessions cannot move to another process; kernel TLS
+		// connections carry their state in the socket and are handed over
+		for (auto &tls : _tlsSessions)
+			disconnectClient(tls.first, "TLS session cannot be kept over a restart, please reconnect");
+		flushDisconnects();
+
+		WireWriter out;
+		std::vector<int> fds;
+		serializeState(out, fds);
+		LOG_INFO("Handing off %zu clients and %zu channels (%zu bytes, %zu fds)",
+				 _clients.size(), _channels.size(), out.buffer().size(), fds.size());
+
+		WireWriter header;
+		header.u64(out.buffer().size());
+		writeAll(sock, header.buffer().data(), header.buffer().size());
+		writeAll(sock, out.buffer().data(), out.buffer().size());
+		sendFds(sock, fds);
+
+		char ack;
+		readAll(sock, &ack, 1);
+		if (ack != 'K')
+			throw std::runtime_error("unexpected acknowledgement");
+	}
+	catch (const std::exception &e)
+	{
+		LOG_ERROR("Hot restart aborted, still serving: %s", e.what());
+		::close(sock);
+		return;
+	}
+	// The connections carry on in the new process, which records them from
+	// here on in the same capture file, once this socket is closed
+	if (_capture.enabled())
+	{
+		for (const auto &pair : _clients)
+			if (!pair.second.isRemote())
+				_capture.recordClose(pair.first);
+		_capture.close();
+	}
+	::close(sock);
+	_handedOff = true;
+	requestStop();
+}
+
+/*
+** Write server, client and channel state
+** fds receives every descriptor to pass, in the order the blob refers to them
+*/
+void Server::serializeState(WireWriter &out, std::vector<int> &fds) const
+{
+	out.str(HANDOFF_MAGIC);
+	out.u32(HANDOFF_VERSION);
+	out.u32(static_cast<std::uint32_t>(_port));
+	out.u64(static_cast<std::uint64_t>(_startTime));
+	out.u8(_wasRegistered);
+
+	out.u32(static_cast<std::uint32_t>(_listeners.size()));
+	for (const Listener &listener : _listeners)
+	{
+		out.u32(static_cast<std::uint32_t>(listener.fd));
+		fds.push_back(listener.fd);
+		out.str(listener.address);
+		out.u32(static_cast<std::uint32_t>(listener.backlog));
+		out.str(listener.connClass);
+		out.u8(static_cast<std::uint8_t>(listener.tls | listener.configured << 1));
+	}
+	out.u32(_metricsFd >= 0 ? static_cast<std::uint32_t>(_metricsFd) : NO_FD);
+	if (_metricsFd >= 0)
+		fds.push_back(_metricsFd);
+
+	out.u32(static_cast<std::uint32_t>(_clients.size()));
+	for (const auto &pair : _clients)
+	{
+		pair.second.serialize(out);
+		fds.push_back(pair.first);
+	}
+	out.u32(static_cast<std::uint32_t>(_channels.size()));
+	for (const auto &pair : _channels)
+		pair.second.serialize(out);
+}
+
+/*
+** Rebuild state written by serializeState()
+** fds holds the received descriptors, in the same order as the blob
+*/
+void Server::restoreState(WireReader &in, const std::vector<int> &fds)
+{
+	if (in.str() != HANDOFF_MAGIC || in.u32() != HANDOFF_VERSION)
+		throw std::runtime_error("Incompatible handoff state");
+	_port = static_cast<int>(in.u32());
+	_startTime = static_cast<std::time_t>(in.u64());
+	_wasRegistered = in.u8();
+
+	std::size_t next = 0;
+	std::unordered_map<int, int> newFd;
+	auto take = [&](int oldFd) {
+		if (next >= fds.size())
+			throw std::runtime_error("Handoff is missing descriptors");
+		newFd[oldFd] = fds[next];
+		return fds[next++];
+	};
+
+	std::uint32_t listenerCount = in.u32();
+	for (std::uint32_t i = 0; i < listenerCount; ++i)
+	{
+		Listener listener;
+		listener.fd = take(static_cast<int>(in.u32()));
+		listener.address = in.str();
+		listener.backlog = static_cast<int>(in.u32());
+		listener.connClass = in.str();
+		std::uint8_t flags = in.u8();
+		listener.tls = flags & 1;
+		listener.configured = flags & 2;
+		_listeners.push_back(listener);
+	}
+	std::uint32_t metricsFd = in.u32();
+	if (metricsFd != NO_FD)
+		_metricsFd = take(static_cast<int>(metricsFd));
+
+	std::unordered_map<int, Client *> byOldFd;
+	std::uint32_t clientCount = in.u32();
+	for (std::uint32_t i = 0; i < clientCount; ++i)
+	{
+		Client client = Client::deserialize(in);
+		int oldFd = client.getFd();
+		int fd = take(oldFd);
+		client.setFd(fd);
+		auto inserted = _clients.emplace(fd, client);
+		byOldFd[oldFd] = &inserted.first->second;
+		indexNick(inserted.first->second);
+	}
+	std::uint32_t channelCount = in.u32();
+	for (std::uint32_t i = 0; i < channelCount; ++i)
+	{
+		Channel *chan = addChannel(Channel::deserialize(in, byOldFd));
+		if (chan)
+			chan->attachMembers();
+		// The hold of a channel the old process restored starts over
+		if (chan && chan->getCurrentUsers() == 0)
+			_restoredUntil = _clock->now() + RESTORE_HOLD_SECONDS;
+	}
+
+	auto addPollFd = [this](int fd, short events) {
+		pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = events;
+		pfd.revents = 0;
+		_fds.push_back(pfd);
+	};
+	for (const Listener &listener : _listeners)
+		addPollFd(listener.fd, POLLIN);
+	if (_metricsFd >= 0)
+		addPollFd(_metricsFd, POLLIN);
+	// Output the old process had not sent goes out in the first flush phase,
+	// and lines it had not handled yet in the first round of ready clients
+	for (auto &pair : _clients)
+	{
+		addPollFd(pair.first, POLLIN);
+		if (pair.second.dataToWrite())
+			markDirty(pair.second);
+		if (pair.second.getReadBuffer().find("\r\n") != std::string::npos)
+			markReadReady(pair.second);
+	}
+}
+
+/*
+** Take over from the process listening on the upgrade socket at path
+** Used instead of initSocket() when IRCSERV_TAKEOVER is set
+*/
+void Server::takeOver(const std::string &path)
+{
+	_tookOver = true;
+	struct sockaddr_un addr = unixAddress(path);
+	int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		throw std::runtime_error("Takeover socket creation failed: " + std::string(strerror(errno)));
+	try
+	{
+		if (::connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+			throw std::runtime_error("Cannot reach running server at " + path + ": " + std::string(strerror(errno)));
+
+		char header[8];
+		readAll(sock, header, sizeof(header));
+		std::uint64_t size = WireReader(header, sizeof(header)).u64();
+		std::string blob(size, '\0');
+		readAll(sock, &blob[0], blob.size());
+
+		WireReader peek(blob.data(), blob.size());
+		peek.str();
+		peek.u32();
+		peek.u32();
+		peek.u64();
+		peek.u8();
+		std::size_t expected = peek.u32();
+		for (std::size_t i = 0; i < expected; ++i)
+		{
+			peek.u32();
+			peek.str();
+			peek.u32();
+			peek.str();
+			peek.u8();
+		}
+		expected += (peek.u32() != NO_FD);
+		expected += peek.u32();
+		std::vector<int> fds = receiveFds(sock, expected);
+
+		WireReader in(blob.data(), blob.size());
+		restoreState(in, fds);
+		writeAll(sock, "K", 1);
+		// Wait for the old process to close the socket: its last capture
+		// records must come before this process's first ones
+		char eof;
+		while (::read(sock, &eof, 1) < 0 && errno == EINTR)
+			;
+	}
+	catch (...)
+	{
+		::close(sock);
+		throw;
+	}
+	::close(sock);
+	LOG_INFO("Took over %zu clients and %zu channels on port %d", _clients.size(), _channels.size(), _port);
+}
@@ -0,0 +1,327 @@
+#include "History.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+/// HistoryRing ///
+HistoryRing::HistoryRing(std::size_t maxBytes) : _maxBytes(maxBytes) {}
+
+std::size_t HistoryRing::capacity() const noexcept { return _arena.size(); }
+
+std::size_t HistoryRing::maxBytes() const noexcept { return _maxBytes; }
+
+std::size_t HistoryRing::size() const noexcept { return _entries.size(); }
+
+/*
+** True when storing length more bytes would overwrite old lines (or not fit
+** at all) while the arena may still grow
+*/
+bool HistoryRing::needsGrowth(std::size_t length) const noexcept
+{
+	if (_arena.size() >= _maxBytes)
+		return false;
+	if (_head + length > _arena.size())
+		return true;
+	return !_entries.empty() && overlaps(_entries.front(), _head, length);
+}
+
+/*
+** Move to a larger arena, packing the lines in order at its start
+*/
+void HistoryRing::grow(std::size_t newCapacity)
+{
+	std::vector<char> arena(newCapacity);
+	std::size_t pos = 0;
+	for (Entry &entry : _entries)
+	{
+		std::size_t length = entry.keyLength + entry.lineLength;
+		std::memcpy(arena.data() + pos, _arena.data() + entry.offset, length);
+		entry.offset = static_cast<std::uint32_t>(pos);
+		pos += length;
+	}
+	_arena.swap(arena);
+	_head = pos;
+}
+
+/*
+** Store a line, overwriting the oldest ones as needed
+** Lines are kept contiguous: when one does not fit before the end of the
+** arena, writing restarts at offset 0 and the tail is left unused
+*/
+void HistoryRing::append(std::uint64_t id, std::uint64_t timeMs, std::string_view key, std::string_view line)
+{
+	std::size_t length = key.size() + line.size();
+	if (length == 0 || length > _arena.size())
+		return;
+	std::size_t pos = _head;
+	if (pos + length > _arena.size())
+	{
+		// Everything past the old head is from the previous lap: the oldest lines
+		while (!_entries.empty() && _entries.front().offset >= _head)
+			_entries.pop_front();
+		pos = 0;
+	}
+	while (!_entries.empty() && overlaps(_entries.front(), pos, length))
+		_entries.pop_front();
+
+	std::memcpy(_arena.data() + pos, key.data(), key.size());
+	std::memcpy(_arena.data() + pos + key.size(), line.data(), line.size());
+	Entry entry = { id, timeMs, static_cast<std::uint32_t>(pos), static_cast<std::uint32_t>(key.size()),
+					static_cast<std::uint32_t>(line.size()) };
+	_entries.push_back(entry);
+	_head = pos + length;
+}
+
+/*
+** Select up to limit lines, returned oldest first
+** Latest: the newest lines, after bound if given
+** Before: the newest lines before bound
+** After: the oldest lines after bound
+** key restricts the result to entries stored with that key
+*/
+std::vector<HistoryRing::Message> HistoryRing::query(Direction dir, const Bound *bound, std::size_t limit,
+													 std::string_view key) const
+{
+	std::vector<Message> result;
+	if (dir == After)
+	{
+		for (const Entry &entry : _entries)
+		{
+			if (result.size() >= limit)
+				break;
+			if (matches(entry, key) && (!bound || beyond(entry, *bound)))
+				result.push_back({ entry.id, entry.timeMs,
+								   std::string_view(_arena.data() + entry.offset + entry.keyLength, entry.lineLength) });
+		}
+		return result;
+	}
+	for (auto it = _entries.rbegin(); it != _entries.rend() && result.size() < limit; ++it)
+	{
+		if (bound && dir == Latest && !beyond(*it, *bound))
+			break;
+		if (bound && dir == Before && !before(*it, *bound))
+			continue;
+		if (matches(*it, key))
+			result.push_back({ it->id, it->timeMs,
+							   std::string_view(_arena.data() + it->offset + it->keyLength, it->lineLength) });
+	}
+	std::reverse(result.begin(), result.end());
+	return result;
+}
+
+bool HistoryRing::overlaps(const Entry &entry, std::size_t pos, std::size_t length) const noexcept
+{
+	return entry.offset < pos + length && pos < entry.offset + entry.keyLength + entry.lineLength;
+}
+
+bool HistoryRing::matches(const Entry &entry, std::string_view key) const noexcept
+{
+	return entry.keyLength == key.size() && std::memcmp(_arena.data() + entry.offset, key.data(), key.size()) == 0;
+}
+
+bool HistoryRing::beyond(const Entry &entry, const Bound &bound) noexcept
+{
+	return bound.byId ? entry.id > bound.value : entry.timeMs > bound.value;
+}
+
+bool HistoryRing::before(const Entry &entry, const Bound &bound) noexcept
+{
+	return bound.byId ? entry.id < bound.value : entry.timeMs < bound.value;
+}
+
+/// HistoryStore ///
+const std::size_t HistoryStore::INITIAL_RING_BYTES;
+
+/*
+** totalBytes caps all arenas together, 0 disables history
+** channelBytes and privateBytes are the largest a single ring may grow to
+*/
+void HistoryStore::configure(std::size_t totalBytes, std::size_t channelBytes, std::size_t privateBytes)
+{
+	_totalBytes = totalBytes;
+	_channelBytes = std::min(channelBytes, totalBytes);
+	_private = HistoryRing(std::min(privateBytes, totalBytes));
+	_channels.clear();
+	_lru.clear();
+	_allocated = 0;
+}
+
+bool HistoryStore::enabled() const noexcept { return _totalBytes > 0; }
+
+/*
+** Message ids are handed out to every PRIVMSG, stored or not, so that the
+** msgid tag of a live message matches the one CHATHISTORY returns
+*/
+std::uint64_t HistoryStore::nextId() noexcept { return _nextId++; }
+
+void HistoryStore::recordChannel(const std::string &channel, std::uint64_t id, std::uint64_t timeMs,
+								 std::string_view line)
+{
+	if (!enabled())
+		return;
+	auto it = _channels.find(channel);
+	if (it == _channels.end())
+	{
+		_lru.push_front(channel);
+		it = _channels.emplace(channel, ChannelRing{ HistoryRing(_channelBytes), _lru.begin() }).first;
+	}
+	touch(it->second);
+	append(it->second.ring, &it->first, id, timeMs, std::string_view(), line);
+}
+
+void HistoryStore::recordPrivate(std::uint64_t from, std::uint64_t to, std::uint64_t id, std::uint64_t timeMs,
+								 std::string_view line)
+{
+	if (!enabled())
+		return;
+	append(_private, nullptr, id, timeMs, privateKey(from, to), line);
+}
+
+void HistoryStore::dropChannel(const std::string &channel)
+{
+	auto it = _channels.find(channel);
+	if (it == _channels.end())
+		return;
+	_allocated -= it->second.ring.capacity();
+	_lru.erase(it->second.lru);
+	_channels.erase(it);
+}
+
+std::vector<HistoryRing::Message> HistoryStore::channelHistory(const std::string &channel,
+															   HistoryRing::Direction dir,
+															   const HistoryRing::Bound *bound, std::size_t limit)
+{
+	auto it = _channels.find(channel);
+	if (it == _channels.end())
+		return std::vector<HistoryRing::Message>();
+	touch(it->second);
+	return it->second.ring.query(dir, bound, limit, std::string_view());
+}
+
+std::vector<HistoryRing::Message> HistoryStore::privateHistory(std::uint64_t a, std::uint64_t b,
+															   HistoryRing::Direction dir,
+															   const HistoryRing::Bound *bound,
+															   std::size_t limit) const
+{
+	return _private.query(dir, bound, limit, privateKey(a, b));
+}
+
+std::size_t HistoryStore::bytes() const noexcept { return _allocated; }
+
+std::size_t HistoryStore::rings() const noexcept { return _channels.size() + (_private.capacity() > 0); }
+
+std::uint64_t HistoryStore::evictions() const noexcept { return _evictions; }
+
+/*
+** Wall-clock time in milliseconds, for server-time
+*/
+std::uint64_t HistoryStore::nowMs()
+{
+	return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+/*
+** IRCv3 server-time format: 2011-10-19T16:40:51.620Z
+*/
+std::string HistoryStore::formatTime(std::uint64_t timeMs)
+{
+	std::time_t seconds = static_cast<std::time_t>(timeMs / 1000);
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	char buffer[64];
+	std::snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm.tm_year + 1900, tm.tm_mon + 1,
+				  tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, static_cast<int>(timeMs % 1000));
+	return buffer;
+}
+
+bool HistoryStore::parseTime(std::string_view text, std::uint64_t &timeMs)
+{
+	std::string value(text);
+	struct tm tm{};
+	int millis = 0;
+	int consumed = 0;
+	if (std::sscanf(value.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+					&tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6)
+		return false;
+	const char *rest = value.c_str() + consumed;
+	if (*rest == '.')
+	{
+		int digits = 0;
+		for (++rest; *rest >= '0' && *rest <= '9'; ++rest, ++digits)
+			if (digits < 3)
+				millis = millis * 10 + (*rest - '0');
+		for (; digits < 3; ++digits)
+			millis *= 10;
+	}
+	if (*rest == 'Z')
+		++rest;
+	if (*rest != '\0')
+		return false;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	std::time_t seconds = timegm(&tm);
+	if (seconds < 0)
+		return false;
+	timeMs = static_cast<std::uint64_t>(seconds) * 1000 + static_cast<std::uint64_t>(millis);
+	return true;
+}
+
+/// Private ///
+
+/*
+** Private messages are keyed by the history ids of the two connections, in
+** a fixed order so that both directions of a conversation share the key
+*/
+std::string HistoryStore::privateKey(std::uint64_t a, std::uint64_t b)
+{
+	return std::to_string(std::min(a, b)) + " " + std::to_string(std::max(a, b));
+}
+
+void HistoryStore::touch(ChannelRing &entry)
+{
+	_lru.splice(_lru.begin(), _lru, entry.lru);
+}
+
+/*
+** Make room for bytes more under the global cap by dropping the least
+** recently used channel rings, never the one named keep
+*/
+bool HistoryStore::reserve(std::size_t bytes, const std::string *keep)
+{
+	while (_allocated + bytes > _totalBytes)
+	{
+		if (_lru.empty() || (keep && _lru.back() == *keep))
+			return false;
+		auto it = _channels.find(_lru.back());
+		_allocated -= it->second.ring.capacity();
+		_channels.erase(it);
+		_lru.pop_back();
+		++_evictions;
+	}
+	return true;
+}
+
+/*
+** Grow the ring while the line would otherwise overwrite older ones and the
+** cap allows it, then store the line
+*/
+void HistoryStore::append(HistoryRing &ring, const std::string *keep, std::uint64_t id, std::uint64_t timeMs,
+						  std::string_view key, std::string_view line)
+{
+	std::size_t length = key.size() + line.size();
+	while (ring.needsGrowth(length))
+	{
+		std::size_t capacity = std::max(ring.capacity() * 2, INITIAL_RING_BYTES);
+		while (capacity < length)
+			capacity *= 2;
+		capacity = std::min(capacity, ring.maxBytes());
+		if (capacity <= ring.capacity() || !reserve(capacity - ring.capacity(), keep))
+			break;
+		_allocated += capacity - ring.capacity();
+		ring.grow(capacity);
+	}
+	ring.append(id, timeMs, key, line);
+}
@@ -0,0 +1,993 @@
+#include "Server.hpp"
+#include "Logger.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+/*
+** Server links
+** Several ircserv processes form one network by linking into a tree. The
+** protocol is a simplified TS6: lines as clients send them, prefixed with
+** the server or nickname they come from.
+**   PASS <password>
+**   SERVER <name> 1 :<description>           handshake, each side then bursts
+**   :<uplink> SERVER <name> <hops> :<desc>   a server behind the link
+**   :<server> SQUIT <name> :<reason>         a server and all behind it left
+**   :<server> UID <nick> <hops> <ts> <user> <host> :<realname>
+**   :<nick> NICK <newnick> <ts>
+**   :<nick> QUIT :<reason>
+**   :<source> KILL <nick> <ts> :<reason>
+**   :<server> SJOIN <ts> <channel> <modes> [<key>] [<limit>] :[@]<nick> ...
+**   :<nick> PART, KICK, MODE, TOPIC, PRIVMSG, INVITE   as sent by clients
+** ts are the times nicknames were taken and channels created. On a nickname
+** collision the older nickname stays and the newer is killed (both if equal);
+** when two channels merge, the older one's modes and operators win.
+** Every line received is relayed to the other links, so it crosses the
+** tree once; PRIVMSG only goes towards servers with a recipient.
+** Remote users are Clients without a socket, in _clients under negative keys:
+** channels, nickname lookups, WHO and NAMES treat them as any other user.
+*/
+
+const Server::LinkCommand Server::LINK_COMMANDS[] = {
+	{ "PASS",		&Server::linkPASS },
+	{ "SERVER",		&Server::linkSERVER },
+	{ "SQUIT",		&Server::linkSQUIT },
+	{ "ERROR",		&Server::linkERROR },
+	{ "UID",		&Server::linkUID },
+	{ "NICK",		&Server::linkNICK },
+	{ "QUIT",		&Server::linkQUIT },
+	{ "KILL",		&Server::linkKILL },
+	{ "SJOIN",		&Server::linkSJOIN },
+	{ "PART",		&Server::linkPART },
+	{ "KICK",		&Server::linkKICK },
+	{ "MODE",		&Server::linkMODE },
+	{ "TOPIC",		&Server::linkTOPIC },
+	{ "PRIVMSG",	&Server::linkPRIVMSG },
+	{ "INVITE",		&Server::linkINVITE },
+};
+
+static const char LINK_DESCRIPTION[] = "ft_irc server";
+
+static std::time_t parseTs(std::string_view text)
+{
+	return static_cast<std::time_t>(std::strtoll(std::string(text).c_str(), nullptr, 10));
+}
+
+/*
+** Join a network of linked servers
+** serverName must be unique in the network; password is what linked servers
+** send with PASS. Each "host:port" of autoconnect is dialled at startup and
+** again whenever its link is lost. The hosts are resolved here, once, before
+** the event loop runs: a lookup in the loop would stall every client.
+*/
+void Server::enableLinks(const std::string &serverName, const std::string &password,
+						 const std::vector<std::string> &autoconnect)
+{
+	_serverName = serverName;
+	_linkPassword = password;
+	_autoconnect.clear();
+	for (const std::string &target : autoconnect)
+	{
+		LinkTarget resolved;
+		std::string error = resolveLinkTarget(target, 0, resolved);
+		if (!error.empty())
+			throw std::runtime_error("Invalid link target " + target + ": " + error);
+		_autoconnect.push_back(resolved);
+	}
+}
+
+/*
+** Resolve target ("host:port", "[v6]:port" for an IPv6 address) into resolved
+** flags are getaddrinfo()'s: AI_NUMERICHOST turns a hostname down instead of
+** looking it up. Returns an error message, empty on success.
+*/
+std::string Server::resolveLinkTarget(const std::string &target, int flags, LinkTarget &resolved)
+{
+	std::size_t colon = target.rfind(':');
+	if (colon == std::string::npos || colon == 0 || colon + 1 == target.size())
+		return "expected host:port";
+	std::string host = target.substr(0, colon);
+	if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+		host = host.substr(1, host.size() - 2);
+	struct addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = flags | AI_NUMERICSERV;
+	struct addrinfo *found = nullptr;
+	int rc = ::getaddrinfo(host.c_str(), target.c_str() + colon + 1, &hints, &found);
+	if (rc != 0)
+		return gai_strerror(rc);
+	resolved.target = target;
+	std::memcpy(&resolved.address, found->ai_addr, found->ai_addrlen);
+	resolved.addressLen = found->ai_addrlen;
+	::freeaddrinfo(found);
+	return "";
+}
+
+/*
+** Start linking to the server at target
+** The connect completes in the event loop (handleLinkWrite). With redial,
+** the link is dialled again whenever it is lost.
+*/
+void Server::connectLink(const LinkTarget &target, bool redial)
+{
+	const struct sockaddr *address = reinterpret_cast<const struct sockaddr *>(&target.address);
+	int fd = ::socket(address->sa_family, SOCK_STREAM, 0);
+	if (fd < 0 || ::fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+		|| (::connect(fd, address, target.addressLen) < 0 && errno != EINPROGRESS))
+	{
+		LOG_WARN("Link to %s failed: %s", target.target.c_str(), strerror(errno));
+		if (fd >= 0)
+			::close(fd);
+		return;
+	}
+
+	Link &link = _links[fd];
+	link.fd = fd;
+	link.target = target.target;
+	link.redial = redial;
+	link.connecting = true;
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	_fds.push_back(pfd);
+	LOG_INFO("Linking to %s", target.target.c_str());
+}
+
+/*
+** Turn the client connection fd, which just sent SERVER, into a link
+** Whatever it sent after SERVER is the start of its side of the link, and
+** what was queued for the client goes out on the link first
+*/
+void Server::adoptLink(int fd)
+{
+	auto it = _clients.find(fd);
+	Link &link = _links.at(fd);
+	link.readBuffer = std::move(it->second.getReadBuffer());
+	link.writeBuffer.insert(0, it->second.getWriteBuffer());
+	if (pollfd *pfd = link.writeBuffer.empty() ? nullptr : findPollFd(fd))
+		pfd->events |= POLLOUT;
+	_listings.erase(fd);
+	// The client may have output waiting for the flush phase
+	unmarkDirty(it->second);
+	_clients.erase(it);
+
+	std::size_t start = 0;
+	std::size_t pos;
+	while ((pos = link.readBuffer.find("\r\n", start)) != std::string::npos)
+	{
+		std::string line = link.readBuffer.substr(start, pos - start);
+		start = pos + 2;
+		processLinkLine(fd, line);
+		if (!_links.count(fd))
+			return;
+	}
+	link.readBuffer.erase(0, start);
+}
+
+/*
+** Send our half of the handshake
+*/
+void Server::startLink(Link &link)
+{
+	sendToLink(link, "PASS " + _linkPassword);
+	sendToLink(link, "SERVER " + _serverName + " 1 :" + LINK_DESCRIPTION);
+}
+
+/*
+** Tell a newly linked server everything known on this side of the link:
+** servers (nearest first, so each uplink is known before what is behind
+** it), users, then channels with their members and topics
+*/
+void Server::burstTo(Link &link)
+{
+	std::vector<std::pair<const std::string *, const PeerServer *>> servers;
+	for (const auto &pair : _peers)
+		if (pair.second.via != link.fd)
+			servers.emplace_back(&pair.first, &pair.second);
+	std::sort(servers.begin(), servers.end(),
+			  [](const auto &a, const auto &b) { return a.second->hops < b.second->hops; });
+	for (const auto &server : servers)
+		sendToLink(link, ":" + server.second->uplink + " SERVER " + *server.first + " "
+							 + std::to_string(server.second->hops + 1) + " :" + server.second->description);
+
+	std::size_t users = 0;
+	for (auto &pair : _clients)
+	{
+		Client &client = pair.second;
+		if (!client.isRegistered() || client.isDeparting() || (client.isRemote() && routeTo(client) == link.fd))
+			continue;
+		int hops = client.isRemote() ? _peers.at(client.getServer()).hops + 1 : 1;
+		sendToLink(link, userLine(client, hops));
+		++users;
+	}
+
+	for (auto &pair : _channels)
+	{
+		const Channel &chan = pair.second;
+		std::string members;
+		for (Client *member : chan.getMembers())
+		{
+			if (member->isDeparting() || (member->isRemote() && routeTo(*member) == link.fd))
+				continue;
+			if (!members.empty())
+				members += ' ';
+			if (chan.isOperator(member))
+				members += '@';
+			members += member->getNickname();
+			// Long member lists go out in several SJOINs
+			if (members.size() > 400)
+			{
+				sendToLink(link, sjoinLine(chan, members));
+				members.clear();
+			}
+		}
+		if (!members.empty())
+			sendToLink(link, sjoinLine(chan, members));
+		if (!chan.getTopic().empty())
+			sendToLink(link, ":" + _serverName + " TOPIC " + chan.getChannelName() + " :" + chan.getTopic());
+	}
+	LOG_INFO("Sent burst to %s: %zu servers, %zu users, %zu channels", link.name.c_str(), servers.size(), users,
+			 _channels.size());
+}
+
+/*
+** Close a link, removing every server and user behind it
+** The other links are told with SQUIT; a link this side dialled is
+** dialled again later
+*/
+void Server::dropLink(int fd, const std::string &reason)
+{
+	auto it = _links.find(fd);
+	if (it == _links.end())
+		return;
+	Link &link = it->second;
+	if (!link.connecting)
+	{
+		std::string error = "ERROR :Closing link: " + reason + "\r\n";
+		link.writeBuffer += error;
+		// Best effort: a link being dropped is not waited for
+		if (link.inbound)
+			_transport->send(fd, link.writeBuffer.data(), link.writeBuffer.size(), false);
+		else
+			::send(fd, link.writeBuffer.data(), link.writeBuffer.size(), 0);
+	}
+	std::string name = link.name;
+	bool inbound = link.inbound;
+	bool established = link.established;
+	bool redial = link.redial;
+	LOG_WARN("Link %s lost: %s", name.empty() ? link.target.c_str() : name.c_str(), reason.c_str());
+
+	if (inbound)
+		_transport->close(fd);
+	else
+		::close(fd);
+	_fds.erase(std::remove_if(_fds.begin(), _fds.end(), [fd](const pollfd &pfd) { return pfd.fd == fd; }),
+			   _fds.end());
+	_links.erase(it);
+	if (established)
+	{
+		removeServers(name, reason);
+		propagate(":" + _serverName + " SQUIT " + name + " :" + reason);
+	}
+	if (redial)
+		_nextLinkAttempt = _clock->now() + LINK_RETRY_SECONDS;
+}
+
+void Server::dropAllLinks(const std::string &reason)
+{
+	std::vector<int> fds;
+	for (const auto &pair : _links)
+		fds.push_back(pair.first);
+	for (int fd : fds)
+		dropLink(fd, reason);
+}
+
+/*
+** Forget server name and every server behind it, removing their users
+** Users quit with "<uplink> <server>", as in any netsplit
+*/
+void Server::removeServers(const std::string &name, const std::string &reason)
+{
+	auto top = _peers.find(name);
+	if (top == _peers.end())
+		return;
+	std::string quitReason = top->second.uplink + " " + name;
+	std::unordered_set<std::string> gone{name};
+	for (bool grew = true; grew;)
+	{
+		grew = false;
+		for (const auto &pair : _peers)
+			if (!gone.count(pair.first) && gone.count(pair.second.uplink))
+				grew = gone.insert(pair.first).second;
+	}
+	for (const std::string &server : gone)
+		_peers.erase(server);
+
+	std::size_t users = 0;
+	for (auto &pair : _clients)
+		if (pair.second.isRemote() && gone.count(pair.second.getServer()))
+		{
+			disconnectClient(pair.first, quitReason);
+			++users;
+		}
+	LOG_INFO("Netsplit %s: %zu servers and %zu users gone (%s)", quitReason.c_str(), gone.size(), users,
+			 reason.c_str());
+}
+
+/*
+** Dial the autoconnect targets that have no link, every LINK_RETRY_SECONDS
+*/
+void Server::tickLinks()
+{
+	if (_autoconnect.empty() || _clock->now() < _nextLinkAttempt)
+		return;
+	_nextLinkAttempt = _clock->now() + LINK_RETRY_SECONDS;
+	for (const LinkTarget &target : _autoconnect)
+	{
+		bool linked = false;
+		for (const auto &pair : _links)
+			linked = linked || (pair.second.redial && pair.second.target == target.target);
+		if (!linked)
+			connectLink(target, true);
+	}
+}
+
+/*
+** Milliseconds poll() may sleep before tickLinks() has to dial, -1 if never
+*/
+int Server::msUntilLinkAttempt() const
+{
+	std::size_t dialled = 0;
+	for (const auto &pair : _links)
+		dialled += pair.second.redial;
+	if (dialled >= _autoconnect.size())
+		return -1;
+	std::time_t wait = _nextLinkAttempt - _clock->now();
+	return wait > 0 ? static_cast<int>(wait * 1000) : 0;
+}
+
+/*
+** Read from a link and process every complete line
+*/
+void Server::handleLinkRead(std::size_t index)
+{
+	int fd = _fds[index].fd;
+	char buffer[BUFFER_SIZE * 16];
+	bool inbound = _links.at(fd).inbound;
+
+	while (true)
+	{
+		ssize_t bytes = inbound ? _transport->recv(fd, buffer, sizeof(buffer)) : ::recv(fd, buffer, sizeof(buffer), 0);
+		if (bytes == 0)
+		{
+			dropLink(fd, "Connection closed");
+			return;
+		}
+		if (bytes < 0)
+		{
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return;
+			dropLink(fd, std::string("Read error: ") + strerror(errno));
+			return;
+		}
+		std::string &readBuffer = _links.at(fd).readBuffer;
+		readBuffer.append(buffer, static_cast<std::size_t>(bytes));
+		std::size_t start = 0;
+		std::size_t pos;
+		while ((pos = readBuffer.find("\r\n", start)) != std::string::npos)
+		{
+			std::string line = readBuffer.substr(start, pos - start);
+			start = pos + 2;
+			processLinkLine(fd, line);
+			if (!_links.count(fd))
+				return;
+		}
+		readBuffer.erase(0, start);
+	}
+}
+
+/*
+** Finish connecting, or send what is queued for a link
+*/
+void Server::handleLinkWrite(std::size_t index)
+{
+	int fd = _fds[index].fd;
+	Link &link = _links.at(fd);
+	if (link.connecting)
+	{
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+			error = errno;
+		if (error != 0)
+		{
+			dropLink(fd, std::string("Connect failed: ") + strerror(error));
+			return;
+		}
+		link.connecting = false;
+		_fds[index].events = POLLIN;
+		startLink(link);
+	}
+	while (!link.writeBuffer.empty())
+	{
+		ssize_t sent = link.inbound ? _transport->send(fd, link.writeBuffer.data(), link.writeBuffer.size(), false)
+									: ::send(fd, link.writeBuffer.data(), link.writeBuffer.size(), 0);
+		if (sent < 0)
+		{
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				break;
+			dropLink(fd, std::string("Write error: ") + strerror(errno));
+			return;
+		}
+		link.writeBuffer.erase(0, static_cast<std::size_t>(sent));
+	}
+	if (link.writeBuffer.empty())
+		_fds[index].events &= ~POLLOUT;
+}
+
+/*
+** Dispatch a line received from a link
+** Until the handshake is done only PASS, SERVER and ERROR are accepted
+*/
+void Server::processLinkLine(int fd, std::string_view line)
+{
+	Link &link = _links.at(fd);
+	ParsedCommand cmd = parseCommand(line);
+	if (cmd.command.empty())
+		return;
+	std::string_view source = cmd.prefix.empty() ? std::string_view(link.name) : cmd.prefix;
+	for (const LinkCommand &entry : LINK_COMMANDS)
+	{
+		if (cmd.command != entry.name)
+			continue;
+		if (!link.established && entry.handler != &Server::linkPASS && entry.handler != &Server::linkSERVER
+			&& entry.handler != &Server::linkERROR)
+		{
+			dropLink(fd, "Not registered");
+			return;
+		}
+		(this->*entry.handler)(link, source, cmd.params);
+		return;
+	}
+	LOG_DEBUG("Unknown command from link %s: %.*s", link.name.c_str(), static_cast<int>(line.size()), line.data());
+}
+
+/*
+** Queue a line for a link
+*/
+void Server::sendToLink(Link &link, const std::string &line)
+{
+	link.writeBuffer += line;
+	link.writeBuffer += "\r\n";
+	if (pollfd *pfd = findPollFd(link.fd))
+		pfd->events |= POLLOUT;
+}
+
+/*
+** Send a line to every linked server except the one on exceptFd
+*/
+void Server::propagate(const std::string &line, int exceptFd)
+{
+	for (auto &pair : _links)
+		if (pair.first != exceptFd && pair.second.established)
+			sendToLink(pair.second, line);
+}
+
+/*
+** Send a line to the links leading to members of channel
+*/
+void Server::propagateToChannel(const Channel &channel, const std::string &line, int exceptFd)
+{
+	std::unordered_set<int> vias;
+	for (const Client *member : channel.getMembers())
+		if (member->isRemote())
+			vias.insert(routeTo(*member));
+	for (int via : vias)
+	{
+		auto it = _links.find(via);
+		if (via != exceptFd && it != _links.end() && it->second.established)
+			sendToLink(it->second, line);
+	}
+}
+
+/*
+** Tell the network that a local client joined channel
+*/
+void Server::propagateJoin(const Channel &channel, Client &client)
+{
+	if (_links.empty())
+		return;
+	propagate(sjoinLine(channel, (channel.isOperator(&client) ? "@" : "") + client.getNickname()));
+}
+
+/*
+** UID line introducing client, hops servers away from the receiver
+*/
+std::string Server::userLine(Client &client, int hops)
+{
+	return ":" + (client.isRemote() ? client.getServer() : _serverName) + " UID " + client.getNickname() + " "
+		   + std::to_string(hops) + " " + std::to_string(client.getNickTime()) + " " + client.getUsername() + " "
+		   + getClientHost(client.getFd()) + " :" + client.getFullname();
+}
+
+/*
+** SJOIN line carrying channel's creation time and modes, and members
+*/
+std::string Server::sjoinLine(const Channel &channel, const std::string &members) const
+{
+	std::string line = ":" + _serverName + " SJOIN " + std::to_string(channel.getCreationTime()) + " "
+					   + channel.getChannelName() + " " + channel.getModeString();
+	if (channel.PasswordRequired())
+		line += " " + channel.getPassword();
+	if (channel.UserlimitSet())
+		line += " " + std::to_string(channel.getUserLimit());
+	return line + " :" + members;
+}
+
+/*
+** nick!~user@host prefix of a user, for lines sent to local clients
+*/
+std::string Server::userPrefix(const Client &client)
+{
+	return ":" + client.getNickname() + "!~" + client.getUsername() + "@" + getClientHost(client.getFd());
+}
+
+/*
+** fd of the link leading to a remote user, -1 if its server is unknown
+*/
+int Server::routeTo(const Client &client) const
+{
+	auto it = _peers.find(client.getServer());
+	return it == _peers.end() ? -1 : it->second.via;
+}
+
+/*
+** The remote user nick, if lines from it may come over link
+*/
+Client *Server::linkSource(const Link &link, std::string_view nick)
+{
+	Client *client = findClientByNick(nick);
+	if (!client || !client->isRemote() || routeTo(*client) != link.fd)
+		return nullptr;
+	return client;
+}
+
+/*
+** Settle a collision between the user holding a nickname and one taking it
+** over link at time ts. The newer one is killed, both if equally old.
+** Returns whether the incoming user keeps the nickname.
+*/
+bool Server::keepsNick(Client &existing, std::time_t ts, Link &link)
+{
+	std::string nick = existing.getNickname();
+	std::time_t held = existing.getNickTime();
+	LOG_WARN("Nick collision on %s (%lld here, %lld from %s)", nick.c_str(), static_cast<long long>(held),
+			 static_cast<long long>(ts), link.name.c_str());
+	if (held <= ts)
+		sendToLink(link, ":" + _serverName + " KILL " + nick + " " + std::to_string(ts) + " :Nick collision");
+	if (held >= ts)
+	{
+		propagate(":" + _serverName + " KILL " + nick + " " + std::to_string(held) + " :Nick collision");
+		disconnectClient(existing.getFd(), "Nick collision", false);
+	}
+	return held > ts;
+}
+
+/// Link commands ///
+
+void Server::linkPASS(Link &link, std::string_view, const std::vector<std::string_view> &params)
+{
+	link.passwordOk = !params.empty() && !_linkPassword.empty() && params[0] == _linkPassword;
+}
+
+/*
+** SERVER <name> <hops> :<description>
+** Completes the handshake on a new link, or introduces a server behind an
+** established one. A name already in the network would make a loop: the
+** link is dropped.
+*/
+void Server::linkSERVER(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	if (params.size() < 3)
+		return;
+	std::string name(params[0]);
+	int hops = std::atoi(std::string(params[1]).c_str());
+	std::string description(params[2]);
+	if (name == _serverName || _peers.count(name))
+	{
+		dropLink(link.fd, "Server " + name + " already exists");
+		return;
+	}
+	if (link.established)
+	{
+		std::string uplink(source);
+		if (uplink != link.name && (!_peers.count(uplink) || _peers.at(uplink).via != link.fd))
+			return;
+		_peers[name] = PeerServer{description, uplink, hops, link.fd};
+		propagate(":" + uplink + " SERVER " + name + " " + std::to_string(hops + 1) + " :" + description, link.fd);
+		return;
+	}
+	if (!link.passwordOk)
+	{
+		dropLink(link.fd, "Bad link password");
+		return;
+	}
+	link.established = true;
+	link.name = name;
+	link.description = description;
+	_peers[name] = PeerServer{description, _serverName, 1, link.fd};
+	LOG_INFO("Linked with %s (%s)", name.c_str(), link.target.empty() ? "incoming" : link.target.c_str());
+	// The side that was dialled answers the handshake
+	if (link.target.empty())
+		startLink(link);
+	propagate(":" + _serverName + " SERVER " + name + " 2 :" + description, link.fd);
+	burstTo(link);
+}
+
+/*
+** SQUIT <server> :<reason>
+*/
+void Server::linkSQUIT(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	if (params.empty())
+		return;
+	std::string name(params[0]);
+	std::string reason = params.size() > 1 ? std::string(params[1]) : std::string(source);
+	if (name == _serverName || name == link.name)
+	{
+		dropLink(link.fd, reason);
+		return;
+	}
+	auto it = _peers.find(name);
+	if (it == _peers.end() || it->second.via != link.fd)
+		return;
+	removeServers(name, reason);
+	propagate(":" + std::string(source) + " SQUIT " + name + " :" + reason, link.fd);
+}
+
+void Server::linkERROR(Link &link, std::string_view, const std::vector<std::string_view> &params)
+{
+	dropLink(link.fd, "ERROR from peer: " + (params.empty() ? std::string() : std::string(params[0])));
+}
+
+/*
+** UID <nick> <hops> <ts> <user> <host> :<realname>
+*/
+void Server::linkUID(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	if (params.size() < 6)
+		return;
+	std::string server(source);
+	auto peer = _peers.find(server);
+	if (peer == _peers.end() || peer->second.via != link.fd)
+		return;
+	std::string nick(params[0]);
+	std::time_t ts = parseTs(params[2]);
+	Client *existing = findClientByNick(nick);
+	if (existing && !keepsNick(*existing, ts, link))
+		return;
+
+	int id = _nextRemoteId--;
+	Client remote(id);
+	remote.setNickname(nick);
+	remote.setUsername(std::string(params[3]));
+	remote.setHost(std::string(params[4]));
+	remote.setFullname(std::string(params[5]));
+	remote.setServer(server);
+	remote.setNickTime(ts);
+	remote.setHasPassword(true);
+	remote.setIsRegistered(true);
+	Client &stored = _clients.emplace(id, std::move(remote)).first->second;
+	indexNick(stored);
+	propagate(":" + server + " UID " + nick + " " + std::to_string(std::atoi(std::string(params[1]).c_str()) + 1)
+				  + " " + std::to_string(ts) + " " + stored.getUsername() + " " + stored.getHost() + " :"
+				  + stored.getFullname(),
+			  link.fd);
+}
+
+/*
+** :<nick> NICK <newnick> <ts>
+*/
+void Server::linkNICK(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	Client *client = linkSource(link, source);
+	if (!client || params.size() < 2)
+		return;
+	std::string newNick(params[0]);
+	std::time_t ts = parseTs(params[1]);
+	Client *holder = findClientByNick(newNick);
+	if (holder && holder != client && !keepsNick(*holder, ts, link))
+	{
+		// Known elsewhere under its old nickname
+		propagate(":" + _serverName + " KILL " + client->getNickname() + " " + std::to_string(client->getNickTime())
+					  + " :Nick collision",
+				  link.fd);
+		disconnectClient(client->getFd(), "Nick collision", false);
+		return;
+	}
+	std::string oldNick = client->getNickname();
+	unindexNick(*client);
+	client->setNickname(newNick);
+	client->setNickTime(ts);
+	indexNick(*client);
+	announceNick(*client, oldNick);
+	propagate(":" + oldNick + " NICK " + newNick + " " + std::to_string(ts), link.fd);
+}
+
+/*
+** :<nick> QUIT :<reason>
+*/
+void Server::linkQUIT(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	Client *client = linkSource(link, source);
+	if (!client)
+		return;
+	std::string reason = params.empty() ? std::string() : std::string(params[0]);
+	propagate(":" + client->getNickname() + " QUIT :" + reason, link.fd);
+	disconnectClient(client->getFd(), reason);
+}
+
+/*
+** :<source> KILL <nick> <ts> :<reason>
+** Only removes the user if it took the nickname at ts: after a collision
+** the nickname may already belong to the user that won it
+*/
+void Server::linkKILL(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	if (params.size() < 2)
+		return;
+	Client *target = findClientByNick(params[0]);
+	if (!target || target->getNickTime() != parseTs(params[1]))
+		return;
+	std::string reason = params.size() > 2 ? std::string(params[2]) : std::string("Killed");
+	propagate(":" + std::string(source) + " KILL " + target->getNickname() + " " + std::string(params[1]) + " :"
+				  + reason,
+			  link.fd);
+	if (!target->isRemote())
+		sendTo(*target, ":" + std::string(source) + " KILL " + target->getNickname() + " :" + reason + "\r\n");
+	disconnectClient(target->getFd(), "Killed (" + std::string(source) + " (" + reason + "))", false);
+}
+
+/*
+** :<server> SJOIN <ts> <channel> <modes> [<key>] [<limit>] :[@]<nick> ...
+** Creates the channel if needed. If theirs is older, ours takes their
+** creation time and modes and loses its operators; if ours is older, their
+** modes and operator flags are ignored; if equally old, modes are merged.
+*/
+void Server::linkSJOIN(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	if (params.size() < 4 || params[1].empty() || params[1][0] != '#')
+		return;
+	std::time_t ts = parseTs(params[0]);
+	std::vector<std::string_view> modes(params.begin() + 2, params.end() - 1);
+
+	Channel *chan = findChannel(params[1]);
+	bool created = !chan;
+	if (created)
+	{
+		chan = addChannel(Channel(std::string(params[1])));
+		chan->setCreationTime(ts);
+	}
+	const std::string &name = chan->getChannelName();
+	std::string before = chan->getModeString();
+	bool theirModes = ts <= chan->getCreationTime();
+	if (ts < chan->getCreationTime())
+	{
+		chan->setCreationTime(ts);
+		chan->unsetInviteOnly();
+		chan->unsetTopicProtection();
+		chan->unsetPassword();
+		chan->unsetUserlimit();
+		for (Client *member : chan->getMembers())
+			if (chan->isOperator(member))
+			{
+				chan->removeOperator(member->getNickname());
+				sendToChannel(*chan, ":" + _serverName + " MODE " + name + " -o " + member->getNickname() + "\r\n",
+							  nullptr);
+			}
+	}
+	if (theirModes && !modes.empty() && modes[0].find('k') != std::string_view::npos)
+		chan->unsetPassword();
+	if (theirModes && !modes.empty() && modes[0] != "+")
+	{
+		try
+		{
+			chan->setMode(modes);
+		}
+		catch (errs &)
+		{
+		}
+	}
+	if (!created && chan->getModeString() != before)
+		sendToChannel(*chan, ":" + _serverName + " MODE " + name + " " + chan->getModeString() + "\r\n", nullptr);
+
+	std::string accepted;
+	std::string_view members = params.back();
+	while (!members.empty())
+	{
+		std::size_t space = members.find(' ');
+		std::string_view token = members.substr(0, space);
+		members.remove_prefix(space == std::string_view::npos ? members.size() : space + 1);
+		bool op = !token.empty() && token[0] == '@';
+		if (op)
+			token.remove_prefix(1);
+		Client *member = linkSource(link, token);
+		if (!member)
+			continue;
+		if (!chan->isMember(member))
+		{
+			chan->addClient(member);
+			sendToChannel(*chan, userPrefix(*member) + " JOIN " + name + "\r\n", nullptr);
+		}
+		if (op && theirModes && !chan->isOperator(member))
+		{
+			chan->addOperator(member->getNickname());
+			sendToChannel(*chan, ":" + std::string(source) + " MODE " + name + " +o " + member->getNickname() + "\r\n",
+						  nullptr);
+		}
+		if (!accepted.empty())
+			accepted += ' ';
+		accepted += (chan->isOperator(member) ? "@" : "") + member->getNickname();
+	}
+	if (chan->isEmpty())
+	{
+		removeChannel(name);
+		return;
+	}
+	if (created || chan->getModeString() != before)
+		persistChannel(*chan);
+	if (!accepted.empty())
+		propagate(sjoinLine(*chan, accepted), link.fd);
+}
+
+/*
+** :<nick> PART <channel> [:<reason>]
+*/
+void Server::linkPART(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	Client *client = linkSource(link, source);
+	Channel *chan = params.empty() ? nullptr : findChannel(params[0]);
+	if (!client || !chan || !chan->isMember(client))
+		return;
+	std::string name = chan->getChannelName();
+	std::string reason = params.size() > 1 ? " :" + std::string(params[1]) : "";
+	sendToChannel(*chan, userPrefix(*client) + " PART " + name + reason + "\r\n", nullptr);
+	chan->removeClient(client);
+	propagate(":" + client->getNickname() + " PART " + name + reason, link.fd);
+	if (chan->isEmpty())
+		removeChannel(name);
+}
+
+/*
+** :<source> KICK <channel> <nick> :<comment>
+*/
+void Server::linkKICK(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	Channel *chan = params.size() < 2 ? nullptr : findChannel(params[0]);
+	Client *target = chan ? findClientByNick(params[1]) : nullptr;
+	if (!target || !chan->isMember(target))
+		return;
+	Client *kicker = findClientByNick(source);
+	std::string prefix = kicker ? userPrefix(*kicker) : ":" + std::string(source);
+	std::string name = chan->getChannelName();
+	std::string comment = params.size() > 2 ? std::string(params[2]) : target->getNickname();
+	sendToChannel(*chan, prefix + " KICK " + name + " " + target->getNickname() + " :" + comment + "\r\n", nullptr);
+	chan->removeClient(target);
+	propagate(":" + std::string(source) + " KICK " + name + " " + target->getNickname() + " :" + comment, link.fd);
+	if (chan->isEmpty())
+		removeChannel(name);
+}
+
+/*
+** :<source> MODE <channel> <modes> [<params>]
+** Checked by the server of the user who sent it, so applied as is
+*/
+void Server::linkMODE(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	Channel *chan = params.size() < 2 ? nullptr : findChannel(params[0]);
+	if (!chan)
+		return;
+	std::vector<std::string_view> modes(params.begin() + 1, params.end());
+	try
+	{
+		chan->setMode(modes);
+	}
+	catch (errs &)
+	{
+		return;
+	}
+	persistChannel(*chan);
+	std::string change = " MODE " + chan->getChannelName();
+	for (std::string_view mode : modes)
+		change += " " + std::string(mode);
+	Client *setter = findClientByNick(source);
+	sendToChannel(*chan, (setter ? userPrefix(*setter) : ":" + std::string(source)) + change + "\r\n", nullptr);
+	propagate(":" + std::string(source) + change, link.fd);
+}
+
+/*
+** :<source> TOPIC <channel> :<topic>
+*/
+void Server::linkTOPIC(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	Channel *chan = params.size() < 2 ? nullptr : findChannel(params[0]);
+	if (!chan || chan->getTopic() == params[1])
+		return;
+	chan->setTopic(std::string(params[1]));
+	persistChannel(*chan);
+	std::string change = " TOPIC " + chan->getChannelName() + " :" + chan->getTopic();
+	Client *setter = findClientByNick(source);
+	sendToChannel(*chan, (setter ? userPrefix(*setter) : ":" + std::string(source)) + change + "\r\n", nullptr);
+	propagate(":" + std::string(source) + change, link.fd);
+}
+
+/*
+** :<nick> PRIVMSG <target> :<text>
+** Delivered to local recipients and recorded in the history, then passed
+** on towards the servers of the other recipients
+*/
+void Server::linkPRIVMSG(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	Client *client = linkSource(link, source);
+	if (!client || params.size() < 2)
+		return;
+	std::string text(params[1]);
+	if (!params[0].empty() && params[0][0] == '#')
+	{
+		Channel *chan = findChannel(params[0]);
+		if (!chan)
+			return;
+		const std::string &name = chan->getChannelName();
+		std::string line = userPrefix(*client) + " PRIVMSG " + name + " :" + text;
+		OutgoingMessage message(line + "\r\n", 0, _history.nextId());
+		sendToChannel(*chan, message, nullptr);
+		_history.recordChannel(name, message.id(), message.timeMs(), line);
+		propagateToChannel(*chan, ":" + client->getNickname() + " PRIVMSG " + name + " :" + text, link.fd);
+		return;
+	}
+	Client *target = findClientByNick(params[0]);
+	if (!target)
+		return;
+	if (target->isRemote())
+	{
+		auto via = _links.find(routeTo(*target));
+		if (via != _links.end() && via->first != link.fd)
+			sendToLink(via->second, ":" + client->getNickname() + " PRIVMSG " + target->getNickname() + " :" + text);
+		return;
+	}
+	std::string line = userPrefix(*client) + " PRIVMSG " + target->getNickname() + " :" + text;
+	OutgoingMessage message(line + "\r\n", 0, _history.nextId());
+	sendTo(*target, message);
+	_history.recordPrivate(historyId(*client), historyId(*target), message.id(), message.timeMs(), line);
+}
+
+/*
+** :<nick> INVITE <nick> <channel>
+** Recorded where the invited user is, since its JOIN is checked there
+*/
+void Server::linkINVITE(Link &link, std::string_view source, const std::vector<std::string_view> &params)
+{
+	Client *client = linkSource(link, source);
+	Client *target = params.size() < 2 ? nullptr : findClientByNick(params[0]);
+	Channel *chan = target ? findChannel(params[1]) : nullptr;
+	if (!client || !chan)
+		return;
+	if (target->isRemote())
+	{
+		auto via = _links.find(routeTo(*target));
+		if (via != _links.end() && via->first != link.fd)
+			sendToLink(via->second, ":" + client->getNickname() + " INVITE " + target->getNickname() + " "
+										+ chan->getChannelName());
+		return;
+	}
+	invite(*chan, *target);
+	sendTo(*target, userPrefix(*client) + " INVITE " + target->getNickname() + " :" + chan->getChannelName() + "\r\n");
+}
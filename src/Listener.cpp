@@ -0,0 +1,218 @@
+#include "Server.hpp"
+#include "Logger.hpp"
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <sstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+/*
+** Parse a listener: an address, then options separated by spaces
+**   6667 or *:6667			every address, IPv4 and IPv6 (dual-stack)
+**   127.0.0.1:6667			one IPv4 address (0.0.0.0 for all)
+**   [::1]:6667				one IPv6 address ([::] for all), IPv6 only
+**   unix:/run/ircserv.sock	a unix socket, for bouncers on the same host
+** Options: backlog=N, class=NAME (the connection class of its clients), tls
+*/
+Server::Listener Server::parseListener(const std::string &spec)
+{
+	std::istringstream words(spec);
+	Listener listener;
+	if (!(words >> listener.address))
+		throw std::runtime_error("Empty listener");
+	if (listener.address.find(':') == std::string::npos)
+		listener.address = "*:" + listener.address;
+
+	std::string option;
+	while (words >> option)
+	{
+		if (option.compare(0, 8, "backlog=") == 0)
+		{
+			char *end;
+			long backlog = std::strtol(option.c_str() + 8, &end, 10);
+			if (*end || end == option.c_str() + 8 || backlog < 1 || backlog > 65535)
+				throw std::runtime_error("Invalid backlog for listener " + listener.address + ": " + option);
+			listener.backlog = static_cast<int>(backlog);
+		}
+		else if (option.compare(0, 6, "class=") == 0 && option.size() > 6)
+			listener.connClass = option.substr(6);
+		else if (option == "tls")
+			listener.tls = true;
+		else
+			throw std::runtime_error("Unknown option for listener " + listener.address + ": " + option);
+	}
+	return listener;
+}
+
+/*
+** Listen on an address given as for parseListener()
+*/
+void Server::addListener(const std::string &spec)
+{
+	startListener(parseListener(spec));
+}
+
+/*
+** Listen on listener.address and serve it from the event loop
+** A listener inherited through a hot restart keeps its socket and takes the
+** new backlog, class and TLS setting
+*/
+void Server::startListener(const Listener &listener)
+{
+	if (listener.tls && !_tls.enabled())
+		throw std::runtime_error("Listener " + listener.address + " needs a TLS certificate (IRCSERV_TLS_CERT)");
+	for (Listener &open : _listeners)
+	{
+		if (open.address != listener.address)
+			continue;
+		if (::listen(open.fd, listener.backlog) < 0)
+			LOG_WARN("Cannot change backlog of %s: %s", open.address.c_str(), strerror(errno));
+		open.backlog = listener.backlog;
+		open.connClass = listener.connClass;
+		open.tls = listener.tls;
+		// Also given on the command line or in the environment: stays open
+		open.configured = open.configured && listener.configured;
+		return;
+	}
+
+	Listener added = listener;
+	added.fd = openListener(added);
+	added.accepted = 0;
+	_listeners.push_back(added);
+
+	pollfd listenPollFd;
+	listenPollFd.fd = added.fd;
+	listenPollFd.events = POLLIN;
+	listenPollFd.revents = 0;
+	_fds.push_back(listenPollFd);
+	LOG_INFO("Listening on %s (class %s, backlog %d%s)", added.address.c_str(), added.connClass.c_str(),
+			 added.backlog, added.tls ? ", TLS" : "");
+}
+
+/*
+** Bind a non-blocking listening socket of the given family
+*/
+static int bindListener(int family, const struct sockaddr *addr, socklen_t addrLen, bool v6Only,
+						const std::string &address, int backlog)
+{
+	int fd = ::socket(family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	try
+	{
+		if (::fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+			throw std::runtime_error("Set non-blocking mode failed: " + std::string(strerror(errno)));
+		int opt = 1;
+		if (family != AF_UNIX && ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+			throw std::runtime_error("Set socket options failed: " + std::string(strerror(errno)));
+		opt = v6Only;
+		if (family == AF_INET6 && ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) < 0)
+			throw std::runtime_error("Set socket options failed: " + std::string(strerror(errno)));
+		if (::bind(fd, addr, addrLen) < 0)
+			throw std::runtime_error("Bind failed on " + address + ": " + strerror(errno));
+		if (::listen(fd, backlog) < 0)
+			throw std::runtime_error("Listen failed on " + address + ": " + strerror(errno));
+	}
+	catch (...)
+	{
+		::close(fd);
+		throw;
+	}
+	return fd;
+}
+
+/*
+** Open the socket of a listener
+** *:port takes IPv6 with IPv4-mapped addresses, or plain IPv4 where the
+** host has no IPv6
+*/
+int Server::openListener(const Listener &listener)
+{
+	const std::string &address = listener.address;
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+		std::string path = address.substr(5);
+		struct sockaddr_un addr = unixAddress(path);
+		::unlink(path.c_str());
+		int fd = bindListener(AF_UNIX, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr), false, address,
+							  listener.backlog);
+		if (fd < 0)
+			throw std::runtime_error("Socket creation failed: " + std::string(strerror(errno)));
+		return fd;
+	}
+
+	std::size_t colon = address.rfind(':');
+	std::string host = address.substr(0, colon);
+	char *end;
+	long port = std::strtol(address.c_str() + colon + 1, &end, 10);
+	if (*end || end == address.c_str() + colon + 1 || port < 0 || port > 65535)
+		throw std::runtime_error("Invalid listen address: " + address);
+
+	struct sockaddr_in6 addr6{};
+	addr6.sin6_family = AF_INET6;
+	addr6.sin6_port = htons(static_cast<std::uint16_t>(port));
+	struct sockaddr_in addr4{};
+	addr4.sin_family = AF_INET;
+	addr4.sin_port = htons(static_cast<std::uint16_t>(port));
+
+	int fd;
+	if (host == "*")
+	{
+		addr6.sin6_addr = in6addr_any;
+		fd = bindListener(AF_INET6, reinterpret_cast<struct sockaddr *>(&addr6), sizeof(addr6), false, address,
+						  listener.backlog);
+		if (fd < 0 && errno == EAFNOSUPPORT)
+		{
+			addr4.sin_addr.s_addr = INADDR_ANY;
+			fd = bindListener(AF_INET, reinterpret_cast<struct sockaddr *>(&addr4), sizeof(addr4), false, address,
+							  listener.backlog);
+		}
+	}
+	else if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+	{
+		if (::inet_pton(AF_INET6, host.substr(1, host.size() - 2).c_str(), &addr6.sin6_addr) != 1)
+			throw std::runtime_error("Invalid listen address: " + address);
+		fd = bindListener(AF_INET6, reinterpret_cast<struct sockaddr *>(&addr6), sizeof(addr6), true, address,
+						  listener.backlog);
+	}
+	else
+	{
+		if (::inet_pton(AF_INET, host.c_str(), &addr4.sin_addr) != 1)
+			throw std::runtime_error("Invalid listen address: " + address);
+		fd = bindListener(AF_INET, reinterpret_cast<struct sockaddr *>(&addr4), sizeof(addr4), false, address,
+						  listener.backlog);
+	}
+	if (fd < 0)
+		throw std::runtime_error("Socket creation failed: " + std::string(strerror(errno)));
+	return fd;
+}
+
+/*
+** The listener serving fd, if fd is a listening socket
+*/
+Server::Listener *Server::findListener(int fd)
+{
+	for (Listener &listener : _listeners)
+	{
+		if (listener.fd == fd)
+			return &listener;
+	}
+	return nullptr;
+}
+
+/*
+** Close every listener; unix socket files are removed unless a successor
+** took the sockets over
+*/
+void Server::closeListeners(bool removeFiles)
+{
+	for (const Listener &listener : _listeners)
+	{
+		::close(listener.fd);
+		if (removeFiles && listener.address.compare(0, 5, "unix:") == 0)
+			::unlink(listener.address.c_str() + 5);
+	}
+	_listeners.clear();
+}
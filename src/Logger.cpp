@@ -0,0 +1,199 @@
+#include "Logger.hpp"
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <stdexcept>
+
+/// Constructor ///
+Logger::Logger()
+{
+	for (std::size_t i = 0; i < RING_SIZE; ++i)
+		_ring[i].seq.store(i, std::memory_order_relaxed);
+}
+
+/// Destructor ///
+Logger::~Logger()
+{
+	stop();
+}
+
+Logger &Logger::instance()
+{
+	static Logger logger;
+	return logger;
+}
+
+/*
+** Start the drain thread
+** An empty path means stdout, anything else is opened for appending
+*/
+void Logger::start(const std::string &path)
+{
+	if (_running.load())
+		return;
+	if (path.empty())
+		_out = stdout;
+	else
+	{
+		_out = std::fopen(path.c_str(), "a");
+		if (!_out)
+			throw std::runtime_error("Cannot open log file " + path + ": " + std::string(strerror(errno)));
+	}
+	_running.store(true);
+	_thread = std::thread(&Logger::drain, this);
+}
+
+/*
+** Stop the drain thread
+** Everything already in the ring is written before the thread exits
+*/
+void Logger::stop()
+{
+	if (!_running.exchange(false))
+		return;
+	_wake.notify_one();
+	if (_thread.joinable())
+		_thread.join();
+	if (_out && _out != stdout)
+		std::fclose(_out);
+	_out = nullptr;
+}
+
+void Logger::setLevel(LogLevel level) noexcept { _level.store(static_cast<int>(level), std::memory_order_relaxed); }
+
+bool Logger::enabled(LogLevel level) const noexcept
+{
+	return static_cast<int>(level) >= _level.load(std::memory_order_relaxed);
+}
+
+std::uint64_t Logger::dropped() const noexcept { return _dropped.load(std::memory_order_relaxed); }
+
+bool Logger::parseLevel(const std::string &name, LogLevel &levelOut)
+{
+	if (name == "debug")
+		levelOut = LogLevel::Debug;
+	else if (name == "info")
+		levelOut = LogLevel::Info;
+	else if (name == "warn")
+		levelOut = LogLevel::Warn;
+	else if (name == "error")
+		levelOut = LogLevel::Error;
+	else
+		return false;
+	return true;
+}
+
+/*
+** Queue a record
+** Claims a slot with a single CAS, formats into it and publishes it.
+** Never blocks: a full ring only bumps the drop counter.
+*/
+void Logger::log(LogLevel level, const char *fmt, ...)
+{
+	if (!enabled(level))
+		return;
+
+	std::size_t pos = _head.load(std::memory_order_relaxed);
+	Slot *slot;
+	while (true)
+	{
+		slot = &_ring[pos & (RING_SIZE - 1)];
+		std::size_t seq = slot->seq.load(std::memory_order_acquire);
+		std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+		if (diff == 0)
+		{
+			if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else
+			pos = _head.load(std::memory_order_relaxed);
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	slot->timeNs = static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	slot->level = level;
+
+	va_list args;
+	va_start(args, fmt);
+	int n = std::vsnprintf(slot->text, LINE_SIZE, fmt, args);
+	va_end(args);
+	if (n < 0)
+		n = 0;
+	slot->len = std::min(static_cast<std::size_t>(n), LINE_SIZE - 1);
+
+	slot->seq.store(pos + 1, std::memory_order_release);
+	if (_sleeping.load(std::memory_order_relaxed))
+		_wake.notify_one();
+}
+
+/*
+** Drain thread body
+** Writes records as they appear and flushes only once the ring is empty,
+** then sleeps until a producer wakes it (or a short timeout elapses)
+*/
+void Logger::drain()
+{
+	std::uint64_t reportedDrops = 0;
+	while (true)
+	{
+		bool wrote = false;
+		while (writeOne())
+			wrote = true;
+		std::uint64_t drops = dropped();
+		if (drops != reportedDrops)
+		{
+			std::fprintf(_out, "WARN  logger dropped %llu records (ring full)\n",
+						 static_cast<unsigned long long>(drops - reportedDrops));
+			reportedDrops = drops;
+			wrote = true;
+		}
+		if (wrote)
+			std::fflush(_out);
+		if (!_running.load())
+		{
+			while (writeOne())
+				;
+			std::fflush(_out);
+			return;
+		}
+		std::unique_lock<std::mutex> lock(_wakeMutex);
+		_sleeping.store(true);
+		Slot &next = _ring[_tail & (RING_SIZE - 1)];
+		if (next.seq.load(std::memory_order_acquire) != _tail + 1 && _running.load())
+			_wake.wait_for(lock, std::chrono::milliseconds(100));
+		_sleeping.store(false);
+	}
+}
+
+/*
+** Write the oldest published record, if any
+*/
+bool Logger::writeOne()
+{
+	Slot &slot = _ring[_tail & (RING_SIZE - 1)];
+	if (slot.seq.load(std::memory_order_acquire) != _tail + 1)
+		return false;
+
+	static const char *names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+	std::time_t secs = static_cast<std::time_t>(slot.timeNs / 1000000000);
+	int millis = static_cast<int>((slot.timeNs / 1000000) % 1000);
+	struct tm tm;
+	gmtime_r(&secs, &tm);
+	char stamp[32];
+	std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	std::fprintf(_out, "%s.%03dZ %s %.*s\n", stamp, millis,
+				 names[static_cast<int>(slot.level)], static_cast<int>(slot.len), slot.text);
+
+	slot.seq.store(_tail + RING_SIZE, std::memory_order_release);
+	++_tail;
+	return true;
+}
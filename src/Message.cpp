@@ -0,0 +1,80 @@
+#include "Message.hpp"
+#include "History.hpp"
+
+const CapabilityName CAPABILITIES[] = {
+	{ "batch",			CAP_BATCH },
+	{ "server-time",	CAP_SERVER_TIME },
+	{ "message-tags",	CAP_MESSAGE_TAGS },
+	{ "multi-prefix",	CAP_MULTI_PREFIX },
+	{ "echo-message",	CAP_ECHO_MESSAGE },
+};
+
+const int CAPABILITY_COUNT = sizeof(CAPABILITIES) / sizeof(CAPABILITIES[0]);
+
+/*
+** line is the complete message, CRLF included
+** timeMs defaults to now; msgid 0 means the message has no id
+*/
+OutgoingMessage::OutgoingMessage(std::string line, std::uint64_t timeMs, std::uint64_t msgid)
+	: _line(std::move(line)), _timeMs(timeMs ? timeMs : HistoryStore::nowMs()), _msgid(msgid)
+{
+}
+
+void OutgoingMessage::setClientTags(std::string tags) { _clientTags = std::move(tags); }
+
+void OutgoingMessage::setBatch(std::string batch) { _batch = std::move(batch); }
+
+std::uint64_t OutgoingMessage::id() const noexcept { return _msgid; }
+
+std::uint64_t OutgoingMessage::timeMs() const noexcept { return _timeMs; }
+
+/*
+** The message as written for a client with the capabilities caps
+*/
+const std::string &OutgoingMessage::render(std::uint8_t caps)
+{
+	std::uint8_t relevant = caps & TAG_CAPS;
+	if (_batch.empty())
+		relevant &= static_cast<std::uint8_t>(~CAP_BATCH);
+	if (!relevant)
+		return _line;
+	// Bits 0..2 of the capability set are exactly batch, server-time, message-tags
+	std::string &variant = _variants[relevant];
+	if (!variant.empty())
+		return variant;
+
+	std::string tags;
+	if (relevant & CAP_BATCH)
+		tags += "batch=" + _batch;
+	if (relevant & CAP_SERVER_TIME)
+		tags += (tags.empty() ? "" : ";") + std::string("time=") + HistoryStore::formatTime(_timeMs);
+	if ((relevant & CAP_MESSAGE_TAGS) && _msgid)
+		tags += (tags.empty() ? "" : ";") + std::string("msgid=") + std::to_string(_msgid);
+	if ((relevant & CAP_MESSAGE_TAGS) && !_clientTags.empty())
+		tags += (tags.empty() ? "" : ";") + _clientTags;
+	if (tags.empty())
+		variant = _line;
+	else
+		variant = "@" + tags + " " + _line;
+	return variant;
+}
+
+std::string OutgoingMessage::clientOnlyTags(std::string_view tags)
+{
+	std::string result;
+	while (!tags.empty())
+	{
+		std::size_t end = tags.find(';');
+		std::string_view tag = tags.substr(0, end);
+		if (!tag.empty() && tag[0] == '+')
+		{
+			if (!result.empty())
+				result += ';';
+			result.append(tag.data(), tag.size());
+		}
+		if (end == std::string_view::npos)
+			break;
+		tags.remove_prefix(end + 1);
+	}
+	return result;
+}
@@ -0,0 +1,211 @@
+#include "Metrics.hpp"
+#include <ctime>
+#if defined(__x86_64__)
+# include <cpuid.h>
+# include <x86intrin.h>
+#endif
+
+/// Clock ///
+bool			Clock::_tsc = false;
+std::uint64_t	Clock::_tscBase = 0;
+std::uint64_t	Clock::_nsBase = 0;
+std::uint64_t	Clock::_mult = 0;
+
+static std::uint64_t monotonicNs() noexcept
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<std::uint64_t>(ts.tv_nsec);
+}
+
+/*
+** Calibrates the TSC once, before main() runs
+** Measures ticks against CLOCK_MONOTONIC over ~20ms and stores the ratio as
+** a 32.32 fixed-point multiplier
+*/
+struct ClockCalibration
+{
+	ClockCalibration()
+	{
+#if defined(__x86_64__)
+		unsigned int eax, ebx, ecx, edx;
+		if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8)))
+			return;
+		std::uint64_t ns0 = monotonicNs();
+		std::uint64_t t0 = __rdtsc();
+		struct timespec pause = { 0, 20000000 };
+		nanosleep(&pause, nullptr);
+		std::uint64_t ns1 = monotonicNs();
+		std::uint64_t t1 = __rdtsc();
+		if (t1 <= t0 || ns1 <= ns0)
+			return;
+		Clock::_mult = static_cast<std::uint64_t>((static_cast<unsigned __int128>(ns1 - ns0) << 32) / (t1 - t0));
+		Clock::_tscBase = t1;
+		Clock::_nsBase = ns1;
+		Clock::_tsc = Clock::_mult != 0;
+#endif
+	}
+};
+
+static ClockCalibration g_clockCalibration;
+
+std::uint64_t Clock::now() noexcept
+{
+#if defined(__x86_64__)
+	if (_tsc)
+		return _nsBase + static_cast<std::uint64_t>((static_cast<unsigned __int128>(__rdtsc() - _tscBase) * _mult) >> 32);
+#endif
+	return monotonicNs();
+}
+
+bool Clock::usesTsc() noexcept { return _tsc; }
+
+/// Histogram ///
+int Histogram::bucketOf(std::uint64_t value) noexcept
+{
+	if (value < static_cast<std::uint64_t>(SUB_BUCKETS))
+		return static_cast<int>(value);
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - SUB_BITS;
+	return (shift + 1) * SUB_BUCKETS + static_cast<int>((value >> shift) - SUB_BUCKETS);
+}
+
+std::uint64_t Histogram::bucketUpper(int index) noexcept
+{
+	if (index < SUB_BUCKETS)
+		return static_cast<std::uint64_t>(index);
+	int shift = index / SUB_BUCKETS - 1;
+	std::uint64_t sub = static_cast<std::uint64_t>(index % SUB_BUCKETS);
+	std::uint64_t lower = (SUB_BUCKETS + sub) << shift;
+	return lower + ((std::uint64_t(1) << shift) - 1);
+}
+
+void Histogram::record(std::uint64_t value) noexcept
+{
+	++_buckets[bucketOf(value)];
+	++_count;
+	_sum += value;
+	if (value > _max)
+		_max = value;
+}
+
+std::uint64_t Histogram::count() const noexcept { return _count; }
+
+std::uint64_t Histogram::sum() const noexcept { return _sum; }
+
+std::uint64_t Histogram::max() const noexcept { return _max; }
+
+/*
+** Value at quantile q (0..1), reported as the upper edge of its bucket
+*/
+std::uint64_t Histogram::percentile(double q) const noexcept
+{
+	if (_count == 0)
+		return 0;
+	std::uint64_t rank = static_cast<std::uint64_t>(q * static_cast<double>(_count));
+	if (rank >= _count)
+		rank = _count - 1;
+	std::uint64_t seen = 0;
+	for (int i = 0; i < BUCKETS; ++i)
+	{
+		seen += _buckets[i];
+		if (seen > rank)
+			return bucketUpper(i) < _max ? bucketUpper(i) : _max;
+	}
+	return _max;
+}
+
+/// Metrics ///
+std::uint64_t Metrics::now() noexcept { return Clock::now(); }
+
+/*
+** Render counters and histograms in Prometheus text format
+*/
+void Metrics::render(std::ostringstream &out) const
+{
+	renderCounter(out, "ircserv_connections_accepted_total", "Client connections accepted", connectionsAccepted);
+	renderCounter(out, "ircserv_connections_closed_total", "Client connections closed", connectionsClosed);
+	renderCounter(out, "ircserv_loop_iterations_total", "Event loop iterations", loopIterations);
+	renderCounter(out, "ircserv_recv_calls_total", "recv() calls on client sockets", recvCalls);
+	renderCounter(out, "ircserv_send_calls_total", "send() calls on client sockets", sendCalls);
+	renderCounter(out, "ircserv_bytes_in_total", "Bytes received from clients", bytesIn);
+	renderCounter(out, "ircserv_bytes_out_total", "Bytes sent to clients", bytesOut);
+	renderCounter(out, "ircserv_lines_in_total", "Protocol lines received", linesIn);
+	renderCounter(out, "ircserv_messages_queued_total", "Messages queued for clients", messagesQueued);
+	renderCounter(out, "ircserv_poll_interest_changes_total", "POLLOUT registrations and removals on client sockets",
+				  pollInterestChanges);
+	renderCounter(out, "ircserv_read_turns_deferred_total", "Client turns cut short by the per-iteration read budget",
+				  readTurnsDeferred);
+	renderCounter(out, "ircserv_invites_expired_total", "Channel invitations dropped after invite_ttl", invitesExpired);
+	renderCounter(out, "ircserv_slow_commands_total", "Commands slower than the slow-command threshold", slowCommands);
+	renderCounter(out, "ircserv_slow_iterations_total", "Loop iterations slower than the slow-command threshold", slowIterations);
+	renderSummary(out, "ircserv_loop_seconds", "Event loop iteration time, excluding poll wait", loopNs);
+	renderSummary(out, "ircserv_read_seconds", "Time spent in handleClientRead", readNs);
+	renderSummary(out, "ircserv_write_seconds", "Time spent in handleClientWrite", writeNs);
+	renderSummary(out, "ircserv_process_line_seconds", "Time spent handling one protocol line", processLineNs);
+	renderSummary(out, "ircserv_flush_seconds", "Time spent in the flush phase of a loop iteration", flushNs);
+
+	out << "# HELP ircserv_sendq_bytes Write buffer size when a client becomes writable\n"
+		<< "# TYPE ircserv_sendq_bytes summary\n";
+	const double qs[] = { 0.5, 0.99, 0.999 };
+	for (double q : qs)
+		out << "ircserv_sendq_bytes{quantile=\"" << q << "\"} " << sendqBytes.percentile(q) << "\n";
+	out << "ircserv_sendq_bytes_sum " << sendqBytes.sum() << "\n"
+		<< "ircserv_sendq_bytes_count " << sendqBytes.count() << "\n";
+
+	out << "# HELP ircserv_messages_per_write Messages coalesced into one send() to a client\n"
+		<< "# TYPE ircserv_messages_per_write summary\n";
+	for (double q : qs)
+		out << "ircserv_messages_per_write{quantile=\"" << q << "\"} " << messagesPerWrite.percentile(q) << "\n";
+	out << "ircserv_messages_per_write_sum " << messagesPerWrite.sum() << "\n"
+		<< "ircserv_messages_per_write_count " << messagesPerWrite.count() << "\n";
+}
+
+void Metrics::renderGauge(std::ostringstream &out, const char *name, const char *help, std::uint64_t value)
+{
+	out << "# HELP " << name << " " << help << "\n"
+		<< "# TYPE " << name << " gauge\n"
+		<< name << " " << value << "\n";
+}
+
+void Metrics::renderCounter(std::ostringstream &out, const char *name, const char *help, std::uint64_t value)
+{
+	out << "# HELP " << name << " " << help << "\n"
+		<< "# TYPE " << name << " counter\n"
+		<< name << " " << value << "\n";
+}
+
+/*
+** Histograms of nanoseconds are exported as summaries in seconds
+*/
+void Metrics::renderSummary(std::ostringstream &out, const char *name, const char *help, const Histogram &h)
+{
+	out << "# HELP " << name << " " << help << "\n"
+		<< "# TYPE " << name << " summary\n";
+	const double qs[] = { 0.5, 0.99, 0.999 };
+	for (double q : qs)
+		out << name << "{quantile=\"" << q << "\"} " << static_cast<double>(h.percentile(q)) / 1e9 << "\n";
+	out << name << "_sum " << static_cast<double>(h.sum()) / 1e9 << "\n"
+		<< name << "_count " << h.count() << "\n";
+}
+
+/*
+** Per-command handler latency, one labelled summary per command seen so far
+*/
+void Metrics::renderCommands(std::ostringstream &out, const char *const *names, int count) const
+{
+	out << "# HELP ircserv_command_seconds Time spent in each command handler\n"
+		<< "# TYPE ircserv_command_seconds summary\n";
+	const double qs[] = { 0.5, 0.99, 0.999 };
+	for (int i = 0; i < count && i < MAX_COMMANDS; ++i)
+	{
+		const Histogram &h = commandNs[i];
+		if (h.count() == 0)
+			continue;
+		for (double q : qs)
+			out << "ircserv_command_seconds{command=\"" << names[i] << "\",quantile=\"" << q << "\"} "
+				<< static_cast<double>(h.percentile(q)) / 1e9 << "\n";
+		out << "ircserv_command_seconds_sum{command=\"" << names[i] << "\"} " << static_cast<double>(h.sum()) / 1e9 << "\n"
+			<< "ircserv_command_seconds_count{command=\"" << names[i] << "\"} " << h.count() << "\n";
+	}
+}
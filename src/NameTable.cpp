@@ -0,0 +1,122 @@
+#include "NameTable.hpp"
+#include "Slab.hpp"
+#include <new>
+
+struct NameSlab {
+	static constexpr const char *name = "name";
+};
+
+static SlabAllocator<NameTable::Name, NameSlab> nameAllocator;
+
+NameTable::~NameTable()
+{
+	for (Name *name : _slots)
+	{
+		if (!name)
+			continue;
+		name->~Name();
+		nameAllocator.deallocate(name, 1);
+	}
+}
+
+/*
+** FNV-1a over the casefolded text
+*/
+std::size_t NameTable::hash(std::string_view text) noexcept
+{
+	std::size_t h = 14695981039346656037ULL;
+	for (char c : text)
+	{
+		h ^= static_cast<unsigned char>(fold(c));
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+** The slot holding text, or the empty slot where it would go
+** Needs at least one empty slot, which grow() guarantees
+*/
+std::size_t NameTable::slotOf(std::string_view text, std::size_t hash) const noexcept
+{
+	std::size_t mask = _slots.size() - 1;
+	std::size_t i = hash & mask;
+	while (_slots[i] && (_slots[i]->hash != hash || !equal(_slots[i]->text, text)))
+		i = (i + 1) & mask;
+	return i;
+}
+
+/*
+** Handle of text, adding it if needed; every call takes a reference
+** The text is kept as first interned
+*/
+NameTable::Name const *NameTable::intern(std::string_view text)
+{
+	if ((_size + 1) * 4 > _slots.size() * 3)
+		grow();
+	std::size_t h = hash(text);
+	std::size_t i = slotOf(text, h);
+	if (!_slots[i])
+	{
+		_slots[i] = new (nameAllocator.allocate(1)) Name{ std::string(text), h, 0 };
+		++_size;
+	}
+	++_slots[i]->refs;
+	return _slots[i];
+}
+
+/*
+** Handle of text, or nullptr if it is not interned; never allocates
+*/
+NameTable::Name const *NameTable::find(std::string_view text) const noexcept
+{
+	if (_slots.empty())
+		return nullptr;
+	return _slots[slotOf(text, hash(text))];
+}
+
+/*
+** Drop a reference taken by intern(), removing the name with the last one
+** The entries after it in its probe run are shifted back over the hole
+*/
+void NameTable::release(const Name *name) noexcept
+{
+	if (!name || --const_cast<Name *>(name)->refs > 0)
+		return;
+	std::size_t mask = _slots.size() - 1;
+	std::size_t hole = slotOf(name->text, name->hash);
+	Name *dead = _slots[hole];
+	_slots[hole] = nullptr;
+	--_size;
+	for (std::size_t i = (hole + 1) & mask; _slots[i]; i = (i + 1) & mask)
+	{
+		std::size_t home = _slots[i]->hash & mask;
+		// Move the entry back unless its home lies cyclically in (hole, i]
+		if ((i > hole && (home <= hole || home > i)) || (i < hole && home <= hole && home > i))
+		{
+			_slots[hole] = _slots[i];
+			_slots[i] = nullptr;
+			hole = i;
+		}
+	}
+	dead->~Name();
+	nameAllocator.deallocate(dead, 1);
+}
+
+std::size_t NameTable::size() const noexcept { return _size; }
+
+void NameTable::grow()
+{
+	std::vector<Name *> old(_slots.empty() ? INITIAL_SLOTS : _slots.size() * 2, nullptr);
+	old.swap(_slots);
+	std::size_t mask = _slots.size() - 1;
+	for (Name *name : old)
+	{
+		if (!name)
+			continue;
+		std::size_t i = name->hash & mask;
+		while (_slots[i])
+			i = (i + 1) & mask;
+		_slots[i] = name;
+	}
+}
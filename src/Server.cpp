@@ -1,23 +1,32 @@
 #include "Server.hpp"
-#include <iostream>
+#include "Logger.hpp"
 #include <iomanip>
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <cstdint>
 #include <cerrno>
 #include <unistd.h>
 #include <fcntl.h>
 #include <algorithm>
+#include <unordered_set>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 
 /// Constructor ///
-Server::Server(int port, const std::string &password)
-	: _port(port), _password(password), _addrLen(sizeof(_address))
+Server::Server(int port, const std::string &password, const std::string &takeoverPath)
+	: _port(port), _password(password), _commandLinePassword(password), _addrLen(sizeof(_address)),
+	  _readChunk(BUFFER_SIZE)
 {
 	_channelCount = 0;
-	initSocket();
+	_startTime = std::time(nullptr);
+	_history.configure(DEFAULT_HISTORY_BYTES, DEFAULT_HISTORY_CHANNEL_BYTES, DEFAULT_HISTORY_PRIVATE_BYTES);
+	if (takeoverPath.empty())
+		initSocket();
+	else
+		takeOver(takeoverPath);
 }
 
 /// Destructor ///
@@ -35,32 +44,115 @@ Server::~Server()
 void Server::run()
 {
 	_running = true;
-	std::cout << "Server is running..." << std::endl;
+	LOG_INFO("Server is running...");
 	mainLoop();
+	shutdown();
+}
+
+/*
+** Record every client's inbound lines, with opens and closes, to path
+** After a takeover the file goes on where the old process left it, which
+** closed the connections it handed over: they are opened again here, on
+** their fds in this process
+*/
+void Server::enableCapture(const std::string &path)
+{
+	_capture.open(path, _tookOver);
+	for (const auto &pair : _clients)
+		if (!pair.second.isRemote())
+			_capture.recordOpen(pair.first);
+}
+
+/*
+** Replace the sockets and the system clock, for a simulation
+** Connections registered from then on are read and written through
+** transport, also once SERVER makes one a link; listeners and dialled
+** links stay on real sockets
+*/
+void Server::useTransport(Transport &transport, WallClock &clock)
+{
+	_transport = &transport;
+	_clock = &clock;
+}
+
+/*
+** Ask the main loop to stop
+** Only sets a flag, so it is safe to call from a signal handler
+*/
+void Server::requestStop()
+{
+	_stopRequested = 1;
 }
 
 void Server::shutdown()
 {
 	if (!_running)
 		return;
-	std::cout << "\nShutting down server..." << std::endl;
+	LOG_INFO("Shutting down server...");
 	_running = false;
 
-	std::vector<int> fds;
-	fds.reserve(_clients.size());
-	for (std::unordered_map<int, Client>::iterator it = _clients.begin(); it != _clients.end(); ++it)
-		fds.push_back(it->first);
-	for (int fd : fds)
-		disconnectClient(fd, "Server shutting down");
-	if (_serverFd >= 0)
+	if (_handedOff)
+	{
+		// The new process owns the connections now: close our copies silently
+		for (auto &pollFd : _fds)
+			close(pollFd.fd);
+		_fds.clear();
+		_clients.clear();
+		_listeners.clear();
+		_metricsFd = -1;
+		_upgradeFd = -1;
+		_syncFd = -1;
+		_metricsConns.clear();
+		_syncExports.clear();
+		_import = SyncImport();
+		_capture.close();
+		_store.close();
+		LOG_INFO("Handoff complete, old process exiting.");
+		return;
+	}
+
+	// Save the channels before the disconnects below empty them
+	if (_store.enabled())
+	{
+		_store.writeSnapshot(_channels);
+		_store.close();
+	}
+
+	dropAllLinks("Server shutting down");
+	for (ClientMap::iterator it = _clients.begin(); it != _clients.end(); ++it)
+		disconnectClient(it->first, "Server shutting down");
+	flushDisconnects();
+	closeListeners(true);
+	for (auto &conn : _metricsConns)
+		close(conn.first);
+	_metricsConns.clear();
+	if (_metricsFd >= 0)
 	{
-		close(_serverFd);
-		_serverFd = -1;
+		close(_metricsFd);
+		_metricsFd = -1;
+	}
+	if (_upgradeFd >= 0)
+	{
+		close(_upgradeFd);
+		unlink(_upgradePath.c_str());
+		_upgradeFd = -1;
+	}
+	for (auto &sync : _syncExports)
+		close(sync.first);
+	_syncExports.clear();
+	if (_import.fd >= 0)
+		finishImport("Server shutting down");
+	if (_syncFd >= 0)
+	{
+		close(_syncFd);
+		unlink(_syncPath.c_str());
+		_syncFd = -1;
 	}
 	_fds.clear();
 	_clients.clear();
+	_capture.close();
 
-	std::cout << "Server shutdown successful." << std::endl;
+	LOG_INFO("Server shutdown successful.");
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -68,153 +160,289 @@ void Server::shutdown()
 
 /*
 ** Main server loop
-** Uses poll to monitor multiple file descriptors
-** Handles new connections and client read/write events
+** Uses poll to monitor multiple file descriptors and runs one iteration for
+** what it reports; a signal (EINTR) still gets an iteration, so a REHASH
+** or stop it asked for is seen at once
 */
 void Server::mainLoop()
 {
-	while (_running)
+	while (_running && !_stopRequested)
 	{
-		int ready = ::poll(_fds.data(), _fds.size(), -1);
+		int ready = ::poll(_fds.data(), _fds.size(), pollTimeout());
 		if (ready < 0)
 		{
-			if (errno == EINTR)
-			{
-				if (!_running)
-					break;
-				continue;
-			}
-			throw std::runtime_error("Poll failed: " + std::string(strerror(errno)));
+			if (errno != EINTR)
+				throw std::runtime_error("Poll failed: " + std::string(strerror(errno)));
+			ready = 0;
 		}
+		runIteration(ready);
+	}
+}
+
+/*
+** How long poll() may wait: until the next snapshot, link attempt or end of
+** the hold on restored channels, or not at all while work is left over from
+** the last iteration, such as a client dropped by the final flush whose QUIT
+** is still to be sent
+*/
+int Server::pollTimeout()
+{
+	int timeout = _store.enabled() ? _store.msUntilSnapshot() : -1;
+	int linkTimeout = msUntilLinkAttempt();
+	if (linkTimeout >= 0 && (timeout < 0 || linkTimeout < timeout))
+		timeout = linkTimeout;
+	if (_restoredUntil)
+	{
+		std::time_t wait = _restoredUntil - _clock->now();
+		int holdTimeout = wait > 0 ? static_cast<int>(wait * 1000) : 0;
+		if (timeout < 0 || holdTimeout < timeout)
+			timeout = holdTimeout;
+	}
+	if (syncPending() || _dirtyClients || !_readyClients.empty() || !_departures.empty())
+		timeout = 0;
+	return timeout;
+}
+
+/*
+** One event loop iteration, once ready entries of _fds have their revents
+** Handles new connections and client read/write events, then the phases
+** that run every iteration: left-over client input, disconnects, timers,
+** the output flush. The simulation (bench/simulate.cpp) fills in revents
+** itself and calls this too, so it runs exactly what the server runs.
+*/
+void Server::runIteration(int ready)
+{
+	if (_rehashRequested)
+		rehash();
+	std::uint64_t iterationStart = Metrics::now();
+
+	for (std::size_t i = 0; i < _fds.size() && ready > 0; ++i)
+	{
+		short revents = _fds[i].revents;
+		if (revents == 0)
+			continue;
+		--ready;
 
-		for (std::size_t i = 0; i < _fds.size() && ready > 0; ++i)
+		Listener *listener = (revents & POLLIN) ? findListener(_fds[i].fd) : nullptr;
+		if (listener)
+			handleNewConnection(*listener);
+		else if (_fds[i].fd == _metricsFd && (revents & POLLIN))
+			handleMetricsConnection();
+		else if (_metricsConns.count(_fds[i].fd))
+			handleMetricsRequest(i);
+		else if (_links.count(_fds[i].fd))
 		{
-			short revents = _fds[i].revents;
-			if (revents == 0)
-				continue;
-			--ready;
-
-			if (_fds[i].fd == _serverFd && (revents & POLLIN))
-				handleNewConnection();
-			else
-			{
-				if (revents & POLLIN)
-					handleClientRead(i);
-				if (revents & POLLOUT) {
-					handleClientWrite(i);
-				}
+			if (revents & (POLLOUT | POLLERR | POLLHUP))
+				handleLinkWrite(i);
+			if (i < _fds.size() && (revents & POLLIN) && _links.count(_fds[i].fd))
+				handleLinkRead(i);
+		}
+		else if (_fds[i].fd == _syncFd && (revents & POLLIN))
+			handleSyncConnection();
+		else if (_syncExports.count(_fds[i].fd))
+			handleSyncExport(i);
+		else if (_import.fd >= 0 && _fds[i].fd == _import.fd)
+			handleSyncImport(i);
+		else if (_fds[i].fd == _upgradeFd && (revents & POLLIN))
+		{
+			handleUpgradeConnection();
+			if (_handedOff)
+				break;
+		}
+		else if (_clients.count(_fds[i].fd))
+		{
+			int fd = _fds[i].fd;
+			if (revents & POLLIN)
+				handleClientRead(i);
+			if ((revents & POLLOUT) && _clients.count(fd)) {
+				handleClientWrite(i);
 			}
 		}
 	}
+	serviceReadyClients();
+	flushDisconnects();
+	tickInvites();
+	tickRestoredChannels();
+	tickLinks();
+	tickSync();
+	if (_store.enabled())
+		_store.tick(_channels);
+	flushOutput();
+	// Clients whose write failed in the flush phase
+	flushDisconnects();
+	++_metrics.loopIterations;
+	std::uint64_t iterationNs = Metrics::now() - iterationStart;
+	_metrics.loopNs.record(iterationNs);
+	if (_slowCommandNs && iterationNs >= _slowCommandNs)
+	{
+		++_metrics.slowIterations;
+		LOG_WARN("Slow loop iteration: %llu us", static_cast<unsigned long long>(iterationNs / 1000));
+	}
 }
 
 /*
 ** Initialize server socket
-** Sets up the socket
-** Set socket to non-blocking mode
-** Set socket options to reuse address
-** Bind the socket to the specified port
-** Start listening for connections
+** Listens on the port given on the command line, over IPv4 and IPv6;
+** IRCSERV_LISTEN adds more listeners with addListener()
 */
 void Server::initSocket()
 {
-	_serverFd = socket(AF_INET, SOCK_STREAM, 0);
-	if (_serverFd < 0)
-		throw std::runtime_error("Socket creation failed: " + std::string(strerror(errno)));
-
-	if (::fcntl(_serverFd, F_SETFL, O_NONBLOCK) < 0)
-		throw std::runtime_error("Set non-blocking mode failed: " + std::string(strerror(errno)));
-
-	int opt = 1;
-	if (::setsockopt(_serverFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
-		throw std::runtime_error("Set socket options failed: " + std::string(strerror(errno)));
-
-	_address.sin_family = AF_INET;
-	_address.sin_addr.s_addr = INADDR_ANY;
-	_address.sin_port = htons(_port);
-
-	if (::bind(_serverFd, reinterpret_cast<struct sockaddr *>(&_address), sizeof(_address)) < 0)
-		throw std::runtime_error("Bind failed: " + std::string(strerror(errno)));
-
-	if (::listen(_serverFd, 10) < 0)
-		throw std::runtime_error("Listen failed: " + std::string(strerror(errno)));
+	startListener(parseListener(std::to_string(_port)));
 
-	std::cout << "IRC Server is now listening on port " << _port
-			  << " (password: " << _password << ")" << std::endl;
-
-	pollfd serverPollFd;
-	serverPollFd.fd = _serverFd;
-	serverPollFd.events = POLLIN;
-	serverPollFd.revents = 0;
-	_fds.push_back(serverPollFd);
+	LOG_INFO("IRC Server is now listening on port %d (password: %s)", _port, _password.c_str());
 }
 
 /*
 ** Handle new client connections
-** Accepts the connection, sets the socket to non-blocking,
-** adds the client to the poll fds and the clients map
+** Accepts the connection, sets the socket to non-blocking and serves it
+** with registerConnection()
 */
-void Server::handleNewConnection()
+void Server::handleNewConnection(Listener &listener)
 {
 	_addrLen = sizeof(_address);
 
-	int clientFd = ::accept(_serverFd, reinterpret_cast<struct sockaddr *>(&_address), &_addrLen);
+	int clientFd = ::accept(listener.fd, reinterpret_cast<struct sockaddr *>(&_address), &_addrLen);
 	if (clientFd < 0)
 	{
 		if (errno != EWOULDBLOCK && errno != EAGAIN)
-		{
-			std::cerr << "Accept failed: " << strerror(errno) << std::endl;
-			return;
-		}
-		std::perror("Accept failed");
+			LOG_ERROR("Accept failed: %s", strerror(errno));
 		return;
 	}
 	if (::fcntl(clientFd, F_SETFL, O_NONBLOCK) < 0)
 		throw std::runtime_error("Set non-blocking mode failed: " + std::string(strerror(errno)));
+	// Output is coalesced by the flush phase: what it writes should leave at
+	// once, not wait for Nagle (unix sockets have no such option)
+	int noDelay = 1;
+	::setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	registerConnection(clientFd, listener);
+}
+
+/*
+** Serve a new connection on fd, accepted by listener
+** The client takes the connection class of the listener; on a TLS listener
+** the connection starts with the TLS handshake
+*/
+Client &Server::registerConnection(int fd, Listener &listener)
+{
 	pollfd clientPollFd;
-	clientPollFd.fd = clientFd;
+	clientPollFd.fd = fd;
 	clientPollFd.events = POLLIN;
 	clientPollFd.revents = 0;
 	_fds.push_back(clientPollFd);
+	// Appending leaves every other index valid: record this one at once
+	std::size_t slot = static_cast<std::size_t>(fd);
+	if (slot >= _pollIndex.size())
+		_pollIndex.resize(slot + 1, SIZE_MAX);
+	_pollIndex[slot] = _fds.size() - 1;
 
-	_clients.emplace(clientFd, Client(clientFd));
+	Client &client = _clients.emplace(fd, Client(fd)).first->second;
+	client.setConnClass(listener.connClass);
+	client.setLimits(_config.connectionClass(listener.connClass));
+	if (listener.tls)
+	{
+		client.setSecure(true);
+		_tlsSessions[fd] = _tls.accept(fd);
+	}
+	++_metrics.connectionsAccepted;
+	++listener.accepted;
+	if (_capture.enabled())
+		_capture.recordOpen(fd);
+	return client;
 }
 
 /*
 ** Handle client read events
-** Reads data from the client socket, processes complete lines,
-** and handles client disconnections
+** A client already on the ready list is skipped: its turn comes in
+** serviceReadyClients(), once per iteration like everyone else's
 */
 void Server::handleClientRead(std::size_t index)
 {
 	int clientFd = _fds[index].fd;
 	Client &client = _clients.at(clientFd);
+	if (client.isDeparting() || client.isReadReady())
+		return;
+	auto tls = _tlsSessions.find(clientFd);
+	if (tls != _tlsSessions.end() && !tls->second->established())
+	{
+		continueTlsHandshake(index);
+		return;
+	}
+	readClient(client);
+}
 
-	char buffer[BUFFER_SIZE];
+/*
+** One turn of reading and command handling for a client
+** Reads the socket and processes complete lines, at most READS_PER_TURN
+** reads and LINES_PER_TURN lines. A client with work left (lines already
+** buffered, a socket not read to EAGAIN, decrypted TLS data poll cannot
+** see) goes on the ready list for its next turn, so one fast sender cannot
+** hold the loop while everyone else waits.
+*/
+void Server::readClient(Client &client)
+{
+	int clientFd = client.getFd();
+	std::uint64_t start = Metrics::now();
+	std::time_t now = _clock->now();
+	const ConnectionClass &limits = client.getLimits();
+	std::size_t lines = 0;
+	std::size_t reads = 0;
 
 	while (true)
 	{
-		ssize_t bytes = ::recv(clientFd, buffer, BUFFER_SIZE, 0);
-		if (bytes > 0)
-		{
-			client.getReadBuffer().append(buffer, static_cast<std::size_t>(bytes));
+		std::string &readBuffer = client.getReadBuffer();
+		std::size_t pos;
 
-			std::string &readBuffer = client.getReadBuffer();
-			std::size_t pos;
-
-			while ((pos = readBuffer.find("\r\n")) != std::string::npos)
-			{
-				std::string line = readBuffer.substr(0, pos);
-				readBuffer.erase(0, pos + 2);
-				processLine(clientFd, line);
-				if (_clients.find(clientFd) == _clients.end()) {
-					return;
-				}
+		while (lines < LINES_PER_TURN && (pos = readBuffer.find("\r\n")) != std::string::npos)
+		{
+			std::string line = readBuffer.substr(0, pos);
+			readBuffer.erase(0, pos + 2);
+			++lines;
+			++_metrics.linesIn;
+			if (!client.countLine(now)) {
+				disconnectClient(clientFd, "Excess Flood");
+				_metrics.readNs.record(Metrics::now() - start);
+				return;
+			}
+			if (_capture.enabled())
+				_capture.recordLine(clientFd, line);
+			processLine(clientFd, line);
+			// SERVER turned the connection into a server link
+			if (_links.count(clientFd)) {
+				adoptLink(clientFd);
+				_metrics.readNs.record(Metrics::now() - start);
+				return;
+			}
+			if (client.isDeparting()) {
+				_metrics.readNs.record(Metrics::now() - start);
+				return;
 			}
 		}
+		if (lines == LINES_PER_TURN || reads == READS_PER_TURN)
+		{
+			markReadReady(client);
+			++_metrics.readTurnsDeferred;
+			break;
+		}
+		if (limits.recvq && readBuffer.size() > limits.recvq) {
+			disconnectClient(clientFd, "Max RecvQ exceeded");
+			_metrics.readNs.record(Metrics::now() - start);
+			return;
+		}
+
+		ssize_t bytes = receive(clientFd, _readChunk.data(), _readChunk.size());
+		++reads;
+		++_metrics.recvCalls;
+		if (bytes > 0)
+		{
+			_metrics.bytesIn += static_cast<std::uint64_t>(bytes);
+			if (readBuffer.empty())
+				_buffers.acquire(readBuffer);
+			readBuffer.append(_readChunk.data(), static_cast<std::size_t>(bytes));
+		}
 		else if (bytes == 0)
 		{
 			disconnectClient(clientFd, "EOF");
+			_metrics.readNs.record(Metrics::now() - start);
 			return;
 		}
 		else
@@ -222,51 +450,287 @@ void Server::handleClientRead(std::size_t index)
 			if (errno == EWOULDBLOCK || errno == EAGAIN)
 				break;
 
-			std::perror("Recv failed");
+			LOG_ERROR("Recv failed on fd=%d: %s", clientFd, strerror(errno));
 			disconnectClient(clientFd, "Recv error");
+			_metrics.readNs.record(Metrics::now() - start);
 			return;
 		}
 	}
-	if (client.dataToWrite())
-		_fds[index].events |= POLLOUT;
+	// Only a partial line keeps its buffer between reads
+	if (client.getReadBuffer().empty())
+		_buffers.release(client.getReadBuffer());
+	_metrics.readNs.record(Metrics::now() - start);
+}
+
+/*
+** Put client on the ready list, once
+*/
+void Server::markReadReady(Client &client)
+{
+	if (client.isReadReady())
+		return;
+	client.setReadReady(true);
+	_readyClients.push_back(client.getFd());
+}
+
+/*
+** Give every client on the ready list one more turn, in the order they
+** ran out of budget; those still not done go back at the end of the list
+*/
+void Server::serviceReadyClients()
+{
+	if (_readyClients.empty())
+		return;
+	std::vector<int> ready;
+	ready.swap(_readyClients);
+	for (int fd : ready)
+	{
+		auto found = _clients.find(fd);
+		// Gone, or the fd now belongs to a newer client
+		if (found == _clients.end() || !found->second.isReadReady())
+			continue;
+		Client &client = found->second;
+		client.setReadReady(false);
+		if (!client.isDeparting())
+			readClient(client);
+	}
 }
 
 /*
 ** Handles client write events
+** Only clients whose output did not all fit in the flush phase wait for
+** POLLOUT; once drained they stop
 */
 void Server::handleClientWrite(std::size_t index)
 {
 	int clientFd = _fds[index].fd;
 	Client &client = _clients.at(clientFd);
+	if (client.isDeparting())
+		return;
+	auto tls = _tlsSessions.find(clientFd);
+	if (tls != _tlsSessions.end() && !tls->second->established())
+	{
+		continueTlsHandshake(index);
+		return;
+	}
+	if (writeClient(client) && !client.dataToWrite())
+		setWriteInterest(client, false);
+}
 
+/*
+** Write as much of the client's queued output as the socket takes, in one
+** send() unless it is taken in parts
+** While a LIST is streaming more output follows, so the data goes out with
+** MSG_MORE; the LIST goes on once the sendq drains
+** Returns false if the client was disconnected
+*/
+bool Server::writeClient(Client &client)
+{
+	int clientFd = client.getFd();
 	std::string &wb = client.getWriteBuffer();
-	
-	while (!wb.empty())
+	std::uint64_t start = Metrics::now();
+	_metrics.sendqBytes.record(wb.size());
+	bool listing = _listings.count(clientFd) != 0;
+	std::uint32_t messages = client.takeQueuedMessages();
+	std::size_t offset = 0;
+
+	while (offset < wb.size())
 	{
-		ssize_t sent = ::send(clientFd, wb.data(), wb.size(), 0);
+		ssize_t sent = transmit(clientFd, wb.data() + offset, wb.size() - offset, listing);
+		++_metrics.sendCalls;
 		if (sent > 0)
 		{
-			wb.erase(0, static_cast<std::size_t>(sent));
+			_metrics.bytesOut += static_cast<std::uint64_t>(sent);
+			offset += static_cast<std::size_t>(sent);
+			if (messages)
+				_metrics.messagesPerWrite.record(messages);
+			messages = 0;
 		}
 		else if (sent < 0)
 		{
 			if (errno == EWOULDBLOCK || errno == EAGAIN)
 				break;
-			std::perror("send");
+			LOG_ERROR("Send failed on fd=%d: %s", clientFd, strerror(errno));
 			disconnectClient(clientFd, "Send error");
-			return;
+			_metrics.writeNs.record(Metrics::now() - start);
+			return false;
 		}
 	}
+	wb.erase(0, offset);
+	if (listing && wb.size() < LIST_SENDQ_BYTES)
+		continueList(client);
 	if (!client.dataToWrite())
-		_fds[index].events &= ~POLLOUT;
+		_buffers.release(wb);
+	_metrics.writeNs.record(Metrics::now() - start);
+	return true;
+}
+
+/*
+** Flush phase, once per loop iteration after every event is handled
+** Each client with output queued during the iteration gets one write of
+** all of it, so a burst of replies (JOIN's 353/366/329...) leaves in as few
+** segments as it fits in. Only a socket that does not take everything gets
+** POLLOUT armed for the rest; a client already waiting on POLLOUT is left to
+** it, since its socket is still full.
+** Output queued while flushing (a LIST going on) waits for the next phase.
+*/
+void Server::flushOutput()
+{
+	if (!_dirtyClients)
+		return;
+	std::uint64_t start = Metrics::now();
+	Client *dirty = _dirtyClients;
+	_dirtyClients = nullptr;
+	while (dirty)
+	{
+		Client &client = *dirty;
+		dirty = client.nextDirty();
+		client.unlinkDirty();
+		if (client.isDeparting() || !client.dataToWrite() || client.isWaitingWrite())
+			continue;
+		// Still in the TLS handshake: written once it is established
+		auto tls = _tlsSessions.find(client.getFd());
+		if (tls != _tlsSessions.end() && !tls->second->established())
+			continue;
+		if (writeClient(client) && client.dataToWrite())
+			setWriteInterest(client, true);
+	}
+	_metrics.flushNs.record(Metrics::now() - start);
+}
+
+/*
+** Add client to the clients to flush, once
+*/
+void Server::markDirty(Client &client)
+{
+	if (client.isDirty())
+		return;
+	client.linkDirty(_dirtyClients);
+	_dirtyClients = &client;
+}
+
+/*
+** Take client out of the clients to flush, before it is destroyed
+*/
+void Server::unmarkDirty(Client &client)
+{
+	if (!client.isDirty())
+		return;
+	if (_dirtyClients == &client)
+		_dirtyClients = client.nextDirty();
+	client.unlinkDirty();
+}
+
+/*
+** Poll the client's socket for POLLOUT, or stop
+** The poll set only changes when the client's state does
+*/
+void Server::setWriteInterest(Client &client, bool enabled)
+{
+	if (client.isWaitingWrite() == enabled)
+		return;
+	client.setWaitingWrite(enabled);
+	pollfd *pfd = findPollFd(client.getFd());
+	if (!pfd)
+		return;
+	if (enabled)
+		pfd->events |= POLLOUT;
+	else
+		pfd->events &= ~POLLOUT;
+	++_metrics.pollInterestChanges;
+}
+
+/*
+** The entry of fd in _fds
+** Indexes go stale when _fds changes (accept, disconnect...); a stale one is
+** noticed on lookup and the index is rebuilt in one pass
+*/
+pollfd *Server::findPollFd(int fd)
+{
+	if (fd < 0)
+		return nullptr;
+	std::size_t slot = static_cast<std::size_t>(fd);
+	if (slot < _pollIndex.size() && _pollIndex[slot] < _fds.size() && _fds[_pollIndex[slot]].fd == fd)
+		return &_fds[_pollIndex[slot]];
+	for (std::size_t i = 0; i < _fds.size(); ++i)
+	{
+		if (_fds[i].fd < 0)
+			continue;
+		std::size_t entry = static_cast<std::size_t>(_fds[i].fd);
+		if (entry >= _pollIndex.size())
+			_pollIndex.resize(entry + 1, SIZE_MAX);
+		_pollIndex[entry] = i;
+	}
+	if (slot < _pollIndex.size() && _pollIndex[slot] < _fds.size() && _fds[_pollIndex[slot]].fd == fd)
+		return &_fds[_pollIndex[slot]];
+	return nullptr;
 }
 
 
 /////////////////////////////////////////////////////////////////////////////////////////
 /// Command processing and message sending ///
+/*
+** Command dispatch table
+** The index of an entry is also its slot in the per-command metrics.
+** Entries without a handler are accepted and ignored.
+*/
+const Server::CommandEntry Server::COMMANDS[] = {
+	{ "PASS",		&Server::handlePASS,	true },
+	{ "NICK",		&Server::handleNICK,	true },
+	{ "USER",		&Server::handleUSER,	true },
+	{ "CAP",		&Server::handleCAP,		true },
+	{ "QUIT",		&Server::handleQUIT,	true },
+	{ "PING",		&Server::handlePING,	true },
+	{ "JOIN",		&Server::handleJOIN,	false },
+	{ "TOPIC",		&Server::handleTOPIC,	false },
+	{ "KICK",		&Server::handleKICK,	false },
+	{ "INVITE",		&Server::handleINVITE,	false },
+	{ "MODE",		&Server::handleMODE,	false },
+	{ "PRIVMSG",	&Server::handlePRIVMSG,	false },
+	{ "PART",		&Server::handlePART,	false },
+	{ "OPER",		&Server::handleOPER,	false },
+	{ "STATS",		&Server::handleSTATS,	false },
+	{ "CHATHISTORY",	&Server::handleCHATHISTORY,	false },
+	{ "WHO",		&Server::handleWHO,		false },
+	{ "WHOIS",		&Server::handleWHOIS,	false },
+	{ "NAMES",		&Server::handleNAMES,	false },
+	{ "LIST",		&Server::handleLIST,	false },
+	{ "SERVER",		&Server::handleSERVER,	true },
+	{ "CONNECT",	&Server::handleCONNECT,	false },
+	{ "SQUIT",		&Server::handleSQUIT,	false },
+	{ "LINKS",		&Server::handleLINKS,	false },
+	{ "REHASH",		&Server::handleREHASH,	false },
+};
+
+const int Server::COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+/*
+** Find a command in the dispatch table, case-insensitively
+** Returns its index, or -1 if unknown; the index is always below
+** Metrics::MAX_COMMANDS
+*/
+int Server::findCommand(std::string_view command)
+{
+	static_assert(sizeof(COMMANDS) / sizeof(COMMANDS[0]) <= Metrics::MAX_COMMANDS,
+				  "Metrics::MAX_COMMANDS is too small for the command table");
+	for (int i = 0; i < COMMAND_COUNT; ++i)
+	{
+		std::string_view name(COMMANDS[i].name);
+		if (name.size() != command.size())
+			continue;
+		std::size_t j = 0;
+		while (j < name.size() && std::toupper(static_cast<unsigned char>(command[j])) == name[j])
+			++j;
+		if (j == name.size())
+			return i;
+	}
+	return -1;
+}
+
 /*
 ** Process a complete line received from a client
 ** Parses the command and dispatches to the appropriate handler
+** Every handler call is timed; calls above the slow-command threshold are logged
 */
 void Server::processLine(int clientFd, std::string_view line)
 {
@@ -279,57 +743,45 @@ void Server::processLine(int clientFd, std::string_view line)
 	if (cmd.command.empty())
 		return;
 
-	std::string upper(cmd.command);
-	for (char &c : upper)
-		c = std::toupper(static_cast<unsigned char>(c));
- 
-	bool preRegAllowed = (upper == "PASS" ||
-						  upper == "NICK" ||
-						  upper == "USER" ||
-						  upper == "CAP"  ||
-						  upper == "QUIT" ||
-						  upper == "PING");
-
-	if (!client.isRegistered() && !preRegAllowed)
+	int index = findCommand(cmd.command);
+	if (index < 0)
 	{
-		sendNumeric(client, 451, ":You have not registered");
+		if (!client.isRegistered())
+			sendNumeric(client, 451, ":You have not registered");
+		else
+			sendNumeric(client, 421, std::string(cmd.command), "Unknown command");
 		return;
 	}
-	if (upper == "PASS")
-		handlePASS(client, cmd.params);
-	else if (upper == "NICK")
-		handleNICK(client, cmd.params);
-	else if (upper == "USER")
-		handleUSER(client, cmd.params);
-	else if (upper == "PING")
-		handlePING(client, cmd.params);
-	else if (upper == "QUIT")	
-		handleQUIT(client, cmd.params);
-	else if (upper == "JOIN")
-		handleJOIN(client, cmd.params);
-	else if (upper == "TOPIC")
-		handleTOPIC(client, cmd.params);
-	else if (upper == "KICK")
-		handleKICK(client, cmd.params);
-	else if (upper == "INVITE")
-		handleINVITE(client, cmd.params);
-	else if (upper == "MODE")
-		handleMODE(client, cmd.params);
-	else if (upper == "PRIVMSG")
-		handlePRIVMSG(client, cmd.params);
-	else if (upper == "PART")
-		handlePART(client, cmd.params);
-	else if (upper == "TOPIC")
-		handleTOPIC(client, cmd.params);
-	else if (upper == "CAP" || upper == "WHO" || upper == "WHOIS")
+	const CommandEntry &entry = COMMANDS[index];
+	if (!client.isRegistered() && !entry.preRegistration)
+	{
+		sendNumeric(client, 451, ":You have not registered");
 		return;
-	else
-		sendNumeric(client, 421, std::string(cmd.command), "Unknown command");
+	}
+
+	std::uint64_t start = Metrics::now();
+	_currentTags = cmd.tags;
+	if (entry.handler)
+		(this->*entry.handler)(client, cmd.params);
+	_currentTags = std::string_view();
+	std::uint64_t elapsed = Metrics::now() - start;
+
+	_metrics.processLineNs.record(elapsed);
+	_metrics.commandNs[index].record(elapsed);
+	if (_slowCommandNs && elapsed >= _slowCommandNs)
+	{
+		++_metrics.slowCommands;
+		auto after = _clients.find(clientFd);
+		LOG_WARN("Slow command %s from [%s] fd=%d: %llu us", entry.name,
+				 after != _clients.end() ? after->second.getNickname().c_str() : "<gone>",
+				 clientFd, static_cast<unsigned long long>(elapsed / 1000));
+	}
 }
 
 /*
 ** Parse a command line into command and parameters
-** Returns a ParsedCommand struct, containing the command and a vector of parameters
+** Returns a ParsedCommand struct, containing the IRCv3 tags (without the
+** leading '@'), the command and a vector of parameters
 */
 Server::ParsedCommand Server::parseCommand(std::string_view line)
 {
@@ -338,6 +790,24 @@ Server::ParsedCommand Server::parseCommand(std::string_view line)
 	while (!line.empty() && std::isspace(static_cast<unsigned char>(line.front())))
 		line.remove_prefix(1);
 
+	if (!line.empty() && line.front() == '@')
+	{
+		auto tagsEnd = line.find(' ');
+		result.tags = line.substr(1, tagsEnd == std::string_view::npos ? std::string_view::npos : tagsEnd - 1);
+		line.remove_prefix(tagsEnd == std::string_view::npos ? line.size() : tagsEnd + 1);
+		while (!line.empty() && line.front() == ' ')
+			line.remove_prefix(1);
+	}
+
+	if (!line.empty() && line.front() == ':')
+	{
+		auto prefixEnd = line.find(' ');
+		result.prefix = line.substr(1, prefixEnd == std::string_view::npos ? std::string_view::npos : prefixEnd - 1);
+		line.remove_prefix(prefixEnd == std::string_view::npos ? line.size() : prefixEnd + 1);
+		while (!line.empty() && line.front() == ' ')
+			line.remove_prefix(1);
+	}
+
 	auto spacePos = line.find(' ');
 	if (spacePos == std::string_view::npos)
 	{
@@ -410,20 +880,32 @@ std::string Server::formatPrefix(const Client &client)
 
 /*
 ** Send a message to a client
+** Queued until the flush phase at the end of the loop iteration
 */
 void Server::sendTo(Client &client, const std::string &message)
 {
-	if (client.getFd() < 0)
+	if (client.getFd() < 0 || client.isDeparting())
 		return;
+	if (!client.dataToWrite())
+		_buffers.acquire(client.getWriteBuffer());
 	client.queueMsg(message);
-	for (std::size_t i = 0; i < _fds.size(); ++i)
+	++_metrics.messagesQueued;
+	// A reader this slow is dropped rather than buffered for without end
+	std::size_t sendq = client.getLimits().sendq;
+	if (sendq && client.getWriteBuffer().size() > sendq)
 	{
-		if (_fds[i].fd == client.getFd())
-		{
-			_fds[i].events |= POLLOUT;
-			break;
-		}
+		disconnectClient(client.getFd(), "Max SendQ exceeded");
+		return;
 	}
+	markDirty(client);
+}
+
+/*
+** Send a message to a client, tagged as its capabilities ask for
+*/
+void Server::sendTo(Client &client, OutgoingMessage &message)
+{
+	sendTo(client, message.render(client.getCaps()));
 }
 
 /*
@@ -431,106 +913,240 @@ void Server::sendTo(Client &client, const std::string &message)
 */
 void Server::sendToChannel(Channel &channel, const std::string &message, Client *exclude)
 {
-	const std::unordered_set<Client *> &clients = channel.getMembers();
+	OutgoingMessage outgoing(message);
+	sendToChannel(channel, outgoing, exclude);
+}
+
+/*
+** Send a message to a channel
+** Each tagged variant is rendered once and shared by all members needing it
+*/
+void Server::sendToChannel(Channel &channel, OutgoingMessage &message, Client *exclude)
+{
+	const ClientSet &clients = channel.getMembers();
 	for (Client *client : clients)
 	{
 		if (exclude && client == exclude)
 			continue;
 		if (!client)
 			continue;
-		sendTo(*client, message);
+		sendTo(*client, message.render(client->getCaps()));
 	}
 }
 
 /*
 ** Check if client has completed registration
 ** If so, mark as registered and send welcome messages
+** Registration waits for CAP END while capabilities are being negotiated
 */
 void Server::maybeRegistered(Client &client)
 {
 	if (client.isRegistered())
 		return;
 
-	if (client.hasPassword() && client.hasNickname() && client.hasUsername())
+	if (client.hasPassword() && client.hasNickname() && client.hasUsername() && !client.isNegotiatingCaps())
 	{
 		client.setIsRegistered(true);
 		sendNumeric(client, 001, "Welcome to the IRC Network, " + client.getNickname());
 		sendNumeric(client, 002, "Your host is " + _serverName);
 		sendNumeric(client, 003, "This server was created just now");
 		sendNumeric(client, 004, _serverName + " ft_irc_server v1.0");
+		sendNumeric(client, 005, "CASEMAPPING=rfc1459 CHANTYPES=# PREFIX=(o)@ ELIST=CU :are supported by this server");
 		_wasRegistered = true;
+		client.setNickTime(_clock->now());
+		propagate(userLine(client, 1));
+		reclaimIdentity(client);
 	}
 }
 
 /*
-** Disconnect a client and clean up resources
+** Disconnect a client
+** The client stops being polled and sent to at once, but it is removed by
+** flushDisconnects() at the end of the loop iteration, together with every
+** other client that left in the same iteration
+** relay: tell linked servers the client quit; not when they are told
+** otherwise (a KILL)
 */
-void Server::disconnectClient(int fd, std::string_view reason)
+void Server::disconnectClient(int fd, std::string_view reason, bool relay)
 {
 	auto it = _clients.find(fd);
-	if (it == _clients.end())
+	if (it == _clients.end() || it->second.isDeparting())
 		return;
+	it->second.setDeparting();
+	// The nickname is free again at once, for whoever takes it next
+	unindexNick(it->second);
+	_departures.push_back(Departure{fd, std::string(reason), relay});
+	if (pollfd *pfd = findPollFd(fd))
+		pfd->events = 0;
+}
 
-	Client &client = it->second;
-	std::string nickname = client.hasNickname() ? client.getNickname() : "<unknown>";
-
-	std::cout << "Disconnecting client [" << nickname << "] fd=" << fd
-			  << " reason: " << reason << std::endl;
-
-	::close(fd);
-
-	auto newEnd = std::remove_if(_fds.begin(), _fds.end(),
-								 [fd](const pollfd &pfd)
-								 { return pfd.fd == fd; });
-	_fds.erase(newEnd, _fds.end());
+/*
+** Remove the clients disconnected since the last call, as one batch
+** Each remaining user sharing a channel with them gets all their QUITs in
+** one write, inside a netsplit batch when there are several and it enabled
+** batch. A user sharing several channels with a departing one is told once.
+*/
+void Server::flushDisconnects()
+{
+	if (_departures.empty())
+		return;
+	std::vector<Departure> departures;
+	departures.swap(_departures);
 
+	std::unordered_set<int> closed;
+	std::vector<OutgoingMessage> quits;
+	// Recipient -> indexes in departures of the QUITs it must get, in order
+	std::unordered_map<Client *, std::vector<std::size_t>> notify;
 	std::vector<std::string> emptyChannels;
-	for (auto &channelPair : _channels)
+	quits.reserve(departures.size());
+	for (std::size_t i = 0; i < departures.size(); ++i)
 	{
-		Channel &channel = channelPair.second;
-		try
+		const Departure &departure = departures[i];
+		Client &client = _clients.at(departure.fd);
+		std::string nickname = client.hasNickname() ? client.getNickname() : "<unknown>";
+		// Only users in channels have anyone to tell; the host is looked up before close
+		std::vector<Channel *> joined(client.getChannels().begin(), client.getChannels().end());
+		quits.emplace_back(joined.empty() ? std::string()
+										  : ":" + formatPrefix(client) + "!~" + client.getUsername() + "@"
+												+ getClientHost(departure.fd) + " QUIT :" + departure.reason + "\r\n");
+		if (client.isRemote())
+			LOG_DEBUG("Removing remote user [%s] reason: %s", nickname.c_str(), departure.reason.c_str());
+		else
 		{
-			channel.removeClient(client.getNickname());
+			LOG_INFO("Disconnecting client [%s] fd=%d reason: %s", nickname.c_str(), departure.fd,
+					 departure.reason.c_str());
+			// Remote users leaving were announced by the server that removed them
+			if (client.isRegistered() && departure.relay)
+				propagate(":" + client.getNickname() + " QUIT :" + departure.reason);
+			auto tls = _tlsSessions.find(departure.fd);
+			if (tls != _tlsSessions.end())
+			{
+				tls->second->shutdown();
+				_tlsSessions.erase(tls);
+			}
+			_transport->close(departure.fd);
+			closed.insert(departure.fd);
+			++_metrics.connectionsClosed;
+			if (_capture.enabled())
+				_capture.recordClose(departure.fd);
 		}
-		catch (const errs &)
+
+		for (Channel *channel : joined)
 		{
+			for (Client *member : channel->getMembers())
+			{
+				if (member->isDeparting() || member->isRemote())
+					continue;
+				std::vector<std::size_t> &pending = notify[member];
+				if (pending.empty() || pending.back() != i)
+					pending.push_back(i);
+			}
+			channel->removeClient(&client);
+			if (channel->isEmpty())
+				emptyChannels.push_back(channel->getChannelName());
 		}
-		if (channel.isEmpty())
-			emptyChannels.push_back(channel.getChannelName());
-	}
 
-	_clients.erase(it);
+		// Invitations would otherwise outlive the client, and a later one
+		// at the same address could use them
+		std::vector<Channel *> invitations(client.getInvitations().begin(), client.getInvitations().end());
+		for (Channel *channel : invitations)
+			channel->uninvite(&client);
+
+		unindexNick(client);
+		_listings.erase(departure.fd);
+		_buffers.release(client.getReadBuffer());
+		_buffers.release(client.getWriteBuffer());
+		unmarkDirty(client);
+		_clients.erase(departure.fd);
+		LOG_DEBUG("Client %s disconnected successfully.", nickname.c_str());
+	}
 
+	_fds.erase(std::remove_if(_fds.begin(), _fds.end(),
+							  [&closed](const pollfd &pfd) { return closed.count(pfd.fd) != 0; }),
+			   _fds.end());
 	for (const std::string &chanName : emptyChannels)
-		_channels.erase(chanName);
-	std::cout << "Client " << nickname << " disconnected successfully." << std::endl;
+		removeChannel(chanName);
+
+	std::string batch = "n" + std::to_string(++_batchCounter);
+	std::vector<OutgoingMessage> batched(quits);
+	for (OutgoingMessage &quit : batched)
+		quit.setBatch(batch);
+	for (auto &pair : notify)
+	{
+		Client &recipient = *pair.first;
+		bool split = pair.second.size() > 1 && recipient.hasCap(CAP_BATCH);
+		std::string out;
+		if (split)
+			out = ":" + _serverName + " BATCH +" + batch + " netsplit " + _serverName + " *\r\n";
+		for (std::size_t i : pair.second)
+			out += (split ? batched[i] : quits[i]).render(recipient.getCaps());
+		if (split)
+			out += ":" + _serverName + " BATCH -" + batch + "\r\n";
+		sendTo(recipient, out);
+	}
+	if (departures.size() > 1)
+		LOG_INFO("Disconnected %zu clients in one batch, %zu users notified", departures.size(), notify.size());
 }
 
 /*
 ** Get the client's host name
+** Resolved once and kept on the client: WHO asks for it for every member
+** IPv4 clients of a dual-stack listener show as IPv4, unix socket clients
+** as localhost, and addresses without a name numerically
 ** Returns "unknown" if failed
 */
 std::string Server::getClientHost(int clientFd)
 {
+	auto client = _clients.find(clientFd);
+	if (client != _clients.end() && !client->second.getHost().empty())
+		return client->second.getHost();
+
 	struct sockaddr_storage addr;
 	socklen_t addrLen = sizeof(addr);
 
 	if (getpeername(clientFd, reinterpret_cast<struct sockaddr *>(&addr), &addrLen) < 0)
 	{
-		std::cerr << "getpeername failed: " << strerror(errno) << std::endl;
+		LOG_WARN("getpeername failed: %s", strerror(errno));
 		return "unknown";
 	}
+	if (addr.ss_family == AF_UNIX)
+	{
+		if (client != _clients.end())
+			client->second.setHost("localhost");
+		return "localhost";
+	}
+	const struct sockaddr_in6 *addr6 = reinterpret_cast<const struct sockaddr_in6 *>(&addr);
+	if (addr.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))
+	{
+		struct sockaddr_in addr4{};
+		addr4.sin_family = AF_INET;
+		addr4.sin_port = addr6->sin6_port;
+		std::memcpy(&addr4.sin_addr, &addr6->sin6_addr.s6_addr[12], sizeof(addr4.sin_addr));
+		std::memcpy(&addr, &addr4, sizeof(addr4));
+		addrLen = sizeof(addr4);
+	}
 
 	char host[NI_MAXHOST];
 	char service[NI_MAXSERV];
 
-	if (getnameinfo(reinterpret_cast<struct sockaddr *>(&addr), addrLen,
-					host, sizeof(host), service, sizeof(service),
-					NI_NUMERICSERV) == 0)
-		return std::string(host); 
+	int rc = getnameinfo(reinterpret_cast<struct sockaddr *>(&addr), addrLen,
+						 host, sizeof(host), service, sizeof(service),
+						 NI_NUMERICSERV);
+	if (rc != 0)
+		rc = getnameinfo(reinterpret_cast<struct sockaddr *>(&addr), addrLen,
+						 host, sizeof(host), service, sizeof(service),
+						 NI_NUMERICHOST | NI_NUMERICSERV);
+	if (rc == 0)
+	{
+		// A leading ':' would read as the trailing parameter (::1 becomes 0::1)
+		std::string name = host[0] == ':' ? "0" + std::string(host) : std::string(host);
+		if (client != _clients.end())
+			client->second.setHost(name);
+		return name;
+	}
 	else
 	{
-		std::cerr << "getnameinfo failed: " << strerror(errno) << std::endl;
+		LOG_WARN("getnameinfo failed: %s", gai_strerror(rc));
 		return "unknown";
 	}
 }
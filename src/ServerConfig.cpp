@@ -0,0 +1,105 @@
+#include "Server.hpp"
+#include "Logger.hpp"
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+
+/*
+** Read the configuration file at path and apply it
+** At startup an invalid file is fatal; REHASH and SIGHUP read it again
+*/
+void Server::loadConfig(const std::string &path)
+{
+	_configPath = path;
+	applyConfig(Config::load(path));
+	LOG_INFO("Configuration loaded from %s: %zu listeners, %zu connection classes", path.c_str(),
+			 _config.listeners.size(), _config.classes.size());
+}
+
+/*
+** Ask the main loop to read the configuration file again
+** Only sets a flag, so it is safe to call from a signal handler
+*/
+void Server::requestRehash()
+{
+	_rehashRequested = 1;
+}
+
+/*
+** Read the configuration file again, between two loop iterations
+** A file that does not parse changes nothing; the outcome is logged and
+** sent to the server operators
+*/
+void Server::rehash()
+{
+	_rehashRequested = 0;
+	std::string outcome;
+	if (_configPath.empty())
+		outcome = "No configuration file to reload (IRCSERV_CONFIG)";
+	else
+	{
+		try
+		{
+			applyConfig(Config::load(_configPath));
+			outcome = "Configuration reloaded from " + _configPath;
+			LOG_INFO("%s", outcome.c_str());
+		}
+		catch (const std::exception &e)
+		{
+			outcome = "Rehash failed: " + std::string(e.what());
+			LOG_ERROR("%s", outcome.c_str());
+		}
+	}
+	for (auto &pair : _clients)
+	{
+		Client &client = pair.second;
+		if (pair.first >= 0 && client.isServerOperator())
+			sendTo(client, ":" + _serverName + " NOTICE " + client.getNickname() + " :" + outcome + "\r\n");
+	}
+}
+
+/*
+** Make config the running configuration, without dropping anyone
+** Connected clients take the new limits of their class; listeners added to
+** the file are opened and those removed from it are closed. The listeners
+** come last, so a failed bind leaves every other setting applied.
+*/
+void Server::applyConfig(const Config &config)
+{
+	std::vector<Listener> listeners;
+	for (const std::string &spec : config.listeners)
+	{
+		listeners.push_back(parseListener(spec));
+		listeners.back().configured = true;
+	}
+
+	_config = config;
+	_password = config.password.empty() ? _commandLinePassword : config.password;
+	_readChunk.assign(config.recvBuffer, '\0');
+	_buffers.configure(config.pooledBufferBytes, config.pooledBuffers);
+	for (auto &pair : _clients)
+	{
+		if (pair.first >= 0)
+			pair.second.setLimits(_config.connectionClass(pair.second.getConnClass()));
+	}
+
+	for (std::size_t i = 0; i < _listeners.size();)
+	{
+		const Listener &open = _listeners[i];
+		bool kept = std::any_of(listeners.begin(), listeners.end(),
+								[&](const Listener &listener) { return listener.address == open.address; });
+		if (!open.configured || kept)
+		{
+			++i;
+			continue;
+		}
+		LOG_INFO("No longer listening on %s", open.address.c_str());
+		_fds.erase(std::find_if(_fds.begin(), _fds.end(), [&](const pollfd &pfd) { return pfd.fd == open.fd; }));
+		::close(open.fd);
+		if (open.address.compare(0, 5, "unix:") == 0)
+			::unlink(open.address.c_str() + 5);
+		_listeners.erase(_listeners.begin() + static_cast<std::ptrdiff_t>(i));
+	}
+	for (const Listener &listener : listeners)
+		startListener(listener);
+}
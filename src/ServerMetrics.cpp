@@ -0,0 +1,231 @@
+#include "Server.hpp"
+#include "Logger.hpp"
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+/*
+** Open the metrics exporter
+** Listens on 127.0.0.1:<port> and answers every HTTP request on it with
+** the current metrics in Prometheus text format
+** Does nothing when the listener was inherited through a hot restart
+*/
+void Server::enableMetrics(int port)
+{
+	if (_metricsFd >= 0)
+		return;
+	_metricsFd = ::socket(AF_INET, SOCK_STREAM, 0);
+	if (_metricsFd < 0)
+		throw std::runtime_error("Metrics socket creation failed: " + std::string(strerror(errno)));
+	if (::fcntl(_metricsFd, F_SETFL, O_NONBLOCK) < 0)
+		throw std::runtime_error("Set non-blocking mode failed: " + std::string(strerror(errno)));
+
+	int opt = 1;
+	if (::setsockopt(_metricsFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+		throw std::runtime_error("Set socket options failed: " + std::string(strerror(errno)));
+
+	struct sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (::bind(_metricsFd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+		throw std::runtime_error("Metrics bind failed: " + std::string(strerror(errno)));
+	if (::listen(_metricsFd, 16) < 0)
+		throw std::runtime_error("Metrics listen failed: " + std::string(strerror(errno)));
+
+	pollfd metricsPollFd;
+	metricsPollFd.fd = _metricsFd;
+	metricsPollFd.events = POLLIN;
+	metricsPollFd.revents = 0;
+	_fds.push_back(metricsPollFd);
+	LOG_INFO("Metrics exported on http://127.0.0.1:%d/metrics", port);
+}
+
+/*
+** Commands (and loop iterations) taking at least this long are logged
+** 0 disables the slow-command log
+*/
+void Server::setSlowCommandThreshold(std::uint64_t micros)
+{
+	_slowCommandNs = micros * 1000;
+}
+
+void Server::setOperator(const std::string &name, const std::string &password)
+{
+	_operName = name;
+	_operPassword = password;
+}
+
+/*
+** Accept a scrape connection
+** The request is answered once its header has fully arrived
+*/
+void Server::handleMetricsConnection()
+{
+	int fd = ::accept(_metricsFd, nullptr, nullptr);
+	if (fd < 0)
+	{
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
+			LOG_ERROR("Metrics accept failed: %s", strerror(errno));
+		return;
+	}
+	if (::fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+	{
+		::close(fd);
+		return;
+	}
+	pollfd connPollFd;
+	connPollFd.fd = fd;
+	connPollFd.events = POLLIN;
+	connPollFd.revents = 0;
+	_fds.push_back(connPollFd);
+	_metricsConns.emplace(fd, std::string());
+}
+
+/*
+** Read a scrape request and answer it
+** The response is small enough for the socket buffer, so it is sent in one
+** go and the connection closed right after
+*/
+void Server::handleMetricsRequest(std::size_t index)
+{
+	int fd = _fds[index].fd;
+	std::string &request = _metricsConns[fd];
+	char buffer[BUFFER_SIZE];
+	bool done = false;
+
+	while (true)
+	{
+		ssize_t bytes = ::recv(fd, buffer, sizeof(buffer), 0);
+		if (bytes > 0)
+		{
+			request.append(buffer, static_cast<std::size_t>(bytes));
+			if (request.find("\r\n\r\n") != std::string::npos || request.size() > 8192)
+			{
+				done = true;
+				break;
+			}
+		}
+		else if (bytes == 0 || (errno != EWOULDBLOCK && errno != EAGAIN))
+		{
+			done = true;
+			request.clear();
+			break;
+		}
+		else
+			return;
+	}
+	if (done && !request.empty())
+	{
+		std::string body = renderMetrics();
+		std::string response = "HTTP/1.0 200 OK\r\n"
+							   "Content-Type: text/plain; version=0.0.4\r\n"
+							   "Content-Length: " + std::to_string(body.size()) + "\r\n"
+							   "Connection: close\r\n\r\n" + body;
+		if (::send(fd, response.data(), response.size(), 0) < static_cast<ssize_t>(response.size()))
+			LOG_WARN("Metrics response truncated on fd=%d", fd);
+	}
+	::close(fd);
+	_metricsConns.erase(fd);
+	_fds.erase(_fds.begin() + static_cast<std::ptrdiff_t>(index));
+}
+
+/*
+** Render all metrics, adding the gauges that are read from live state
+*/
+std::string Server::renderMetrics()
+{
+	std::size_t registered = 0;
+	std::uint64_t sendq = 0;
+	std::uint64_t recvq = 0;
+	std::uint64_t buffered = 0;
+	for (const auto &pair : _clients)
+	{
+		if (pair.second.isRegistered())
+			++registered;
+		sendq += pair.second.getWriteBuffer().size();
+		recvq += pair.second.getReadBuffer().size();
+		buffered += pair.second.getWriteBuffer().capacity() + pair.second.getReadBuffer().capacity();
+	}
+
+	std::ostringstream out;
+	Metrics::renderGauge(out, "ircserv_clients", "Connected clients", _clients.size());
+	Metrics::renderGauge(out, "ircserv_clients_registered", "Registered clients", registered);
+	Metrics::renderGauge(out, "ircserv_channels", "Existing channels", _channels.size());
+	Metrics::renderGauge(out, "ircserv_sendq_bytes_total", "Bytes queued in all write buffers", sendq);
+	Metrics::renderGauge(out, "ircserv_recvq_bytes_total", "Bytes held in all read buffers", recvq);
+	Metrics::renderGauge(out, "ircserv_client_buffer_bytes", "Capacity of all client read and write buffers", buffered);
+	Metrics::renderGauge(out, "ircserv_buffer_pool_buffers", "Empty buffers kept for reuse", _buffers.freeBuffers());
+	Metrics::renderGauge(out, "ircserv_buffer_pool_bytes", "Capacity of the empty buffers kept for reuse",
+						 _buffers.freeBytes());
+	Metrics::renderCounter(out, "ircserv_buffer_pool_reused_total", "Client buffers given pooled storage",
+						   _buffers.reused());
+	Metrics::renderCounter(out, "ircserv_buffer_pool_discarded_total",
+						   "Emptied buffers freed because they were too large or the pool was full",
+						   _buffers.discarded());
+	Metrics::renderGauge(out, "ircserv_uptime_seconds", "Seconds since the server started",
+						 static_cast<std::uint64_t>(std::time(nullptr) - _startTime));
+	Metrics::renderCounter(out, "ircserv_log_dropped_total", "Log records dropped because the ring was full",
+						   Logger::instance().dropped());
+	Metrics::renderCounter(out, "ircserv_channel_snapshots_total", "Channel snapshots written", _store.snapshots());
+	Metrics::renderCounter(out, "ircserv_channel_snapshot_failures_total", "Channel snapshots that failed",
+						   _store.snapshotFailures());
+	Metrics::renderCounter(out, "ircserv_channel_log_records_total", "Channel changes written to the log",
+						   _store.logRecords());
+	Metrics::renderGauge(out, "ircserv_history_bytes", "Bytes allocated to message history", _history.bytes());
+	Metrics::renderGauge(out, "ircserv_history_rings", "Message history rings", _history.rings());
+	Metrics::renderCounter(out, "ircserv_history_evictions_total", "Channel histories evicted to stay under the cap",
+						   _history.evictions());
+	if (_tls.enabled())
+	{
+		Metrics::renderCounter(out, "ircserv_tls_handshakes_total", "TLS handshakes completed", _tls.handshakes());
+		Metrics::renderCounter(out, "ircserv_tls_resumed_total", "TLS handshakes that resumed a session",
+							   _tls.resumed());
+		Metrics::renderCounter(out, "ircserv_tls_kernel_total", "TLS connections handed to kernel TLS",
+							   _tls.offloaded());
+		Metrics::renderCounter(out, "ircserv_tls_failures_total", "TLS handshakes that failed", _tls.failures());
+		Metrics::renderGauge(out, "ircserv_tls_userspace_sessions",
+							 "TLS connections in the handshake or encrypted in user space", _tlsSessions.size());
+	}
+	renderListeners(out);
+	renderSlabs(out);
+	_metrics.render(out);
+
+	const char *names[Metrics::MAX_COMMANDS];
+	for (int i = 0; i < COMMAND_COUNT && i < Metrics::MAX_COMMANDS; ++i)
+		names[i] = COMMANDS[i].name;
+	_metrics.renderCommands(out, names, COMMAND_COUNT);
+	return out.str();
+}
+
+/*
+** Connections accepted on each listener, labelled by address and class
+*/
+void Server::renderListeners(std::ostringstream &out) const
+{
+	out << "# HELP ircserv_listener_connections_total Connections accepted on each listener\n"
+		<< "# TYPE ircserv_listener_connections_total counter\n";
+	for (const Listener &listener : _listeners)
+		out << "ircserv_listener_connections_total{listener=\"" << listener.address << "\",class=\""
+			<< listener.connClass << "\"} " << listener.accepted << "\n";
+}
+
+/*
+** Slab pool occupancy, labelled by pool and object size
+*/
+void Server::renderSlabs(std::ostringstream &out)
+{
+	std::vector<SlabPool::Stats> pools = SlabPool::report();
+	out << "# HELP ircserv_slab_objects Objects allocated from each slab pool\n"
+		<< "# TYPE ircserv_slab_objects gauge\n";
+	for (const SlabPool::Stats &pool : pools)
+		out << "ircserv_slab_objects{pool=\"" << pool.name << "\",size=\"" << pool.objectSize << "\"} "
+			<< pool.inUse << "\n";
+	out << "# HELP ircserv_slab_capacity_objects Objects the slabs of each pool can hold\n"
+		<< "# TYPE ircserv_slab_capacity_objects gauge\n";
+	for (const SlabPool::Stats &pool : pools)
+		out << "ircserv_slab_capacity_objects{pool=\"" << pool.name << "\",size=\"" << pool.objectSize << "\"} "
+			<< pool.capacity << "\n";
+}
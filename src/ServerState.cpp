@@ -0,0 +1,175 @@
+#include "Server.hpp"
+#include "Logger.hpp"
+
+/*
+** Restore channel settings saved at path and keep them up to date
+** Restored channels start out empty and stay until their first users have
+** joined and left again, or for RESTORE_HOLD_SECONDS if nobody joins them.
+** Channels already present (inherited through a hot restart) win over the
+** copy on disk, and none are restored past max_channels.
+** snapshotSeconds: interval between background snapshots, 0 to only save
+** at shutdown
+*/
+void Server::enableStateStore(const std::string &path, unsigned snapshotSeconds)
+{
+	std::uint64_t start = Metrics::now();
+	ChannelStore::SavedChannels saved;
+	_store.load(path, saved);
+	std::size_t restored = 0;
+	std::vector<std::string> dropped;
+	_channels.reserve(_channels.size() + saved.size());
+	for (auto &pair : saved)
+	{
+		if (_channelCount >= _config.maxChannels && !findChannel(pair.first))
+			dropped.push_back(pair.first);
+		else
+			restored += addChannel(std::move(pair.second)) != nullptr;
+	}
+	if (restored)
+		_restoredUntil = _clock->now() + RESTORE_HOLD_SECONDS;
+	_store.setInterval(snapshotSeconds);
+	_store.open(path);
+	for (const std::string &name : dropped)
+		_store.logRemove(name);
+	if (!dropped.empty())
+		LOG_WARN("Dropped %zu saved channels over max_channels (%d)", dropped.size(), _config.maxChannels);
+	LOG_INFO("Restored %zu channels from %s in %llu us", restored, path.c_str(),
+			 static_cast<unsigned long long>((Metrics::now() - start) / 1000));
+}
+
+/*
+** Add a channel to _channels and to the ordered index LIST walks
+** Returns the stored channel, or nullptr if the name is already taken
+*/
+Channel *Server::addChannel(Channel channel)
+{
+	NameHandle name = _names.intern(channel.getChannelName());
+	auto inserted = _channels.emplace(name, std::move(channel));
+	if (!inserted.second)
+	{
+		_names.release(name);
+		return nullptr;
+	}
+	_channelIndex.emplace(name->text, &inserted.first->second);
+	_channelCount++;
+	return &inserted.first->second;
+}
+
+/*
+** Find a channel by name, in any case, without allocating
+*/
+Channel *Server::findChannel(std::string_view name)
+{
+	NameHandle handle = _names.find(name);
+	if (!handle)
+		return nullptr;
+	auto it = _channels.find(handle);
+	return it == _channels.end() ? nullptr : &it->second;
+}
+
+/*
+** Log a change to a channel's settings
+*/
+void Server::persistChannel(const Channel &channel)
+{
+	if (_store.enabled())
+		_store.logPut(channel);
+}
+
+/*
+** Delete a channel once its last member is gone
+** Its history goes too, so whoever recreates it cannot read the old one
+** name may be the channel's own, so it is not used once the channel is gone
+*/
+void Server::removeChannel(const std::string &name)
+{
+	NameHandle handle = _names.find(name);
+	auto it = handle ? _channels.find(handle) : _channels.end();
+	if (it == _channels.end())
+		return;
+	std::string canonical = it->second.getChannelName();
+	it->second.clearInvites();
+	_channelIndex.erase(handle->text);
+	_channels.erase(it);
+	_names.release(handle);
+	_channelCount--;
+	_history.dropChannel(canonical);
+	if (_store.enabled())
+		_store.logRemove(canonical);
+}
+
+/*
+** Invite target to chan for the configured time
+** A busy +i channel holds at most max_invites of them
+*/
+void Server::invite(Channel &chan, Client &target)
+{
+	std::time_t expires = _config.inviteTtl ? _clock->now() + _config.inviteTtl
+											: std::numeric_limits<std::time_t>::max();
+	chan.inviteUser(&target, expires, _config.maxInvites);
+}
+
+/*
+** Drop expired invitations, at most once per sweep interval
+** The interval follows invite_ttl, so an expired invitation lingers no
+** longer than it lived; an expired one is refused by JOIN meanwhile
+*/
+void Server::tickInvites()
+{
+	std::time_t now = _clock->now();
+	if (!_config.inviteTtl || now < _nextInviteSweep)
+		return;
+	_nextInviteSweep = now + (_config.inviteTtl < INVITE_SWEEP_SECONDS ? _config.inviteTtl : INVITE_SWEEP_SECONDS);
+	std::size_t expired = 0;
+	for (auto &pair : _channels)
+	{
+		if (!pair.second.getInvited().empty())
+			expired += pair.second.expireInvites(now);
+	}
+	_metrics.invitesExpired += expired;
+	if (expired)
+		LOG_DEBUG("Expired %zu invitations", expired);
+}
+
+/*
+** Drop the restored or imported channels still empty once their hold is over
+** A channel otherwise goes with its last member. One restored without members
+** and left empty would stay for good, an invite-only one with nobody inside
+** to invite anyone.
+*/
+void Server::tickRestoredChannels()
+{
+	if (!_restoredUntil || _clock->now() < _restoredUntil)
+		return;
+	_restoredUntil = 0;
+	std::vector<std::string> unclaimed;
+	for (const auto &pair : _channels)
+		if (pair.second.getCurrentUsers() == 0)
+			unclaimed.push_back(pair.second.getChannelName());
+	for (const std::string &name : unclaimed)
+		removeChannel(name);
+	if (!unclaimed.empty())
+		LOG_INFO("Dropped %zu restored or imported channels nobody joined", unclaimed.size());
+}
+
+/*
+** Size the message history kept for CHATHISTORY
+** totalBytes caps all of it (0 disables history); channelBytes and
+** privateBytes cap one channel's ring and the shared private-message ring
+*/
+void Server::configureHistory(std::size_t totalBytes, std::size_t channelBytes, std::size_t privateBytes)
+{
+	_history.configure(totalBytes, channelBytes, privateBytes);
+}
+
+/*
+** The key of client's private message history, handed out on first use
+** It belongs to the connection: whoever takes the nickname next does not
+** get the messages, and a nick change keeps them
+*/
+std::uint64_t Server::historyId(Client &client)
+{
+	if (!client.getHistoryId())
+		client.setHistoryId(_nextHistoryId++);
+	return client.getHistoryId();
+}
@@ -0,0 +1,86 @@
+#include "Server.hpp"
+#include "Logger.hpp"
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/*
+** Load the PEM certificate chain and key of the listeners marked tls
+*/
+void Server::enableTls(const std::string &certPath, const std::string &keyPath)
+{
+	if (!TlsContext::supported())
+		throw std::runtime_error("A TLS certificate is set, but ircserv was built without TLS support (make TLS=1)");
+	_tls.load(certPath, keyPath);
+	LOG_INFO("TLS certificate %s loaded", certPath.c_str());
+}
+
+/*
+** Drive the TLS handshake of the client at index
+** Once it is done, a connection running in kernel TLS drops its session and
+** is served like any other; otherwise the session stays for receive() and
+** transmit()
+*/
+void Server::continueTlsHandshake(std::size_t index)
+{
+	int fd = _fds[index].fd;
+	TlsSession &session = *_tlsSessions.at(fd);
+	switch (session.handshake())
+	{
+		case TlsSession::WantRead:
+			_fds[index].events = POLLIN;
+			return;
+		case TlsSession::WantWrite:
+			_fds[index].events = POLLIN | POLLOUT;
+			return;
+		case TlsSession::Failed:
+			_tls.countFailure();
+			disconnectClient(fd, "TLS handshake failed");
+			return;
+		case TlsSession::Established:
+			break;
+	}
+	_tls.countHandshake(session);
+	bool offloaded = session.offloaded();
+	LOG_DEBUG("TLS handshake done on fd=%d (%s, %s)", fd, session.resumed() ? "resumed" : "full",
+			  offloaded ? "kernel TLS" : "user-space TLS");
+	if (offloaded)
+		_tlsSessions.erase(fd);
+	// Replies queued during the handshake go out in the next flush phase
+	_fds[index].events = POLLIN;
+	Client &client = _clients.at(fd);
+	if (client.dataToWrite())
+		markDirty(client);
+	// Lines sent along with the end of the handshake may already be decrypted
+	if (!offloaded)
+		handleClientRead(index);
+}
+
+/*
+** recv() and send() for client connections, through OpenSSL for those
+** whose TLS runs in user space and through the transport for the others
+** more: further output follows shortly (MSG_MORE), so a last partial
+** segment may wait for it
+*/
+ssize_t Server::receive(int fd, char *buffer, std::size_t size)
+{
+	if (!_tlsSessions.empty())
+	{
+		auto tls = _tlsSessions.find(fd);
+		if (tls != _tlsSessions.end())
+			return tls->second->read(buffer, size);
+	}
+	return _transport->recv(fd, buffer, size);
+}
+
+ssize_t Server::transmit(int fd, const char *data, std::size_t size, bool more)
+{
+	if (!_tlsSessions.empty())
+	{
+		auto tls = _tlsSessions.find(fd);
+		if (tls != _tlsSessions.end())
+			return tls->second->write(data, size);
+	}
+	return _transport->send(fd, data, size, more);
+}
@@ -0,0 +1,96 @@
+#include "Slab.hpp"
+#include <algorithm>
+#include <cstring>
+
+SlabPool::SlabPool(const char *name, std::size_t objectSize)
+	: _name(name), _objectSize(slotSize(objectSize)),
+	  _perSlab(std::max<std::size_t>(SLAB_BYTES / _objectSize, 1))
+{
+}
+
+/*
+** Bytes taken by an object: it must hold a free-list link and keep the
+** objects after it aligned
+*/
+std::size_t SlabPool::slotSize(std::size_t objectSize)
+{
+	const std::size_t align = alignof(std::max_align_t);
+	objectSize = std::max(objectSize, sizeof(FreeObject));
+	return (objectSize + align - 1) / align * align;
+}
+
+SlabPool::~SlabPool()
+{
+	for (void *slab : _slabs)
+		::operator delete(slab);
+}
+
+std::vector<std::unique_ptr<SlabPool>> &SlabPool::registry()
+{
+	static std::vector<std::unique_ptr<SlabPool>> pools;
+	return pools;
+}
+
+/*
+** The pool for objects of objectSize bytes under name, created on first use
+*/
+SlabPool &SlabPool::get(const char *name, std::size_t objectSize)
+{
+	std::vector<std::unique_ptr<SlabPool>> &pools = registry();
+	std::size_t slot = slotSize(objectSize);
+	for (const std::unique_ptr<SlabPool> &pool : pools)
+		if (pool->_objectSize == slot && std::strcmp(pool->_name, name) == 0)
+			return *pool;
+	pools.emplace_back(new SlabPool(name, objectSize));
+	return *pools.back();
+}
+
+/*
+** Occupancy of every pool
+*/
+std::vector<SlabPool::Stats> SlabPool::report()
+{
+	std::vector<Stats> stats;
+	for (const std::unique_ptr<SlabPool> &pool : registry())
+		stats.push_back(pool->stats());
+	return stats;
+}
+
+/*
+** Take an object off the free list, carving a new slab when it is empty
+*/
+void *SlabPool::allocate()
+{
+	if (!_free)
+	{
+		char *slab = static_cast<char *>(::operator new(_perSlab * _objectSize));
+		_slabs.push_back(slab);
+		// Thread the new objects so they are handed out in address order
+		for (std::size_t i = _perSlab; i-- > 0;)
+		{
+			FreeObject *object = reinterpret_cast<FreeObject *>(slab + i * _objectSize);
+			object->next = _free;
+			_free = object;
+		}
+	}
+	FreeObject *object = _free;
+	_free = object->next;
+	if (++_inUse > _peak)
+		_peak = _inUse;
+	return object;
+}
+
+void SlabPool::deallocate(void *object) noexcept
+{
+	if (!object)
+		return;
+	FreeObject *freed = static_cast<FreeObject *>(object);
+	freed->next = _free;
+	_free = freed;
+	--_inUse;
+}
+
+SlabPool::Stats SlabPool::stats() const noexcept
+{
+	return Stats{ _name, _objectSize, _inUse, _slabs.size() * _perSlab, _peak, _slabs.size() };
+}
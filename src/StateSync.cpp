@@ -0,0 +1,44 @@
+#include "StateSync.hpp"
+#include <stdexcept>
+
+const char SyncStream::MAGIC[] = "IRCSYNC";
+
+/*
+** Write the frame header with a placeholder length
+** Returns where the frame starts, for end()
+*/
+std::size_t SyncStream::begin(WireWriter &out, FrameType type)
+{
+	std::size_t start = out.buffer().size();
+	out.u32(0);
+	out.u8(type);
+	return start;
+}
+
+/*
+** Patch the length of the frame started at start, now that it is complete
+*/
+void SyncStream::end(WireWriter &out, std::size_t start)
+{
+	std::string &buffer = out.buffer();
+	std::uint32_t length = static_cast<std::uint32_t>(buffer.size() - start - 4);
+	for (int i = 0; i < 4; ++i)
+		buffer[start + static_cast<std::size_t>(i)] = static_cast<char>((length >> (8 * i)) & 0xff);
+}
+
+bool SyncStream::next(const std::string &buffer, std::size_t &offset, Frame &frame)
+{
+	if (buffer.size() - offset < 4)
+		return false;
+	WireReader header(buffer.data() + offset, 4);
+	std::uint32_t length = header.u32();
+	if (length == 0 || length > MAX_FRAME_BYTES)
+		throw std::runtime_error("Corrupt sync frame of " + std::to_string(length) + " bytes");
+	if (buffer.size() - offset - 4 < length)
+		return false;
+	frame.type = static_cast<FrameType>(buffer[offset + 4]);
+	frame.data = buffer.data() + offset + 5;
+	frame.size = length - 1;
+	offset += 4 + length;
+	return true;
+}
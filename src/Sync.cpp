@@ -0,0 +1,517 @@
+#include "Server.hpp"
+#include "Logger.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+/*
+** State sync
+** A server started with IRCSERV_SYNC_SOCKET streams its users and channels
+** (SyncStream frames) to every standby that connects there. A standby started
+** with IRCSERV_SYNC_FROM imports such a stream while it serves: it applies
+** frames for at most SYNC_SLICE_NS per loop iteration, and stops reading
+** while SYNC_BUFFER_BYTES are waiting, so the sender is paced by the apply.
+**
+** Channels are imported with their settings and operators, and without
+** members. Users are held as identities: a client registering with the same
+** nickname, username and host within SYNC_HOLD_SECONDS is put back into its
+** channels, and gets its operator status back. That check is the only way
+** imported operators get their status back: the channels do not keep them.
+*/
+
+static std::string foldName(std::string_view name)
+{
+	std::string folded(name);
+	for (char &c : folded)
+		c = NameTable::fold(c);
+	return folded;
+}
+
+/*
+** Listen for standby processes on a unix socket
+** A stale socket file left by a crashed process is replaced
+*/
+void Server::enableSyncExport(const std::string &path)
+{
+	struct sockaddr_un addr = unixAddress(path);
+	_syncFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (_syncFd < 0)
+		throw std::runtime_error("Sync socket creation failed: " + std::string(strerror(errno)));
+	::unlink(path.c_str());
+	if (::bind(_syncFd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+		throw std::runtime_error("Sync bind failed: " + std::string(strerror(errno)));
+	if (::listen(_syncFd, 4) < 0)
+		throw std::runtime_error("Sync listen failed: " + std::string(strerror(errno)));
+	if (::fcntl(_syncFd, F_SETFL, O_NONBLOCK) < 0)
+		throw std::runtime_error("Set non-blocking mode failed: " + std::string(strerror(errno)));
+	_syncPath = path;
+
+	pollfd syncPollFd;
+	syncPollFd.fd = _syncFd;
+	syncPollFd.events = POLLIN;
+	syncPollFd.revents = 0;
+	_fds.push_back(syncPollFd);
+	LOG_INFO("State sync socket ready at %s", path.c_str());
+}
+
+/*
+** Import the state streamed by the server listening at path
+** Only connects: the stream is read and applied by the event loop
+*/
+void Server::importState(const std::string &path)
+{
+	struct sockaddr_un addr = unixAddress(path);
+	int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		throw std::runtime_error("Sync socket creation failed: " + std::string(strerror(errno)));
+	if (::connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0
+		|| ::fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+	{
+		int error = errno;
+		::close(sock);
+		throw std::runtime_error("Cannot reach server to import from at " + path + ": " + strerror(error));
+	}
+	_import = SyncImport();
+	_import.fd = sock;
+	_import.startNs = Metrics::now();
+
+	pollfd importPollFd;
+	importPollFd.fd = sock;
+	importPollFd.events = POLLIN;
+	importPollFd.revents = 0;
+	_fds.push_back(importPollFd);
+	LOG_INFO("Importing state from %s", path.c_str());
+}
+
+/// Export ///
+
+/*
+** A standby connected: encode the state as it is now and start sending it
+*/
+void Server::handleSyncConnection()
+{
+	int sock = ::accept(_syncFd, nullptr, nullptr);
+	if (sock < 0)
+		return;
+	if (::fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+	{
+		::close(sock);
+		return;
+	}
+	std::uint64_t start = Metrics::now();
+	WireWriter out;
+	encodeSyncState(out);
+	SyncExport &sync = _syncExports[sock];
+	sync.out.swap(out.buffer());
+	sync.startNs = Metrics::now();
+
+	pollfd syncPollFd;
+	syncPollFd.fd = sock;
+	syncPollFd.events = POLLIN | POLLOUT;
+	syncPollFd.revents = 0;
+	_fds.push_back(syncPollFd);
+	LOG_INFO("Streaming state to standby on fd=%d: %zu bytes, encoded in %llu us", sock, sync.out.size(),
+			 static_cast<unsigned long long>((sync.startNs - start) / 1000));
+}
+
+/*
+** Write every registered local user, then every channel with its members
+*/
+void Server::encodeSyncState(WireWriter &out)
+{
+	std::vector<Client *> users;
+	users.reserve(_clients.size());
+	for (auto &pair : _clients)
+		if (pair.second.isRegistered() && !pair.second.isRemote() && !pair.second.isDeparting())
+			users.push_back(&pair.second);
+
+	std::size_t frame = SyncStream::begin(out, SyncStream::HelloFrame);
+	out.str(SyncStream::MAGIC);
+	out.u32(SyncStream::VERSION);
+	out.str(_serverName);
+	out.u32(static_cast<std::uint32_t>(users.size()));
+	out.u32(static_cast<std::uint32_t>(_channels.size()));
+	SyncStream::end(out, frame);
+
+	for (Client *user : users)
+	{
+		frame = SyncStream::begin(out, SyncStream::UserFrame);
+		out.str(user->getNickname());
+		out.str(user->getUsername());
+		out.str(getClientHost(user->getFd()));
+		SyncStream::end(out, frame);
+	}
+	std::vector<Client *> members;
+	for (const auto &pair : _channels)
+	{
+		members.clear();
+		for (Client *member : pair.second.getMembers())
+			if (member->isRegistered() && !member->isRemote() && !member->isDeparting())
+				members.push_back(member);
+		frame = SyncStream::begin(out, SyncStream::ChannelFrame);
+		pair.second.serializeSettings(out);
+		out.u32(static_cast<std::uint32_t>(members.size()));
+		for (Client *member : members)
+		{
+			out.str(member->getNickname());
+			out.u8(pair.second.isOperator(member));
+		}
+		SyncStream::end(out, frame);
+	}
+	SyncStream::end(out, SyncStream::begin(out, SyncStream::EndFrame));
+}
+
+/*
+** Send what the socket takes of the stream, then wait for the standby's Done
+*/
+void Server::handleSyncExport(std::size_t index)
+{
+	int fd = _fds[index].fd;
+	SyncExport &sync = _syncExports.at(fd);
+	short revents = _fds[index].revents;
+
+	if ((revents & POLLOUT) && sync.sent < sync.out.size())
+	{
+		while (sync.sent < sync.out.size())
+		{
+			ssize_t n = ::send(fd, sync.out.data() + sync.sent, sync.out.size() - sync.sent, MSG_NOSIGNAL);
+			if (n < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+				break;
+			if (n < 0)
+			{
+				LOG_WARN("State sync to fd=%d failed: %s", fd, strerror(errno));
+				closeSyncExport(index);
+				return;
+			}
+			sync.sent += static_cast<std::size_t>(n);
+		}
+		if (sync.sent == sync.out.size())
+			_fds[index].events = POLLIN;
+	}
+	if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+		return;
+
+	char buffer[BUFFER_SIZE];
+	while (true)
+	{
+		ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+		if (n > 0)
+		{
+			sync.in.append(buffer, static_cast<std::size_t>(n));
+			continue;
+		}
+		if (n < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+			return;
+		break;
+	}
+
+	std::size_t offset = 0;
+	SyncStream::Frame frame;
+	try
+	{
+		if (SyncStream::next(sync.in, offset, frame) && frame.type == SyncStream::DoneFrame)
+		{
+			WireReader done(frame.data, frame.size);
+			std::uint64_t applyNs = done.u64();
+			std::uint64_t longestSliceNs = done.u64();
+			std::uint32_t slices = done.u32();
+			std::uint32_t users = done.u32();
+			std::uint32_t channels = done.u32();
+			LOG_INFO("Standby on fd=%d imported %u users and %u channels (%zu bytes) in %llu ms; "
+					 "applying took %llu ms in %u slices, the longest %llu us",
+					 fd, users, channels, sync.out.size(),
+					 static_cast<unsigned long long>((Metrics::now() - sync.startNs) / 1000000),
+					 static_cast<unsigned long long>(applyNs / 1000000), slices,
+					 static_cast<unsigned long long>(longestSliceNs / 1000));
+			closeSyncExport(index);
+			return;
+		}
+	}
+	catch (const std::exception &)
+	{
+	}
+	LOG_WARN("Standby on fd=%d left after %zu of %zu bytes", fd, sync.sent, sync.out.size());
+	closeSyncExport(index);
+}
+
+void Server::closeSyncExport(std::size_t index)
+{
+	int fd = _fds[index].fd;
+	::close(fd);
+	_syncExports.erase(fd);
+	_fds.erase(_fds.begin() + static_cast<std::ptrdiff_t>(index));
+}
+
+/// Import ///
+
+/*
+** Buffer what the server we import from sent
+** Applying happens in tickSync(), a slice per loop iteration
+*/
+void Server::handleSyncImport(std::size_t index)
+{
+	char buffer[BUFFER_SIZE * 16];
+	while (!syncBufferFull())
+	{
+		ssize_t n = ::recv(_import.fd, buffer, sizeof(buffer), 0);
+		if (n > 0)
+		{
+			_import.buffer.append(buffer, static_cast<std::size_t>(n));
+			continue;
+		}
+		if (n < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+			break;
+		// The End frame may still be waiting in the buffer
+		if (!syncPending())
+			finishImport(n == 0 ? "stream ended early" : strerror(errno));
+		else
+			_fds[index].events = 0;
+		return;
+	}
+	if (syncBufferFull())
+		_fds[index].events = 0;
+}
+
+/*
+** True while a complete frame waits to be applied, so poll must not block
+*/
+bool Server::syncPending() const
+{
+	if (_import.fd < 0)
+		return false;
+	std::size_t offset = _import.offset;
+	SyncStream::Frame frame;
+	try
+	{
+		return SyncStream::next(_import.buffer, offset, frame);
+	}
+	catch (const std::exception &)
+	{
+		return true;
+	}
+}
+
+/*
+** True once enough is buffered to stop reading: SYNC_BUFFER_BYTES, holding at
+** least one complete frame however large
+*/
+bool Server::syncBufferFull() const
+{
+	return _import.buffer.size() - _import.offset >= SYNC_BUFFER_BYTES && syncPending();
+}
+
+/*
+** Once per loop iteration: apply a slice of the import, and forget the
+** identities nobody reclaimed in time
+*/
+void Server::tickSync()
+{
+	if (_import.fd >= 0)
+		applySyncFrames();
+	if (!_held.empty() && _import.fd < 0 && _clock->now() >= _heldUntil)
+	{
+		LOG_INFO("Released %zu imported identities that were not reclaimed", _held.size());
+		_held.clear();
+	}
+}
+
+/*
+** Apply buffered frames for at most SYNC_SLICE_NS
+*/
+void Server::applySyncFrames()
+{
+	std::uint64_t start = Metrics::now();
+	bool applied = false;
+	bool ended = false;
+	SyncStream::Frame frame;
+	try
+	{
+		while (SyncStream::next(_import.buffer, _import.offset, frame))
+		{
+			applied = true;
+			if (!applySyncFrame(frame))
+			{
+				ended = true;
+				break;
+			}
+			if (Metrics::now() - start >= SYNC_SLICE_NS)
+				break;
+		}
+	}
+	catch (const std::exception &e)
+	{
+		finishImport(e.what());
+		return;
+	}
+	if (applied)
+	{
+		std::uint64_t slice = Metrics::now() - start;
+		_import.applyNs += slice;
+		_import.longestSliceNs = std::max(_import.longestSliceNs, slice);
+		++_import.slices;
+	}
+	if (ended)
+	{
+		finishImport("");
+		return;
+	}
+
+	if (_import.offset > 0 && _import.offset * 2 >= _import.buffer.size())
+	{
+		_import.buffer.erase(0, _import.offset);
+		_import.offset = 0;
+	}
+	if (!syncBufferFull())
+		for (pollfd &pfd : _fds)
+			if (pfd.fd == _import.fd)
+				pfd.events = POLLIN;
+}
+
+/*
+** Apply one frame; returns false at the end of the stream
+*/
+bool Server::applySyncFrame(const SyncStream::Frame &frame)
+{
+	WireReader in(frame.data, frame.size);
+	if (!_import.started && frame.type != SyncStream::HelloFrame)
+		throw std::runtime_error("Sync stream does not start with Hello");
+	switch (frame.type)
+	{
+		case SyncStream::HelloFrame:
+		{
+			if (in.str() != SyncStream::MAGIC || in.u32() != SyncStream::VERSION)
+				throw std::runtime_error("Incompatible sync stream");
+			_import.source = in.str();
+			std::uint32_t users = in.u32();
+			std::uint32_t channels = in.u32();
+			_held.reserve(_held.size() + users);
+			_channels.reserve(_channels.size() + channels);
+			_import.started = true;
+			return true;
+		}
+		case SyncStream::UserFrame:
+		{
+			std::string nick = in.str();
+			HeldIdentity &held = _held[foldName(nick)];
+			held.username = in.str();
+			held.host = in.str();
+			held.channels.clear();
+			held.operatorOf.clear();
+			++_import.users;
+			return true;
+		}
+		case SyncStream::ChannelFrame:
+		{
+			// A channel this server already has keeps its own settings, and
+			// none are added past max_channels
+			Channel settings = Channel::deserializeSettings(in);
+			Channel *chan = nullptr;
+			if (!findChannel(settings.getChannelName()))
+			{
+				if (_channelCount < _config.maxChannels)
+					chan = addChannel(std::move(settings));
+				else
+					++_import.droppedChannels;
+			}
+			std::uint32_t count = in.u32();
+			for (std::uint32_t i = 0; i < count; ++i)
+			{
+				std::string nick = in.str();
+				bool wasOperator = in.u8();
+				auto it = chan ? _held.find(foldName(nick)) : _held.end();
+				if (it == _held.end())
+					continue;
+				// Operator status goes with the held identities, never by nickname
+				it->second.channels.push_back(chan->getChannelName());
+				if (wasOperator)
+					it->second.operatorOf.push_back(chan->getChannelName());
+			}
+			if (chan)
+			{
+				persistChannel(*chan);
+				++_import.channels;
+			}
+			return true;
+		}
+		case SyncStream::EndFrame:
+			return false;
+		default:
+			throw std::runtime_error("Unknown sync frame type " + std::to_string(frame.type));
+	}
+}
+
+/*
+** Stop importing, answering the server with a Done frame if it went well
+** What was applied before an error is kept
+*/
+void Server::finishImport(const std::string &error)
+{
+	std::uint64_t elapsedNs = Metrics::now() - _import.startNs;
+	if (error.empty())
+	{
+		WireWriter out;
+		std::size_t frame = SyncStream::begin(out, SyncStream::DoneFrame);
+		out.u64(_import.applyNs);
+		out.u64(_import.longestSliceNs);
+		out.u32(_import.slices);
+		out.u32(_import.users);
+		out.u32(_import.channels);
+		SyncStream::end(out, frame);
+		if (::send(_import.fd, out.buffer().data(), out.buffer().size(), MSG_NOSIGNAL) < 0)
+			LOG_WARN("Could not acknowledge the import: %s", strerror(errno));
+		LOG_INFO("Imported %u users and %u channels from %s in %llu ms; applying took %llu ms in %u slices, "
+				 "the longest %llu us",
+				 _import.users, _import.channels, _import.source.c_str(),
+				 static_cast<unsigned long long>(elapsedNs / 1000000),
+				 static_cast<unsigned long long>(_import.applyNs / 1000000), _import.slices,
+				 static_cast<unsigned long long>(_import.longestSliceNs / 1000));
+	}
+	else
+		LOG_ERROR("State import stopped after %u users and %u channels: %s", _import.users, _import.channels,
+				  error.c_str());
+
+	if (_import.droppedChannels)
+		LOG_WARN("Dropped %u imported channels over max_channels (%d)", _import.droppedChannels,
+				 _config.maxChannels);
+	// Imported channels nobody rejoins go when the identities are released
+	if (_import.channels)
+		_restoredUntil = _clock->now() + SYNC_HOLD_SECONDS;
+
+	int fd = _import.fd;
+	::close(fd);
+	auto newEnd = std::remove_if(_fds.begin(), _fds.end(), [fd](const pollfd &pfd) { return pfd.fd == fd; });
+	_fds.erase(newEnd, _fds.end());
+	_import = SyncImport();
+	_heldUntil = _clock->now() + SYNC_HOLD_SECONDS;
+}
+
+/*
+** A client registered: if it is a user imported from another server, put it
+** back into its channels
+*/
+void Server::reclaimIdentity(Client &client)
+{
+	if (_held.empty())
+		return;
+	auto it = _held.find(foldName(client.getNickname()));
+	if (it == _held.end() || it->second.username != client.getUsername()
+		|| it->second.host != getClientHost(client.getFd()))
+		return;
+	HeldIdentity held = std::move(it->second);
+	_held.erase(it);
+	for (const std::string &name : held.channels)
+	{
+		Channel *chan = findChannel(name);
+		if (!chan || chan->isMember(&client) || client.getChannelCount() >= _config.maxJoinedChannels)
+			continue;
+		chan->addClient(&client);
+		if (std::find(held.operatorOf.begin(), held.operatorOf.end(), name) != held.operatorOf.end())
+			chan->restoreOperator(&client);
+		sendJoin(client, *chan);
+	}
+	LOG_INFO("%s reclaimed its imported identity and %zu channels", client.getNickname().c_str(),
+			 held.channels.size());
+}
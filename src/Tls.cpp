@@ -0,0 +1,225 @@
+#include "Tls.hpp"
+#include <stdexcept>
+#include <cerrno>
+
+#ifdef IRCSERV_TLS
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+#endif
+
+/// TlsContext counters ///
+void TlsContext::countHandshake(const TlsSession &session)
+{
+	++_handshakes;
+	if (session.resumed())
+		++_resumed;
+	if (session.offloaded())
+		++_offloaded;
+}
+
+void TlsContext::countFailure() noexcept { ++_failures; }
+
+std::uint64_t TlsContext::handshakes() const noexcept { return _handshakes; }
+
+std::uint64_t TlsContext::resumed() const noexcept { return _resumed; }
+
+std::uint64_t TlsContext::offloaded() const noexcept { return _offloaded; }
+
+std::uint64_t TlsContext::failures() const noexcept { return _failures; }
+
+bool TlsContext::enabled() const noexcept { return _ctx != nullptr; }
+
+bool TlsSession::established() const noexcept { return _established; }
+
+#ifdef IRCSERV_TLS
+
+/// TlsContext ///
+TlsContext::~TlsContext()
+{
+	if (_ctx)
+		SSL_CTX_free(_ctx);
+}
+
+bool TlsContext::supported() noexcept { return true; }
+
+/*
+** Create the server context from a PEM certificate chain and private key
+** Only TLS 1.2 and later, with AEAD ciphers the kernel can take over
+*/
+void TlsContext::load(const std::string &certPath, const std::string &keyPath)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx)
+		throw std::runtime_error("TLS context creation failed: " + lastError());
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+	SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+	// Resumption: TLS 1.3 tickets are on by default, TLS 1.2 uses the cache
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	static const unsigned char sessionContext[] = "ircserv";
+	SSL_CTX_set_session_id_context(ctx, sessionContext, sizeof(sessionContext) - 1);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, certPath.c_str()) != 1
+		|| SSL_CTX_use_PrivateKey_file(ctx, keyPath.c_str(), SSL_FILETYPE_PEM) != 1
+		|| SSL_CTX_check_private_key(ctx) != 1)
+	{
+		std::string error = lastError();
+		SSL_CTX_free(ctx);
+		throw std::runtime_error("Cannot load TLS certificate " + certPath + " and key " + keyPath + ": " + error);
+	}
+	if (_ctx)
+		SSL_CTX_free(_ctx);
+	_ctx = ctx;
+}
+
+std::unique_ptr<TlsSession> TlsContext::accept(int fd)
+{
+	SSL *ssl = SSL_new(_ctx);
+	if (!ssl || SSL_set_fd(ssl, fd) != 1)
+	{
+		if (ssl)
+			SSL_free(ssl);
+		throw std::runtime_error("TLS session creation failed: " + lastError());
+	}
+	return std::unique_ptr<TlsSession>(new TlsSession(ssl));
+}
+
+/*
+** The oldest queued OpenSSL error, as text
+*/
+std::string TlsContext::lastError()
+{
+	unsigned long code = ERR_get_error();
+	if (code == 0)
+		return "unknown error";
+	char text[256];
+	ERR_error_string_n(code, text, sizeof(text));
+	ERR_clear_error();
+	return text;
+}
+
+/// TlsSession ///
+TlsSession::TlsSession(ssl_st *ssl) noexcept : _ssl(ssl) {}
+
+TlsSession::~TlsSession() { SSL_free(_ssl); }
+
+TlsSession::Step TlsSession::handshake()
+{
+	ERR_clear_error();
+	int rc = SSL_accept(_ssl);
+	if (rc == 1)
+	{
+		_established = true;
+		return Established;
+	}
+	switch (SSL_get_error(_ssl, rc))
+	{
+		case SSL_ERROR_WANT_READ:
+			return WantRead;
+		case SSL_ERROR_WANT_WRITE:
+			return WantWrite;
+		default:
+			ERR_clear_error();
+			return Failed;
+	}
+}
+
+bool TlsSession::resumed() const { return SSL_session_reused(_ssl) == 1; }
+
+bool TlsSession::offloaded() const
+{
+	return BIO_get_ktls_send(SSL_get_wbio(_ssl)) && BIO_get_ktls_recv(SSL_get_rbio(_ssl));
+}
+
+/*
+** Map an OpenSSL result to recv()/send() conventions
+*/
+static ssize_t ioResult(SSL *ssl, int rc)
+{
+	if (rc > 0)
+		return rc;
+	switch (SSL_get_error(ssl, rc))
+	{
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0)
+				errno = EIO;
+			ERR_clear_error();
+			return -1;
+		default:
+			errno = EPROTO;
+			ERR_clear_error();
+			return -1;
+	}
+}
+
+ssize_t TlsSession::read(char *buffer, std::size_t size)
+{
+	errno = 0;
+	return ioResult(_ssl, SSL_read(_ssl, buffer, static_cast<int>(size)));
+}
+
+ssize_t TlsSession::write(const char *data, std::size_t size)
+{
+	errno = 0;
+	return ioResult(_ssl, SSL_write(_ssl, data, static_cast<int>(size)));
+}
+
+void TlsSession::shutdown()
+{
+	if (_established)
+		SSL_shutdown(_ssl);
+	ERR_clear_error();
+}
+
+#else
+
+/// Without TLS support: nothing past load() is ever reached ///
+TlsContext::~TlsContext() {}
+
+bool TlsContext::supported() noexcept { return false; }
+
+void TlsContext::load(const std::string &, const std::string &)
+{
+	throw std::runtime_error("ircserv was built without TLS support (build with make TLS=1)");
+}
+
+std::unique_ptr<TlsSession> TlsContext::accept(int)
+{
+	throw std::runtime_error("TLS is not supported");
+}
+
+std::string TlsContext::lastError() { return "TLS is not supported"; }
+
+TlsSession::TlsSession(ssl_st *ssl) noexcept : _ssl(ssl) {}
+
+TlsSession::~TlsSession() {}
+
+TlsSession::Step TlsSession::handshake() { return Failed; }
+
+bool TlsSession::resumed() const { return false; }
+
+bool TlsSession::offloaded() const { return false; }
+
+ssize_t TlsSession::read(char *, std::size_t)
+{
+	errno = EPROTO;
+	return -1;
+}
+
+ssize_t TlsSession::write(const char *, std::size_t)
+{
+	errno = EPROTO;
+	return -1;
+}
+
+void TlsSession::shutdown() {}
+
+#endif
@@ -0,0 +1,23 @@
+#include "Transport.hpp"
+#include <unistd.h>
+#include <sys/socket.h>
+
+ssize_t Transport::recv(int fd, char *buffer, std::size_t size)
+{
+	return ::recv(fd, buffer, size, 0);
+}
+
+ssize_t Transport::send(int fd, const char *data, std::size_t size, bool more)
+{
+	return ::send(fd, data, size, more ? MSG_MORE : 0);
+}
+
+void Transport::close(int fd)
+{
+	::close(fd);
+}
+
+std::time_t WallClock::now() const
+{
+	return std::time(nullptr);
+}
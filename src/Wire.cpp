@@ -0,0 +1,70 @@
+#include "Wire.hpp"
+#include <stdexcept>
+
+/// WireWriter ///
+void WireWriter::u8(std::uint8_t value) { _out.push_back(static_cast<char>(value)); }
+
+void WireWriter::u32(std::uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		_out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+void WireWriter::u64(std::uint64_t value)
+{
+	for (int i = 0; i < 8; ++i)
+		_out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+void WireWriter::str(std::string_view value)
+{
+	u32(static_cast<std::uint32_t>(value.size()));
+	_out.append(value.data(), value.size());
+}
+
+std::string &WireWriter::buffer() noexcept { return _out; }
+
+const std::string &WireWriter::buffer() const noexcept { return _out; }
+
+/// WireReader ///
+WireReader::WireReader(const char *data, std::size_t size) : _data(data), _size(size) {}
+
+const char *WireReader::need(std::size_t bytes)
+{
+	if (bytes > _size - _pos)
+		throw std::runtime_error("Truncated state at offset " + std::to_string(_pos));
+	const char *p = _data + _pos;
+	_pos += bytes;
+	return p;
+}
+
+std::uint8_t WireReader::u8() { return static_cast<std::uint8_t>(*need(1)); }
+
+std::uint32_t WireReader::u32()
+{
+	const char *p = need(4);
+	std::uint32_t value = 0;
+	for (int i = 0; i < 4; ++i)
+		value |= static_cast<std::uint32_t>(static_cast<std::uint8_t>(p[i])) << (8 * i);
+	return value;
+}
+
+std::uint64_t WireReader::u64()
+{
+	const char *p = need(8);
+	std::uint64_t value = 0;
+	for (int i = 0; i < 8; ++i)
+		value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(p[i])) << (8 * i);
+	return value;
+}
+
+std::string WireReader::str()
+{
+	std::uint32_t len = u32();
+	const char *p = need(len);
+	return std::string(p, len);
+}
+
+std::size_t WireReader::offset() const noexcept { return _pos; }
+
+bool WireReader::atEnd() const noexcept { return _pos >= _size; }
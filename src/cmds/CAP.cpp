@@ -0,0 +1,96 @@
+#include "Server.hpp"
+#include <sstream>
+
+/*
+** Look up a capability by name, 0 if unsupported
+*/
+static std::uint8_t findCapability(std::string_view name)
+{
+	for (int i = 0; i < CAPABILITY_COUNT; ++i)
+		if (name == CAPABILITIES[i].name)
+			return CAPABILITIES[i].cap;
+	return 0;
+}
+
+static std::string capabilityList(std::uint8_t caps)
+{
+	std::string list;
+	for (int i = 0; i < CAPABILITY_COUNT; ++i)
+	{
+		if (!(caps & CAPABILITIES[i].cap))
+			continue;
+		if (!list.empty())
+			list += ' ';
+		list += CAPABILITIES[i].name;
+	}
+	return list;
+}
+
+/*
+** Handle CAP command (IRCv3 capability negotiation, version 302)
+** LS: list supported capabilities
+** LIST: list the capabilities enabled for this client
+** REQ: enable (or with '-' disable) capabilities, all or none: ACK or NAK
+** END: finish negotiation
+** LS and REQ before registration hold registration back until END
+*/
+void Server::handleCAP(Client &client, const std::vector<std::string_view> &params)
+{
+	if (params.empty())
+	{
+		sendNumeric(client, 461, "CAP :Not enough parameters");
+		return;
+	}
+	std::string subcommand(params[0]);
+	for (char &c : subcommand)
+		c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+	std::string prefix = ":" + _serverName + " CAP " + (client.hasNickname() ? client.getNickname() : "*") + " ";
+
+	if (subcommand == "LS" || subcommand == "REQ")
+	{
+		if (!client.isRegistered())
+			client.setNegotiatingCaps(true);
+	}
+	if (subcommand == "LS")
+		sendTo(client, prefix + "LS :" + capabilityList(0xff) + "\r\n");
+	else if (subcommand == "LIST")
+		sendTo(client, prefix + "LIST :" + capabilityList(client.getCaps()) + "\r\n");
+	else if (subcommand == "REQ")
+	{
+		std::string_view request = params.size() > 1 ? params[1] : std::string_view();
+		std::uint8_t caps = client.getCaps();
+		bool valid = !request.empty();
+		std::string_view rest = request;
+		while (valid && !rest.empty())
+		{
+			std::size_t end = rest.find(' ');
+			std::string_view name = rest.substr(0, end);
+			rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
+			if (name.empty())
+				continue;
+			bool removing = name[0] == '-';
+			if (removing)
+				name.remove_prefix(1);
+			std::uint8_t cap = findCapability(name);
+			if (!cap)
+				valid = false;
+			else if (removing)
+				caps &= static_cast<std::uint8_t>(~cap);
+			else
+				caps |= cap;
+		}
+		if (valid)
+			client.setCaps(caps);
+		sendTo(client, prefix + (valid ? "ACK :" : "NAK :") + std::string(request) + "\r\n");
+	}
+	else if (subcommand == "END")
+	{
+		if (client.isNegotiatingCaps())
+		{
+			client.setNegotiatingCaps(false);
+			maybeRegistered(client);
+		}
+	}
+	else
+		sendNumeric(client, 410, subcommand + " :Invalid CAP command");
+}
@@ -0,0 +1,113 @@
+#include "Server.hpp"
+#include <cstdlib>
+#include <sstream>
+
+static const std::size_t MAX_HISTORY_LIMIT = 100;
+
+/*
+** Parse a message reference: timestamp=<server-time> or msgid=<id>
+*/
+static bool parseReference(std::string_view text, HistoryRing::Bound &bound)
+{
+	if (text.compare(0, 10, "timestamp=") == 0)
+	{
+		bound.byId = false;
+		return HistoryStore::parseTime(text.substr(10), bound.value);
+	}
+	if (text.compare(0, 6, "msgid=") == 0 && text.size() > 6)
+	{
+		std::string id(text.substr(6));
+		char *end = nullptr;
+		bound.byId = true;
+		bound.value = std::strtoull(id.c_str(), &end, 10);
+		return *end == '\0';
+	}
+	return false;
+}
+
+/*
+** Handle CHATHISTORY command (IRCv3)
+** CHATHISTORY LATEST <target> <* | reference> <limit>
+** CHATHISTORY BEFORE <target> <reference> <limit>
+** CHATHISTORY AFTER <target> <reference> <limit>
+** Only members can read a channel's history; for a nickname, the private
+** messages exchanged with it are returned
+** Replies with a chathistory batch, tagged with time and msgid, for clients
+** that enabled batch, server-time and message-tags
+*/
+void Server::handleCHATHISTORY(Client &client, const std::vector<std::string_view> &params)
+{
+	if (params.size() < 4)
+	{
+		sendTo(client, "FAIL CHATHISTORY NEED_MORE_PARAMS :Missing parameters\r\n");
+		return;
+	}
+	std::string subcommand(params[0]);
+	for (char &c : subcommand)
+		c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+	std::string target(params[1]);
+
+	HistoryRing::Direction dir;
+	if (subcommand == "LATEST")
+		dir = HistoryRing::Latest;
+	else if (subcommand == "BEFORE")
+		dir = HistoryRing::Before;
+	else if (subcommand == "AFTER")
+		dir = HistoryRing::After;
+	else
+	{
+		sendTo(client, "FAIL CHATHISTORY INVALID_PARAMS " + subcommand + " :Unknown subcommand\r\n");
+		return;
+	}
+
+	HistoryRing::Bound bound;
+	bool bounded = !(dir == HistoryRing::Latest && params[2] == "*");
+	std::string limitText(params[3]);
+	char *end = nullptr;
+	long limit = std::strtol(limitText.c_str(), &end, 10);
+	if ((bounded && !parseReference(params[2], bound)) || *end != '\0' || limit <= 0)
+	{
+		sendTo(client, "FAIL CHATHISTORY INVALID_PARAMS " + subcommand + " :Invalid message reference or limit\r\n");
+		return;
+	}
+	std::size_t count = std::min(static_cast<std::size_t>(limit), MAX_HISTORY_LIMIT);
+
+	std::vector<HistoryRing::Message> messages;
+	if (target[0] == '#')
+	{
+		Channel *chan = findChannel(target);
+		if (!chan || !chan->isMember(&client))
+		{
+			sendTo(client, "FAIL CHATHISTORY INVALID_TARGET " + subcommand + " " + target
+							   + " :Messages could not be retrieved\r\n");
+			return;
+		}
+		target = chan->getChannelName();
+		messages = _history.channelHistory(target, dir, bounded ? &bound : nullptr, count);
+	}
+	else
+	{
+		// Kept per connection: a peer that is gone takes the conversation along
+		Client *peer = findClientByNick(target);
+		if (peer)
+		{
+			target = peer->getNickname();
+			messages = _history.privateHistory(historyId(client), historyId(*peer), dir, bounded ? &bound : nullptr,
+											   count);
+		}
+	}
+
+	// Without batch the lines are sent bare, still tagged per the other capabilities
+	bool batched = client.hasCap(CAP_BATCH);
+	std::string batch = "h" + std::to_string(++_batchCounter);
+	if (batched)
+		sendTo(client, ":" + _serverName + " BATCH +" + batch + " chathistory " + target + "\r\n");
+	for (const HistoryRing::Message &stored : messages)
+	{
+		OutgoingMessage message(std::string(stored.line) + "\r\n", stored.timeMs, stored.id);
+		message.setBatch(batch);
+		sendTo(client, message);
+	}
+	if (batched)
+		sendTo(client, ":" + _serverName + " BATCH -" + batch + "\r\n");
+}
@@ -0,0 +1,45 @@
+#include "Server.hpp"
+#include <algorithm>
+
+/*
+** Handle CONNECT command
+** CONNECT <host> <port>
+** Restricted to server operators
+** Links this server to another one; unlike the autoconnect links, the
+** link is not dialled again once lost. The host is an IPv4 or IPv6 address,
+** or one of the autoconnect hosts: a DNS lookup would block the event loop.
+*/
+void Server::handleCONNECT(Client &client, const std::vector<std::string_view> &params)
+{
+	if (!client.isServerOperator())
+	{
+		sendNumeric(client, 481, ":Permission Denied- You're not an IRC operator");
+		return;
+	}
+	if (params.size() < 2)
+	{
+		sendNumeric(client, 461, "CONNECT :Not enough parameters");
+		return;
+	}
+	if (_linkPassword.empty())
+	{
+		sendTo(client, ":" + _serverName + " NOTICE " + client.getNickname() + " :Linking is not enabled\r\n");
+		return;
+	}
+	std::string host(params[0]);
+	if (host.find(':') != std::string::npos && host.front() != '[')
+		host = "[" + host + "]";
+	std::string target = host + ":" + std::string(params[1]);
+	LinkTarget resolved;
+	auto known = std::find_if(_autoconnect.begin(), _autoconnect.end(),
+							  [&](const LinkTarget &link) { return link.target == target; });
+	std::string error = known != _autoconnect.end() ? "" : resolveLinkTarget(target, AI_NUMERICHOST, resolved);
+	if (!error.empty())
+	{
+		sendTo(client, ":" + _serverName + " NOTICE " + client.getNickname() + " :Cannot link to " + target + ": "
+						   + error + "\r\n");
+		return;
+	}
+	sendTo(client, ":" + _serverName + " NOTICE " + client.getNickname() + " :Connecting to " + target + "\r\n");
+	connectLink(known != _autoconnect.end() ? *known : resolved, false);
+}
@@ -10,7 +10,7 @@
 ** Checks if channel is invite-only
 ** Checks if client is channel operator
 ** Checks if target client is already in the channel
-** Adds target client to channel invite list
+** Adds target client to channel invite list, until invite_ttl runs out
 ** Sends INVITE message to target client
 ** Sends 341 numeric to inviting client
 */
@@ -22,20 +22,19 @@ void Server::handleINVITE(Client &client, const std::vector<std::string_view> &p
         return;
     }
 
-    std::string targetNick(params[0]);
-    std::string channelName(params[1]);
-
-    Client *target = findClientByNick(targetNick);
+    Client *target = findClientByNick(params[0]);
     if (!target)
     {
-        sendNumeric(client, 401, targetNick + " :No such nick");
+        sendNumeric(client, 401, std::string(params[0]) + " :No such nick");
         return;
     }
+    const std::string &targetNick = target->getNickname();
 
-    auto it = _channels.find(channelName);
-    if (it != _channels.end())
+    Channel *found = findChannel(params[1]);
+    if (found)
     {
-        Channel &chan = it->second;
+        Channel &chan = *found;
+        const std::string &channelName = chan.getChannelName();
 
         if (!chan.isMember(&client))
         {
@@ -55,18 +54,23 @@ void Server::handleINVITE(Client &client, const std::vector<std::string_view> &p
             return;
         }
         
-        chan.inviteUser(target);
+        invite(chan, *target);
     }
     else
     {
-        sendNumeric(client, 403, channelName + " :No such channel");
+        sendNumeric(client, 403, std::string(params[1]) + " :No such channel");
         return;
     }
+    const std::string &channelName = found->getChannelName();
     std::ostringstream inviteMsg;
     inviteMsg << ":" << client.getNickname() << "!" 
               << client.getUsername() << "@" << getClientHost(client.getFd())
               << " INVITE " << targetNick << " :" << channelName << "\r\n";
     sendTo(*target, inviteMsg.str());
+    // A remote user's JOIN is checked by its own server, which must know of the invitation
+    auto via = target->isRemote() ? _links.find(routeTo(*target)) : _links.end();
+    if (via != _links.end())
+        sendToLink(via->second, ":" + client.getNickname() + " INVITE " + targetNick + " " + channelName);
     
     sendNumeric(client, 341, targetNick + " " + channelName);
 }
@@ -9,7 +9,9 @@
 ** Checks if channel is password protected
 ** Checks if channel is invite-only
 ** Checks if channel is full
-** Adds client to channel
+** Adds client to channel, using up its invitation
+** The first to join a channel restored empty becomes its operator, as whoever
+** creates a channel does; its modes still apply
 */
 void Server::handleJOIN(Client &client, const std::vector<std::string_view> &params)
 {
@@ -19,79 +21,80 @@ void Server::handleJOIN(Client &client, const std::vector<std::string_view> &par
 		return;
 	}
 
-	std::string _channelName(params[0]);
-	if (client.getChannelCount() == 10)
+	std::string_view requested = params[0];
+	if (client.getChannelCount() >= _config.maxJoinedChannels)
 	{
-		sendNumeric(client, 405, _channelName + " :You have joined too many channels");
+		sendNumeric(client, 405, std::string(requested) + " :You have joined too many channels");
 		return;
 	}
-	auto it = _channels.find(_channelName);
-	if (it != _channels.end())
+	Channel *found = findChannel(requested);
+	if (found)
 	{
-		if (it->second.PasswordRequired())
+		const std::string &_channelName = found->getChannelName();
+		if (found->PasswordRequired())
 		{
-			if (params.size() < 2 || it->second.getPassword() != params[1])
+			if (params.size() < 2 || found->getPassword() != params[1])
 			{
 				sendNumeric(client, 475, _channelName + " :Cannot join channel (+k)");
 				return ;
 			}
 		}
-		if (it->second.UserlimitSet())
+		if (found->UserlimitSet())
 		{
-			if (it->second.getUserLimit() == it->second.getCurrentUsers())
+			if (found->getUserLimit() == found->getCurrentUsers())
 			{
 				sendNumeric(client, 471, _channelName + " :Cannot join channel (+l)");
 				return ;
 			}
 		}
-		if (it->second.isInviteOnly())
+		if (found->isInviteOnly())
 		{
-			if (!it->second.isInvited(&client))
+			if (!found->isInvited(&client, _clock->now()))
 			{
 				sendNumeric(client, 473, _channelName + " :Cannot join channel (+i)");
 				return ;
 			}
 		}
-		it->second.addClient(&client);
+		bool first = found->getCurrentUsers() == 0;
+		found->addClient(&client);
+		// An invitation lets one JOIN through
+		found->uninvite(&client);
+		if (first)
+			found->addOperator(client.getNickname());
 	}
 	else
 	{
-		if (_channelCount == 500) {
-			sendNumeric(client, 600, _channelName + " :Channel not created. Too many channels exist");
+		if (_channelCount >= _config.maxChannels) {
+			sendNumeric(client, 600, std::string(requested) + " :Channel not created. Too many channels exist");
 			return ;
 		}
-		Channel newChannel(_channelName);
-		newChannel.addClient(&client);
-		newChannel.addOperator(client.getNickname());
-		newChannel.setCreationTime(std::time(nullptr));
-		_channels.emplace(_channelName, newChannel);
-		_channelCount++;
+		// Members point at the channel, so it is only joined once stored
+		found = addChannel(Channel(std::string(requested)));
+		found->addClient(&client);
+		found->addOperator(client.getNickname());
+		found->setCreationTime(_clock->now());
+		persistChannel(*found);
 	}
-	Channel &chan = _channels.at(_channelName);
+	sendJoin(client, *found);
+}
+
+/*
+** Announce client's join to the channel and the network, and send it the
+** channel's topic, names and creation time
+*/
+void Server::sendJoin(Client &client, Channel &chan)
+{
+	const std::string &_channelName = chan.getChannelName();
 	std::ostringstream joinMsg;
 	joinMsg << ":" << client.getNickname() << "!~" 
 			<< client.getUsername() << "@" << getClientHost(client.getFd())
 			<< " JOIN " << _channelName << "\r\n";
 	sendToChannel(chan, joinMsg.str(), nullptr);
+	propagateJoin(chan, client);
 	
 	const std::string &topic = chan.getTopic();
 	if (!topic.empty())
 		sendNumeric(client, 332, _channelName, topic);
-
-	std::ostringstream names;
-	for (Client *member : chan.getMembers())
-	{
-		if (chan.isOperator(member))
-			names << "@";
-		names << member->getNickname() << " ";
-	}
-	sendNumeric(client, 353, "= " + _channelName, ":" + names.str());
-
-	std::ostringstream endNames;
-	endNames << ":" << _serverName
-			 << " 366 " << client.getNickname()
-			 << " " << _channelName
-			 << " :End of /NAMES list\r\n";
-	sendTo(client, endNames.str());
+	sendNames(client, chan);
 	sendNumeric(client, 329, _channelName, std::to_string(chan.getCreationTime()));
-}	
+}
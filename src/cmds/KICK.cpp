@@ -20,8 +20,7 @@ void Server::handleKICK(Client &client, const std::vector<std::string_view> &par
         return;
     }
 
-    std::string channelName(params[0]);
-    std::string targetNick(params[1]);
+    std::string_view targetNick = params[1];
     std::string comment = "";
     if (params.size() > 2) {
         std::ostringstream commentStream;
@@ -32,13 +31,14 @@ void Server::handleKICK(Client &client, const std::vector<std::string_view> &par
         comment = commentStream.str();
     }
 
-    auto it = _channels.find(channelName);
-    if (it == _channels.end()) {
-        sendNumeric(client, 403, channelName + " :No such channel");
+    Channel *found = findChannel(params[0]);
+    if (!found) {
+        sendNumeric(client, 403, std::string(params[0]) + " :No such channel");
         return;
     }
 
-    Channel &chan = it->second;
+    Channel &chan = *found;
+    const std::string &channelName = chan.getChannelName();
 
     if (!chan.isMember(&client)) {
         sendNumeric(client, 442, channelName + " :You're not on that channel");
@@ -50,24 +50,26 @@ void Server::handleKICK(Client &client, const std::vector<std::string_view> &par
         return;
     }
 
-    Client *target = chan.findClientByNickname(targetNick);
-    if (!target) {
-        sendNumeric(client, 441, targetNick + " " + channelName + " :They aren't on that channel");
+    Client *target = findClientByNick(targetNick);
+    if (!target || !chan.isMember(target)) {
+        sendNumeric(client, 441, std::string(targetNick) + " " + channelName + " :They aren't on that channel");
         return;
     }
     std::ostringstream kickMsg;
     kickMsg << ":" << client.getNickname() << "!" 
             << client.getUsername() << "@" << getClientHost(client.getFd())
-            << " KICK " << channelName << " " << targetNick;
+            << " KICK " << channelName << " " << target->getNickname();
     if (!comment.empty())
         kickMsg << " :" << comment;
     kickMsg << "\r\n";
-    sendTo(*target, kickMsg.str());
-    chan.removeClient(target->getNickname());
-    sendToChannel(chan, kickMsg.str(), nullptr);
+    OutgoingMessage message(kickMsg.str());
+    sendTo(*target, message);
+    chan.removeClient(target);
+    sendToChannel(chan, message, nullptr);
+    propagate(":" + client.getNickname() + " KICK " + channelName + " " + target->getNickname() + " :"
+              + (comment.empty() ? target->getNickname() : comment));
     
     if (chan.isEmpty()) {
-        _channels.erase(channelName);
-        _channelCount--;
+        removeChannel(channelName);
     }
 }
@@ -0,0 +1,15 @@
+#include "Server.hpp"
+
+/*
+** Handle LINKS command
+** Lists every server of the network with the server it is linked to and
+** its distance in hops
+*/
+void Server::handleLINKS(Client &client, const std::vector<std::string_view> &)
+{
+	sendNumeric(client, 364, _serverName + " " + _serverName, ":0 ft_irc server");
+	for (const auto &pair : _peers)
+		sendNumeric(client, 364, pair.first + " " + pair.second.uplink,
+					":" + std::to_string(pair.second.hops) + " " + pair.second.description);
+	sendNumeric(client, 365, "*", ":End of /LINKS list");
+}
@@ -0,0 +1,126 @@
+#include "Server.hpp"
+#include <cstdlib>
+
+/*
+** Handle LIST command
+** LIST [<channel>{,<channel>} | <filter>{,<filter>}]
+** Filters (ELIST=CU): >n and <n on the user count, C>n and C<n for channels
+** created more or less than n minutes ago
+** Named channels are answered at once. A full listing walks the channel
+** index in name order and only fills the sendq up to LIST_SENDQ_BYTES; the
+** rest follows from handleClientWrite() as the client reads it.
+*/
+void Server::handleLIST(Client &client, const std::vector<std::string_view> &params)
+{
+	ListRequest request;
+	std::vector<std::string> names;
+	std::time_t now = _clock->now();
+	std::string_view items = params.empty() ? std::string_view() : params[0];
+	while (!items.empty())
+	{
+		std::size_t comma = items.find(',');
+		std::string_view item = items.substr(0, comma);
+		items.remove_prefix(comma == std::string_view::npos ? items.size() : comma + 1);
+		if (!item.empty() && !request.addFilter(item, now))
+			names.emplace_back(item);
+	}
+
+	sendNumeric(client, 321, "Channel", ":Users  Name");
+	if (names.empty())
+	{
+		_listings[client.getFd()] = request;
+		continueList(client);
+		return;
+	}
+	_listings.erase(client.getFd());
+	for (const std::string &name : names)
+	{
+		Channel *chan = findChannel(name);
+		if (chan && request.matches(*chan))
+			sendNumeric(client, 322, chan->getChannelName(), std::to_string(chan->getCurrentUsers()) + " :"
+																 + chan->getTopic());
+	}
+	sendNumeric(client, 323, ":End of /LIST");
+}
+
+/*
+** Send the next LIST replies of client, until its sendq is full again
+** Resumes after the last channel name sent, so channels created or removed
+** in between are handled like in any ordered walk
+*/
+void Server::continueList(Client &client)
+{
+	auto it = _listings.find(client.getFd());
+	if (it == _listings.end())
+		return;
+	ListRequest &request = it->second;
+	auto pos = request.started ? _channelIndex.upper_bound(request.resumeAfter) : _channelIndex.begin();
+	auto last = _channelIndex.end();
+	while (pos != _channelIndex.end() && client.getWriteBuffer().size() < LIST_SENDQ_BYTES)
+	{
+		const Channel &channel = *pos->second;
+		if (request.matches(channel))
+			sendNumeric(client, 322, pos->first, std::to_string(channel.getCurrentUsers()) + " :"
+													 + channel.getTopic());
+		last = pos++;
+	}
+	if (pos == _channelIndex.end())
+	{
+		_listings.erase(it);
+		sendNumeric(client, 323, ":End of /LIST");
+		return;
+	}
+	if (last != _channelIndex.end())
+	{
+		request.resumeAfter.assign(last->first);
+		request.started = true;
+	}
+}
+
+/*
+** Add an ELIST filter to the request
+** Returns false if filter is not one, e.g. a channel name
+*/
+bool Server::ListRequest::addFilter(std::string_view filter, std::time_t now)
+{
+	bool created = false;
+	if (filter.size() > 1 && (filter[0] == 'C' || filter[0] == 'c'))
+	{
+		created = true;
+		filter.remove_prefix(1);
+	}
+	if (filter.size() < 2 || (filter[0] != '<' && filter[0] != '>'))
+		return false;
+	std::string number(filter.substr(1));
+	char *end = nullptr;
+	long value = std::strtol(number.c_str(), &end, 10);
+	if (*end != '\0' || value < 0 || value > 1000000000)
+		return false;
+
+	if (created)
+	{
+		// C<n: created less than n minutes ago; C>n: more than n minutes ago
+		if (filter[0] == '<')
+			createdAfter = now - value * 60;
+		else
+			createdBefore = now - value * 60;
+	}
+	else if (filter[0] == '>')
+		minUsers = static_cast<int>(value) + 1;
+	else
+		maxUsers = static_cast<int>(value) - 1;
+	return true;
+}
+
+bool Server::ListRequest::matches(const Channel &channel) const
+{
+	int users = channel.getCurrentUsers();
+	if (users < minUsers || users > maxUsers)
+		return false;
+	std::time_t created = channel.getCreationTime();
+	if (createdAfter && created < createdAfter)
+		return false;
+	if (createdBefore && created > createdBefore)
+		return false;
+	return true;
+}
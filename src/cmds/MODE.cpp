@@ -16,23 +16,22 @@ void Server::handleMODE(Client &client, const std::vector<std::string_view> &par
 		return;
 	}
 	
-	std::string target(params[0]);
-	if (target[0] != '#') {
+	if (params[0].empty() || params[0][0] != '#') {
 		if (params.size() == 1) {
 			sendNumeric(client, 221, "+");
 			return;
 		}
 		return;
 	}
-	std::string channelName = target;
 	
-	auto it = _channels.find(channelName);
-	if (it == _channels.end()) {
-		sendNumeric(client, 403, channelName, ":No such channel");
+	Channel *found = findChannel(params[0]);
+	if (!found) {
+		sendNumeric(client, 403, params[0], ":No such channel");
 		return;
 	}
 	
-	Channel &chan = it->second;
+	Channel &chan = *found;
+	const std::string &channelName = chan.getChannelName();
 	if (params.size() < 2)
 	{
 		sendNumeric(client, 324, channelName, chan.getModeString());
@@ -53,6 +52,7 @@ void Server::handleMODE(Client &client, const std::vector<std::string_view> &par
 		sendNumeric(client, e.num, e.msg);
 		return;
 	}
+	persistChannel(chan);
 	std::ostringstream oss;
 	oss << ":" << client.getNickname();
 	if (client.hasUsername())
@@ -63,4 +63,9 @@ void Server::handleMODE(Client &client, const std::vector<std::string_view> &par
 		oss << " " << modeParams[i];
 	oss << "\r\n";
 	sendToChannel(chan, oss.str(), nullptr);
+
+	std::string change = ":" + client.getNickname() + " MODE " + channelName;
+	for (std::string_view mode : modeParams)
+		change += " " + std::string(mode);
+	propagate(change);
 }
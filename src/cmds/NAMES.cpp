@@ -0,0 +1,58 @@
+#include "Server.hpp"
+
+/*
+** Handle NAMES command
+** NAMES <channel>{,<channel>}
+** Lists the members of each channel, operators prefixed with '@'
+** Without a channel only the end of the list is sent, instead of every
+** member of every channel on the server
+*/
+void Server::handleNAMES(Client &client, const std::vector<std::string_view> &params)
+{
+	if (params.empty() || params[0].empty())
+	{
+		sendNumeric(client, 366, "*", ":End of /NAMES list");
+		return;
+	}
+	std::string_view targets = params[0];
+	while (!targets.empty())
+	{
+		std::size_t comma = targets.find(',');
+		std::string_view name = targets.substr(0, comma);
+		targets.remove_prefix(comma == std::string_view::npos ? targets.size() : comma + 1);
+		if (name.empty())
+			continue;
+		Channel *chan = findChannel(name);
+		if (!chan)
+			sendNumeric(client, 366, name, ":End of /NAMES list");
+		else
+			sendNames(client, *chan);
+	}
+}
+
+/*
+** Send a channel's member list (353) followed by 366
+** Split over several 353 replies so each stays under the 512 byte line limit
+*/
+void Server::sendNames(Client &client, Channel &channel)
+{
+	static const std::size_t NAMES_LINE_BYTES = 400;
+	const std::string &name = channel.getChannelName();
+	std::string names;
+	for (Client *member : channel.getMembers())
+	{
+		if (names.size() + member->getNickname().size() + 2 > NAMES_LINE_BYTES)
+		{
+			sendNumeric(client, 353, "= " + name, ":" + names);
+			names.clear();
+		}
+		if (!names.empty())
+			names += ' ';
+		if (channel.isOperator(member))
+			names += '@';
+		names += member->getNickname();
+	}
+	if (!names.empty())
+		sendNumeric(client, 353, "= " + name, ":" + names);
+	sendNumeric(client, 366, name, ":End of /NAMES list");
+}
@@ -7,6 +7,8 @@
 ** Validates parameters
 ** Checks if nickname is already in use
 ** Updates nickname if valid
+** Nicknames are compared with RFC 1459 casemapping; a client may change
+** the case of its own
 */
 void Server::handleNICK(Client &client, const std::vector<std::string_view> &params)
 {
@@ -23,7 +25,8 @@ void Server::handleNICK(Client &client, const std::vector<std::string_view> &par
 	std::string newNick(params[0]);
 	if (client.hasNickname() && client.getNickname() == newNick)
 		return;
-	if (nickInUse(newNick))
+	Client *holder = findClientByNick(newNick);
+	if (holder && holder != &client)
 	{
 		sendNumeric(client, 433, "* " + newNick, "Nickname is already in use");
 		return;
@@ -32,41 +35,72 @@ void Server::handleNICK(Client &client, const std::vector<std::string_view> &par
 	std::string oldNick;
 	if (hadNickBefore)
 		oldNick = client.getNickname();
+	unindexNick(client);
 	client.setNickname(newNick);
+	indexNick(client);
 	if (hadNickBefore && oldNick != newNick)
+		announceNick(client, oldNick);
+	if (client.isRegistered())
 	{
-		std::ostringstream oss;
-		oss << ":" << oldNick;
-		if (client.hasUsername())
-			oss << "!" << client.getUsername() << "@" << getClientHost(client.getFd());
-
-		oss << " NICK :" << newNick << "\r\n";
-		std::string msg = oss.str();
-		std::unordered_set<Client*> recipients;
-		recipients.insert(&client);
-		for (auto &chanPair : _channels) {
-			Channel &chan = chanPair.second;
-			if (chan.isMember(&client)) {
-				const auto &members = chan.getMembers();
-				recipients.insert(members.begin(), members.end());
-			}
-		}
-		for (Client *recipient : recipients)
-			sendTo(*recipient, msg);
+		client.setNickTime(_clock->now());
+		propagate(":" + oldNick + " NICK " + newNick + " " + std::to_string(client.getNickTime()));
 	}
 	maybeRegistered(client);
 }
 
+/*
+** Tell the client and everyone sharing a channel with it, once each, that
+** it changed its nickname from oldNick
+*/
+void Server::announceNick(Client &client, const std::string &oldNick)
+{
+	std::ostringstream oss;
+	oss << ":" << oldNick;
+	if (client.hasUsername())
+		oss << "!" << client.getUsername() << "@" << getClientHost(client.getFd());
+
+	oss << " NICK :" << client.getNickname() << "\r\n";
+	OutgoingMessage msg(oss.str());
+	std::unordered_set<Client*> recipients;
+	recipients.insert(&client);
+	for (Channel *chan : client.getChannels()) {
+		const auto &members = chan->getMembers();
+		recipients.insert(members.begin(), members.end());
+	}
+	for (Client *recipient : recipients)
+		sendTo(*recipient, msg);
+}
+
 /*
 ** Checks if nickname is already in use
 */
 bool Server::nickInUse(std::string_view nick) {
-	if (_clients.empty())
-		return false;
-	for (auto it = _clients.begin(); it != _clients.end(); ++it)
-	{
-		if (it->second.getNickname() == nick)
-			return true;
-	}
-	return false;
+	return findClientByNick(nick) != nullptr;
+}
+
+/*
+** Add the client's nickname to the nickname index
+*/
+void Server::indexNick(Client &client)
+{
+	if (!client.hasNickname())
+		return;
+	NameHandle handle = _names.intern(client.getNickname());
+	if (!_nicks.emplace(handle, &client).second)
+		_names.release(handle);
+}
+
+/*
+** Remove the client's nickname from the index, if it is the client holding it
+*/
+void Server::unindexNick(Client &client)
+{
+	if (!client.hasNickname())
+		return;
+	NameHandle handle = _names.find(client.getNickname());
+	auto it = handle ? _nicks.find(handle) : _nicks.end();
+	if (it == _nicks.end() || it->second != &client)
+		return;
+	_nicks.erase(it);
+	_names.release(handle);
 }
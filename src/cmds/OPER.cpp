@@ -0,0 +1,30 @@
+#include "Server.hpp"
+
+/*
+** Handle OPER command
+** Validates parameters
+** Checks that an operator block is configured
+** Checks name and password
+** Grants server operator status
+*/
+void Server::handleOPER(Client &client, const std::vector<std::string_view> &params)
+{
+	if (params.size() < 2)
+	{
+		sendNumeric(client, 461, "OPER :Not enough parameters");
+		return;
+	}
+	if (_operName.empty() || _operPassword.empty())
+	{
+		sendNumeric(client, 491, ":No O-lines for your host");
+		return;
+	}
+	if (params[0] != _operName || params[1] != _operPassword)
+	{
+		sendNumeric(client, 464, ":Password incorrect");
+		return;
+	}
+	client.setIsServerOperator(true);
+	sendNumeric(client, 381, ":You are now an IRC operator");
+	sendTo(client, ":" + client.getNickname() + " MODE " + client.getNickname() + " :+o\r\n");
+}
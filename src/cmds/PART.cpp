@@ -16,16 +16,15 @@ void Server::handlePART(Client &client, const std::vector<std::string_view> &par
 		return;
 	}
 	
-	std::string channelName(params[0]);
-
-	auto it = _channels.find(channelName);
-	if (it == _channels.end())
+	Channel *found = findChannel(params[0]);
+	if (!found)
 	{
-		sendNumeric(client, 403, channelName + " :No such channel");
+		sendNumeric(client, 403, std::string(params[0]) + " :No such channel");
 		return;
 	}
 	
-	Channel &chan = it->second;
+	Channel &chan = *found;
+	const std::string &channelName = chan.getChannelName();
 
 	if (!chan.isMember(&client))
 	{
@@ -45,16 +44,7 @@ void Server::handlePART(Client &client, const std::vector<std::string_view> &par
 		}
 		reason = reasonStream.str();
 	}
-	try
-	{
-		std::string clientName = client.getNickname();
-		chan.removeClient(clientName);
-	}
-	catch (errs &e)
-	{
-		sendNumeric(client, e.num, e.msg);
-		return;
-	}
+	chan.removeClient(&client);
 	std::ostringstream partMsg;
 	partMsg << ":" << client.getNickname();
 
@@ -66,12 +56,13 @@ void Server::handlePART(Client &client, const std::vector<std::string_view> &par
 		partMsg << " :" << reason;
 	partMsg << "\r\n";
 
-	sendTo(client, partMsg.str());
-	sendToChannel(chan, partMsg.str(), nullptr);
+	OutgoingMessage message(partMsg.str());
+	sendTo(client, message);
+	sendToChannel(chan, message, nullptr);
+	propagate(":" + client.getNickname() + " PART " + channelName + (reason.empty() ? "" : " :" + reason));
 
 	if (chan.isEmpty())
 	{
-		_channels.erase(channelName);
-		_channelCount--;
+		removeChannel(channelName);
 	}
 }
@@ -17,9 +17,13 @@ void Server::handlePASS(Client &client, const std::vector<std::string_view> &par
 		sendNumeric(client, 461, "PASS :Not enough parameters");
 		return;
 	}
+	// A server linking to this one sends the link password instead
+	bool linkPassword = !_linkPassword.empty() && params[0] == _linkPassword;
+	client.setHasLinkPassword(linkPassword);
 	if (std::string(params[0]) != _password)
 	{
-		sendNumeric(client, 464, "Password incorrect");
+		if (!linkPassword)
+			sendNumeric(client, 464, "Password incorrect");
 		return;
 	}
 	client.setHasPassword(true);
@@ -23,7 +23,9 @@ std::string joinParams(const std::vector<std::string_view> &params, size_t start
 ** Handle message sending inside a channel
 ** Validates parameters
 ** Checks if target client exists
-** Sends message to target client
+** Sends message to target client, and back to the sender with echo-message
+** Client-only tags are relayed to recipients with message-tags
+** Records the message in the history
 */
 void Server::handlePRIVMSG(Client &client, const std::vector<std::string_view> &params)
 {
@@ -32,58 +34,66 @@ void Server::handlePRIVMSG(Client &client, const std::vector<std::string_view> &
 		sendNumeric(client, 412, ":No text to send");
 		return;
 	}
-	std::string target(params[0]);
+	std::string_view target = params[0];
 	std::string msg = joinParams(params, 1);
-	if (target[0] == '#')
+	if (!target.empty() && target[0] == '#')
 	{
-		auto it = _channels.find(target);
-		if (it == _channels.end())
+		Channel *found = findChannel(target);
+		if (!found)
 		{
-			sendNumeric(client, 403, target + " :No such channel");
+			sendNumeric(client, 403, std::string(target) + " :No such channel");
 			return;
 		}
-		Channel &chan = it->second;
+		Channel &chan = *found;
+		const std::string &channelName = chan.getChannelName();
 
 		if (!chan.isMember(&client))
 		{
-			sendNumeric(client, 442, target + " :You're not on that channel");
+			sendNumeric(client, 442, channelName + " :You're not on that channel");
 			return;
 		}
 		std::string prefix = ":" + formatPrefix(client) + "!~";
 		prefix += client.getUsername() + "@" + getClientHost(client.getFd());
-		std::string message = prefix + " PRIVMSG " + target + " :" + msg + "\r\n";
-		for (Client *member : chan.getMembers())
-		{
-			if (member->getFd() != client.getFd())
-				sendTo(*member, message);
-		}
+		std::string line = prefix + " PRIVMSG " + channelName + " :" + msg;
+		OutgoingMessage message(line + "\r\n", 0, _history.nextId());
+		message.setClientTags(OutgoingMessage::clientOnlyTags(_currentTags));
+		sendToChannel(chan, message, client.hasCap(CAP_ECHO_MESSAGE) ? nullptr : &client);
+		_history.recordChannel(channelName, message.id(), message.timeMs(), line);
+		propagateToChannel(chan, ":" + client.getNickname() + " PRIVMSG " + channelName + " :" + msg);
 	} 
 	else
 	{
 		Client *targetClient = findClientByNick(target);
 		if (!targetClient)
 		{
-			sendNumeric(client, 401, target + " :No such nick");
+			sendNumeric(client, 401, std::string(target) + " :No such nick");
 			return;
 		}
 
 		std::string prefix = ":" + formatPrefix(client) + "!~";
 		prefix += client.getUsername() + "@" + getClientHost(client.getFd());
-		std::string message = prefix + " PRIVMSG " + target + " :" + msg + "\r\n";
+		std::string line = prefix + " PRIVMSG " + targetClient->getNickname() + " :" + msg;
+		OutgoingMessage message(line + "\r\n", 0, _history.nextId());
+		message.setClientTags(OutgoingMessage::clientOnlyTags(_currentTags));
 
 		sendTo(*targetClient, message);
+		// Remote users get it through the link leading to their server
+		auto via = targetClient->isRemote() ? _links.find(routeTo(*targetClient)) : _links.end();
+		if (via != _links.end())
+			sendToLink(via->second, ":" + client.getNickname() + " PRIVMSG " + targetClient->getNickname() + " :" + msg);
+		if (client.hasCap(CAP_ECHO_MESSAGE) && targetClient != &client)
+			sendTo(client, message);
+		_history.recordPrivate(historyId(client), historyId(*targetClient), message.id(), message.timeMs(), line);
 	}
 }
 
 /*
 ** Find client by nickname
 */
-Client* Server::findClientByNick(const std::string &nick) {
-	for (auto &pair : _clients)
-	{
-		Client &c = pair.second;
-		if (c.hasNickname() && c.getNickname() == nick)
-			return &c;
-	}
-	return nullptr;
+Client* Server::findClientByNick(std::string_view nick) {
+	NameHandle handle = _names.find(nick);
+	if (!handle)
+		return nullptr;
+	auto it = _nicks.find(handle);
+	return it == _nicks.end() ? nullptr : it->second;
 }
\ No newline at end of file
@@ -0,0 +1,24 @@
+#include "Server.hpp"
+
+/*
+** Handle REHASH command
+** Restricted to server operators
+** Reads the configuration file again before the next loop iteration; the
+** operators get a NOTICE saying whether it applied
+*/
+void Server::handleREHASH(Client &client, const std::vector<std::string_view> &)
+{
+	if (!client.isServerOperator())
+	{
+		sendNumeric(client, 481, ":Permission Denied- You're not an IRC operator");
+		return;
+	}
+	if (_configPath.empty())
+	{
+		sendTo(client, ":" + _serverName + " NOTICE " + client.getNickname()
+					   + " :No configuration file to reload (IRCSERV_CONFIG)\r\n");
+		return;
+	}
+	sendNumeric(client, 382, _configPath + " :Rehashing");
+	requestRehash();
+}
@@ -0,0 +1,49 @@
+#include "Server.hpp"
+
+/*
+** Handle SERVER command
+** Sent instead of NICK/USER by another ircserv linking to this one, after
+** PASS with the link password
+** Checks the name is not already in the network
+** Over the TLS listener this needs the connection to run in kernel TLS
+** The connection stops being a client and becomes a server link
+*/
+void Server::handleSERVER(Client &client, const std::vector<std::string_view> &params)
+{
+	if (client.isRegistered() || client.hasNickname())
+	{
+		sendNumeric(client, 462, "You may not reregister");
+		return;
+	}
+	if (params.size() < 3)
+	{
+		sendNumeric(client, 461, "SERVER :Not enough parameters");
+		return;
+	}
+	if (!client.hasLinkPassword())
+	{
+		sendTo(client, "ERROR :Closing link: not authorized to link\r\n");
+		disconnectClient(client.getFd(), "Unauthorized server");
+		return;
+	}
+	// Links use the socket directly: over TLS only once the kernel runs it
+	if (_tlsSessions.count(client.getFd()))
+	{
+		sendTo(client, "ERROR :Closing link: server links need kernel TLS or the plaintext port\r\n");
+		disconnectClient(client.getFd(), "Server link over user-space TLS");
+		return;
+	}
+	std::string name(params[0]);
+	if (name == _serverName || _peers.count(name))
+	{
+		sendTo(client, "ERROR :Closing link: server " + name + " already exists\r\n");
+		disconnectClient(client.getFd(), "Server already exists");
+		return;
+	}
+	int fd = client.getFd();
+	Link &link = _links[fd];
+	link.fd = fd;
+	link.inbound = true;
+	link.passwordOk = true;
+	linkSERVER(link, "", params);
+}
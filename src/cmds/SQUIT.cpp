@@ -0,0 +1,32 @@
+#include "Server.hpp"
+
+/*
+** Handle SQUIT command
+** SQUIT <server> [:<reason>]
+** Restricted to server operators
+** Drops the link to a directly linked server, splitting off everything
+** behind it
+*/
+void Server::handleSQUIT(Client &client, const std::vector<std::string_view> &params)
+{
+	if (!client.isServerOperator())
+	{
+		sendNumeric(client, 481, ":Permission Denied- You're not an IRC operator");
+		return;
+	}
+	if (params.empty())
+	{
+		sendNumeric(client, 461, "SQUIT :Not enough parameters");
+		return;
+	}
+	std::string reason = params.size() > 1 ? std::string(params[1]) : "SQUIT by " + client.getNickname();
+	for (auto &pair : _links)
+	{
+		if (pair.second.name == params[0])
+		{
+			dropLink(pair.first, reason);
+			return;
+		}
+	}
+	sendNumeric(client, 402, std::string(params[0]) + " :No such server");
+}
@@ -0,0 +1,82 @@
+#include "Server.hpp"
+#include <sstream>
+#include <cstdio>
+
+/*
+** Handle STATS command
+** Restricted to server operators
+** m: call count and handler latency per command
+** u: server uptime
+** P: the metrics exporter output, one sample per line
+** p: listeners, with their connection class and backlog
+** z: occupancy of the slab pools holding clients, channels and memberships,
+** and of the pool lending storage to client buffers
+** Always ends with 219
+*/
+void Server::handleSTATS(Client &client, const std::vector<std::string_view> &params)
+{
+	if (!client.isServerOperator())
+	{
+		sendNumeric(client, 481, ":Permission Denied- You're not an IRC operator");
+		return;
+	}
+	char query = params.empty() || params[0].empty() ? '*' : params[0][0];
+
+	if (query == 'm')
+	{
+		for (int i = 0; i < COMMAND_COUNT && i < Metrics::MAX_COMMANDS; ++i)
+		{
+			const Histogram &h = _metrics.commandNs[i];
+			if (h.count() == 0)
+				continue;
+			std::ostringstream line;
+			line << COMMANDS[i].name << " " << h.count()
+				 << " :p50 " << h.percentile(0.5) / 1000 << "us p99 " << h.percentile(0.99) / 1000
+				 << "us max " << h.max() / 1000 << "us";
+			sendNumeric(client, 212, line.str());
+		}
+	}
+	else if (query == 'u')
+	{
+		long up = static_cast<long>(std::time(nullptr) - _startTime);
+		char uptime[64];
+		std::snprintf(uptime, sizeof(uptime), ":Server Up %ld days %ld:%02ld:%02ld",
+					  up / 86400, (up / 3600) % 24, (up / 60) % 60, up % 60);
+		sendNumeric(client, 242, uptime);
+	}
+	else if (query == 'z')
+	{
+		for (const SlabPool::Stats &pool : SlabPool::report())
+		{
+			std::ostringstream line;
+			line << "z :" << pool.name << " " << pool.objectSize << "B " << pool.inUse << "/" << pool.capacity
+				 << " in use, peak " << pool.peak << ", " << pool.slabs << " slabs";
+			sendNumeric(client, 249, line.str());
+		}
+		std::ostringstream line;
+		line << "z :buffers " << _buffers.freeBuffers() << " pooled (" << _buffers.freeBytes() << "B), "
+			 << _buffers.reused() << " reused, " << _buffers.discarded() << " discarded";
+		sendNumeric(client, 249, line.str());
+	}
+	else if (query == 'p')
+	{
+		for (const Listener &listener : _listeners)
+		{
+			std::ostringstream line;
+			line << "p :" << listener.address << " class " << listener.connClass << " backlog "
+				 << listener.backlog << (listener.tls ? " tls" : "") << ", " << listener.accepted << " accepted";
+			sendNumeric(client, 249, line.str());
+		}
+	}
+	else if (query == 'P')
+	{
+		std::istringstream samples(renderMetrics());
+		std::string line;
+		while (std::getline(samples, line))
+		{
+			if (!line.empty() && line[0] != '#')
+				sendNumeric(client, 249, "P :" + line);
+		}
+	}
+	sendNumeric(client, 219, std::string(1, query), ":End of /STATS report");
+}
@@ -17,14 +17,14 @@ void Server::handleTOPIC(Client &client, const std::vector<std::string_view> &pa
 		sendNumeric(client, 461, "TOPIC :Not enough parameters");
 		return;
 	}
-	std::string channelName(params[0]);
-	auto it = _channels.find(channelName);
-	if (it == _channels.end())
+	Channel *found = findChannel(params[0]);
+	if (!found)
 	{
-		sendNumeric(client, 403, channelName + " :No such channel");
+		sendNumeric(client, 403, std::string(params[0]) + " :No such channel");
 		return;
 	}
-	Channel &chan = it->second;
+	Channel &chan = *found;
+	const std::string &channelName = chan.getChannelName();
 	if (!chan.isMember(&client))
 	{
 		sendNumeric(client, 442, channelName + " :You're not on that channel");
@@ -54,6 +54,7 @@ void Server::handleTOPIC(Client &client, const std::vector<std::string_view> &pa
 		topicStream << " " << params[i];
 	newTopic = topicStream.str();
 	chan.setTopic(newTopic);
+	persistChannel(chan);
 	
 	std::ostringstream topicMsg;
 	topicMsg << ":" << client.getNickname() << "!" 
@@ -61,4 +62,5 @@ void Server::handleTOPIC(Client &client, const std::vector<std::string_view> &pa
 			 << " TOPIC " << channelName << " :" << newTopic << "\r\n";
 
 	sendToChannel(chan, topicMsg.str(), nullptr);
+	propagate(":" + client.getNickname() + " TOPIC " + channelName + " :" + newTopic);
 }
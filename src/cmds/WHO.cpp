@@ -0,0 +1,90 @@
+#include "Server.hpp"
+
+/*
+** Match text against a mask where '*' stands for any run of characters and
+** '?' for any single one
+*/
+static bool matchMask(std::string_view mask, std::string_view text)
+{
+	std::size_t m = 0;
+	std::size_t t = 0;
+	std::size_t star = std::string_view::npos;
+	std::size_t resume = 0;
+	while (t < text.size())
+	{
+		if (m < mask.size() && (mask[m] == '?' || mask[m] == text[t]))
+		{
+			++m;
+			++t;
+		}
+		else if (m < mask.size() && mask[m] == '*')
+		{
+			star = m++;
+			resume = t;
+		}
+		else if (star != std::string_view::npos)
+		{
+			m = star + 1;
+			t = ++resume;
+		}
+		else
+			return false;
+	}
+	while (m < mask.size() && mask[m] == '*')
+		++m;
+	return m == mask.size();
+}
+
+/*
+** Handle WHO command
+** WHO <channel> lists the channel's members
+** WHO <nick> is answered from the nickname index; a mask with wildcards
+** is matched against every registered nickname
+** Flags: H (here), * (server operator), @ (channel operator)
+*/
+void Server::handleWHO(Client &client, const std::vector<std::string_view> &params)
+{
+	if (params.empty() || params[0].empty())
+	{
+		sendNumeric(client, 461, "WHO :Not enough parameters");
+		return;
+	}
+	std::string mask(params[0]);
+
+	auto reply = [&](Client &target, const std::string &context, bool chanop) {
+		std::string flags = "H";
+		if (target.isServerOperator())
+			flags += '*';
+		if (chanop)
+			flags += '@';
+		sendNumeric(client, 352, context + " " + target.getUsername() + " " + getClientHost(target.getFd())
+									 + " " + (target.isRemote() ? target.getServer() : _serverName) + " "
+									 + target.getNickname() + " " + flags + " :0 " + target.getFullname());
+	};
+
+	if (mask[0] == '#')
+	{
+		Channel *chan = findChannel(mask);
+		if (chan)
+		{
+			for (Client *member : chan->getMembers())
+				reply(*member, chan->getChannelName(), chan->isOperator(member));
+		}
+	}
+	else if (mask.find_first_of("*?") == std::string::npos)
+	{
+		Client *target = findClientByNick(mask);
+		if (target && target->isRegistered())
+			reply(*target, "*", false);
+	}
+	else
+	{
+		for (auto &pair : _clients)
+		{
+			Client &target = pair.second;
+			if (target.isRegistered() && matchMask(mask, target.getNickname()))
+				reply(target, "*", false);
+		}
+	}
+	sendNumeric(client, 315, mask, ":End of /WHO list");
+}
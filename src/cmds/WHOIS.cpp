@@ -0,0 +1,55 @@
+#include "Server.hpp"
+
+/*
+** Handle WHOIS command
+** WHOIS [<server>] <nick>{,<nick>}
+** Nicknames are looked up in the nickname index and channels come from the
+** client's own list, so the reply does not depend on the number of channels
+*/
+void Server::handleWHOIS(Client &client, const std::vector<std::string_view> &params)
+{
+	if (params.empty() || params.back().empty())
+	{
+		sendNumeric(client, 431, ":No nickname given");
+		return;
+	}
+	std::string_view nicks = params.back();
+	while (!nicks.empty())
+	{
+		std::size_t comma = nicks.find(',');
+		std::string nick(nicks.substr(0, comma));
+		nicks.remove_prefix(comma == std::string_view::npos ? nicks.size() : comma + 1);
+		if (nick.empty())
+			continue;
+
+		Client *target = findClientByNick(nick);
+		if (!target || !target->isRegistered())
+		{
+			sendNumeric(client, 401, nick, ":No such nick/channel");
+			sendNumeric(client, 318, nick, ":End of /WHOIS list");
+			continue;
+		}
+		sendNumeric(client, 311, nick, target->getUsername() + " " + getClientHost(target->getFd())
+											+ " * :" + target->getFullname());
+		std::string channels;
+		for (Channel *chan : target->getChannels())
+		{
+			if (!channels.empty())
+				channels += ' ';
+			if (chan->isOperator(target))
+				channels += '@';
+			channels += chan->getChannelName();
+		}
+		if (!channels.empty())
+			sendNumeric(client, 319, nick, ":" + channels);
+		if (target->isRemote())
+			sendNumeric(client, 312, nick, target->getServer() + " :ft_irc server");
+		else
+			sendNumeric(client, 312, nick, _serverName + " :ft_irc server");
+		if (target->isServerOperator())
+			sendNumeric(client, 313, nick, ":is an IRC operator");
+		if (target->isSecure())
+			sendNumeric(client, 671, nick, ":is using a secure connection");
+		sendNumeric(client, 318, nick, ":End of /WHOIS list");
+	}
+}
@@ -1,5 +1,7 @@
 #include "Server.hpp"
+#include "Logger.hpp"
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <string>
@@ -7,6 +9,10 @@
 
 static void handleSignal(int signal);
 static bool parsePort(const char *s, int &portOut);
+static void startLogger();
+static void configureServer(Server &server);
+static std::string takeoverPath();
+static std::size_t parseBytes(const char *name, const char *value, std::size_t fallback);
 
 /* Global Server pointer */
 static Server* g_server = 0;
@@ -14,7 +20,8 @@ static Server* g_server = 0;
 /* 
 ** Main
 ** Create server and run it
-** If signal SIGINT is received, shutdown server
+** If signal SIGINT is received, the server stops and shuts down; SIGHUP
+** reloads the configuration file
 */
 int main(int argc, char **argv)
 {
@@ -35,19 +42,24 @@ int main(int argc, char **argv)
 
 	try
 	{
-		Server server(port, password);
+		startLogger();
+		Server server(port, password, takeoverPath());
+		configureServer(server);
 		g_server = &server;
 		std::signal(SIGINT, handleSignal);
+		std::signal(SIGHUP, handleSignal);
 		std::signal(SIGPIPE, SIG_IGN);
 		server.run();
 		g_server = 0;
 	}
 	catch (const std::exception &e)
 	{
+		Logger::instance().stop();
 		std::cerr << "Fatal error: " << e.what() << '\n';
 		return EXIT_FAILURE;
 	}
 
+	Logger::instance().stop();
 	return EXIT_SUCCESS;
 }
 
@@ -62,9 +74,196 @@ static bool parsePort(const char *s, int &portOut)
 	return true;
 }
 
-/* Signal handler SIGINT */
+/*
+** Start the asynchronous logger
+** IRCSERV_LOG_FILE selects a log file (stdout by default),
+** IRCSERV_LOG_LEVEL one of debug, info, warn, error
+*/
+static void startLogger()
+{
+	Logger &logger = Logger::instance();
+	const char *level = std::getenv("IRCSERV_LOG_LEVEL");
+	LogLevel parsed;
+	if (level && Logger::parseLevel(level, parsed))
+		logger.setLevel(parsed);
+	const char *path = std::getenv("IRCSERV_LOG_FILE");
+	logger.start(path ? path : "");
+}
+
+/*
+** Optional features configured from the environment
+** IRCSERV_METRICS_PORT: serve Prometheus metrics on 127.0.0.1:<port>
+** IRCSERV_OPER: "name:password" operator credentials for OPER
+** IRCSERV_SLOW_COMMAND_US: slow-command log threshold in microseconds (0 = off)
+** IRCSERV_CAPTURE_FILE: record inbound client traffic for bench/ircreplay
+** IRCSERV_UPGRADE_SOCKET: unix socket a new binary connects to for a hot restart
+** IRCSERV_STATE_FILE: persist channel settings there (snapshot + <file>.wal)
+** IRCSERV_SNAPSHOT_SECONDS: interval between snapshots (default 300, 0 = at exit only)
+** IRCSERV_HISTORY_BYTES: memory for CHATHISTORY (default 16 MiB, 0 = off)
+** IRCSERV_HISTORY_CHANNEL_BYTES / IRCSERV_HISTORY_PRIVATE_BYTES: largest history
+**   of one channel (default 64 KiB) and of all private messages (default 1 MiB)
+** IRCSERV_LINK_PASSWORD: accept and make server links with this password
+** IRCSERV_SERVER_NAME: this server's name, unique in the network of links
+** IRCSERV_LINKS: comma-separated host:port ([v6]:port) of servers to stay
+**   linked to, resolved at startup
+** IRCSERV_SYNC_SOCKET: unix socket standby processes import the state from
+** IRCSERV_SYNC_FROM: import the state of the server listening on this socket
+** IRCSERV_TLS_CERT, IRCSERV_TLS_KEY: PEM certificate chain and key for TLS
+**   listeners (make TLS=1)
+** IRCSERV_TLS_PORT: also accept TLS clients on this port
+** IRCSERV_LISTEN: more listeners, comma-separated, each an address and its
+**   options, e.g. "[::1]:6667 backlog=512, unix:/run/ircserv.sock class=local"
+**   (see Server::parseListener)
+** IRCSERV_CONFIG: configuration file (see Config.hpp), read again on REHASH
+**   and SIGHUP
+*/
+static void configureServer(Server &server)
+{
+	const char *history = std::getenv("IRCSERV_HISTORY_BYTES");
+	const char *channelHistory = std::getenv("IRCSERV_HISTORY_CHANNEL_BYTES");
+	const char *privateHistory = std::getenv("IRCSERV_HISTORY_PRIVATE_BYTES");
+	if (history || channelHistory || privateHistory)
+		server.configureHistory(parseBytes("IRCSERV_HISTORY_BYTES", history, 16 << 20),
+								parseBytes("IRCSERV_HISTORY_CHANNEL_BYTES", channelHistory, 64 << 10),
+								parseBytes("IRCSERV_HISTORY_PRIVATE_BYTES", privateHistory, 1 << 20));
+	const char *metricsPort = std::getenv("IRCSERV_METRICS_PORT");
+	if (metricsPort)
+	{
+		int port;
+		if (!parsePort(metricsPort, port))
+			throw std::runtime_error("Invalid IRCSERV_METRICS_PORT: " + std::string(metricsPort));
+		server.enableMetrics(port);
+	}
+	const char *slow = std::getenv("IRCSERV_SLOW_COMMAND_US");
+	if (slow)
+	{
+		char *end = nullptr;
+		unsigned long long micros = std::strtoull(slow, &end, 10);
+		if (*slow == '\0' || *end != '\0')
+			throw std::runtime_error("Invalid IRCSERV_SLOW_COMMAND_US: " + std::string(slow));
+		server.setSlowCommandThreshold(micros);
+	}
+	const char *capture = std::getenv("IRCSERV_CAPTURE_FILE");
+	if (capture)
+		server.enableCapture(capture);
+	const char *cert = std::getenv("IRCSERV_TLS_CERT");
+	const char *key = std::getenv("IRCSERV_TLS_KEY");
+	if (cert || key)
+	{
+		if (!cert || !key)
+			throw std::runtime_error("IRCSERV_TLS_CERT and IRCSERV_TLS_KEY go together");
+		server.enableTls(cert, key);
+	}
+	const char *tlsPort = std::getenv("IRCSERV_TLS_PORT");
+	if (tlsPort)
+	{
+		int port;
+		if (!parsePort(tlsPort, port))
+			throw std::runtime_error("Invalid IRCSERV_TLS_PORT: " + std::string(tlsPort));
+		server.addListener(std::to_string(port) + " tls");
+	}
+	const char *listen = std::getenv("IRCSERV_LISTEN");
+	std::string listeners = listen ? listen : "";
+	for (std::size_t start = 0; start < listeners.size();)
+	{
+		std::size_t comma = std::min(listeners.find(',', start), listeners.size());
+		std::string spec = listeners.substr(start, comma - start);
+		if (spec.find_first_not_of(' ') != std::string::npos)
+			server.addListener(spec);
+		start = comma + 1;
+	}
+	const char *config = std::getenv("IRCSERV_CONFIG");
+	if (config)
+		server.loadConfig(config);
+	const char *upgrade = std::getenv("IRCSERV_UPGRADE_SOCKET");
+	if (upgrade)
+		server.enableUpgrade(upgrade);
+	const char *state = std::getenv("IRCSERV_STATE_FILE");
+	if (state)
+	{
+		unsigned long seconds = 300;
+		const char *interval = std::getenv("IRCSERV_SNAPSHOT_SECONDS");
+		if (interval)
+		{
+			char *end = nullptr;
+			seconds = std::strtoul(interval, &end, 10);
+			if (*interval == '\0' || *end != '\0' || seconds > 86400)
+				throw std::runtime_error("Invalid IRCSERV_SNAPSHOT_SECONDS: " + std::string(interval));
+		}
+		server.enableStateStore(state, static_cast<unsigned>(seconds));
+	}
+	const char *oper = std::getenv("IRCSERV_OPER");
+	if (oper)
+	{
+		std::string credentials(oper);
+		std::size_t colon = credentials.find(':');
+		if (colon == std::string::npos || colon == 0 || colon + 1 == credentials.size())
+			throw std::runtime_error("IRCSERV_OPER must be name:password");
+		server.setOperator(credentials.substr(0, colon), credentials.substr(colon + 1));
+	}
+	const char *linkPassword = std::getenv("IRCSERV_LINK_PASSWORD");
+	if (linkPassword)
+	{
+		const char *name = std::getenv("IRCSERV_SERVER_NAME");
+		std::string serverName = name ? name : "ft_irc_server";
+		if (*linkPassword == '\0' || serverName.empty() || serverName.find_first_of(" :,") != std::string::npos)
+			throw std::runtime_error("IRCSERV_LINK_PASSWORD needs a non-empty value and a valid IRCSERV_SERVER_NAME");
+		std::vector<std::string> targets;
+		const char *links = std::getenv("IRCSERV_LINKS");
+		std::string list = links ? links : "";
+		for (std::size_t start = 0; start < list.size();)
+		{
+			std::size_t comma = std::min(list.find(',', start), list.size());
+			std::string target = list.substr(start, comma - start);
+			if (target.find(':') == std::string::npos)
+				throw std::runtime_error("Invalid IRCSERV_LINKS entry: " + target);
+			targets.push_back(target);
+			start = comma + 1;
+		}
+		server.enableLinks(serverName, linkPassword, targets);
+	}
+	const char *syncSocket = std::getenv("IRCSERV_SYNC_SOCKET");
+	if (syncSocket)
+		server.enableSyncExport(syncSocket);
+	const char *syncFrom = std::getenv("IRCSERV_SYNC_FROM");
+	if (syncFrom)
+		server.importState(syncFrom);
+}
+
+/*
+** Hot restart
+** With IRCSERV_TAKEOVER=1 the server does not bind its port but takes the
+** listener and every connection over from the process serving
+** IRCSERV_UPGRADE_SOCKET
+*/
+static std::string takeoverPath()
+{
+	const char *takeover = std::getenv("IRCSERV_TAKEOVER");
+	if (!takeover || std::string(takeover) != "1")
+		return "";
+	const char *upgrade = std::getenv("IRCSERV_UPGRADE_SOCKET");
+	if (!upgrade)
+		throw std::runtime_error("IRCSERV_TAKEOVER requires IRCSERV_UPGRADE_SOCKET");
+	return upgrade;
+}
+
+/* Parse a byte count from the environment variable name */
+static std::size_t parseBytes(const char *name, const char *value, std::size_t fallback)
+{
+	if (!value)
+		return fallback;
+	char *end = nullptr;
+	unsigned long long bytes = std::strtoull(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || bytes > (1ull << 40))
+		throw std::runtime_error("Invalid " + std::string(name) + ": " + std::string(value));
+	return static_cast<std::size_t>(bytes);
+}
+
+/* Signal handler: SIGINT stops the server, SIGHUP reloads the configuration */
 static void handleSignal(int signal)
 {
 	if (signal == SIGINT && g_server)
-		g_server->shutdown();
+		g_server->requestStop();
+	else if (signal == SIGHUP && g_server)
+		g_server->requestRehash();
 }